@@ -0,0 +1,904 @@
+// Copyright (c) 2011 The Native Client Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// AppEngineBenchmark drives KernelProxy calls against an AppEngineMount and
+// reports throughput and latency percentiles for each workload.  It is meant
+// to be run against naclmounts/standin.py, whose latency, bandwidth and
+// failure injection is configured by benchmark.html before each run.
+//
+// Messages understood by the module have the form
+//   "<workload> <count> <size>"
+// where workload is one of open, popen, stat, read, firstbyte, readcall,
+// write, fsync, burst, getdents, readdirplus, batch, transfer, delta,
+// compress or mixed, count is the number of files (or calls to stat()
+// on one file, or threads for popen and burst, or passes over one file
+// for readcall, or chunks in flight at once for transfer, or the
+// percentage of the file edited for delta, or the zlib level for
+// compress) and size is the file size in bytes (for mixed, the size of
+// the upload the reads compete with).  The reply is a single line of
+// results, followed by the mount's traffic and local cache counters,
+// the main thread queue counters and how many requests had to allocate
+// their post.  The stat
+// workload gives the latency of the smallest request.  Built as C++20,
+// the module also knows coread, which fetches count files of size bytes
+// at once from coroutines on a single thread.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <ppapi/cpp/instance.h>
+#include <ppapi/cpp/module.h>
+#include <ppapi/cpp/var.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "AppEngineMount.h"
+#include "../base/KernelAwait.h"
+#include "../base/MountManager.h"
+#include "../base/dirent.h"
+#include "../memory/MemMount.h"
+
+static double NowMs(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+// Collects per-operation latencies for one workload run.
+class BenchmarkResult {
+ public:
+  BenchmarkResult() : bytes_(0), errors_(0), wall_ms_(0) {}
+
+  void AddSample(double ms) { samples_.push_back(ms); }
+  void AddBytes(int64_t bytes) { bytes_ += bytes; }
+  void AddError(void) { ++errors_; }
+  void set_wall_ms(double ms) { wall_ms_ = ms; }
+  // Extra text for the end of the report.
+  void set_detail(const std::string& detail) { detail_ = detail; }
+
+  double Percentile(double p) {
+    if (samples_.empty()) {
+      return 0;
+    }
+    std::sort(samples_.begin(), samples_.end());
+    size_t i = static_cast<size_t>(p * (samples_.size() - 1) + 0.5);
+    return samples_[i];
+  }
+
+  std::string Report(const std::string& workload) {
+    char line[512];
+    double secs = wall_ms_ / 1000.0;
+    double mbps = secs > 0 ? bytes_ / (1024.0 * 1024.0) / secs : 0;
+    double ops = secs > 0 ? samples_.size() / secs : 0;
+    snprintf(line, sizeof(line),
+             "%s: ops=%d errors=%d bytes=%lld wall=%.1fms "
+             "ops/s=%.1f MB/s=%.3f p50=%.2fms p90=%.2fms p99=%.2fms "
+             "max=%.2fms",
+             workload.c_str(), static_cast<int>(samples_.size()), errors_,
+             static_cast<long long>(bytes_), wall_ms_, ops, mbps,
+             Percentile(0.5), Percentile(0.9), Percentile(0.99),
+             Percentile(1.0));
+    return detail_.empty() ? line : line + (" " + detail_);
+  }
+
+ private:
+  std::vector<double> samples_;
+  int64_t bytes_;
+  int errors_;
+  double wall_ms_;
+  std::string detail_;
+};
+
+class AppEngineBenchmarkInstance : public pp::Instance {
+ public:
+  explicit AppEngineBenchmarkInstance(PP_Instance instance)
+    : pp::Instance(instance),
+      runner_(this),
+      count_(0),
+      size_(0) {
+    MountManager *mm = MountManager::MMInstance();
+    mount_ = new AppEngineMount(&runner_, "/_file");
+    // Rereads of unchanged files should cost one small round trip.
+    cache_ = new AppEngineCache(new MemMount(), kCacheBytes);
+    mount_->set_cache(cache_);
+    mm->RemoveMount("/");
+    mm->AddMount(mount_, "/");
+    kp_ = mm->kp();
+  }
+  virtual ~AppEngineBenchmarkInstance() {}
+
+  virtual void HandleMessage(const pp::Var& var_message);
+
+ private:
+  static void *RunShim(void *p);
+  static void *OpenShim(void *p);
+  static void *SyncShim(void *p);
+  void Run(void);
+  std::string MountStats(void);
+
+  std::string FileName(int i);
+  void RunOpen(BenchmarkResult *result);
+  void RunParallelOpen(BenchmarkResult *result);
+  void RunStat(BenchmarkResult *result);
+  void RunRead(BenchmarkResult *result);
+  void RunFirstByte(BenchmarkResult *result);
+  void RunReadCalls(BenchmarkResult *result);
+  void RunWrite(BenchmarkResult *result, bool sync);
+  void RunBurst(BenchmarkResult *result);
+  void RunGetdents(BenchmarkResult *result);
+  void RunReadDirPlus(BenchmarkResult *result);
+  void RunBatch(BenchmarkResult *result);
+  void RunTransfer(BenchmarkResult *result);
+  void RunDelta(BenchmarkResult *result);
+  void RunCompress(BenchmarkResult *result);
+  void RunMixed(BenchmarkResult *result);
+#if __cplusplus >= 202002L
+  void RunCoRead(BenchmarkResult *result);
+#endif
+  std::string QueueStats(void);
+
+  static const size_t kCacheBytes = 64 * 1024 * 1024;
+
+  MainThreadRunner runner_;
+  AppEngineMount *mount_;
+  AppEngineCache *cache_;
+  KernelProxy *kp_;
+  pthread_t thread_;
+  std::string workload_;
+  int count_;
+  int size_;
+};
+
+void AppEngineBenchmarkInstance::HandleMessage(const pp::Var& var_message) {
+  if (!var_message.is_string()) {
+    return;
+  }
+  // Blocking mount calls must not run on the main thread, which is the
+  // one that services the MainThreadRunner.
+  char workload[64];
+  std::string message = var_message.AsString();
+  if (sscanf(message.c_str(), "%63s %d %d", workload, &count_, &size_) != 3) {
+    PostMessage(pp::Var("bad request: " + message));
+    return;
+  }
+  workload_ = workload;
+  pthread_create(&thread_, NULL, RunShim, this);
+}
+
+void *AppEngineBenchmarkInstance::RunShim(void *p) {
+  AppEngineBenchmarkInstance *inst = (AppEngineBenchmarkInstance *)p;
+  inst->Run();
+  return NULL;
+}
+
+void AppEngineBenchmarkInstance::Run(void) {
+  BenchmarkResult result;
+  double start = NowMs();
+  if (workload_ == "open") {
+    RunOpen(&result);
+  } else if (workload_ == "popen") {
+    RunParallelOpen(&result);
+  } else if (workload_ == "stat") {
+    RunStat(&result);
+  } else if (workload_ == "read") {
+    RunRead(&result);
+  } else if (workload_ == "firstbyte") {
+    RunFirstByte(&result);
+  } else if (workload_ == "readcall") {
+    RunReadCalls(&result);
+  } else if (workload_ == "write") {
+    RunWrite(&result, false);
+  } else if (workload_ == "fsync") {
+    RunWrite(&result, true);
+  } else if (workload_ == "burst") {
+    RunBurst(&result);
+  } else if (workload_ == "getdents") {
+    RunGetdents(&result);
+  } else if (workload_ == "readdirplus") {
+    RunReadDirPlus(&result);
+  } else if (workload_ == "batch") {
+    RunBatch(&result);
+  } else if (workload_ == "transfer") {
+    RunTransfer(&result);
+  } else if (workload_ == "delta") {
+    RunDelta(&result);
+  } else if (workload_ == "compress") {
+    RunCompress(&result);
+  } else if (workload_ == "mixed") {
+    RunMixed(&result);
+#if __cplusplus >= 202002L
+  } else if (workload_ == "coread") {
+    RunCoRead(&result);
+#endif
+  } else {
+    PostMessage(pp::Var("unknown workload: " + workload_));
+    return;
+  }
+  result.set_wall_ms(NowMs() - start);
+  PostMessage(pp::Var(result.Report(workload_) + " " + MountStats() + " " +
+                      QueueStats()));
+}
+
+std::string AppEngineBenchmarkInstance::MountStats(void) {
+  AppEngineMountStats stats = mount_->stats();
+  AppEngineTransferStats transfer = mount_->url_request()->transfer_stats();
+  ReadAheadStats readahead = kp_->readahead()->stats();
+  AppEngineCompressionStats compression =
+      mount_->url_request()->compressor()->stats();
+  double hits = stats.cache_hits;
+  double misses = stats.cache_misses;
+  double downloaded = transfer.bytes_downloaded;
+  char line[2048];
+  snprintf(line, sizeof(line),
+           "remote_fetches=%lld remote_stats=%lld coalesced_fetches=%lld "
+           "node_table_hits=%lld evicted_nodes=%lld attr_revalidations=%lld "
+           "negative_hits=%lld remote_lists=%lld listing_hits=%lld "
+           "prefetched_list_pages=%lld cache_hits=%lld cache_misses=%lld "
+           "cache_hit_rate=%.2f cache_bytes_saved=%lld cache_bytes=%lld "
+           "bytes_downloaded=%lld bytes_copied=%lld copies_per_byte=%.3f "
+           "streamed_reads=%lld readahead_prefetched=%lld "
+           "readahead_dropped=%lld group_commits=%lld grouped_fsyncs=%lld "
+           "bytes_uploaded=%lld delta_syncs=%lld delta_bytes_saved=%lld "
+           "compressed_bytes_saved=%lld compress_ms=%.1f batched_reads=%lld",
+           static_cast<long long>(stats.remote_fetches),
+           static_cast<long long>(stats.remote_stats),
+           static_cast<long long>(stats.coalesced_fetches),
+           static_cast<long long>(stats.node_table_hits),
+           static_cast<long long>(stats.evicted_nodes),
+           static_cast<long long>(stats.attr_revalidations),
+           static_cast<long long>(stats.negative_hits),
+           static_cast<long long>(stats.remote_lists),
+           static_cast<long long>(stats.listing_hits),
+           static_cast<long long>(stats.prefetched_list_pages),
+           static_cast<long long>(stats.cache_hits),
+           static_cast<long long>(stats.cache_misses),
+           hits + misses > 0 ? hits / (hits + misses) : 0.0,
+           static_cast<long long>(stats.cache_bytes_saved),
+           static_cast<long long>(cache_->bytes()),
+           static_cast<long long>(transfer.bytes_downloaded),
+           static_cast<long long>(transfer.bytes_copied),
+           downloaded > 0 ? transfer.bytes_copied / downloaded : 0.0,
+           static_cast<long long>(stats.streamed_reads),
+           static_cast<long long>(readahead.prefetched),
+           static_cast<long long>(readahead.dropped),
+           static_cast<long long>(stats.group_commits),
+           static_cast<long long>(stats.grouped_fsyncs),
+           static_cast<long long>(transfer.bytes_uploaded),
+           static_cast<long long>(stats.delta_syncs),
+           static_cast<long long>(stats.delta_bytes_saved),
+           static_cast<long long>(compression.bytes_in - compression.bytes_out),
+           compression.compress_us / 1000.0,
+           static_cast<long long>(stats.batched_reads));
+  return line;
+}
+
+std::string AppEngineBenchmarkInstance::QueueStats(void) {
+  static const char *kNames[MainThreadRunner::kNumPriorities] = {
+    "interactive", "metadata", "background", "prefetch"
+  };
+  std::string stats;
+  for (int i = 0; i < MainThreadRunner::kNumPriorities; ++i) {
+    MainThreadQueueStats queue =
+        runner_.queue_stats(static_cast<MainThreadRunner::Priority>(i));
+    char line[256];
+    snprintf(line, sizeof(line),
+             "%s%s_depth=%d %s_started=%lld %s_aged=%lld "
+             "%s_avg_wait=%.2fms %s_max_wait=%.2fms",
+             i > 0 ? " " : "", kNames[i], queue.depth, kNames[i],
+             static_cast<long long>(queue.started), kNames[i],
+             static_cast<long long>(queue.aged), kNames[i],
+             queue.started > 0 ? queue.wait_ms / queue.started : 0.0,
+             kNames[i], queue.max_wait_ms);
+    stats += line;
+  }
+  AppEnginePostPoolStats pool = AppEnginePost::pool_stats();
+  double posts = pool.created + pool.reused;
+  char line[256];
+  snprintf(line, sizeof(line),
+           " posts_created=%lld posts_reused=%lld post_allocs_per_request=%.3f",
+           static_cast<long long>(pool.created),
+           static_cast<long long>(pool.reused),
+           posts > 0 ? pool.created / posts : 0.0);
+  stats += line;
+  ThreadPoolStats io = MountManager::MMInstance()->io_stats();
+  snprintf(line, sizeof(line),
+           " io_threads=%d io_active=%d io_queued=%d io_max_queued=%d "
+           "io_completed=%lld io_stolen=%lld io_avg_wait=%.2fms "
+           "io_max_wait=%.2fms io_avg_run=%.2fms",
+           io.threads, io.active, io.queued, io.max_queued,
+           static_cast<long long>(io.completed),
+           static_cast<long long>(io.stolen),
+           io.completed > 0 ? io.wait_us / 1000.0 / io.completed : 0.0,
+           io.max_wait_us / 1000.0,
+           io.completed > 0 ? io.run_us / 1000.0 / io.completed : 0.0);
+  stats += line;
+  return stats;
+}
+
+std::string AppEngineBenchmarkInstance::FileName(int i) {
+  char name[64];
+  snprintf(name, sizeof(name), "/bench/f%d.dat", i);
+  return name;
+}
+
+// Times open() of files written by an earlier fsync run.
+void AppEngineBenchmarkInstance::RunOpen(BenchmarkResult *result) {
+  for (int i = 0; i < count_; ++i) {
+    double t0 = NowMs();
+    int fd = kp_->open(FileName(i), O_RDONLY, 0);
+    result->AddSample(NowMs() - t0);
+    if (fd < 0) {
+      result->AddError();
+      continue;
+    }
+    kp_->close(fd);
+  }
+}
+
+struct ParallelOpen {
+  AppEngineMount *mount;
+  std::string path;
+  double ms;
+  int result;
+  struct stat st;
+};
+
+void *AppEngineBenchmarkInstance::OpenShim(void *p) {
+  ParallelOpen *op = reinterpret_cast<ParallelOpen*>(p);
+  double t0 = NowMs();
+  op->result = op->mount->GetNode(op->path, &op->st);
+  op->ms = NowMs() - t0;
+  if (op->result == 0) {
+    // As open() does; the node is released once all threads are done.
+    op->mount->Ref(op->st.st_ino);
+  }
+  return NULL;
+}
+
+// Times count threads looking up the same file at once, which is the
+// case the mount coalesces into a single remote read.  This goes to the
+// mount directly because KernelProxy's descriptor tables are not yet
+// safe to use from several threads.
+void AppEngineBenchmarkInstance::RunParallelOpen(BenchmarkResult *result) {
+  std::vector<ParallelOpen> ops(count_);
+  std::vector<pthread_t> threads(count_);
+  for (int i = 0; i < count_; ++i) {
+    ops[i].mount = mount_;
+    ops[i].path = FileName(0);
+    pthread_create(&threads[i], NULL, OpenShim, &ops[i]);
+  }
+  for (int i = 0; i < count_; ++i) {
+    pthread_join(threads[i], NULL);
+    result->AddSample(ops[i].ms);
+    if (ops[i].result != 0) {
+      result->AddError();
+    } else {
+      mount_->Unref(ops[i].st.st_ino);
+    }
+  }
+}
+
+// Times count stat() calls on the same file.  Only the first one should
+// reach the server, and the mount's memory use must not grow.
+void AppEngineBenchmarkInstance::RunStat(BenchmarkResult *result) {
+  struct stat st;
+  for (int i = 0; i < count_; ++i) {
+    double t0 = NowMs();
+    if (kp_->stat(FileName(0), &st) != 0) {
+      result->AddError();
+    }
+    result->AddSample(NowMs() - t0);
+  }
+}
+
+// Times a whole-file sequential read, from open() to EOF, in 4 KB calls.
+void AppEngineBenchmarkInstance::RunRead(BenchmarkResult *result) {
+  std::vector<char> buf(4096);
+  for (int i = 0; i < count_; ++i) {
+    double t0 = NowMs();
+    int fd = kp_->open(FileName(i), O_RDONLY, 0);
+    if (fd < 0) {
+      result->AddError();
+      continue;
+    }
+    ssize_t n;
+    while ((n = kp_->read(fd, &buf[0], buf.size())) > 0) {
+      result->AddBytes(n);
+    }
+    if (n < 0) {
+      result->AddError();
+    }
+    kp_->close(fd);
+    result->AddSample(NowMs() - t0);
+  }
+}
+
+// Times open() plus the first 4 KB read() of each file, which with
+// streaming reads does not wait for the rest of the file.
+void AppEngineBenchmarkInstance::RunFirstByte(BenchmarkResult *result) {
+  std::vector<char> buf(4096);
+  for (int i = 0; i < count_; ++i) {
+    double t0 = NowMs();
+    int fd = kp_->open(FileName(i), O_RDONLY, 0);
+    if (fd < 0) {
+      result->AddError();
+      continue;
+    }
+    ssize_t n = kp_->read(fd, &buf[0], buf.size());
+    result->AddSample(NowMs() - t0);
+    if (n < 0) {
+      result->AddError();
+    } else {
+      result->AddBytes(n);
+    }
+    kp_->close(fd);
+  }
+}
+
+// Times individual 4 KB read() calls over the first file once its
+// contents are local, so the per-call cost can be compared across file
+// sizes; it should not depend on them.
+void AppEngineBenchmarkInstance::RunReadCalls(BenchmarkResult *result) {
+  std::vector<char> buf(4096);
+  int fd = kp_->open(FileName(0), O_RDONLY, 0);
+  if (fd < 0) {
+    result->AddError();
+    return;
+  }
+  // The first read() loads the file.
+  if (kp_->read(fd, &buf[0], 1) < 0) {
+    result->AddError();
+  }
+  for (int i = 0; i < count_; ++i) {
+    kp_->lseek(fd, 0, SEEK_SET);
+    for (;;) {
+      double t0 = NowMs();
+      ssize_t n = kp_->read(fd, &buf[0], buf.size());
+      if (n <= 0) {
+        if (n < 0) {
+          result->AddError();
+        }
+        break;
+      }
+      result->AddSample(NowMs() - t0);
+      result->AddBytes(n);
+    }
+  }
+  kp_->close(fd);
+}
+
+// Times write() of size bytes per file, and with sync also the fsync()
+// that pushes the file to the backend.
+void AppEngineBenchmarkInstance::RunWrite(BenchmarkResult *result,
+                                          bool sync) {
+  std::vector<char> data(size_ > 0 ? size_ : 1);
+  for (size_t j = 0; j < data.size(); ++j) {
+    data[j] = 'a' + j % 26;
+  }
+  for (int i = 0; i < count_; ++i) {
+    int fd = kp_->open(FileName(i), O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+      result->AddError();
+      continue;
+    }
+    double t0 = NowMs();
+    ssize_t n = kp_->write(fd, &data[0], size_);
+    if (sync && n == size_ && kp_->fsync(fd) != 0) {
+      n = -1;
+    }
+    result->AddSample(NowMs() - t0);
+    if (n != size_) {
+      result->AddError();
+    } else {
+      result->AddBytes(n);
+    }
+    kp_->close(fd);
+  }
+}
+
+struct ParallelSync {
+  AppEngineMount *mount;
+  std::string path;
+  const std::vector<char> *data;
+  double ms;
+  int result;
+};
+
+void *AppEngineBenchmarkInstance::SyncShim(void *p) {
+  ParallelSync *op = reinterpret_cast<ParallelSync*>(p);
+  struct stat st;
+  op->result = -1;
+  op->ms = 0;
+  if (op->mount->Creat(op->path, 0644, &st) != 0) {
+    return NULL;
+  }
+  op->mount->Ref(st.st_ino);
+  if (op->mount->Write(st.st_ino, 0, &(*op->data)[0], op->data->size()) ==
+      static_cast<ssize_t>(op->data->size())) {
+    double t0 = NowMs();
+    op->result = op->mount->Fsync(st.st_ino);
+    op->ms = NowMs() - t0;
+  }
+  op->mount->Unref(st.st_ino);
+  return NULL;
+}
+
+// Times count threads each writing and fsync()ing a file of its own at
+// once, the burst that group commit turns into a few requests.  Like
+// popen, this goes to the mount directly.
+void AppEngineBenchmarkInstance::RunBurst(BenchmarkResult *result) {
+  std::vector<char> data(size_ > 0 ? size_ : 1, 'b');
+  std::vector<ParallelSync> ops(count_);
+  std::vector<pthread_t> threads(count_);
+  for (int i = 0; i < count_; ++i) {
+    char name[64];
+    snprintf(name, sizeof(name), "/bench/burst%d.dat", i);
+    ops[i].mount = mount_;
+    ops[i].path = name;
+    ops[i].data = &data;
+    pthread_create(&threads[i], NULL, SyncShim, &ops[i]);
+  }
+  for (int i = 0; i < count_; ++i) {
+    pthread_join(threads[i], NULL);
+    result->AddSample(ops[i].ms);
+    if (ops[i].result != 0) {
+      result->AddError();
+    } else {
+      result->AddBytes(data.size());
+    }
+  }
+}
+
+// Times reading the whole benchmark directory with getdents().
+void AppEngineBenchmarkInstance::RunGetdents(BenchmarkResult *result) {
+  std::vector<struct dirent> dirents(64);
+  for (int i = 0; i < count_; ++i) {
+    int fd = kp_->open("/bench", O_RDONLY, 0);
+    if (fd < 0) {
+      result->AddError();
+      continue;
+    }
+    double t0 = NowMs();
+    int n;
+    do {
+      n = kp_->getdents(fd, &dirents[0],
+                        dirents.size() * sizeof(struct dirent));
+    } while (n > 0);
+    result->AddSample(NowMs() - t0);
+    if (n < 0) {
+      result->AddError();
+    }
+    kp_->close(fd);
+  }
+}
+
+// Times listing the benchmark directory together with the attributes
+// of its files, which getdents followed by a stat of each file would
+// take a round trip per file for.
+void AppEngineBenchmarkInstance::RunReadDirPlus(BenchmarkResult *result) {
+  for (int i = 0; i < count_; ++i) {
+    std::vector<DirentPlus> entries;
+    double t0 = NowMs();
+    int ret = kp_->readdirplus("/bench", &entries);
+    result->AddSample(NowMs() - t0);
+    if (ret != 0) {
+      result->AddError();
+    }
+  }
+}
+
+// Times one KernelProxy::submit() batch that opens, fstats, reads and
+// closes count files of size bytes, which the mount fetches together.
+// The files are stored straight through the mount's AppEngineUrlRequest
+// and the local cache is off meanwhile, so that none of them is here.
+void AppEngineBenchmarkInstance::RunBatch(BenchmarkResult *result) {
+  std::vector<char> data(size_, 'b');
+  std::vector<AppEngineWrite> writes(count_);
+  for (int i = 0; i < count_; ++i) {
+    char name[64];
+    snprintf(name, sizeof(name), "/bench/batch%d.dat", i);
+    writes[i].path = name;
+    writes[i].data = &data;
+  }
+  if (mount_->url_request()->WriteBatch(&writes) != 0) {
+    result->AddError();
+    return;
+  }
+  std::vector<KernelOp> ops;
+  std::vector<std::vector<char> > bufs(count_,
+                                       std::vector<char>(size_ + 1));
+  std::vector<struct stat> st(count_);
+  for (int i = 0; i < count_; ++i) {
+    KernelOp op;
+    op.path = writes[i].path;
+    ops.push_back(op);
+    op.fd = KernelOp::kLinkedFd;
+    op.link = ops.size() - 1;
+    op.type = KernelOp::kFstat;
+    op.st = &st[i];
+    ops.push_back(op);
+    op.type = KernelOp::kRead;
+    op.buf = &bufs[i][0];
+    op.count = bufs[i].size();
+    ops.push_back(op);
+    op.type = KernelOp::kClose;
+    ops.push_back(op);
+  }
+  mount_->set_cache(NULL);
+  double t0 = NowMs();
+  kp_->submit(&ops);
+  result->AddSample(NowMs() - t0);
+  mount_->set_cache(cache_);
+  for (size_t i = 0; i < ops.size(); ++i) {
+    if (ops[i].result < 0) {
+      result->AddError();
+    } else if (ops[i].type == KernelOp::kRead) {
+      result->AddBytes(ops[i].result);
+    }
+  }
+}
+
+#if __cplusplus >= 202002L
+// Looks up and reads the file at path for RunCoRead().  Both wait for
+// the server without holding a thread.
+static KernelTask CoReadFile(KernelProxy *kp, std::string path, double start,
+                             BenchmarkResult *result) {
+  struct stat st;
+  if (co_await AsyncStat(kp, path, &st) != 0) {
+    result->AddError();
+    co_return;
+  }
+  // The lookup left the node in the table, so this does not block.
+  int fd = kp->open(path, O_RDONLY, 0);
+  if (fd < 0) {
+    result->AddError();
+    co_return;
+  }
+  std::vector<char> buf(st.st_size + 1);
+  ssize_t n = co_await AsyncRead(kp, fd, &buf[0], buf.size());
+  kp->close(fd);
+  if (n != st.st_size) {
+    result->AddError();
+    co_return;
+  }
+  result->AddSample(NowMs() - start);
+  result->AddBytes(n);
+}
+
+// Fetches count files, none of them known to the mount, with every
+// lookup and download in flight at once, from coroutines resumed by a
+// single KernelExecutor.
+void AppEngineBenchmarkInstance::RunCoRead(BenchmarkResult *result) {
+  std::vector<char> data(size_, 'c');
+  std::vector<AppEngineWrite> writes(count_);
+  for (int i = 0; i < count_; ++i) {
+    char name[64];
+    snprintf(name, sizeof(name), "/bench/coread%d.dat", i);
+    writes[i].path = name;
+    writes[i].data = &data;
+  }
+  if (mount_->url_request()->WriteBatch(&writes) != 0) {
+    result->AddError();
+    return;
+  }
+  mount_->set_cache(NULL);
+  // Started jobs do not wait for room in the queue: make room for all.
+  runner_.set_max_queued(0, true);
+  KernelExecutor executor;
+  double start = NowMs();
+  for (int i = 0; i < count_; ++i) {
+    executor.Spawn(CoReadFile(kp_, writes[i].path, start, result));
+  }
+  executor.Run();
+  runner_.set_max_queued(MainThreadRunner::kDefaultMaxQueued, true);
+  mount_->set_cache(cache_);
+  char detail[64];
+  snprintf(detail, sizeof(detail), "fetch=%.1fms", NowMs() - start);
+  result->set_detail(detail);
+}
+#endif
+
+// Times the upload and then the download of one size byte file, straight
+// through the mount's AppEngineUrlRequest so that no local cache is
+// involved, with count chunks in flight at a time.
+void AppEngineBenchmarkInstance::RunTransfer(BenchmarkResult *result) {
+  AppEngineUrlRequest *request = mount_->url_request();
+  request->set_chunking(AppEngineUrlRequest::kDefaultChunkSize, count_);
+  const std::string path = "/bench/transfer.dat";
+  double upload_ms = 0;
+  double download_ms = 0;
+  {
+    std::vector<char> data(size_ > 0 ? size_ : 1);
+    for (size_t j = 0; j < data.size(); ++j) {
+      data[j] = 'a' + j % 26;
+    }
+    double t0 = NowMs();
+    int ret = request->Write(path, data);
+    upload_ms = NowMs() - t0;
+    result->AddSample(upload_ms);
+    if (ret != 0) {
+      result->AddError();
+    } else {
+      result->AddBytes(data.size());
+    }
+  }
+  std::vector<char> data;
+  double t0 = NowMs();
+  int ret = request->Read(path, data);
+  download_ms = NowMs() - t0;
+  result->AddSample(download_ms);
+  size_t expected = size_ > 0 ? size_ : 1;
+  bool intact = ret == 0 && data.size() == expected;
+  for (size_t j = 0; intact && j < data.size(); ++j) {
+    intact = data[j] == 'a' + static_cast<int>(j % 26);
+  }
+  if (!intact) {
+    result->AddError();
+  } else {
+    result->AddBytes(data.size());
+  }
+  request->set_chunking(AppEngineUrlRequest::kDefaultChunkSize,
+                        AppEngineUrlRequest::kDefaultConcurrency);
+  char detail[128];
+  snprintf(detail, sizeof(detail),
+           "concurrency=%d upload=%.1fms download=%.1fms", count_,
+           upload_ms, download_ms);
+  result->set_detail(detail);
+}
+
+// Times the fsync() of a size byte file after count percent of it was
+// edited in scattered runs, and reports the bytes uploaded for that
+// against those of the first, full upload.  Goes to the mount directly.
+void AppEngineBenchmarkInstance::RunDelta(BenchmarkResult *result) {
+  const int kRuns = 16;
+  std::vector<char> data(size_ > 0 ? size_ : 1);
+  for (size_t j = 0; j < data.size(); ++j) {
+    data[j] = 'a' + j % 26;
+  }
+  struct stat st;
+  if (mount_->Creat("/bench/delta.dat", 0644, &st) != 0) {
+    result->AddError();
+    return;
+  }
+  mount_->Ref(st.st_ino);
+  int64_t uploaded[2];
+  double upload_ms[2];
+  for (int pass = 0; pass < 2; ++pass) {
+    if (pass == 0) {
+      mount_->Write(st.st_ino, 0, &data[0], data.size());
+    } else {
+      // Edit count percent of the file in kRuns runs spread over it.
+      size_t run = data.size() * count_ / 100 / kRuns;
+      std::vector<char> edit(run > 0 ? run : 1, 'z');
+      for (int i = 0; i < kRuns; ++i) {
+        off_t offset = data.size() / kRuns * i + data.size() / kRuns / 2;
+        mount_->Write(st.st_ino, offset, &edit[0], edit.size());
+      }
+    }
+    int64_t before =
+        mount_->url_request()->transfer_stats().bytes_uploaded;
+    double t0 = NowMs();
+    int ret = mount_->Fsync(st.st_ino);
+    upload_ms[pass] = NowMs() - t0;
+    uploaded[pass] =
+        mount_->url_request()->transfer_stats().bytes_uploaded - before;
+    result->AddSample(upload_ms[pass]);
+    if (ret != 0) {
+      result->AddError();
+    } else {
+      result->AddBytes(uploaded[pass]);
+    }
+  }
+  mount_->Unref(st.st_ino);
+  char detail[160];
+  snprintf(detail, sizeof(detail),
+           "edited=%d%% full_upload=%lld delta_upload=%lld ratio=%.4f "
+           "full=%.1fms delta=%.1fms", count_,
+           static_cast<long long>(uploaded[0]),
+           static_cast<long long>(uploaded[1]),
+           uploaded[0] > 0 ? static_cast<double>(uploaded[1]) / uploaded[0]
+                           : 0.0,
+           upload_ms[0], upload_ms[1]);
+  result->set_detail(detail);
+}
+
+// Uploads a size byte file of text and one of noise with compression at
+// level count, and reports the time spent compressing against the bytes
+// that saved.  Goes through the mount's AppEngineUrlRequest.
+void AppEngineBenchmarkInstance::RunCompress(BenchmarkResult *result) {
+  AppEngineUrlRequest *request = mount_->url_request();
+  AppEngineCompressor *compressor = request->compressor();
+  int old_level = compressor->level();
+  compressor->set_level(count_);
+  AppEngineCompressionStats before = compressor->stats();
+  std::vector<char> data(size_ > 0 ? size_ : 1);
+  for (int pass = 0; pass < 2; ++pass) {
+    unsigned int seed = 1;
+    for (size_t j = 0; j < data.size(); ++j) {
+      if (pass == 0) {
+        // Words from a small vocabulary, like logs or markup.
+        seed = j % 7 == 0 ? seed * 1103515245 + 12345 : seed;
+        data[j] = j % 7 == 6 ? ' ' : 'a' + (seed >> 16) % 8 + j % 7;
+      } else {
+        seed = seed * 1103515245 + 12345;
+        data[j] = static_cast<char>(seed >> 16);
+      }
+    }
+    double t0 = NowMs();
+    int ret = request->Write(pass == 0 ? "/bench/text.dat" : "/bench/noise.dat",
+                             data);
+    result->AddSample(NowMs() - t0);
+    if (ret != 0) {
+      result->AddError();
+    } else {
+      result->AddBytes(data.size());
+    }
+  }
+  AppEngineCompressionStats after = compressor->stats();
+  compressor->set_level(old_level);
+  int64_t saved = (after.bytes_in - after.bytes_out) -
+                  (before.bytes_in - before.bytes_out);
+  double ms = (after.compress_us - before.compress_us) / 1000.0;
+  char detail[160];
+  snprintf(detail, sizeof(detail),
+           "level=%d compressed=%lld skipped=%lld saved=%lld "
+           "compress=%.1fms ms_per_mb_saved=%.2f", count_,
+           static_cast<long long>(after.fields_compressed -
+                                  before.fields_compressed),
+           static_cast<long long>(after.fields_skipped -
+                                  before.fields_skipped),
+           static_cast<long long>(saved), ms,
+           saved > 0 ? ms / (saved / (1024.0 * 1024.0)) : 0.0);
+  result->set_detail(detail);
+}
+
+// Times count reads of the files fsync created, straight through the
+// mount's AppEngineUrlRequest, while a size byte file is uploaded in
+// the background.  With priorities the reads should barely notice it.
+void AppEngineBenchmarkInstance::RunMixed(BenchmarkResult *result) {
+  std::vector<char> bulk(size_ > 0 ? size_ : 1, 'm');
+  ParallelSync upload;
+  upload.mount = mount_;
+  upload.path = "/bench/bulk.dat";
+  upload.data = &bulk;
+  pthread_t thread;
+  pthread_create(&thread, NULL, SyncShim, &upload);
+  AppEngineUrlRequest *request = mount_->url_request();
+  for (int i = 0; i < count_; ++i) {
+    std::vector<char> data;
+    double t0 = NowMs();
+    int ret = request->Read(FileName(i), data);
+    result->AddSample(NowMs() - t0);
+    if (ret != 0) {
+      result->AddError();
+    } else {
+      result->AddBytes(data.size());
+    }
+  }
+  pthread_join(thread, NULL);
+  char detail[64];
+  snprintf(detail, sizeof(detail), "upload=%.1fms%s", upload.ms,
+           upload.result == 0 ? "" : " upload_failed");
+  result->set_detail(detail);
+}
+
+class AppEngineBenchmarkModule : public pp::Module {
+ public:
+  AppEngineBenchmarkModule() : pp::Module() {
+  }
+  virtual ~AppEngineBenchmarkModule() {}
+
+  virtual pp::Instance* CreateInstance(PP_Instance instance) {
+    return new AppEngineBenchmarkInstance(instance);
+  }
+};
+
+namespace pp {
+  Module* CreateModule() {
+    return new AppEngineBenchmarkModule();
+  }
+}  // namespace pp
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+#include "AppEngineCache.h"
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include "../base/dirent.h"
+
+const size_t AppEngineCache::kBlockSize;
+
+AppEngineCache::AppEngineCache(Mount *store, size_t max_bytes)
+  : store_(store),
+    max_bytes_(max_bytes),
+    bytes_(0) {
+  pthread_mutex_init(&lock_, NULL);
+  pthread_mutex_lock(&lock_);
+  Scan();
+  pthread_mutex_unlock(&lock_);
+}
+
+AppEngineCache::~AppEngineCache() {
+  pthread_mutex_destroy(&lock_);
+}
+
+std::string AppEngineCache::StoreName(const std::string& path) {
+  // Flatten the path into a single file name at the root of the store.
+  std::string name = "/";
+  for (size_t i = 0; i < path.size(); ++i) {
+    if (path[i] == '/') {
+      name += "%2F";
+    } else if (path[i] == '%') {
+      name += "%25";
+    } else {
+      name += path[i];
+    }
+  }
+  return name;
+}
+
+std::string AppEngineCache::PathName(const std::string& name) {
+  std::string path;
+  for (size_t i = 1; i < name.size(); ++i) {
+    if (name.compare(i, 3, "%2F") == 0) {
+      path += '/';
+      i += 2;
+    } else if (name.compare(i, 3, "%25") == 0) {
+      path += '%';
+      i += 2;
+    } else {
+      path += name[i];
+    }
+  }
+  return path;
+}
+
+// A file found in the store by Scan().
+struct AppEngineCacheFound {
+  time_t mtime;
+  std::string path;
+  std::string version;
+  size_t size;
+};
+
+static bool AppEngineCacheOlder(const AppEngineCacheFound& a,
+                                const AppEngineCacheFound& b) {
+  return a.mtime < b.mtime;
+}
+
+void AppEngineCache::Scan(void) {
+  struct stat st;
+  if (store_->GetNode("/", &st) != 0) {
+    return;
+  }
+  ino_t root = st.st_ino;
+  store_->Ref(root);
+  std::vector<AppEngineCacheFound> found;
+  std::vector<struct dirent> dirents(64);
+  off_t offset = 0;
+  int n;
+  while ((n = store_->Getdents(root, offset, &dirents[0],
+                               dirents.size() * sizeof(struct dirent))) > 0) {
+    for (size_t i = 0; i < n / sizeof(struct dirent); ++i) {
+      offset = dirents[i].d_off;
+      std::string name = std::string("/") + dirents[i].d_name;
+      AppEngineCacheFound file;
+      int header;
+      // Anything without a version line is not an entry.
+      if (store_->GetNode(name, &st) != 0 || S_ISDIR(st.st_mode) ||
+          (header = ReadHeader(st.st_ino, &file.version)) < 0 ||
+          file.version.empty()) {
+        continue;
+      }
+      file.mtime = st.st_mtime;
+      file.path = PathName(name);
+      file.size = st.st_size - header;
+      found.push_back(file);
+    }
+  }
+  store_->Unref(root);
+  // Oldest first, so that the newest ends up at the front of lru_.
+  std::stable_sort(found.begin(), found.end(), AppEngineCacheOlder);
+  for (size_t i = 0; i < found.size(); ++i) {
+    AddEntry(found[i].path, found[i].version, found[i].size);
+  }
+  Evict();
+}
+
+int AppEngineCache::ReadHeader(ino_t node, std::string *version) {
+  char buf[128];
+  ssize_t n = store_->Read(node, 0, buf, sizeof(buf));
+  if (n <= 0) {
+    return -1;
+  }
+  char *newline = static_cast<char*>(memchr(buf, '\n', n));
+  if (newline == NULL) {
+    return -1;
+  }
+  version->assign(buf, newline - buf);
+  return newline - buf + 1;
+}
+
+AppEngineCache::Entry *AppEngineCache::FindEntry(const std::string& path) {
+  std::map<std::string, Entry>::iterator it = entries_.find(path);
+  if (it != entries_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second.lru_pos);
+    return &it->second;
+  }
+  // Not seen by this instance; the store may still have it.
+  struct stat st;
+  if (store_->GetNode(StoreName(path), &st) != 0) {
+    return NULL;
+  }
+  std::string version;
+  int header = ReadHeader(st.st_ino, &version);
+  if (header < 0 || version.empty()) {
+    return NULL;
+  }
+  AddEntry(path, version, st.st_size - header);
+  Evict();
+  it = entries_.find(path);
+  return it == entries_.end() ? NULL : &it->second;
+}
+
+void AppEngineCache::AddEntry(const std::string& path,
+                              const std::string& version, size_t size) {
+  lru_.push_front(path);
+  Entry& entry = entries_[path];
+  entry.version = version;
+  entry.size = size;
+  entry.lru_pos = lru_.begin();
+  bytes_ += size;
+}
+
+void AppEngineCache::RemoveEntry(const std::string& path) {
+  std::map<std::string, Entry>::iterator it = entries_.find(path);
+  if (it != entries_.end()) {
+    bytes_ -= it->second.size;
+    lru_.erase(it->second.lru_pos);
+    entries_.erase(it);
+  }
+  store_->Unlink(StoreName(path));
+}
+
+void AppEngineCache::Evict(void) {
+  while (bytes_ > max_bytes_ && !lru_.empty()) {
+    std::string path = lru_.back();
+    RemoveEntry(path);
+  }
+}
+
+std::string AppEngineCache::Version(const std::string& path) {
+  pthread_mutex_lock(&lock_);
+  Entry *entry = FindEntry(path);
+  std::string version = entry ? entry->version : "";
+  pthread_mutex_unlock(&lock_);
+  return version;
+}
+
+int AppEngineCache::Load(const std::string& path, const std::string& version,
+                         std::vector<char> *data) {
+  pthread_mutex_lock(&lock_);
+  Entry *entry = FindEntry(path);
+  struct stat st;
+  std::string stored_version;
+  int header;
+  if (entry == NULL || entry->version != version ||
+      store_->GetNode(StoreName(path), &st) != 0 ||
+      (header = ReadHeader(st.st_ino, &stored_version)) < 0 ||
+      stored_version != version) {
+    pthread_mutex_unlock(&lock_);
+    return -1;
+  }
+  data->resize(st.st_size - header);
+  size_t pos = 0;
+  while (pos < data->size()) {
+    ssize_t n = store_->Read(st.st_ino, header + pos, &(*data)[pos],
+                             data->size() - pos);
+    if (n <= 0) {
+      // The store lost part of the file; do not trust it again.
+      RemoveEntry(path);
+      pthread_mutex_unlock(&lock_);
+      return -1;
+    }
+    pos += n;
+  }
+  pthread_mutex_unlock(&lock_);
+  return 0;
+}
+
+int AppEngineCache::Store(const std::string& path, const std::string& version,
+                          const std::vector<char>& data) {
+  if (version.empty() || data.size() > max_bytes_) {
+    return -1;
+  }
+  pthread_mutex_lock(&lock_);
+  RemoveEntry(path);
+  struct stat st;
+  std::string name = StoreName(path);
+  if (store_->Creat(name, 0644, &st) != 0) {
+    pthread_mutex_unlock(&lock_);
+    return -1;
+  }
+  std::string header = version + "\n";
+  bool ok = store_->Write(st.st_ino, 0, header.data(), header.size()) ==
+            static_cast<ssize_t>(header.size());
+  for (size_t pos = 0; ok && pos < data.size(); pos += kBlockSize) {
+    size_t n = std::min(kBlockSize, data.size() - pos);
+    ok = store_->Write(st.st_ino, header.size() + pos, &data[pos], n) ==
+         static_cast<ssize_t>(n);
+  }
+  if (!ok) {
+    store_->Unlink(name);
+    pthread_mutex_unlock(&lock_);
+    return -1;
+  }
+  store_->Fsync(st.st_ino);
+  AddEntry(path, version, data.size());
+  Evict();
+  pthread_mutex_unlock(&lock_);
+  return 0;
+}
+
+void AppEngineCache::Remove(const std::string& path) {
+  pthread_mutex_lock(&lock_);
+  RemoveEntry(path);
+  pthread_mutex_unlock(&lock_);
+}
+
+size_t AppEngineCache::bytes(void) {
+  pthread_mutex_lock(&lock_);
+  size_t bytes = bytes_;
+  pthread_mutex_unlock(&lock_);
+  return bytes;
+}
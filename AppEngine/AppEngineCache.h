@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that be
+ * found in the LICENSE file.
+ */
+#ifndef PACKAGES_SCRIPTS_FILESYS_APPENGINE_APPENGINECACHE_H_
+#define PACKAGES_SCRIPTS_FILESYS_APPENGINE_APPENGINECACHE_H_
+
+#include <pthread.h>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include "../base/Mount.h"
+
+// AppEngineCache keeps the contents of remote files in a local store,
+// keyed by remote path and the server's version of the contents.  A file
+// whose cached version is still current can then be loaded with a tiny
+// conditional request, or none at all, instead of a full transfer.
+//
+// The store is any Mount.  Each cached file is kept as one file at the
+// root of the store holding the version on its first line followed by
+// the contents, written in kBlockSize pieces.  The constructor takes in
+// the entries an earlier instance left in the store, and counts them
+// against max_bytes, so a persistent store makes a persistent cache.
+class AppEngineCache {
+ public:
+  // store is not owned.  max_bytes bounds the contents kept in the store;
+  // least recently used entries are removed to stay under it.
+  AppEngineCache(Mount *store, size_t max_bytes);
+  ~AppEngineCache();
+
+  // Version() returns the cached version of path, or an empty string if
+  // path is not cached.
+  std::string Version(const std::string& path);
+
+  // Load() fills data with the cached contents of path, provided they
+  // are at version.  Returns 0 on success and -1 otherwise.
+  int Load(const std::string& path, const std::string& version,
+           std::vector<char> *data);
+
+  // Store() records data as the contents of path at version, replacing
+  // any older entry.  Returns 0 on success and -1 otherwise.
+  int Store(const std::string& path, const std::string& version,
+            const std::vector<char>& data);
+
+  // Remove() drops the entry for path, if any.
+  void Remove(const std::string& path);
+
+  // bytes() returns the size of the contents currently cached.
+  size_t bytes(void);
+
+  static const size_t kBlockSize = 64 * 1024;
+
+ private:
+  struct Entry {
+    std::string version;
+    size_t size;
+    std::list<std::string>::iterator lru_pos;
+  };
+
+  // StoreName() maps a remote path to the name of its file in the store,
+  // and PathName() maps the name back.
+  static std::string StoreName(const std::string& path);
+  static std::string PathName(const std::string& name);
+
+  // Add the entries found in the store to entries_, the most recently
+  // modified first in lru_, and evict what does not fit.  Called with
+  // lock_ held.
+  void Scan(void);
+
+  // Find the entry for path, reading its header from the store if it is
+  // not in entries_ yet.  Returns NULL if path is not cached.  Called
+  // with lock_ held.
+  Entry *FindEntry(const std::string& path);
+
+  // Read the version line of the store file at node.  Returns the
+  // number of header bytes, or -1.
+  int ReadHeader(ino_t node, std::string *version);
+
+  void AddEntry(const std::string& path, const std::string& version,
+                size_t size);
+  void RemoveEntry(const std::string& path);
+  void Evict(void);
+
+  Mount *store_;
+  size_t max_bytes_;
+  size_t bytes_;
+  // lock_ guards the members below as well as all use of store_.
+  pthread_mutex_t lock_;
+  std::map<std::string, Entry> entries_;
+  // Cached paths, most recently used first.
+  std::list<std::string> lru_;
+};
+
+#endif  // PACKAGES_SCRIPTS_FILESYS_APPENGINE_APPENGINECACHE_H_
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+#include "AppEngineCompression.h"
+#include <string.h>
+#include <sys/time.h>
+#include <zlib.h>
+#include <algorithm>
+
+const size_t AppEngineCompressor::kMinSize;
+const size_t AppEngineCompressor::kSampleSize;
+const double AppEngineCompressor::kMaxRatio = 0.875;
+
+static int64_t NowMicros(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+AppEngineCompressor::AppEngineCompressor() : level_(0) {
+  pthread_mutex_init(&lock_, NULL);
+}
+
+AppEngineCompressor::~AppEngineCompressor() {
+  pthread_mutex_destroy(&lock_);
+}
+
+void AppEngineCompressor::set_level(int level) {
+  pthread_mutex_lock(&lock_);
+  level_ = std::max(0, std::min(level, 9));
+  pthread_mutex_unlock(&lock_);
+}
+
+int AppEngineCompressor::level(void) {
+  pthread_mutex_lock(&lock_);
+  int level = level_;
+  pthread_mutex_unlock(&lock_);
+  return level;
+}
+
+AppEngineCompressionStats AppEngineCompressor::stats(void) {
+  pthread_mutex_lock(&lock_);
+  AppEngineCompressionStats stats = stats_;
+  pthread_mutex_unlock(&lock_);
+  return stats;
+}
+
+int AppEngineCompressor::Deflate(const char *data, size_t len, int level,
+                                 std::vector<char> *out) {
+  uLongf out_len = compressBound(len);
+  out->resize(out_len);
+  if (compress2(reinterpret_cast<Bytef*>(&(*out)[0]), &out_len,
+                reinterpret_cast<const Bytef*>(data), len, level) != Z_OK) {
+    return -1;
+  }
+  out->resize(out_len);
+  return 0;
+}
+
+int AppEngineCompressor::Compress(const char *data, size_t len,
+                                  std::vector<char> *out) {
+  int level = this->level();
+  if (level == 0 || len < kMinSize) {
+    return -1;
+  }
+  int64_t start = NowMicros();
+  // Already compressed data, the common case for media, shows in the
+  // first few kilobytes; do not spend time on the rest of it.
+  bool shrinks = true;
+  if (len > 2 * kSampleSize) {
+    shrinks = Deflate(data, kSampleSize, level, out) == 0 &&
+              out->size() <= kSampleSize * kMaxRatio;
+  }
+  if (shrinks) {
+    shrinks = Deflate(data, len, level, out) == 0 &&
+              out->size() <= len * kMaxRatio;
+  }
+  int64_t elapsed = NowMicros() - start;
+
+  pthread_mutex_lock(&lock_);
+  stats_.compress_us += elapsed;
+  if (shrinks) {
+    ++stats_.fields_compressed;
+    stats_.bytes_in += len;
+    stats_.bytes_out += out->size();
+  } else {
+    ++stats_.fields_skipped;
+  }
+  pthread_mutex_unlock(&lock_);
+  if (!shrinks) {
+    out->clear();
+    return -1;
+  }
+  return 0;
+}
+
+int AppEngineCompressor::Inflate(const char *data, size_t len,
+                                 std::vector<char> *out) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit(&stream) != Z_OK) {
+    return -1;
+  }
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  stream.avail_in = len;
+  char buf[16 * 1024];
+  int ret;
+  do {
+    stream.next_out = reinterpret_cast<Bytef*>(buf);
+    stream.avail_out = sizeof(buf);
+    ret = inflate(&stream, Z_NO_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END) {
+      break;
+    }
+    out->insert(out->end(), buf, buf + sizeof(buf) - stream.avail_out);
+  } while (ret != Z_STREAM_END);
+  inflateEnd(&stream);
+  return ret == Z_STREAM_END ? 0 : -1;
+}
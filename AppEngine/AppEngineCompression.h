@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that be
+ * found in the LICENSE file.
+ */
+#ifndef PACKAGES_SCRIPTS_FILESYS_APPENGINE_APPENGINECOMPRESSION_H_
+#define PACKAGES_SCRIPTS_FILESYS_APPENGINE_APPENGINECOMPRESSION_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+
+// What compression did for the request bodies, and what it cost.
+struct AppEngineCompressionStats {
+  AppEngineCompressionStats()
+    : fields_compressed(0),
+      fields_skipped(0),
+      bytes_in(0),
+      bytes_out(0),
+      compress_us(0) {}
+  // Number of fields sent compressed, and number of fields large enough
+  // to try that were sent as they are because they did not shrink.
+  int64_t fields_compressed;
+  int64_t fields_skipped;
+  // Size of the compressed fields before and after compression.
+  int64_t bytes_in;
+  int64_t bytes_out;
+  // Time spent compressing, skipped fields included, in microseconds.
+  int64_t compress_us;
+};
+
+// AppEngineCompressor deflates the large fields of requests before they
+// are handed to the main thread, so that the PPAPI loop never waits on
+// it.  Data that does not shrink, judged from a sample of its start
+// before the whole of it is compressed, is sent as it is.
+class AppEngineCompressor {
+ public:
+  AppEngineCompressor();
+  ~AppEngineCompressor();
+
+  // Compress() stores in *out the zlib stream of the len bytes at data
+  // and returns 0, or returns -1 if they are better sent as they are:
+  // compression is off, len is under kMinSize, or the result would not
+  // be at most kMaxRatio of len.
+  int Compress(const char *data, size_t len, std::vector<char> *out);
+
+  // Inflate() appends the contents of the zlib stream at data to *out.
+  // Returns 0 on success and -1 if the stream is corrupt or truncated.
+  static int Inflate(const char *data, size_t len, std::vector<char> *out);
+
+  // The zlib level to use, from 1 (fastest) to 9 (smallest); 0, the
+  // default, turns compression off.
+  void set_level(int level);
+  int level(void);
+
+  AppEngineCompressionStats stats(void);
+
+  static const size_t kMinSize = 1024;
+  static const size_t kSampleSize = 16 * 1024;
+  static const double kMaxRatio;
+
+ private:
+  // Deflate len bytes at data into *out, which is resized to fit.
+  // Returns 0 on success.
+  static int Deflate(const char *data, size_t len, int level,
+                     std::vector<char> *out);
+
+  // lock_ guards level_ and stats_; compression itself runs without it.
+  pthread_mutex_t lock_;
+  int level_;
+  AppEngineCompressionStats stats_;
+};
+
+#endif  // PACKAGES_SCRIPTS_FILESYS_APPENGINE_APPENGINECOMPRESSION_H_
@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+#include "AppEngineDelta.h"
+#include <pthread.h>
+#include <string.h>
+#include <map>
+
+const size_t AppEngineDelta::kBlockSize;
+
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+static uint32_t crc_table[256];
+
+static void InitCrcTable(void) {
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; ++k) {
+      c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    }
+    crc_table[i] = c;
+  }
+}
+
+static void PutU32(std::vector<char> *out, uint32_t n) {
+  out->push_back(static_cast<char>(n >> 24));
+  out->push_back(static_cast<char>(n >> 16));
+  out->push_back(static_cast<char>(n >> 8));
+  out->push_back(static_cast<char>(n));
+}
+
+static uint32_t GetU32(const char *p) {
+  const unsigned char *u = reinterpret_cast<const unsigned char*>(p);
+  return (static_cast<uint32_t>(u[0]) << 24) |
+         (static_cast<uint32_t>(u[1]) << 16) |
+         (static_cast<uint32_t>(u[2]) << 8) |
+         static_cast<uint32_t>(u[3]);
+}
+
+static void PutLiteral(std::vector<char> *out, const char *data,
+                       size_t len) {
+  if (len == 0) {
+    return;
+  }
+  out->push_back('L');
+  PutU32(out, len);
+  out->insert(out->end(), data, data + len);
+}
+
+static void PutCopy(std::vector<char> *out, size_t first, size_t count) {
+  if (count == 0) {
+    return;
+  }
+  out->push_back('C');
+  PutU32(out, first);
+  PutU32(out, count);
+}
+
+void AppEngineSignature::Compute(const std::string& version,
+                                 const char *data, size_t len,
+                                 size_t block_size) {
+  version_ = version;
+  block_size_ = block_size;
+  size_ = len;
+  blocks_.resize(len / block_size);
+  for (size_t i = 0; i < blocks_.size(); ++i) {
+    const char *block = data + i * block_size;
+    blocks_[i].weak = AppEngineDelta::WeakChecksum(block, block_size);
+    blocks_[i].strong = AppEngineDelta::Crc32(block, block_size);
+  }
+}
+
+void AppEngineSignature::Clear(void) {
+  version_.clear();
+  block_size_ = 0;
+  size_ = 0;
+  std::vector<AppEngineBlockSum>().swap(blocks_);
+}
+
+uint32_t AppEngineDelta::WeakChecksum(const char *data, size_t len) {
+  const unsigned char *u = reinterpret_cast<const unsigned char*>(data);
+  uint32_t a = 0;
+  uint32_t b = 0;
+  for (size_t i = 0; i < len; ++i) {
+    a += u[i];
+    b += (len - i) * u[i];
+  }
+  return (a & 0xffff) | ((b & 0xffff) << 16);
+}
+
+uint32_t AppEngineDelta::Crc32(const char *data, size_t len, uint32_t crc) {
+  pthread_once(&crc_table_once, InitCrcTable);
+  const unsigned char *u = reinterpret_cast<const unsigned char*>(data);
+  crc = ~crc;
+  for (size_t i = 0; i < len; ++i) {
+    crc = crc_table[(crc ^ u[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+size_t AppEngineDelta::Encode(const AppEngineSignature& base,
+                              const char *data, size_t len,
+                              std::vector<char> *delta) {
+  delta->clear();
+  const size_t block_size = base.block_size();
+  const std::vector<AppEngineBlockSum>& blocks = base.blocks();
+  // Old blocks by weak checksum.
+  std::map<uint32_t, std::vector<uint32_t> > table;
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    table[blocks[i].weak].push_back(i);
+  }
+
+  const unsigned char *u = reinterpret_cast<const unsigned char*>(data);
+  size_t literal_bytes = 0;
+  size_t literal_start = 0;
+  // The run of old blocks being copied, not written out yet.
+  size_t copy_first = 0;
+  size_t copy_count = 0;
+  size_t pos = 0;
+  uint32_t a = 0;
+  uint32_t b = 0;
+  bool fresh = true;
+  while (!table.empty() && pos + block_size <= len) {
+    if (fresh) {
+      uint32_t weak = WeakChecksum(data + pos, block_size);
+      a = weak & 0xffff;
+      b = weak >> 16;
+      fresh = false;
+    }
+    std::map<uint32_t, std::vector<uint32_t> >::iterator it =
+        table.find(a | (b << 16));
+    bool found = false;
+    size_t match = 0;
+    if (it != table.end()) {
+      uint32_t strong = Crc32(data + pos, block_size);
+      for (size_t i = 0; !found && i < it->second.size(); ++i) {
+        found = blocks[it->second[i]].strong == strong;
+        match = it->second[i];
+      }
+    }
+    if (found) {
+      if (pos > literal_start) {
+        PutCopy(delta, copy_first, copy_count);
+        copy_count = 0;
+        PutLiteral(delta, data + literal_start, pos - literal_start);
+        literal_bytes += pos - literal_start;
+      }
+      if (copy_count > 0 && copy_first + copy_count == match) {
+        ++copy_count;
+      } else {
+        PutCopy(delta, copy_first, copy_count);
+        copy_first = match;
+        copy_count = 1;
+      }
+      pos += block_size;
+      literal_start = pos;
+      fresh = true;
+      continue;
+    }
+    // Slide the window one byte.
+    if (pos + block_size < len) {
+      uint32_t out = u[pos];
+      uint32_t in = u[pos + block_size];
+      a = (a - out + in) & 0xffff;
+      b = (b - block_size * out + a) & 0xffff;
+    }
+    ++pos;
+  }
+  PutCopy(delta, copy_first, copy_count);
+  PutLiteral(delta, data + literal_start, len - literal_start);
+  literal_bytes += len - literal_start;
+  return literal_bytes;
+}
+
+int AppEngineDelta::Apply(const char *base, size_t base_len,
+                          size_t block_size, const std::vector<char>& delta,
+                          std::vector<char> *out) {
+  out->clear();
+  size_t pos = 0;
+  while (pos < delta.size()) {
+    char op = delta[pos++];
+    if (op == 'C' && pos + 8 <= delta.size()) {
+      uint64_t first = GetU32(&delta[pos]);
+      uint64_t count = GetU32(&delta[pos + 4]);
+      pos += 8;
+      if ((first + count) * block_size > base_len) {
+        return -1;
+      }
+      out->insert(out->end(), base + first * block_size,
+                  base + (first + count) * block_size);
+    } else if (op == 'L' && pos + 4 <= delta.size()) {
+      size_t length = GetU32(&delta[pos]);
+      pos += 4;
+      if (length > delta.size() - pos) {
+        return -1;
+      }
+      out->insert(out->end(), delta.begin() + pos,
+                  delta.begin() + pos + length);
+      pos += length;
+    } else {
+      return -1;
+    }
+  }
+  return 0;
+}
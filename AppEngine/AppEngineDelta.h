@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that be
+ * found in the LICENSE file.
+ */
+#ifndef PACKAGES_SCRIPTS_FILESYS_APPENGINE_APPENGINEDELTA_H_
+#define PACKAGES_SCRIPTS_FILESYS_APPENGINE_APPENGINEDELTA_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+// Checksums of one block of a file.  weak can be rolled along the
+// contents a byte at a time; strong confirms a weak match.
+struct AppEngineBlockSum {
+  uint32_t weak;
+  uint32_t strong;
+};
+
+// AppEngineSignature describes one version of a file by the checksums of
+// its fixed-size blocks.  It is all AppEngineDelta needs to know about
+// the version the server has.
+class AppEngineSignature {
+ public:
+  AppEngineSignature() : block_size_(0), size_(0) {}
+
+  // Compute() replaces the signature with that of the len bytes at data,
+  // which are the contents of version.
+  void Compute(const std::string& version, const char *data, size_t len,
+               size_t block_size);
+  void Clear(void);
+
+  bool empty(void) const { return version_.empty(); }
+  const std::string& version(void) const { return version_; }
+  size_t block_size(void) const { return block_size_; }
+  // The size of the file the signature was computed from.
+  size_t size(void) const { return size_; }
+  // Sums of the full blocks only; a short last block is left out.
+  const std::vector<AppEngineBlockSum>& blocks(void) const { return blocks_; }
+
+ private:
+  std::string version_;
+  size_t block_size_;
+  size_t size_;
+  std::vector<AppEngineBlockSum> blocks_;
+};
+
+// AppEngineDelta encodes new contents of a file as the blocks of an old
+// version they reuse, wherever they now are, plus the bytes that are
+// new, in the manner of rsync.  A delta is a series of operations with
+// big-endian 32-bit arguments:
+//   'C' <first block> <count>   copy count blocks of the old version
+//   'L' <length> <bytes>        append length literal bytes
+class AppEngineDelta {
+ public:
+  // Encode() stores in *delta the operations that turn the version base
+  // describes into the len bytes at data, and returns the number of
+  // literal bytes among them.
+  static size_t Encode(const AppEngineSignature& base, const char *data,
+                       size_t len, std::vector<char> *delta);
+
+  // Apply() rebuilds the new contents from the base_len bytes of the old
+  // version at base and a delta made with block_size.  Returns 0 on
+  // success and -1 if the delta does not fit the old version.
+  static int Apply(const char *base, size_t base_len, size_t block_size,
+                   const std::vector<char>& delta, std::vector<char> *out);
+
+  // The rolling checksum of a block.
+  static uint32_t WeakChecksum(const char *data, size_t len);
+  // CRC-32 (as in zlib), which also checks whole rebuilt files.
+  static uint32_t Crc32(const char *data, size_t len, uint32_t crc = 0);
+
+  static const size_t kBlockSize = 16 * 1024;
+};
+
+#endif  // PACKAGES_SCRIPTS_FILESYS_APPENGINE_APPENGINEDELTA_H_
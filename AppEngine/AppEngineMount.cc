@@ -4,50 +4,683 @@
  * found in the LICENSE file.
  */
 #include "AppEngineMount.h"
+#include "AppEngineDelta.h"
 #include "AppEngineNode.h"
 #include "../base/dirent.h"
+#include "../base/Trace.h"
 #include <assert.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
 
 AppEngineMount::AppEngineMount(MainThreadRunner *runner, std::string base_url)
-  : url_request_(runner, base_url) {
+  : url_request_(runner, base_url),
+    syncing_(false),
+    // Long enough for a burst of fsyncs to gather, short next to a
+    // round trip.
+    group_commit_window_(0.002),
+    max_cached_nodes_(kDefaultMaxCachedNodes),
+    cache_(NULL),
+    listing_generation_(0) {
   slots_.Alloc();
+  pthread_mutex_init(&lock_, NULL);
+  pthread_key_create(&pin_, NULL);
+  pthread_cond_init(&fetch_done_, NULL);
+  pthread_cond_init(&sync_done_, NULL);
 }
 
-int AppEngineMount::Creat(const std::string& path, mode_t mode, struct stat* buf) {
-  AppEngineNode *child;
-  AppEngineNode *parent;
-  fprintf(stderr, "in Creat\n");
-
-  // Create it.
-  int slot = slots_.Alloc();
-  child = slots_.At(slot);
-  child->set_path(path);
-  child->slot = slot;
-  child->set_is_dir(false);
-  child->set_mount(this);
-  std::string p(path);
-  PathHandle ph(p);
-  child->set_name(ph.Last());
-  child->IncrementUseCount();
-
-  // read from GAE
-  fprintf(stderr, "Before remote read...\n");
-  std::vector<char> data;
-  url_request_.Read(path, data);
-  fprintf(stderr, "Done with remote read.\n");
-  child->set_data(data);
-
-  std::vector<char> test = child->data();
-  std::vector<char>::iterator it;
-
-  fprintf(stderr, "-------------\n");
-  for (it = test.begin(); it != test.end(); ++it) {
-    fprintf(stderr, "%c, ", *it);
-  }
-  fprintf(stderr, "\n-------------\n");
+AppEngineMount::~AppEngineMount() {
+  pthread_cond_destroy(&sync_done_);
+  pthread_cond_destroy(&fetch_done_);
+  pthread_key_delete(pin_);
+  pthread_mutex_destroy(&lock_);
+}
+
+AppEngineMountStats AppEngineMount::stats(void) {
+  pthread_mutex_lock(&lock_);
+  AppEngineMountStats stats = stats_;
+  pthread_mutex_unlock(&lock_);
+  return stats;
+}
+
+void AppEngineMount::set_max_cached_nodes(size_t max_cached_nodes) {
+  pthread_mutex_lock(&lock_);
+  max_cached_nodes_ = max_cached_nodes;
+  EvictNodes();
+  pthread_mutex_unlock(&lock_);
+}
+
+int AppEngineMount::JoinFetch(Fetch *fetch) {
+  ++fetch->waiters;
+  ++stats_.coalesced_fetches;
+  while (!fetch->done) {
+    pthread_cond_wait(&fetch_done_, &lock_);
+  }
+  --fetch->waiters;
+  int error = fetch->error;
+  // The fetch has already been removed from its in-flight map by its
+  // owner; the last waiter out frees it.
+  if (fetch->waiters == 0) {
+    delete fetch;
+  }
+  return error;
+}
+
+void AppEngineMount::FinishFetch(std::map<std::string, Fetch*> *inflight,
+                                 const std::string& path, Fetch *fetch,
+                                 int error) {
+  fetch->done = true;
+  fetch->error = error;
+  inflight->erase(path);
+  if (fetch->waiters == 0) {
+    delete fetch;
+  } else {
+    pthread_cond_broadcast(&fetch_done_);
+  }
+}
+
+bool AppEngineMount::CachedSlot(const std::string& path, bool create,
+                                int *slot) {
+  double now = NowSeconds();
+  std::map<std::string, int>::iterator node_it = nodes_.find(path);
+  if (node_it != nodes_.end()) {
+    AppEngineNode *node = slots_.At(node_it->second);
+    // Nodes with local changes are authoritative; anything else is
+    // only trusted for attr_ttl seconds.
+    if (node->is_dirty() ||
+        now - node->attr_time() < timeouts_.attr_ttl) {
+      ++stats_.node_table_hits;
+      *slot = node_it->second;
+      // Keep recently used unreferenced nodes at the front of the LRU.
+      std::map<int, std::list<int>::iterator>::iterator pos =
+        lru_pos_.find(*slot);
+      if (pos != lru_pos_.end()) {
+        lru_.splice(lru_.begin(), lru_, pos->second);
+      }
+      return true;
+    }
+  } else if (!create) {
+    std::map<std::string, double>::iterator neg = negative_.find(path);
+    if (neg != negative_.end()) {
+      if (now < neg->second) {
+        ++stats_.negative_hits;
+        *slot = -1;
+        errno = ENOENT;
+        return true;
+      }
+      negative_.erase(neg);
+    }
+  }
+  return false;
+}
+
+int AppEngineMount::GetSlot(const std::string& path, bool create) {
+  pthread_mutex_lock(&lock_);
+  if (create) {
+    negative_.erase(path);
+  }
+  for (;;) {
+    int slot;
+    if (CachedSlot(path, create, &slot)) {
+      if (slot != -1) {
+        Pin(slot);
+      }
+      pthread_mutex_unlock(&lock_);
+      return slot;
+    }
+    std::map<std::string, Fetch*>::iterator fetch_it =
+      inflight_stats_.find(path);
+    if (fetch_it == inflight_stats_.end()) {
+      break;
+    }
+    // Someone else is looking this path up; once they are done the node
+    // is in the table, unless it does not exist.
+    int error = JoinFetch(fetch_it->second);
+    if (error != 0 && !create) {
+      pthread_mutex_unlock(&lock_);
+      errno = error;
+      return -1;
+    }
+  }
+  Fetch *fetch = new Fetch;
+  inflight_stats_[path] = fetch;
+  ++stats_.remote_stats;
+  pthread_mutex_unlock(&lock_);
+
+  // Only the attributes are fetched here; the contents are loaded by
+  // LoadData() once the file is actually read or written.
+  AppEngineFileInfo info;
+  int result = url_request_.Stat(path, &info);
+  return FinishLookup(path, create, fetch, result, info, true);
+}
+
+int AppEngineMount::FinishLookup(const std::string& path, bool create,
+                                 Fetch *fetch, int result,
+                                 const AppEngineFileInfo& info, bool pin) {
+  pthread_mutex_lock(&lock_);
+  int error = 0;
+  int slot = ApplyLookup(path, create, result, info, &error);
+  if (slot != -1 && pin) {
+    Pin(slot);
+  }
+  FinishFetch(&inflight_stats_, path, fetch, error);
+  pthread_mutex_unlock(&lock_);
+  if (slot == -1) {
+    errno = error;
+  }
+  return slot;
+}
+
+int AppEngineMount::ApplyLookup(const std::string& path, bool create,
+                                int result, const AppEngineFileInfo& info,
+                                int *error) {
+  double now = NowSeconds();
+  int slot = -1;
+  *error = 0;
+  std::map<std::string, int>::iterator node_it = nodes_.find(path);
+  if (node_it != nodes_.end()) {
+    // Revalidating a node whose attributes expired.
+    slot = node_it->second;
+    AppEngineNode *node = slots_.At(slot);
+    bool changed = !info.exists || info.size != node->len() ||
+                   info.mtime != node->mtime() ||
+                   (!info.version.empty() && info.version != node->version());
+    if (result != 0 || node->is_dirty() || node->use_count() > 0) {
+      // Open files keep the view they were opened with.
+      node->set_attr_time(now);
+    } else if (!changed) {
+      ++stats_.attr_revalidations;
+      node->set_attr_time(now);
+    } else {
+      DropNode(slot);
+      slot = -1;
+    }
+  }
+  if (slot != -1) {
+    // Revalidated above.
+  } else if (result != 0) {
+    *error = EIO;
+  } else if (!info.exists && !create) {
+    *error = ENOENT;
+    if (timeouts_.negative_ttl > 0) {
+      negative_[path] = now + timeouts_.negative_ttl;
+    }
+  } else {
+    slot = slots_.Alloc();
+    AppEngineNode *child = slots_.At(slot);
+    child->set_path(path);
+    child->slot = slot;
+    child->set_mount(this);
+    child->set_name(BaseName(path));
+    child->set_attr_time(now);
+    if (info.exists) {
+      child->set_is_dir(info.is_dir);
+      child->set_len(info.size);
+      child->set_mtime(info.mtime);
+      child->set_version(info.version);
+    } else {
+      // A new file: there is nothing on the server to load.
+      std::vector<char> empty;
+      child->set_data(&empty);
+      child->set_mtime(time(NULL));
+      listings_.erase(DirName(path));
+    }
+    nodes_[path] = slot;
+    // Nobody holds a reference yet, so the node starts out in the LRU.
+    lru_.push_front(slot);
+    lru_pos_[slot] = lru_.begin();
+    EvictNodes();
+  }
+  return slot;
+}
+
+int AppEngineMount::LoadData(ino_t slot) {
+  AppEngineNode *node;
+  pthread_mutex_lock(&lock_);
+  for (;;) {
+    node = slots_.At(slot);
+    if (node == NULL) {
+      pthread_mutex_unlock(&lock_);
+      errno = ENOENT;
+      return -1;
+    }
+    if (node->is_loaded()) {
+      pthread_mutex_unlock(&lock_);
+      return 0;
+    }
+    std::map<std::string, Fetch*>::iterator it = inflight_.find(node->path());
+    if (it == inflight_.end()) {
+      break;
+    }
+    int error = JoinFetch(it->second);
+    if (error != 0) {
+      pthread_mutex_unlock(&lock_);
+      errno = error;
+      return -1;
+    }
+  }
+  DataFetch *job = StartDataFetch(slot);
+  pthread_mutex_unlock(&lock_);
+  int result = RunDataFetch(job);
+  if (result != 0) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+AppEngineMount::DataFetch *AppEngineMount::StartDataFetch(ino_t slot) {
+  AppEngineNode *node = slots_.At(slot);
+  DataFetch *job = new DataFetch;
+  job->mount = this;
+  job->slot = slot;
+  job->path = node->path();
+  job->version = node->version();
+  // Attributes confirmed within attr_ttl include a current version.
+  job->fresh = NowSeconds() - node->attr_time() < timeouts_.attr_ttl;
+  job->cache = cache_;
+  job->fetch = new Fetch;
+  job->priority = MainThreadRunner::kInteractive;
+  inflight_[job->path] = job->fetch;
+  return job;
+}
+
+void AppEngineMount::DataFetch::OnProgress(size_t available, size_t total) {
+  pthread_mutex_lock(&mount->lock_);
+  fetch->available = available;
+  fetch->total = total;
+  pthread_cond_broadcast(&mount->fetch_done_);
+  pthread_mutex_unlock(&mount->lock_);
+}
+
+int AppEngineMount::RunDataFetch(DataFetch *job) {
+  const std::string& path = job->path;
+  std::string version = job->version;
+  AppEngineCache *cache = job->cache;
+  Fetch *fetch = job->fetch;
+  // fetch->data is only written here until the fetch is finished, and
+  // readers only look at the part OnProgress() has published.
+  std::vector<char>& data = fetch->data;
+  int result = -1;
+  int remote_fetches = 0;
+  bool from_cache = false;
+  if (cache != NULL && job->fresh && !version.empty() &&
+      cache->Load(path, version, &data) == 0) {
+    from_cache = true;
+    result = 0;
+  }
+  if (!from_cache) {
+    // Let the server confirm the cached copy, if there is one, so that
+    // only its version goes over the wire when it is still current.
+    std::string cached = cache != NULL ? cache->Version(path) : "";
+    ++remote_fetches;
+    data.clear();
+    result = url_request_.Read(path, data, cached, &version, job,
+                               job->priority);
+    if (result == AppEngineUrlRequest::kNotModified) {
+      if (cache->Load(path, cached, &data) == 0) {
+        from_cache = true;
+        result = 0;
+      } else {
+        // The cached copy went away in the meantime.
+        ++remote_fetches;
+        data.clear();
+        result = url_request_.Read(path, data, "", &version, job,
+                                   job->priority);
+      }
+    }
+    if (result == 0 && !from_cache && cache != NULL) {
+      cache->Store(path, version, data);
+    }
+  }
+
+  return FinishDataFetch(job, result, version, remote_fetches, from_cache);
+}
+
+int AppEngineMount::FinishDataFetch(DataFetch *job, int result,
+                                    const std::string& version,
+                                    int remote_fetches, bool from_cache) {
+  const std::string& path = job->path;
+  Fetch *fetch = job->fetch;
+  std::vector<char>& data = fetch->data;
+  pthread_mutex_lock(&lock_);
+  stats_.remote_fetches += remote_fetches;
+  if (result == 0 && job->cache != NULL) {
+    if (from_cache) {
+      ++stats_.cache_hits;
+      stats_.cache_bytes_saved += data.size();
+    } else {
+      ++stats_.cache_misses;
+    }
+  }
+  AppEngineNode *node = slots_.At(job->slot);
+  if (result == 0 && node != NULL && node->path() == path &&
+      !node->is_loaded()) {
+    node->set_data(&data);
+    node->set_version(version);
+  }
+  FinishFetch(&inflight_, path, fetch, result == 0 ? 0 : EIO);
+  pthread_mutex_unlock(&lock_);
+  delete job;
+  return result == 0 ? 0 : -1;
+}
+
+AppEngineMount::DataFetch *AppEngineMount::StartBackgroundFetch(
+    ino_t slot, MainThreadRunner::Priority priority) {
+  DataFetch *job = StartDataFetch(slot);
+  job->priority = priority;
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int error = pthread_create(&thread, &attr, DataFetchShim, job);
+  pthread_attr_destroy(&attr);
+  return error == 0 ? NULL : job;
+}
+
+int AppEngineMount::Prefetch(ino_t slot, off_t offset, size_t count) {
+  // Contents are always fetched whole, so prefetching any range means
+  // starting the download of the file, unless it is already under way.
+  pthread_mutex_lock(&lock_);
+  AppEngineNode *node = slots_.At(slot);
+  if (node == NULL || node->is_dir() || node->is_loaded() ||
+      inflight_.find(node->path()) != inflight_.end()) {
+    pthread_mutex_unlock(&lock_);
+    return 0;
+  }
+  // A read that comes along meanwhile waits for this fetch, at this
+  // priority, but the runner does not let it wait long.
+  DataFetch *job = StartBackgroundFetch(slot, MainThreadRunner::kPrefetch);
+  pthread_mutex_unlock(&lock_);
+  if (job != NULL) {
+    RunDataFetch(job);
+  }
+  return 0;
+}
+
+void AppEngineMount::PrefetchBatch(const std::vector<ino_t>& slots) {
+  size_t max_size = url_request_.chunk_size();
+  std::vector<DataFetch*> jobs;
+  std::vector<AppEngineRead> reads;
+  pthread_mutex_lock(&lock_);
+  std::vector<ino_t> wanted;
+  for (size_t i = 0; i < slots.size(); ++i) {
+    AppEngineNode *node = slots_.At(slots[i]);
+    // Files the cache may have are left to be revalidated one by one.
+    if (node == NULL || node->is_dir() || node->is_loaded() ||
+        (max_size > 0 && node->len() > max_size) ||
+        std::find(wanted.begin(), wanted.end(), slots[i]) != wanted.end() ||
+        inflight_.find(node->path()) != inflight_.end() ||
+        (cache_ != NULL && !cache_->Version(node->path()).empty())) {
+      continue;
+    }
+    wanted.push_back(slots[i]);
+  }
+  // A single file is better off with a plain read, whose reply can be
+  // read from as it arrives.
+  if (wanted.size() < 2) {
+    pthread_mutex_unlock(&lock_);
+    return;
+  }
+  for (size_t i = 0; i < wanted.size(); ++i) {
+    DataFetch *job = StartDataFetch(wanted[i]);
+    AppEngineRead read;
+    read.path = job->path;
+    read.size = slots_.At(wanted[i])->len();
+    jobs.push_back(job);
+    reads.push_back(read);
+  }
+  stats_.batched_reads += jobs.size();
+  pthread_mutex_unlock(&lock_);
+
+  url_request_.ReadBatch(&reads);
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    AppEngineRead& read = reads[i];
+    if (read.result == 0) {
+      jobs[i]->fetch->data.swap(read.data);
+      if (jobs[i]->cache != NULL) {
+        jobs[i]->cache->Store(read.path, read.version, jobs[i]->fetch->data);
+      }
+    }
+    FinishDataFetch(jobs[i], read.result, read.version, 0, false);
+  }
+}
+
+void AppEngineMount::ReadAsync(ino_t slot, off_t offset, void *buf,
+                               size_t count, AsyncCallback callback,
+                               void *arg) {
+  AsyncOp *op = new AsyncOp;
+  op->write = false;
+  op->slot = slot;
+  op->offset = offset;
+  op->buf = buf;
+  op->count = count;
+  op->callback = callback;
+  op->arg = arg;
+  StartAsyncOp(op);
+}
+
+void AppEngineMount::WriteAsync(ino_t slot, off_t offset, const void *buf,
+                                size_t count, AsyncCallback callback,
+                                void *arg) {
+  AsyncOp *op = new AsyncOp;
+  op->write = true;
+  op->slot = slot;
+  op->offset = offset;
+  op->buf = const_cast<void*>(buf);
+  op->count = count;
+  op->callback = callback;
+  op->arg = arg;
+  StartAsyncOp(op);
+}
+
+void AppEngineMount::StatAsync(ino_t slot, struct stat *buf,
+                               AsyncCallback callback, void *arg) {
+  // Attributes are always here.
+  int result = Stat(slot, buf);
+  callback(arg, result, result == -1 ? errno : 0);
+}
+
+void AppEngineMount::StatPathAsync(const std::string& path, struct stat *buf,
+                                   AsyncCallback callback, void *arg) {
+  pthread_mutex_lock(&lock_);
+  int slot;
+  if (CachedSlot(path, false, &slot)) {
+    pthread_mutex_unlock(&lock_);
+    if (slot == -1) {
+      callback(arg, -1, ENOENT);
+    } else {
+      StatAsync(slot, buf, callback, arg);
+    }
+    return;
+  }
+  // Joining a lookup in flight means waiting for it.
+  if (inflight_stats_.find(path) != inflight_stats_.end()) {
+    pthread_mutex_unlock(&lock_);
+    Mount::StatPathAsync(path, buf, callback, arg);
+    return;
+  }
+  AsyncLookup *lookup = new AsyncLookup;
+  lookup->mount = this;
+  lookup->path = path;
+  lookup->buf = buf;
+  lookup->callback = callback;
+  lookup->arg = arg;
+  lookup->fetch = new Fetch;
+  inflight_stats_[path] = lookup->fetch;
+  ++stats_.remote_stats;
+  pthread_mutex_unlock(&lock_);
+  url_request_.StatAsync(path, &lookup->info, AsyncLookupDone, lookup);
+}
+
+void AppEngineMount::AsyncLookupDone(void *p, int result) {
+  AsyncLookup *lookup = reinterpret_cast<AsyncLookup*>(p);
+  AppEngineMount *mount = lookup->mount;
+  int slot = mount->FinishLookup(lookup->path, false, lookup->fetch, result,
+                                 lookup->info, false);
+  int error = errno;
+  struct stat *buf = lookup->buf;
+  AsyncCallback callback = lookup->callback;
+  void *arg = lookup->arg;
+  delete lookup;
+  if (slot == -1) {
+    callback(arg, -1, error);
+  } else {
+    mount->StatAsync(slot, buf, callback, arg);
+  }
+}
+
+void AppEngineMount::StartAsyncOp(AsyncOp *op) {
+  pthread_mutex_lock(&lock_);
+  AppEngineNode *node = slots_.At(op->slot);
+  if (node == NULL || node->is_loaded()) {
+    pthread_mutex_unlock(&lock_);
+    RunAsyncOp(op);
+    return;
+  }
+  // Loading from the cache reads local storage, and joining a download
+  // means waiting for it; both need a thread.
+  if (cache_ != NULL || inflight_.find(node->path()) != inflight_.end()) {
+    pthread_mutex_unlock(&lock_);
+    if (op->write) {
+      Mount::WriteAsync(op->slot, op->offset, op->buf, op->count,
+                        op->callback, op->arg);
+    } else {
+      Mount::ReadAsync(op->slot, op->offset, op->buf, op->count,
+                       op->callback, op->arg);
+    }
+    delete op;
+    return;
+  }
+  op->job = StartDataFetch(op->slot);
+  pthread_mutex_unlock(&lock_);
+  url_request_.ReadAsync(op->job->path, &op->job->fetch->data, &op->version,
+                         op->job, op->job->priority, &AsyncFetchDone, op);
+}
+
+void AppEngineMount::AsyncFetchDone(void *p, int result) {
+  AsyncOp *op = reinterpret_cast<AsyncOp*>(p);
+  AppEngineMount *mount = op->job->mount;
+  if (mount->FinishDataFetch(op->job, result, op->version, 1, false) != 0) {
+    op->callback(op->arg, -1, EIO);
+    delete op;
+    return;
+  }
+  // Normally the node is loaded now, and op runs right away.
+  mount->StartAsyncOp(op);
+}
+
+void AppEngineMount::RunAsyncOp(AsyncOp *op) {
+  // The contents are here, so neither call waits on the server.
+  ssize_t result;
+  if (op->write) {
+    result = Write(op->slot, op->offset, op->buf, op->count);
+  } else {
+    result = Read(op->slot, op->offset, op->buf, op->count);
+  }
+  int error = result == -1 ? errno : 0;
+  AsyncCallback callback = op->callback;
+  void *arg = op->arg;
+  delete op;
+  callback(arg, result, error);
+}
+
+void *AppEngineMount::DataFetchShim(void *p) {
+  DataFetch *job = reinterpret_cast<DataFetch*>(p);
+  job->mount->RunDataFetch(job);
+  return NULL;
+}
+
+void AppEngineMount::EvictNodes(void) {
+  std::list<int>::iterator it = lru_.end();
+  while (lru_.size() > max_cached_nodes_ && it != lru_.begin()) {
+    --it;
+    // The node just added or used is what the caller is about to use.
+    if (it == lru_.begin()) {
+      break;
+    }
+    AppEngineNode *node = slots_.At(*it);
+    // Dirty nodes hold the only copy of unsynced writes.
+    if (node->is_dirty()) {
+      continue;
+    }
+    ++stats_.evicted_nodes;
+    int slot = *it;
+    ++it;
+    DropNode(slot);
+  }
+}
+
+void AppEngineMount::DropNode(int slot) {
+  AppEngineNode *node = slots_.At(slot);
+  // An unlinked node may share its path with a newer one.
+  std::map<std::string, int>::iterator it = nodes_.find(node->path());
+  if (it != nodes_.end() && it->second == slot) {
+    nodes_.erase(it);
+  }
+  std::map<int, std::list<int>::iterator>::iterator pos = lru_pos_.find(slot);
+  if (pos != lru_pos_.end()) {
+    lru_.erase(pos->second);
+    lru_pos_.erase(pos);
+  }
+  slots_.Free(slot);
+}
+
+void AppEngineMount::set_timeouts(const AppEngineCacheTimeouts& timeouts) {
+  pthread_mutex_lock(&lock_);
+  timeouts_ = timeouts;
+  listings_.clear();
+  negative_.clear();
+  pthread_mutex_unlock(&lock_);
+}
+
+void AppEngineMount::set_cache(AppEngineCache *cache) {
+  pthread_mutex_lock(&lock_);
+  cache_ = cache;
+  pthread_mutex_unlock(&lock_);
+}
+
+void AppEngineMount::set_group_commit_window(double window) {
+  pthread_mutex_lock(&lock_);
+  group_commit_window_ = window;
+  pthread_mutex_unlock(&lock_);
+}
+
+double AppEngineMount::NowSeconds(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
 
+std::string AppEngineMount::DirName(const std::string& path) {
+  size_t pos = path.find_last_of('/');
+  if (pos == std::string::npos || pos == 0) {
+    return "/";
+  }
+  return path.substr(0, pos);
+}
+
+std::string AppEngineMount::BaseName(const std::string& path) {
+  size_t pos = path.find_last_of('/');
+  if (pos == std::string::npos) {
+    return path;
+  }
+  if (pos + 1 == path.size()) {
+    return "/";
+  }
+  return path.substr(pos + 1);
+}
+
+int AppEngineMount::Creat(const std::string& path, mode_t mode, struct stat* buf) {
+  int slot = GetSlot(path, true);
+  if (slot == -1) {
+    return -1;
+  }
   if (!buf) {
     return 0;
   }
@@ -59,25 +692,66 @@ int AppEngineMount::Mkdir(const std::string& path, mode_t mode, struct stat* buf
 }
 
 int AppEngineMount::GetNode(const std::string& path, struct stat* buf) {
-  return Creat(path, 0, buf);
+  int slot = GetSlot(path, false);
+  if (slot == -1) {
+    return -1;
+  }
+  if (!buf) {
+    return 0;
+  }
+  return Stat(slot, buf);
 }
 
 int AppEngineMount::Chmod(ino_t slot, mode_t mode) {
+  pthread_mutex_lock(&lock_);
   AppEngineNode* node = slots_.At(slot);
   if (node == NULL) {
+    pthread_mutex_unlock(&lock_);
     errno = ENOENT;
     return -1;
   }
-  return node->chmod(mode);
+  int ret = node->chmod(mode);
+  pthread_mutex_unlock(&lock_);
+  return ret;
 }
 
 int AppEngineMount::Stat(ino_t slot, struct stat *buf) {
+  pthread_mutex_lock(&lock_);
   AppEngineNode* node = slots_.At(slot);
   if (node == NULL) {
+    pthread_mutex_unlock(&lock_);
     errno = ENOENT;
     return -1;
   }
-  return node->stat(buf);
+  int ret = node->stat(buf);
+  pthread_mutex_unlock(&lock_);
+  return ret;
+}
+
+int AppEngineMount::Unlink(const std::string& path) {
+  if (url_request_.Remove(path) != 0) {
+    errno = ENOENT;
+    return -1;
+  }
+  pthread_mutex_lock(&lock_);
+  if (cache_ != NULL) {
+    cache_->Remove(path);
+  }
+  listings_.erase(DirName(path));
+  std::map<std::string, int>::iterator it = nodes_.find(path);
+  if (it != nodes_.end() && slots_.At(it->second)->use_count() > 0) {
+    // Still open: forget the path but let the handles keep the node.
+    nodes_.erase(it);
+  } else {
+    if (it != nodes_.end()) {
+      DropNode(it->second);
+    }
+    if (timeouts_.negative_ttl > 0) {
+      negative_[path] = NowSeconds() + timeouts_.negative_ttl;
+    }
+  }
+  pthread_mutex_unlock(&lock_);
+  return 0;
 }
 
 int AppEngineMount::Rmdir(ino_t slot) {
@@ -85,95 +759,581 @@ int AppEngineMount::Rmdir(ino_t slot) {
 }
 
 void AppEngineMount::Ref(ino_t slot) {
-  AppEngineNode* node = slots_.At(slot);
-  if (node == NULL) {
-    return;
+  pthread_mutex_lock(&lock_);
+  if (PinnedSlot() == static_cast<int>(slot)) {
+    // The reference GetSlot() pinned becomes the caller's.
+    pthread_setspecific(pin_, NULL);
+  } else {
+    RefNode(slot);
   }
-  node->IncrementUseCount();
+  pthread_mutex_unlock(&lock_);
 }
 
 void AppEngineMount::Unref(ino_t slot) {
+  pthread_mutex_lock(&lock_);
+  UnrefNode(slot);
+  pthread_mutex_unlock(&lock_);
+}
+
+void AppEngineMount::RefNode(int slot) {
   AppEngineNode* node = slots_.At(slot);
   if (node == NULL) {
     return;
   }
-  if (node->is_dir()) {
+  if (node->use_count() == 0) {
+    std::map<int, std::list<int>::iterator>::iterator pos =
+      lru_pos_.find(slot);
+    if (pos != lru_pos_.end()) {
+      lru_.erase(pos->second);
+      lru_pos_.erase(pos);
+    }
+  }
+  node->IncrementUseCount();
+}
+
+void AppEngineMount::UnrefNode(int slot) {
+  AppEngineNode* node = slots_.At(slot);
+  if (node == NULL || node->use_count() <= 0) {
     return;
   }
   node->DecrementUseCount();
-  if (node->use_count() > 0) {
-    return;
+  if (node->use_count() == 0) {
+    // Keep the closed node around so that reopening or stat'ing the
+    // path again does not go back to the server.
+    lru_.push_front(slot);
+    lru_pos_[slot] = lru_.begin();
+    EvictNodes();
+  }
+}
+
+void AppEngineMount::Pin(int slot) {
+  // Taken before the old pin goes, so that dropping it cannot evict
+  // the node at slot.
+  RefNode(slot);
+  Unpin();
+  intptr_t pin = slot + 1;
+  pthread_setspecific(pin_, reinterpret_cast<void*>(pin));
+}
+
+void AppEngineMount::Unpin(void) {
+  int slot = PinnedSlot();
+  if (slot != -1) {
+    pthread_setspecific(pin_, NULL);
+    UnrefNode(slot);
+  }
+}
+
+int AppEngineMount::PinnedSlot(void) {
+  return static_cast<int>(reinterpret_cast<intptr_t>(
+      pthread_getspecific(pin_))) - 1;
+}
+
+std::string AppEngineMount::ListPrefix(const std::string& path) {
+  if (!path.empty() && path[path.size() - 1] == '/') {
+    return path;
+  }
+  return path + "/";
+}
+
+void AppEngineMount::AddListPage(Listing *listing, const std::string& path,
+                                 const std::vector<char>& dst,
+                                 const std::string& next_cursor) {
+  std::string prefix = ListPrefix(path);
+  std::vector<char>::const_iterator begin = dst.begin();
+  while (begin != dst.end()) {
+    std::vector<char>::const_iterator end = std::find(begin, dst.end(), '\n');
+    std::string file(begin, end);
+    begin = end == dst.end() ? end : end + 1;
+    // Each line is a file somewhere under the directory; its child is
+    // the first component after the prefix, a directory if more follow.
+    if (file.size() <= prefix.size() ||
+        file.compare(0, prefix.size(), prefix) != 0) {
+      continue;
+    }
+    size_t slash = file.find('/', prefix.size());
+    ListEntry entry;
+    entry.name = file.substr(prefix.size(), slash - prefix.size());
+    entry.is_dir = slash != std::string::npos;
+    if (!entry.name.empty() && listing->names.insert(entry.name).second) {
+      listing->entries.push_back(entry);
+    }
+  }
+  listing->cursor = next_cursor;
+  listing->complete = next_cursor.empty();
+}
+
+ino_t AppEngineMount::ListIno(const std::string& path) {
+  std::map<std::string, int>::iterator it = nodes_.find(path);
+  if (it != nodes_.end()) {
+    return it->second;
+  }
+  // FNV-1a: the same path gets the same number as long as the file
+  // has no node.
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < path.size(); ++i) {
+    hash ^= static_cast<unsigned char>(path[i]);
+    hash *= 1099511628211ULL;
+  }
+  return static_cast<ino_t>(hash) |
+         static_cast<ino_t>(1) << (sizeof(ino_t) * 8 - 1);
+}
+
+AppEngineMount::ListPrefetch *AppEngineMount::NewListPrefetch(
+    const std::string& path, Listing *listing) {
+  listing->fetching = true;
+  ++stats_.remote_lists;
+  ++stats_.prefetched_list_pages;
+  ListPrefetch *prefetch = new ListPrefetch;
+  prefetch->mount = this;
+  prefetch->path = path;
+  prefetch->cursor = listing->cursor;
+  prefetch->generation = listing->generation;
+  return prefetch;
+}
+
+void AppEngineMount::ListPrefetchDone(void *p, int result) {
+  ListPrefetch *prefetch = reinterpret_cast<ListPrefetch*>(p);
+  AppEngineMount *mount = prefetch->mount;
+  pthread_mutex_lock(&mount->lock_);
+  std::map<std::string, Listing>::iterator it =
+    mount->listings_.find(prefetch->path);
+  if (it != mount->listings_.end() &&
+      it->second.generation == prefetch->generation) {
+    it->second.fetching = false;
+    // On failure the cursor stays, and the reader fetches the page.
+    if (result == 0) {
+      AddListPage(&it->second, prefetch->path, prefetch->dst,
+                  prefetch->next_cursor);
+    }
   }
-  // If Ref/Unref misused by KernelProxy, it's possible
-  // that parent will have a dangling inode to the deleted child
-  // TODO(krasin): remove the possibility to misuse this API.
-  slots_.Free(node->slot);
+  pthread_cond_broadcast(&mount->fetch_done_);
+  pthread_mutex_unlock(&mount->lock_);
+  delete prefetch;
 }
 
 int AppEngineMount::Getdents(ino_t slot, off_t offset,
                        struct dirent *dir, unsigned int count) {
+  pthread_mutex_lock(&lock_);
   AppEngineNode* node = slots_.At(slot);
   if (node == NULL) {
+    pthread_mutex_unlock(&lock_);
     errno = ENOTDIR;
     return -1;
   }
-  std::vector<char> dst;
-  url_request_.List(node->path(), dst);
-
-  std::vector<std::string> entries;
-  std::vector<char>::iterator ind = dst.begin();
-  std::vector<char>::iterator next = dst.begin();
-  while (ind != dst.end() && next != dst.end()) {
-    if (*next == '\n' && ind != next) {
-      entries.push_back(std::string(ind, next-1));
-      ind = next;
+  if (count < sizeof(struct dirent)) {
+    pthread_mutex_unlock(&lock_);
+    errno = EINVAL;
+    return -1;
+  }
+  std::string path = node->path();
+  // The offset is that of a whole record, as Getdents() returned it.
+  size_t index = offset / sizeof(struct dirent);
+  bool fetched = false;
+  Listing *listing;
+  for (;;) {
+    // A reader starting over gets a fresh listing once dir_ttl has
+    // passed; one further along keeps reading the listing it started.
+    std::map<std::string, Listing>::iterator it = listings_.find(path);
+    if (it == listings_.end() ||
+        (offset == 0 && !it->second.fetching &&
+         NowSeconds() - it->second.time >= timeouts_.dir_ttl)) {
+      Listing fresh;
+      fresh.time = NowSeconds();
+      fresh.generation = ++listing_generation_;
+      listings_[path] = fresh;
+      it = listings_.find(path);
+    }
+    listing = &it->second;
+    if (index < listing->entries.size() || listing->complete) {
+      break;
+    }
+    if (listing->fetching) {
+      pthread_cond_wait(&fetch_done_, &lock_);
+      continue;
+    }
+    // The page the reader has reached is not here: fetch it now.
+    listing->fetching = true;
+    ++stats_.remote_lists;
+    fetched = true;
+    int generation = listing->generation;
+    std::string cursor = listing->cursor;
+    pthread_mutex_unlock(&lock_);
+    std::vector<char> dst;
+    std::string next_cursor;
+    int result = url_request_.List(ListPrefix(path), cursor, dst,
+                                   &next_cursor);
+    pthread_mutex_lock(&lock_);
+    it = listings_.find(path);
+    bool current = it != listings_.end() &&
+                   it->second.generation == generation;
+    if (current) {
+      it->second.fetching = false;
+      if (result == 0) {
+        AddListPage(&it->second, path, dst, next_cursor);
+      }
+    }
+    pthread_cond_broadcast(&fetch_done_);
+    if (result != 0) {
+      pthread_mutex_unlock(&lock_);
+      errno = EIO;
+      return -1;
     }
-    ++next;
   }
-  std::string last(ind, next-1);
-  if (!last.empty()) entries.push_back(last);
-
-  // TODO(arbenson): update the dirent struct
-  return entries.size();
+  if (!fetched) {
+    ++stats_.listing_hits;
+  }
+  // Fill what fits of the entries from index on.
+  std::string prefix = ListPrefix(path);
+  int bytes = 0;
+  for (size_t i = index; i < listing->entries.size() &&
+                         bytes + sizeof(struct dirent) <= count; ++i) {
+    const ListEntry& entry = listing->entries[i];
+    memset(dir, 0, sizeof(struct dirent));
+    dir->d_ino = ListIno(prefix + entry.name);
+    dir->d_off = (i + 1) * sizeof(struct dirent);
+    dir->d_reclen = sizeof(struct dirent);
+    strncpy(dir->d_name, entry.name.c_str(), sizeof(dir->d_name) - 1);
+    ++dir;
+    bytes += sizeof(struct dirent);
+  }
+  // Have the next page on its way while the reader goes through this one.
+  ListPrefetch *prefetch = NULL;
+  if (!listing->complete && !listing->fetching) {
+    prefetch = NewListPrefetch(path, listing);
+  }
+  pthread_mutex_unlock(&lock_);
+  if (prefetch != NULL) {
+    url_request_.ListAsync(ListPrefix(path), prefetch->cursor, &prefetch->dst,
+                           &prefetch->next_cursor,
+                           MainThreadRunner::kPrefetch, ListPrefetchDone,
+                           prefetch);
+  }
+  return bytes;
 }
 
-ssize_t AppEngineMount::Read(ino_t slot, off_t offset, void *buf, size_t count) {
-  AppEngineNode* node = slots_.At(slot);
-  if (node == NULL) {
-    errno = ENOENT;
+int AppEngineMount::ReadDirPlus(const std::string& path,
+                                std::vector<DirentPlus>* entries) {
+  std::string prefix = ListPrefix(path);
+  std::vector<AppEngineListEntry> files;
+  std::string cursor;
+  do {
+    pthread_mutex_lock(&lock_);
+    ++stats_.remote_lists;
+    pthread_mutex_unlock(&lock_);
+    std::string next_cursor;
+    if (url_request_.ListStat(prefix, cursor, &files, &next_cursor) != 0) {
+      errno = EIO;
+      return -1;
+    }
+    cursor = next_cursor;
+  } while (!cursor.empty());
+  if (files.empty() && prefix != "/") {
+    // Directories only exist through the files under them: find out
+    // whether path is missing or a file.
+    if (GetSlot(path, false) != -1) {
+      errno = ENOTDIR;
+    }
     return -1;
   }
-  // Limit to the end of the file.
-  size_t len = count;
-  std::vector<char> data = node->data();
-  if (len > data.size() - offset) {
-    len = data.size() - offset;
+
+  std::vector<DirentPlus> found;
+  std::vector<bool> known;
+  std::set<std::string> names;
+  pthread_mutex_lock(&lock_);
+  for (size_t i = 0; i < files.size(); ++i) {
+    const std::string& file = files[i].path;
+    if (file.size() <= prefix.size() ||
+        file.compare(0, prefix.size(), prefix) != 0) {
+      continue;
+    }
+    size_t slash = file.find('/', prefix.size());
+    std::string name = file.substr(prefix.size(), slash - prefix.size());
+    if (name.empty() || !names.insert(name).second) {
+      continue;
+    }
+    AppEngineFileInfo info = files[i].info;
+    if (slash != std::string::npos) {
+      info = AppEngineFileInfo();
+      info.exists = true;
+      info.is_dir = true;
+    }
+    DirentPlus entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.d.d_reclen = sizeof(struct dirent);
+    strncpy(entry.d.d_name, name.c_str(), sizeof(entry.d.d_name) - 1);
+    // Attributes the server sent go into the node table, which says
+    // what stat() would, local changes included.
+    AppEngineNode *node = NULL;
+    if (info.exists) {
+      int error;
+      int slot = ApplyLookup(prefix + name, false, 0, info, &error);
+      node = slot == -1 ? NULL : slots_.At(slot);
+    }
+    if (node != NULL) {
+      node->raw_stat(&entry.st);
+    }
+    found.push_back(entry);
+    known.push_back(node != NULL);
+  }
+  pthread_mutex_unlock(&lock_);
+
+  int pos = 0;
+  for (size_t i = 0; i < found.size(); ++i) {
+    DirentPlus& entry = found[i];
+    // A server that sent names alone leaves them to be looked up, and
+    // one that went away meanwhile is left out.
+    if (!known[i]) {
+      int slot = GetSlot(prefix + entry.d.d_name, false);
+      if (slot == -1 || Stat(slot, &entry.st) != 0) {
+        continue;
+      }
+    }
+    // The same number as stat() gives; a child is never the root's slot
+    // 0, which readdir() would skip.
+    entry.d.d_ino = entry.st.st_ino;
+    ++pos;
+    entry.d.d_off = pos * sizeof(struct dirent);
+    entries->push_back(entry);
   }
+  return 0;
+}
 
-  // Do the read.
-  if (!data.empty()) {
-    memcpy(buf, &data[0] + offset, len);
+ssize_t AppEngineMount::Read(ino_t slot, off_t offset, void *buf, size_t count) {
+  pthread_mutex_lock(&lock_);
+  for (;;) {
+    AppEngineNode* node = slots_.At(slot);
+    if (node == NULL) {
+      pthread_mutex_unlock(&lock_);
+      errno = ENOENT;
+      return -1;
+    }
+    if (node->is_loaded()) {
+      // Copies only the bytes asked for, straight out of the node.
+      ssize_t len = node->ReadData(offset, buf, count);
+      pthread_mutex_unlock(&lock_);
+      return len;
+    }
+    std::map<std::string, Fetch*>::iterator it = inflight_.find(node->path());
+    if (it == inflight_.end()) {
+      // Download in the background so that this read can return as soon
+      // as its bytes are in, rather than when the whole file is.
+      DataFetch *job = StartBackgroundFetch(slot,
+                                            MainThreadRunner::kInteractive);
+      if (job != NULL) {
+        pthread_mutex_unlock(&lock_);
+        if (RunDataFetch(job) != 0) {
+          errno = EIO;
+          return -1;
+        }
+        pthread_mutex_lock(&lock_);
+      }
+      continue;
+    }
+    Fetch *fetch = it->second;
+    if (fetch->total >= 0 && offset >= 0) {
+      size_t total = fetch->total;
+      if (offset >= static_cast<off_t>(total)) {
+        pthread_mutex_unlock(&lock_);
+        return 0;
+      }
+      size_t end = total;
+      if (count < total - offset) {
+        end = offset + count;
+      }
+      if (fetch->available >= end) {
+        ++stats_.streamed_reads;
+        memcpy(buf, &fetch->data[0] + offset, end - offset);
+        pthread_mutex_unlock(&lock_);
+        return end - offset;
+      }
+    }
+    // Wait for more of the file, or for the download to finish.
+    ++fetch->waiters;
+    pthread_cond_wait(&fetch_done_, &lock_);
+    --fetch->waiters;
+    if (fetch->done) {
+      int error = fetch->error;
+      if (fetch->waiters == 0) {
+        delete fetch;
+      }
+      if (error != 0) {
+        pthread_mutex_unlock(&lock_);
+        errno = error;
+        return -1;
+      }
+    }
   }
-  return len;
 }
 
 ssize_t AppEngineMount::Write(ino_t slot, off_t offset, const void *buf, size_t count) {
-  fprintf(stderr, "Entering AppEngineMount::Write()\n");
+  MOUNT_TRACE("AppEngineMount::Write %d %zu\n", static_cast<int>(slot), count);
+  // Writes modify the current contents, so those have to be here first.
+  if (LoadData(slot) != 0) {
+    return -1;
+  }
+  pthread_mutex_lock(&lock_);
   AppEngineNode* node = slots_.At(slot);
   if (node == NULL) {
+    pthread_mutex_unlock(&lock_);
     errno = ENOENT;
     return -1;
   }
+  // Keep what the server has before the first change, so that Fsync()
+  // can send only what differs.  Write() may run on the main thread, so
+  // the checksums are left to CommitSyncs().
+  if (!node->is_dirty() && node->base_version().empty() &&
+      !node->version().empty() && node->len() >= kDeltaMinSize) {
+    node->SaveBase();
+  }
   // Write out the block.
-  if (node->WriteData(offset, buf, count) == -1) {
+  int ret = node->WriteData(offset, buf, count);
+  pthread_mutex_unlock(&lock_);
+  if (ret == -1) {
     return -1;
   }
   return count;
 }
 
 int AppEngineMount::Fsync(ino_t slot) {
-  fprintf(stderr, "In sync\n");
+  MOUNT_TRACE("AppEngineMount::Fsync %d\n", static_cast<int>(slot));
+  pthread_mutex_lock(&lock_);
   AppEngineNode* node = slots_.At(slot);
-  return url_request_.Write(node->path(), node->data());
+  if (node == NULL) {
+    pthread_mutex_unlock(&lock_);
+    errno = ENOENT;
+    return -1;
+  }
+  // Nothing was ever loaded, so nothing can have changed.
+  if (!node->is_loaded()) {
+    pthread_mutex_unlock(&lock_);
+    return 0;
+  }
+  // The upload runs without lock_, so it needs its own snapshot.
+  SyncRequest request;
+  request.slot = slot;
+  node->CopyData(&request.data);
+  request.write_count = node->write_count();
+  request.write.path = node->path();
+  request.write.data = &request.data;
+  request.cache = cache_;
+  request.done = false;
+  if (!node->base_version().empty() &&
+      node->base_version() == node->version()) {
+    node->SwapBase(&request.base, &request.base_version);
+  }
+  sync_queue_.push_back(&request);
+  while (!request.done) {
+    if (syncing_) {
+      // Another caller is committing; this request goes in the next
+      // group, unless that caller already picked it up.
+      pthread_cond_wait(&sync_done_, &lock_);
+      continue;
+    }
+    // Commit the queued requests, this one included.
+    syncing_ = true;
+    if (group_commit_window_ > 0) {
+      // Let the rest of a burst join.
+      pthread_mutex_unlock(&lock_);
+      usleep(static_cast<useconds_t>(group_commit_window_ * 1e6));
+      pthread_mutex_lock(&lock_);
+    }
+    std::vector<SyncRequest*> batch;
+    if (group_commit_window_ < 0) {
+      batch.push_back(&request);
+      sync_queue_.erase(std::find(sync_queue_.begin(), sync_queue_.end(),
+                                  &request));
+    } else {
+      batch.swap(sync_queue_);
+    }
+    pthread_mutex_unlock(&lock_);
+    CommitSyncs(batch);
+    pthread_mutex_lock(&lock_);
+    syncing_ = false;
+    pthread_cond_broadcast(&sync_done_);
+  }
+  pthread_mutex_unlock(&lock_);
+  if (request.write.result != 0) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
 }
 
+void AppEngineMount::CommitSyncs(const std::vector<SyncRequest*>& batch) {
+  // Files with a known base go out as deltas; the rest, and any delta
+  // the server refuses, go out whole.
+  std::vector<AppEngineWrite> writes(batch.size());
+  std::vector<AppEngineWrite> full;
+  std::vector<size_t> full_index;
+  int64_t delta_syncs = 0;
+  int64_t delta_bytes = 0;
+  for (size_t i = 0; i < batch.size(); ++i) {
+    writes[i] = batch[i]->write;
+    size_t delta_size;
+    if (!batch[i]->base_version.empty()) {
+      AppEngineSignature base;
+      base.Compute(batch[i]->base_version, &batch[i]->base[0],
+                   batch[i]->base.size(), AppEngineDelta::kBlockSize);
+      if (url_request_.WriteDelta(writes[i].path, base, batch[i]->data,
+                                  &writes[i].version, &delta_size) == 0) {
+        writes[i].result = 0;
+        ++delta_syncs;
+        delta_bytes += batch[i]->data.size() - delta_size;
+        continue;
+      }
+    }
+    full.push_back(writes[i]);
+    full_index.push_back(i);
+  }
+  if (!full.empty()) {
+    url_request_.WriteBatch(&full);
+    for (size_t k = 0; k < full.size(); ++k) {
+      writes[full_index[k]] = full[k];
+    }
+  }
+  for (size_t i = 0; i < batch.size(); ++i) {
+    const AppEngineWrite& write = writes[i];
+    // What was just written needs no download when it is next opened.
+    if (write.result == 0 && batch[i]->cache != NULL &&
+        !write.version.empty()) {
+      batch[i]->cache->Store(write.path, write.version, batch[i]->data);
+    }
+  }
+
+  pthread_mutex_lock(&lock_);
+  ++stats_.group_commits;
+  stats_.grouped_fsyncs += batch.size();
+  stats_.delta_syncs += delta_syncs;
+  stats_.delta_bytes_saved += delta_bytes;
+  for (size_t i = 0; i < batch.size(); ++i) {
+    SyncRequest *request = batch[i];
+    request->write.result = writes[i].result;
+    request->write.version = writes[i].version;
+    request->done = true;
+    const std::string& path = writes[i].path;
+    // The slot may have been reused if the node was closed meanwhile,
+    // so check that it still is the same file.
+    AppEngineNode *node = slots_.At(request->slot);
+    if (node != NULL && node->path() != path) {
+      node = NULL;
+    }
+    if (writes[i].result != 0) {
+      // The server still has the base: keep it for the next Fsync().
+      if (node != NULL && node->base_version().empty() &&
+          node->version() == request->base_version) {
+        node->SwapBase(&request->base, &request->base_version);
+      }
+      continue;
+    }
+    // Writes made during the upload keep the node dirty, so that it is
+    // not evicted with them.
+    if (node != NULL &&
+        node->MarkSynced(request->write_count, writes[i].version)) {
+      node->set_attr_time(NowSeconds());
+    }
+    // The file may not have existed on the server before.
+    listings_.erase(DirName(path));
+    negative_.erase(path);
+  }
+  pthread_mutex_unlock(&lock_);
+}
@@ -6,20 +6,107 @@
 #ifndef PACKAGES_SCRIPTS_FILESYS_APPENGINE_APPENGINEMOUNT_H_
 #define PACKAGES_SCRIPTS_FILESYS_APPENGINE_APPENGINEMOUNT_H_
 
+#include <pthread.h>
 #include <list>
+#include <map>
+#include <set>
 #include <string>
+#include <vector>
 #include "../base/Mount.h"
 #include "../base/PathHandle.h"
 #include "../base/SlotAllocator.h"
+#include "AppEngineCache.h"
 #include "AppEngineUrlLoader.h"
 #include "AppEngineNode.h"
 
 class MainThreadRunner;
 
+// Counters describing the remote traffic generated by an AppEngineMount.
+struct AppEngineMountStats {
+  AppEngineMountStats()
+    : remote_fetches(0),
+      coalesced_fetches(0),
+      remote_stats(0),
+      node_table_hits(0),
+      evicted_nodes(0),
+      attr_revalidations(0),
+      negative_hits(0),
+      remote_lists(0),
+      listing_hits(0),
+      prefetched_list_pages(0),
+      cache_hits(0),
+      cache_misses(0),
+      cache_bytes_saved(0),
+      streamed_reads(0),
+      group_commits(0),
+      grouped_fsyncs(0),
+      delta_syncs(0),
+      delta_bytes_saved(0),
+      batched_reads(0) {}
+
+  // Number of read requests actually sent to the backend.
+  int64_t remote_fetches;
+  // Number of lookups or reads that waited on another caller's in-flight
+  // request for the same path instead of issuing their own.
+  int64_t coalesced_fetches;
+  // Number of metadata-only stat requests sent to the backend.
+  int64_t remote_stats;
+  // Number of lookups answered from the path to inode table.
+  int64_t node_table_hits;
+  // Number of closed nodes dropped from the LRU.
+  int64_t evicted_nodes;
+  // Number of expired attributes the server confirmed as unchanged.
+  int64_t attr_revalidations;
+  // Number of lookups failed from the negative cache.
+  int64_t negative_hits;
+  // Number of list requests, one per page, sent to the backend.
+  int64_t remote_lists;
+  // Number of getdents calls answered from the listing cache.
+  int64_t listing_hits;
+  // Number of list pages fetched ahead of the reader.
+  int64_t prefetched_list_pages;
+  // Number of file loads served from the local cache, with or without a
+  // conditional request to confirm the cached version.
+  int64_t cache_hits;
+  // Number of file loads that had to transfer the contents although a
+  // local cache is set.
+  int64_t cache_misses;
+  // Number of content bytes the local cache kept from being downloaded.
+  int64_t cache_bytes_saved;
+  // Number of reads answered from a download still in progress.
+  int64_t streamed_reads;
+  // Number of batches of fsyncs committed together, and the number of
+  // fsyncs they carried.
+  int64_t group_commits;
+  int64_t grouped_fsyncs;
+  // Number of fsyncs uploaded as a delta against the server's version,
+  // and the bytes that saved compared to uploading the whole file.
+  int64_t delta_syncs;
+  int64_t delta_bytes_saved;
+  // Number of files fetched together through PrefetchBatch().
+  int64_t batched_reads;
+};
+
+// How long, in seconds, remote metadata is trusted without asking the
+// server again.  A zero value disables the corresponding cache.
+struct AppEngineCacheTimeouts {
+  AppEngineCacheTimeouts()
+    : attr_ttl(3.0),
+      dir_ttl(3.0),
+      negative_ttl(0.0) {}
+
+  // File attributes (size, mtime, existence) of nodes nobody has open.
+  double attr_ttl;
+  // Directory listings returned by getdents.
+  double dir_ttl;
+  // Paths the server reported as missing.  Off by default.
+  double negative_ttl;
+};
+
 class AppEngineMount: public Mount {
  public:
   AppEngineMount(MainThreadRunner *runner, std::string base_url);
-  virtual ~AppEngineMount() {}
+  virtual ~AppEngineMount();
 
   void Ref(ino_t node);
   void Unref(ino_t node);
@@ -28,6 +115,7 @@ class AppEngineMount: public Mount {
   int Mkdir(const std::string& path, mode_t mode, struct stat* st);
   int GetNode(const std::string& path, struct stat* st);
 
+  int Unlink(const std::string& path);
   int Rmdir(ino_t node);
 
   AppEngineNode *ToAppEngineNode(ino_t node) {
@@ -37,17 +125,327 @@ class AppEngineMount: public Mount {
   int Chmod(ino_t node, mode_t mode);
   int Stat(ino_t node, struct stat *buf);
   int Getdents(ino_t node, off_t offset, struct dirent *dirp, unsigned int count);
+  // Lists the directory with the attributes of its files in one request
+  // per page, and keeps the nodes they describe so that opening or
+  // stat'ing the files next does not go back to the server.
+  int ReadDirPlus(const std::string& path, std::vector<DirentPlus>* entries);
   int Fsync(ino_t node);
 
   virtual ssize_t Read(ino_t node, off_t offset, void *buf, size_t count);
   virtual ssize_t Write(ino_t node, off_t offset, const void *buf, size_t count);
+  virtual int Prefetch(ino_t node, off_t offset, size_t count);
+  virtual bool SupportsPrefetch(void) { return true; }
+  // Files of the batch that are not here yet and fit in a chunk are
+  // fetched together in read_batch requests.
+  virtual void PrefetchBatch(const std::vector<ino_t>& nodes);
+
+  // Stats, and reads and writes of files whose contents are here, are
+  // done before these return.  Otherwise the contents are downloaded in
+  // one request whose callback finishes the call, so that no thread
+  // waits on the server.  With a local cache set, or a download of the
+  // file already in flight, the calls run on the default thread pool.
+  // FsyncAsync() always does: a commit may take several requests.
+  virtual void ReadAsync(ino_t node, off_t offset, void *buf, size_t count,
+                         AsyncCallback callback, void *arg);
+  virtual void WriteAsync(ino_t node, off_t offset, const void *buf,
+                          size_t count, AsyncCallback callback, void *arg);
+  virtual void StatAsync(ino_t node, struct stat *buf,
+                         AsyncCallback callback, void *arg);
+  // Lookups of paths not in the node table are done the same way.
+  virtual void StatPathAsync(const std::string& path, struct stat *buf,
+                             AsyncCallback callback, void *arg);
+
+  // Calls that wait on the server can keep as many threads busy as the
+  // main thread runs requests at once.
+  virtual int IoThreads(void) { return MainThreadRunner::kDefaultMaxInFlight; }
 
   AppEngineUrlRequest *url_request() { return &url_request_; }
 
+  // stats() returns a snapshot of the traffic counters.
+  AppEngineMountStats stats(void);
+
+  // Nodes nobody has open are kept in an LRU so that repeated lookups
+  // of a path do not refetch it.  set_max_cached_nodes() bounds how many
+  // such nodes are kept; nodes with unsynced writes are never dropped.
+  void set_max_cached_nodes(size_t max_cached_nodes);
+
+  static const size_t kDefaultMaxCachedNodes = 64;
+  // Files smaller than this are always uploaded whole.
+  static const size_t kDeltaMinSize = 1024 * 1024;
+
+  // Set the metadata cache timeouts.  Cached listings and misses are
+  // dropped.  Local Creat, Write, Fsync and Unlink invalidate the
+  // entries they affect regardless of the timeouts.
+  void set_timeouts(const AppEngineCacheTimeouts& timeouts);
+
+  // Keep file contents in cache, which is not owned, and revalidate them
+  // with the server by version instead of downloading them again.  NULL
+  // disables the cache.
+  void set_cache(AppEngineCache *cache);
+
+  // Fsync() calls are committed in groups: a caller arriving while a
+  // group is being written joins the next one, and the first caller of
+  // a group waits window seconds for others before sending it.  A
+  // negative window sends every fsync on its own.
+  void set_group_commit_window(double window);
+
  private:
+  // A remote request for one path.  Callers that need a path while a
+  // request for it is in flight wait for it and share its node instead
+  // of sending the same request again.
+  struct Fetch {
+    Fetch() : done(false), error(0), waiters(0), total(-1), available(0) {}
+    bool done;
+    // errno value describing the outcome, 0 on success.
+    int error;
+    int waiters;
+    // Contents of a download in progress.  Once total is known, data has
+    // that size and its first available bytes may be read under lock_.
+    std::vector<char> data;
+    int64_t total;
+    size_t available;
+  };
+
+  // The state of one LoadData() download, which may run on a thread of
+  // its own.  It also receives the download's progress.
+  struct DataFetch : public AppEngineReadListener {
+    void OnProgress(size_t available, size_t total);
+
+    AppEngineMount *mount;
+    ino_t slot;
+    std::string path;
+    std::string version;
+    // Whether the node's attributes, and so its version, are current.
+    bool fresh;
+    AppEngineCache *cache;
+    Fetch *fetch;
+    MainThreadRunner::Priority priority;
+  };
+
+  // An Fsync() call waiting for its group to be committed.
+  struct SyncRequest {
+    ino_t slot;
+    // Snapshot of the node's contents when Fsync() was called, and the
+    // node's write_count() then.
+    std::vector<char> data;
+    int64_t write_count;
+    AppEngineWrite write;
+    AppEngineCache *cache;
+    // The contents the server has at base_version, which the snapshot
+    // may be sent as a delta against, or an empty base_version to upload
+    // it whole.
+    std::vector<char> base;
+    std::string base_version;
+    bool done;
+  };
+
+  // A ReadAsync() or WriteAsync() call.
+  struct AsyncOp {
+    bool write;
+    ino_t slot;
+    off_t offset;
+    void *buf;
+    size_t count;
+    AsyncCallback callback;
+    void *arg;
+    // The download the call waits for, and the version it gets.
+    DataFetch *job;
+    std::string version;
+  };
+
+  // Run op if the contents of its node are here, and otherwise start
+  // their download and run it once they are in.  Frees op.
+  void StartAsyncOp(AsyncOp *op);
+  // Do the read or write of op and report it.  Frees op.
+  void RunAsyncOp(AsyncOp *op);
+  static void AsyncFetchDone(void *p, int result);
+
+  // A StatPathAsync() call waiting for the server.
+  struct AsyncLookup {
+    AppEngineMount *mount;
+    std::string path;
+    struct stat *buf;
+    AsyncCallback callback;
+    void *arg;
+    Fetch *fetch;
+    AppEngineFileInfo info;
+  };
+  static void AsyncLookupDone(void *p, int result);
+
+  // Write the contents of a group of Fsync() calls to the server and
+  // record the outcome in their nodes.  Called without lock_, and never
+  // on the main thread, so it can take its time over delta checksums.
+  void CommitSyncs(const std::vector<SyncRequest*>& batch);
+
+  // Wait for fetch to complete and return its error.  Called and
+  // returns with lock_ held.
+  int JoinFetch(Fetch *fetch);
+
+  // Remove fetch from inflight and wake up its waiters.  Called with
+  // lock_ held.
+  void FinishFetch(std::map<std::string, Fetch*> *inflight,
+                   const std::string& path, Fetch *fetch, int error);
+
+  // GetSlot() returns the slot of the node for path.  If the path is not
+  // in the node table yet, only its attributes are fetched from the
+  // server.  A missing file fails with ENOENT unless create is set, in
+  // which case an empty node is made.  The returned node is pinned to
+  // the calling thread until its next lookup, so that a Ref() of it
+  // right after finds it in place; callers that keep it must Ref() it.
+  int GetSlot(const std::string& path, bool create);
+  // CachedSlot() answers for GetSlot() from the node table and the
+  // negative entries: it returns true with *slot set, or -1 and errno
+  // set, if they know path, and false if the server has to be asked.
+  // Called with lock_ held.
+  bool CachedSlot(const std::string& path, bool create, int *slot);
+  // FinishLookup() ends a lookup started by registering fetch in
+  // inflight_stats_, given what the server said, and returns as
+  // GetSlot() does, with the node pinned if pin is set.  Called
+  // without lock_.
+  int FinishLookup(const std::string& path, bool create, Fetch *fetch,
+                   int result, const AppEngineFileInfo& info, bool pin);
+  // ApplyLookup() brings the node table up to date with what a lookup
+  // of path found: it revalidates the node there or adds one.  Returns
+  // the slot, or -1 with *error set.  Called with lock_ held.
+  int ApplyLookup(const std::string& path, bool create, int result,
+                  const AppEngineFileInfo& info, int *error);
+
+  // LoadData() downloads the contents of the node at slot unless they
+  // are already present.
+  int LoadData(ino_t slot);
+
+  // Register a download of the contents of the node at slot.  Called
+  // with lock_ held.
+  DataFetch *StartDataFetch(ino_t slot);
+
+  // Perform the download set up by StartDataFetch(), store the result
+  // in the node and free job.  Called without lock_.
+  int RunDataFetch(DataFetch *job);
+
+  // Count the requests a download took, store its data and version in
+  // the node if it succeeded, wake its waiters and free job.  Returns
+  // 0 on success.  Called without lock_.
+  int FinishDataFetch(DataFetch *job, int result, const std::string& version,
+                      int remote_fetches, bool from_cache);
+
+  // Start the download for the node at slot on a thread of its own.
+  // Called with lock_ held.  If no thread can be started the job is
+  // returned for the caller to run without lock_; otherwise NULL.
+  DataFetch *StartBackgroundFetch(ino_t slot,
+                                  MainThreadRunner::Priority priority);
+  static void *DataFetchShim(void *p);
+
+  // Drop unreferenced, clean nodes from the tail of the LRU until at
+  // most max_cached_nodes_ are left.  The most recently used node
+  // always stays.  Called with lock_ held.
+  void EvictNodes(void);
+
+  // Take a reference on, or drop one from, the node at slot, moving it
+  // out of or into the LRU.  Called with lock_ held.
+  void RefNode(int slot);
+  void UnrefNode(int slot);
+  // Pin() hands the calling thread a reference on the node at slot in
+  // place of the one it held, which Unpin() drops; Ref() of the pinned
+  // node takes the reference over.  A thread that exits with a pin
+  // keeps that one node from being evicted.  Called with lock_ held.
+  void Pin(int slot);
+  void Unpin(void);
+  int PinnedSlot(void);
+
+  // Remove the node at slot from the node table and the LRU and free
+  // it.  Called with lock_ held.
+  void DropNode(int slot);
+
+  static double NowSeconds(void);
+  static std::string DirName(const std::string& path);
+  static std::string BaseName(const std::string& path);
+
+  // A child of a listed directory.
+  struct ListEntry {
+    std::string name;
+    bool is_dir;
+  };
+
+  // A cached directory listing, fetched a page at a time as it is read.
+  struct Listing {
+    Listing() : time(0), complete(false), fetching(false), generation(0) {}
+    double time;
+    std::vector<ListEntry> entries;
+    // The names in entries: the server lists every file under the
+    // directory, and a subdirectory holding several shows up once.
+    std::set<std::string> names;
+    // Where the next page starts; complete once there is none.
+    std::string cursor;
+    bool complete;
+    // Whether a page is on its way.
+    bool fetching;
+    // Tells this listing from one that replaced it under the same path.
+    int generation;
+  };
+
+  // A list page fetched ahead of the reader.
+  struct ListPrefetch {
+    AppEngineMount *mount;
+    std::string path;
+    std::string cursor;
+    int generation;
+    std::vector<char> dst;
+    std::string next_cursor;
+  };
+
+  // The prefix of the files under the directory at path, which is what
+  // the server is asked to list.
+  static std::string ListPrefix(const std::string& path);
+  // Add the children named by a fetched page of the files under path to
+  // listing.  Called with lock_ held.
+  static void AddListPage(Listing *listing, const std::string& path,
+                          const std::vector<char>& dst,
+                          const std::string& next_cursor);
+  // The d_ino of the file at path: its slot, which stat() reports as
+  // st_ino, if it has a node, and otherwise a hash of path with the top
+  // bit set, so that it matches no slot.  Called with lock_ held.
+  ino_t ListIno(const std::string& path);
+  // Mark the page after the last of listing as on its way, and return
+  // the prefetch to start once lock_ is released.  Called with lock_
+  // held, as its callback takes it.
+  ListPrefetch *NewListPrefetch(const std::string& path, Listing *listing);
+  static void ListPrefetchDone(void *p, int result);
+
   PathHandle *path_handle_;
   SlotAllocator<AppEngineNode> slots_;
   AppEngineUrlRequest url_request_;
+
+  // lock_ guards everything below as well as slots_.  It is never held
+  // across a remote request.
+  pthread_mutex_t lock_;
+  // The slot, plus one, each thread has pinned.
+  pthread_key_t pin_;
+  pthread_cond_t fetch_done_;
+  // Signaled when a group of fsyncs has been committed.
+  pthread_cond_t sync_done_;
+  // Fsync() calls for the next group, and whether a group is being
+  // committed.
+  std::vector<SyncRequest*> sync_queue_;
+  bool syncing_;
+  double group_commit_window_;
+  // In-flight content reads and metadata lookups, by path.
+  std::map<std::string, Fetch*> inflight_;
+  std::map<std::string, Fetch*> inflight_stats_;
+  // Path to slot table of every live node.
+  std::map<std::string, int> nodes_;
+  // Unreferenced nodes, most recently used first.
+  std::list<int> lru_;
+  std::map<int, std::list<int>::iterator> lru_pos_;
+  size_t max_cached_nodes_;
+  AppEngineCacheTimeouts timeouts_;
+  AppEngineCache *cache_;
+  // Directory listings by directory path.  Page fetches signal
+  // fetch_done_ when they complete.
+  std::map<std::string, Listing> listings_;
+  int listing_generation_;
+  // Paths known not to exist, with the time the entry expires.
+  std::map<std::string, double> negative_;
+  AppEngineMountStats stats_;
 };
 
 #endif  // PACKAGES_SCRIPTS_FILESYS_APPENGINE_APPENGINEMOUNT_H_
@@ -14,6 +14,12 @@ AppEngineNode::AppEngineNode() {
   len_ = 0;
   capacity_ = 0;
   use_count_ = 0;
+  write_count_ = 0;
+  is_dir_ = false;
+  is_dirty_ = false;
+  is_loaded_ = false;
+  mtime_ = 0;
+  attr_time_ = 0;
 }
 
 AppEngineNode::~AppEngineNode() {
@@ -34,6 +40,7 @@ void AppEngineNode::raw_stat(struct stat *buf) {
     buf->st_mode = S_IFREG | 0777;
     buf->st_size = len_;
   }
+  buf->st_mtime = mtime_;
   buf->st_uid = 1001;
   buf->st_gid = 1002;
   buf->st_blksize = 1024;
@@ -54,16 +61,32 @@ int AppEngineNode::unlink() {
   return -1;
 }
 
-void AppEngineNode::ReallocData(int len) {
+void AppEngineNode::ReallocData(size_t len) {
   assert(len > 0);
   data_.resize(len);
   set_capacity(len);
 }
 
+ssize_t AppEngineNode::ReadData(off_t offset, void *buf, size_t count) {
+  if (offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  // Limit to the end of the file.
+  if (offset >= static_cast<off_t>(len_)) {
+    return 0;
+  }
+  if (count > len_ - offset) {
+    count = len_ - offset;
+  }
+  memcpy(buf, &data_[0] + offset, count);
+  return count;
+}
+
 int AppEngineNode::WriteData(off_t offset, const void *buf, size_t count) {
   size_t len;
   // Grow the file if needed.
-  if (offset + static_cast<off_t>(count) > data_.size()) {
+  if (offset + count > data_.size()) {
     len = offset + count;
     size_t next = (data_.size() + 1) * 2;
     if (next > len) {
@@ -73,9 +96,24 @@ int AppEngineNode::WriteData(off_t offset, const void *buf, size_t count) {
   }
 
   memcpy(&data_[0]+offset, buf, count);
+  is_dirty_ = true;
+  ++write_count_;
+  mtime_ = time(NULL);
   offset += count;
-  if (offset > static_cast<off_t>(data_.size())) {
+  if (offset > static_cast<off_t>(len_)) {
     set_len(offset);
   }
   return 0;
 }
+
+bool AppEngineNode::MarkSynced(int64_t write_count,
+                               const std::string& version) {
+  if (write_count != write_count_) {
+    return false;
+  }
+  is_dirty_ = false;
+  version_ = version;
+  // The next change is against the version just written.
+  ClearBase();
+  return true;
+}
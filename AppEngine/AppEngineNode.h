@@ -6,10 +6,14 @@
 #ifndef PACKAGES_SCRIPTS_FILESYS_APPENGINE_APPENGINENODE_H_
 #define PACKAGES_SCRIPTS_FILESYS_APPENGINE_APPENGINENODE_H_
 
+#include <stdint.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
 #include <list>
 #include <string>
+#include <vector>
 
 #include "../base/SlotAllocator.h"
 
@@ -44,7 +48,7 @@ class AppEngineNode {
 
   // Reallocate the size of data to be len bytes.  Copies the
   // current data to the reallocated memory.
-  virtual void ReallocData(int len);
+  virtual void ReallocData(size_t len);
 
   // set_name() sets the name of this node.  This is not the
   // path but rather the name of the file or directory
@@ -82,12 +86,83 @@ class AppEngineNode {
 
   int use_count(void) { return use_count_; }
   void IncrementUseCount(void) { ++use_count_; }
-  void DecrementUseCount(void) { ++use_count_; }
+  void DecrementUseCount(void) { --use_count_; }
+
+  // A dirty node has local writes that have not been synced yet.
+  bool is_dirty(void) { return is_dirty_; }
+  void set_dirty(bool is_dirty) { is_dirty_ = is_dirty; }
+
+  // set_data() replaces the contents of this node with those of *data,
+  // without copying them, and marks them loaded.  *data is left with the
+  // old contents.
+  void set_data(std::vector<char> *data) {
+    data_.swap(*data);
+    len_ = data_.size();
+    capacity_ = data_.size();
+    is_loaded_ = true;
+    ClearBase();
+  }
+  // data() gives read-only access to the contents in place.  Only the
+  // first len() bytes are valid; the rest is spare capacity.
+  const std::vector<char>& data(void) const { return data_; }
+
+  // CopyData() replaces *dst with a copy of the first len() bytes.
+  void CopyData(std::vector<char> *dst) {
+    dst->assign(data_.begin(), data_.begin() + len_);
+  }
+
+  // A node starts out holding only the attributes the server reported
+  // (size, mtime).  It is loaded once its contents have been fetched.
+  bool is_loaded(void) { return is_loaded_; }
+
+  time_t mtime(void) { return mtime_; }
+  void set_mtime(time_t mtime) { mtime_ = mtime; }
+
+  // attr_time() is when the attributes were last confirmed by the server.
+  double attr_time(void) { return attr_time_; }
+  void set_attr_time(double attr_time) { attr_time_ = attr_time; }
+
+  // version() is the server's version of the contents, if known.
+  std::string version(void) { return version_; }
+  void set_version(const std::string& version) { version_ = version; }
+
+  // The base is a copy of the contents the server has at base_version(),
+  // saved by SaveBase() before they are first modified, so that Fsync()
+  // can upload a delta against it.  base_version() is empty if there is
+  // none.
+  const std::string& base_version(void) const { return base_version_; }
+  void SaveBase(void) {
+    CopyData(&base_);
+    base_version_ = version_;
+  }
+  // SwapBase() exchanges the base and its version with *base and
+  // *version, to take it out of the node or to put it back.
+  void SwapBase(std::vector<char> *base, std::string *version) {
+    base->swap(base_);
+    version->swap(base_version_);
+  }
+  void ClearBase(void) {
+    std::vector<char>().swap(base_);
+    base_version_.clear();
+  }
+
+  // ReadData() copies up to count bytes at offset into buf and returns
+  // the number copied, which is 0 at or past the end of the contents.
+  ssize_t ReadData(off_t offset, void *buf, size_t count);
+
+  // WriteData() copies count bytes from buf into the contents at offset,
+  // growing them as needed.
+  int WriteData(off_t offset, const void *buf, size_t count);
 
-  void set_data(std::vector<char> data) { data_ = data; }
-  std::vector<char> data(void) { return data_; }
+  // write_count() counts the WriteData() calls, so that a sync can tell
+  // whether the contents changed after it took its snapshot.
+  int64_t write_count(void) { return write_count_; }
 
-  int WriteData(off_t offset, const void *buf, size_t count);
+  // MarkSynced() records that the server stored, as version, the
+  // contents the node had at write_count.  If they were written to
+  // since, the node stays dirty and keeps its old version, and
+  // MarkSynced() returns false.
+  bool MarkSynced(int64_t write_count, const std::string& version);
 
  private:
   std::string name_;
@@ -97,8 +172,16 @@ class AppEngineNode {
   size_t len_;
   size_t capacity_;
   bool is_dir_;
+  bool is_dirty_;
+  bool is_loaded_;
+  time_t mtime_;
+  double attr_time_;
   int use_count_;
+  int64_t write_count_;
   std::string path_;
+  std::string version_;
+  std::vector<char> base_;
+  std::string base_version_;
 };
 
 #endif  // PACKAGES_SCRIPTS_FILESYS_MEMORY_APPENGINENODE_H_
@@ -1,147 +1,1186 @@
 #include "AppEngineUrlLoader.h"
+#include <assert.h>
+#include <errno.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <algorithm>
+#include "../base/Trace.h"
 
 #define BOUNDARY_STRING "4789341488943"
 #define BOUNDARY_STRING_HEADER BOUNDARY_STRING "\n"
 #define BOUNDARY_STRING_SEP "--" BOUNDARY_STRING "\r\n"
 #define BOUNDARY_STRING_END "--" BOUNDARY_STRING "--\r\n\r\n"
 
+// Returns the value of header name in the raw header block headers, or an
+// empty string if it is not there.
+static std::string FindHeader(const std::string& headers,
+                              const std::string& name) {
+  size_t pos = 0;
+  while (pos < headers.size()) {
+    size_t end = headers.find('\n', pos);
+    if (end == std::string::npos) {
+      end = headers.size();
+    }
+    std::string line = headers.substr(pos, end - pos);
+    pos = end + 1;
+    size_t colon = line.find(':');
+    if (colon == std::string::npos ||
+        strncasecmp(line.c_str(), name.c_str(), colon) != 0 ||
+        colon != name.size()) {
+      continue;
+    }
+    size_t begin = line.find_first_not_of(" \t", colon + 1);
+    size_t last = line.find_last_not_of(" \t\r");
+    if (begin == std::string::npos || last < begin) {
+      return "";
+    }
+    return line.substr(begin, last - begin + 1);
+  }
+  return "";
+}
+
+const size_t AppEnginePost::kDefaultReadSize;
+const int AppEnginePost::kMaxPooled;
+pthread_mutex_t AppEnginePost::pool_lock_ = PTHREAD_MUTEX_INITIALIZER;
+AppEnginePost *AppEnginePost::free_list_ = NULL;
+int AppEnginePost::pooled_ = 0;
+AppEnginePostPoolStats AppEnginePost::pool_stats_;
+const size_t AppEngineUrlRequest::kDefaultChunkSize;
+const int AppEngineUrlRequest::kDefaultConcurrency;
+const int AppEngineUrlRequest::kChunkRetries;
+const size_t AppEngineUrlRequest::kListPageSize;
+
+// Values of the *_encoding and accept_encoding fields.
+static const char kDeflate[] = "deflate";
+static const std::vector<char> kDeflateField(kDeflate,
+                                             kDeflate + sizeof(kDeflate) - 1);
+static const char kGzip[] = "gzip";
+static const std::vector<char> kGzipField(kGzip, kGzip + sizeof(kGzip) - 1);
+
+AppEnginePost *AppEnginePost::New(const std::string& url,
+                                  const KeyValueList& fields,
+                                  std::vector<char>* dst) {
+  pthread_mutex_lock(&pool_lock_);
+  AppEnginePost *post = free_list_;
+  if (post != NULL) {
+    free_list_ = post->next_free_;
+    --pooled_;
+    ++pool_stats_.reused;
+  } else {
+    ++pool_stats_.created;
+  }
+  pthread_mutex_unlock(&pool_lock_);
+  if (post == NULL) {
+    return new AppEnginePost(url, fields, dst);
+  }
+  post->Reset(url, fields, dst);
+  return post;
+}
+
+AppEnginePostPoolStats AppEnginePost::pool_stats(void) {
+  pthread_mutex_lock(&pool_lock_);
+  AppEnginePostPoolStats stats = pool_stats_;
+  pthread_mutex_unlock(&pool_lock_);
+  return stats;
+}
+
+void AppEnginePost::Reset(const std::string& url, const KeyValueList& fields,
+                          std::vector<char>* dst) {
+  job_entry_ = NULL;
+  fields_ = &fields;
+  // Assigning keeps the capacity of the last URL.
+  url_ = url;
+  dst_ = dst;
+  window_ = NULL;
+  window_size_ = 0;
+  size_header_ = NULL;
+  headers_dst_ = NULL;
+  status_dst_ = NULL;
+  stats_ = NULL;
+  listener_ = NULL;
+  status_code_ = 0;
+  read_size_ = kDefaultReadSize;
+  base_ = 0;
+  extent_ = 0;
+  expected_ = -1;
+  received_ = 0;
+  mode_ = kReadBuffered;
+  did_open_ = false;
+  ok_ = true;
+  next_free_ = NULL;
+}
+
+void AppEnginePost::Finish(int32_t result) {
+  MainThreadRunner::StuffResult(job_entry_, result);
+  // Nothing of the request may be touched from here on.  Callbacks of
+  // the last request must not reach the next one, and the loader goes
+  // now rather than when the post is reused.
+  factory_.CancelAll();
+  loader_ = pp::URLLoader();
+  if (buf_.capacity() > kDefaultReadSize) {
+    std::vector<char>().swap(buf_);
+  }
+  pthread_mutex_lock(&pool_lock_);
+  bool keep = pooled_ < kMaxPooled;
+  if (keep) {
+    next_free_ = free_list_;
+    free_list_ = this;
+    ++pooled_;
+  }
+  pthread_mutex_unlock(&pool_lock_);
+  if (!keep) {
+    delete this;
+  }
+}
+
 void AppEnginePost::Run(MainThreadJobEntry *e) {
-  fprintf(stderr, "In AppEnginePost::Run()\n");
+  MOUNT_TRACE("AppEnginePost::Run %s\n", url_.c_str());
   job_entry_ = e;
-  loader_ = new pp::URLLoader(job_entry_->pepper_instance);
-  factory_ = new pp::CompletionCallbackFactory<AppEnginePost>(this);
-  pp::CompletionCallback cc = factory_->NewCallback(&AppEnginePost::OnOpen);
-  fprintf(stderr, "About to call open on loader, url is %s\n", url_.c_str());
-  int32_t rv = loader_->Open(MakeRequest(url_, *fields_), cc);
-  fprintf(stderr, "rv from open is %d\n", rv);
+  base_ = window_ ? 0 : dst_->size();
+  loader_ = pp::URLLoader(job_entry_->pepper_instance);
+  pp::CompletionCallback cc = factory_.NewCallback(&AppEnginePost::OnOpen);
+  int32_t rv = loader_.Open(MakeRequest(url_, *fields_), cc);
   if (rv != PP_OK_COMPLETIONPENDING) {
-    fprintf(stderr, "not PP_OK_COMPLETIONPENDING\n");
     cc.Run(rv);
   }
-  fprintf(stderr, "Leaving Post()\n");
+}
+
+void AppEnginePost::Abort(MainThreadJobEntry *e) {
+  // The pending callback then comes back with PP_ERROR_ABORTED and
+  // reports the failure.
+  loader_.Close();
 }
 
 pp::URLRequestInfo AppEnginePost::MakeRequest(const std::string& url, const KeyValueList& fields) {
-  fprintf(stderr, "About to make a request\n");
   pp::URLRequestInfo request(job_entry_->pepper_instance);
-  fprintf(stderr, "url is: %s\n", url.c_str());
   request.SetURL(url);
   request.SetMethod("POST");
   request.SetFollowRedirects(true);
   request.SetAllowCredentials(true);
   request.SetHeaders("Content-Type: multipart/form-data; boundary=" BOUNDARY_STRING_HEADER);
   KeyValueList::const_iterator it;
+  size_t body = 0;
   for (it = fields.begin(); it != fields.end(); ++it) {
-    request.AppendDataToBody(BOUNDARY_STRING_SEP, sizeof(BOUNDARY_STRING_SEP));
+    request.AppendDataToBody(BOUNDARY_STRING_SEP, sizeof(BOUNDARY_STRING_SEP) - 1);
     std::string line = "Content-Disposition: form-data; name=\"" + it->first + "\"\r\n\r\n";
     request.AppendDataToBody(line.c_str(), line.size());
-    request.AppendDataToBody(&it->second[0], it->second->size());
+    if (!it->second->empty()) {
+      request.AppendDataToBody(&(*it->second)[0], it->second->size());
+    }
     request.AppendDataToBody("\r\n", 2);
+    body += sizeof(BOUNDARY_STRING_SEP) - 1 + line.size() +
+            it->second->size() + 2;
   }
-  request.AppendDataToBody(BOUNDARY_STRING_END, sizeof(BOUNDARY_STRING_END));
-  fprintf(stderr, "Returning request\n");
+  request.AppendDataToBody(BOUNDARY_STRING_END, sizeof(BOUNDARY_STRING_END) - 1);
+  body += sizeof(BOUNDARY_STRING_END) - 1;
+  if (stats_) stats_->bytes_uploaded += body;
   return request;
 }
 
 void AppEnginePost::OnOpen(int32_t result) {
-  fprintf(stderr, "Entering OnOpen()\n");
-  if (result >= 0) {
-    ReadMore();
+  MOUNT_TRACE("AppEnginePost::OnOpen %d\n", result);
+  if (result < 0) {
+    Finish(0);
+    return;
   }
+  // Headers are available, and we can start reading the body.
+  did_open_ = true;
+  ProcessResponseInfo(loader_.GetResponseInfo());
+  ReadMore();
 }
 
 void AppEnginePost::OnRead(int32_t result) {
-  fprintf(stderr, "Entering OnRead(), result=%d\n", result);
+  MOUNT_TRACE("AppEnginePost::OnRead %d\n", result);
   if (result > 0) {
-    ProcessBytes(buf_, result);
-    ReadMore();
-  } else if (result == PP_OK && !did_open_) {
-    // Headers are available, and we can start reading the body.
-    did_open_ = true;
-    ProcessResponseInfo(loader_->GetResponseInfo());
+    if (stats_) stats_->bytes_downloaded += result;
+    switch (mode_) {
+      case kReadStatus:
+        // Only a reply carrying the contents is the file the size header
+        // describes; any other status keeps dst to the body.
+        if (extent_ > 0) {
+          if (*status_dst_ == '1') {
+            dst_->resize(base_ + extent_);
+          } else {
+            extent_ = 0;
+          }
+        }
+        status_dst_ = NULL;
+        break;
+      case kReadDirect:
+        if (received_ == static_cast<size_t>(expected_)) {
+          // More than Content-Length promised.  dst cannot grow now that
+          // a listener may be reading it, so give up.
+          Finish(0);
+          return;
+        }
+        received_ += result;
+        if (listener_) listener_->OnProgress(received_, expected_);
+        break;
+      case kReadBuffered:
+        ProcessBytes(&buf_[0], result);
+        break;
+    }
     ReadMore();
   } else {
     // Done reading (possibly with an error given by 'result').
-    MainThreadRunner::StuffResult(job_entry_, 1);
-    delete this;
+    if (window_) {
+      if (received_ != window_size_) {
+        ok_ = false;
+      }
+    } else if (expected_ >= 0) {
+      if (received_ != static_cast<size_t>(expected_)) {
+        ok_ = false;
+      }
+      // Drop whatever part of the preallocated space was not filled.
+      dst_->resize(base_ + std::max(received_, extent_));
+    }
+    bool ok = result == PP_OK && status_code_ == 200 && ok_;
+    Finish(ok ? 1 : 0);
   }
 }
 
 void AppEnginePost::ReadMore() {
-  pp::CompletionCallback cc = factory_->NewCallback(&AppEnginePost::OnRead);
-  int32_t rv = loader_->ReadResponseBody(buf_, sizeof(buf_), cc);
+  char *target;
+  size_t size;
+  if (status_dst_) {
+    mode_ = kReadStatus;
+    target = status_dst_;
+    size = 1;
+  } else if (expected_ >= 0) {
+    // dst was sized in ProcessResponseInfo, so the body goes straight
+    // into place.  Once it is complete, one more byte is asked for to
+    // see the end of the body.
+    mode_ = kReadDirect;
+    size_t left = expected_ - received_;
+    if (left == 0) {
+      target = &probe_;
+      size = 1;
+    } else {
+      target = Target();
+      size = std::min(left, read_size_);
+    }
+  } else {
+    mode_ = kReadBuffered;
+    if (buf_.size() != read_size_) {
+      buf_.resize(read_size_);
+    }
+    target = &buf_[0];
+    size = buf_.size();
+  }
+  pp::CompletionCallback cc = factory_.NewCallback(&AppEnginePost::OnRead);
+  int32_t rv = loader_.ReadResponseBody(target, size, cc);
   if (rv != PP_OK_COMPLETIONPENDING) {
-    fprintf(stderr, "not PP_OK_COMPLETIONPENDING\n");
     cc.Run(rv);
   }
 }
 
+char *AppEnginePost::Target(void) {
+  if (window_) {
+    return window_ + received_;
+  }
+  return &(*dst_)[base_ + received_];
+}
+
 ////////////
 
 void AppEnginePost::ProcessResponseInfo(const pp::URLResponseInfo& response_info) {
-  // Read response headers, etc.
+  status_code_ = response_info.GetStatusCode();
+  std::string headers = response_info.GetHeaders().AsString();
+  // With a known length the whole body is allocated once and read in
+  // place, instead of growing dst chunk by chunk.
+  std::string length = FindHeader(headers, "Content-Length");
+  long long content_length;
+  if (status_code_ == 200 && !length.empty() &&
+      FindHeader(headers, "Content-Encoding").empty() &&
+      sscanf(length.c_str(), "%lld", &content_length) == 1 &&
+      content_length >= (status_dst_ ? 1 : 0)) {
+    expected_ = content_length - (status_dst_ ? 1 : 0);
+    if (window_) {
+      // A body that does not fit the window is read and rejected in
+      // ProcessBytes().
+      if (static_cast<size_t>(expected_) != window_size_) {
+        expected_ = -1;
+      }
+    } else {
+      std::string size;
+      long long full_size;
+      if (size_header_ &&
+          !(size = FindHeader(headers, size_header_)).empty() &&
+          sscanf(size.c_str(), "%lld", &full_size) == 1 &&
+          full_size > expected_) {
+        extent_ = full_size;
+      }
+      // With a status byte to come, the extent waits for it.
+      size_t room = status_dst_ ? 0 : extent_;
+      dst_->resize(base_ + std::max(static_cast<size_t>(expected_), room));
+    }
+  }
+  if (headers_dst_) {
+    headers_dst_->swap(headers);
+  }
 }
 
 void AppEnginePost::ProcessBytes(const char* bytes, int32_t length) {
   assert(length >= 0);
+  if (window_) {
+    if (received_ + length > window_size_) {
+      ok_ = false;
+      return;
+    }
+    memcpy(Target(), bytes, length);
+    received_ += length;
+    if (stats_) stats_->bytes_copied += length;
+    return;
+  }
   std::vector<char>::size_type pos = dst_->size();
   dst_->resize(pos + length);
   memcpy(&(*dst_)[pos], bytes, length);
+  if (stats_) stats_->bytes_copied += length;
+}
+
+AppEnginePost *AppEngineUrlRequest::NewPost(const std::string& method,
+                                            const KeyValueList& fields,
+                                            std::vector<char>* dst) {
+  AppEnginePost *post = AppEnginePost::New(base_url_ + "/" + method, fields,
+                                           dst);
+  post->set_read_size(read_size_);
+  post->set_stats(&transfer_stats_);
+  return post;
 }
 
-int AppEngineUrlRequest::Read(const std::string& path, std::vector<char>& dst) {
-  fprintf(stderr, "In AppEngineUrlLoader::read\n");
+// Returns n as the text of a form field.
+static std::vector<char> NumberField(unsigned long long n) {
+  char text[32];
+  int len = snprintf(text, sizeof(text), "%llu", n);
+  return std::vector<char>(text, text + len);
+}
+
+void AppEngineUrlRequest::AddDataField(KeyValueList *fields,
+                                       const std::string& name,
+                                       const std::vector<char>* value,
+                                       std::vector<char>* packed) {
+  // This runs on the caller's thread, not the main one.
+  if (!value->empty() &&
+      compressor_.Compress(&(*value)[0], value->size(), packed) == 0) {
+    fields->push_back(KeyValue(name, packed));
+    fields->push_back(KeyValue(name + "_encoding", &kDeflateField));
+  } else {
+    fields->push_back(KeyValue(name, value));
+  }
+}
+
+void AppEngineUrlRequest::AcceptEncoding(KeyValueList *fields) {
+  if (compressor_.level() > 0) {
+    fields->push_back(KeyValue("accept_encoding", &kGzipField));
+  }
+}
+
+// Keeps track of the pieces of a chunked read, and tells the caller's
+// listener how much of the file, counted from its start, has arrived.
+// Everything but the constructor runs on the main thread while pieces
+// are in flight.
+class AppEngineUrlRequest::ChunkProgress {
+ public:
+  struct Piece {
+    Piece() : offset(0), size(0), done(0), base(0), attempts(0), status(0),
+              confirmed(false) {}
+    size_t offset;
+    size_t size;
+    // Bytes of the piece already in place; a retry continues there.
+    size_t done;
+    // done when the current attempt started.
+    size_t base;
+    int attempts;
+    char status;
+    std::string headers;
+    // Whether the reply is known to be of the file's version.
+    bool confirmed;
+  };
+
+  // Passes the progress of one piece on.
+  class Listener : public AppEngineReadListener {
+   public:
+    Listener() : progress_(NULL), index_(0) {}
+    Listener(ChunkProgress *progress, size_t index)
+      : progress_(progress), index_(index) {}
+
+    void OnProgress(size_t available, size_t total) {
+      progress_->Update(index_, available, total);
+    }
+
+   private:
+    ChunkProgress *progress_;
+    size_t index_;
+  };
+
+  explicit ChunkProgress(AppEngineReadListener *listener)
+    : pieces(1),
+      priority(MainThreadRunner::kInteractive),
+      listener_(listener),
+      total_(-1),
+      published_(0) {}
+
+  // Told about the body of the attempt on piece index.
+  void Update(size_t index, size_t available, size_t total) {
+    Piece& piece = pieces[index];
+    // Only file contents count, and only of the version being read.
+    if (piece.status != '1') {
+      return;
+    }
+    if (index == 0 && total_ < 0) {
+      std::string size = FindHeader(piece.headers, "X-File-Size");
+      long long file_size;
+      total_ = total;
+      if (sscanf(size.c_str(), "%lld", &file_size) == 1) {
+        total_ = file_size;
+      }
+      piece.size = total;
+    }
+    if (index > 0 && !piece.confirmed) {
+      piece.confirmed =
+          FindHeader(piece.headers, "X-File-Version") == version;
+      if (!piece.confirmed) {
+        return;
+      }
+    }
+    piece.done = piece.base + available;
+    Publish();
+  }
+
+  void Publish(void) {
+    if (listener_ == NULL || total_ < 0) {
+      return;
+    }
+    size_t prefix = 0;
+    for (size_t i = 0; i < pieces.size(); ++i) {
+      prefix += pieces[i].done;
+      if (pieces[i].done < pieces[i].size) {
+        break;
+      }
+    }
+    if (prefix > published_) {
+      published_ = prefix;
+      listener_->OnProgress(prefix, total_);
+    }
+  }
+
+  std::vector<Piece> pieces;
+  // The version of the file, from the reply to the first piece.
+  std::string version;
+  // The priority of the pieces' requests.
+  MainThreadRunner::Priority priority;
+
+ private:
+  AppEngineReadListener *listener_;
+  int64_t total_;
+  size_t published_;
+};
+
+int AppEngineUrlRequest::Read(const std::string& path, std::vector<char>& dst,
+                              const std::string& if_version,
+                              std::string* version,
+                              AppEngineReadListener* listener,
+                              MainThreadRunner::Priority priority) {
+  MOUNT_TRACE("AppEngineUrlRequest::Read %s\n", path.c_str());
   KeyValueList fields;
   int raw_result;
 
   std::vector<char> filename_vec(path.begin(), path.end());
   fields.push_back(KeyValue("filename", &filename_vec));
-  fprintf(stderr, "fields initiatlized\n");
- 
-  raw_result = runner_->RunJob(new AppEnginePost(base_url_ + "/read", fields, &dst));
+  std::vector<char> version_vec(if_version.begin(), if_version.end());
+  if (!if_version.empty()) {
+    fields.push_back(KeyValue("version", &version_vec));
+  }
+  // Large files only send their first piece here; the rest follows in
+  // ReadChunks().
+  std::vector<char> length_vec = NumberField(chunk_size_);
+  if (chunk_size_ > 0) {
+    fields.push_back(KeyValue("length", &length_vec));
+  }
+  AcceptEncoding(&fields);
+
+  // The reply is "0" for a missing file, "2" if if_version is still
+  // current, and "1" followed by the contents otherwise.  The version of
+  // the contents comes in the X-File-Version header and their full size
+  // in X-File-Size.
+  ChunkProgress progress(listener);
+  progress.priority = priority;
+  ChunkProgress::Piece& first = progress.pieces[0];
+  AppEnginePost *post = NewPost("read", fields, &dst);
+  post->set_headers_dst(&first.headers);
+  // Keep the status byte out of dst so that dst holds only the contents.
+  post->set_status_dst(&first.status);
+  // Make room for the whole file, so that the first piece stays put
+  // while the others arrive.
+  post->set_size_header("X-File-Size");
+  ChunkProgress::Listener first_listener(&progress, 0);
+  post->set_listener(&first_listener);
+  raw_result = runner_->RunJob(post, priority, this);
   if (!raw_result) return -1;
-  fprintf(stderr, "getting data\n");
-  if (dst.size() < 1) return -1;
-  if (dst[0] != '1') return -1;
+  if (first.status == '2' && !if_version.empty()) {
+    if (version) *version = if_version;
+    return kNotModified;
+  }
+  if (first.status != '1') return -1;
+  progress.version = FindHeader(first.headers, "X-File-Version");
+  if (version) *version = progress.version;
+
+  long long total;
+  std::string size = FindHeader(first.headers, "X-File-Size");
+  if (chunk_size_ == 0 || sscanf(size.c_str(), "%lld", &total) != 1 ||
+      total <= static_cast<long long>(chunk_size_)) {
+    // All of the file came in this reply.
+    return 0;
+  }
+  // A compressed reply cannot be read in place, so then dst only has
+  // the first piece.  Nothing has been told about it yet, so dst may
+  // still move.
+  if (dst.size() == chunk_size_) dst.resize(total);
+  if (dst.size() != static_cast<size_t>(total)) return -1;
+  first.size = chunk_size_;
+  first.done = chunk_size_;
+  return ReadChunks(path, dst, progress.version, &progress);
+}
+
+// The state of one ReadAsync() call.
+struct AppEngineUrlRequest::AsyncRead {
+  AsyncRead() : status(0) {}
+  std::vector<char> filename;
+  KeyValueList fields;
+  std::string headers;
+  char status;
+  std::string* version;
+  ReadCallback callback;
+  void* arg;
+};
+
+void AppEngineUrlRequest::ReadAsync(const std::string& path,
+                                    std::vector<char>* dst,
+                                    std::string* version,
+                                    AppEngineReadListener* listener,
+                                    MainThreadRunner::Priority priority,
+                                    ReadCallback callback, void* arg) {
+  MOUNT_TRACE("AppEngineUrlRequest::ReadAsync %s\n", path.c_str());
+  AsyncRead *read = new AsyncRead;
+  read->filename.assign(path.begin(), path.end());
+  read->fields.push_back(KeyValue("filename", &read->filename));
+  AcceptEncoding(&read->fields);
+  read->version = version;
+  read->callback = callback;
+  read->arg = arg;
+  // Without a length field the whole file comes back, so there are no
+  // further pieces to wait for.
+  AppEnginePost *post = NewPost("read", read->fields, dst);
+  post->set_headers_dst(&read->headers);
+  post->set_status_dst(&read->status);
+  post->set_listener(listener);
+  if (runner_->StartJob(post, priority, this, &AsyncReadDone, read) != 0) {
+    delete read;
+    callback(arg, -1);
+  }
+}
+
+void AppEngineUrlRequest::AsyncReadDone(void *p, int32_t result, int error) {
+  AsyncRead *read = reinterpret_cast<AsyncRead*>(p);
+  int ret = -1;
+  if (result && error == 0 && read->status == '1') {
+    if (read->version) {
+      *read->version = FindHeader(read->headers, "X-File-Version");
+    }
+    ret = 0;
+  }
+  ReadCallback callback = read->callback;
+  void *arg = read->arg;
+  delete read;
+  callback(arg, ret);
+}
+
+int AppEngineUrlRequest::ReadChunks(const std::string& path,
+                                    std::vector<char>& dst,
+                                    const std::string& version,
+                                    ChunkProgress *progress) {
+  typedef ChunkProgress::Piece Piece;
+  std::vector<Piece>& pieces = progress->pieces;
+  for (size_t offset = chunk_size_; offset < dst.size();
+       offset += chunk_size_) {
+    Piece piece;
+    piece.offset = offset;
+    piece.size = std::min(chunk_size_, dst.size() - offset);
+    pieces.push_back(piece);
+  }
+  std::list<size_t> pending;
+  for (size_t i = 1; i < pieces.size(); ++i) {
+    pending.push_back(i);
+  }
+
+  std::vector<char> filename_vec(path.begin(), path.end());
+  while (!pending.empty()) {
+    size_t count = std::min(pending.size(),
+                            static_cast<size_t>(concurrency_));
+    std::vector<size_t> batch(count);
+    std::vector<std::vector<char> > offsets(count);
+    std::vector<std::vector<char> > lengths(count);
+    std::vector<KeyValueList> fields(count);
+    std::vector<ChunkProgress::Listener> listeners(count);
+    std::vector<MainThreadJob*> jobs(count);
+    std::vector<int32_t> results(count);
+    for (size_t k = 0; k < count; ++k) {
+      batch[k] = pending.front();
+      pending.pop_front();
+      Piece& piece = pieces[batch[k]];
+      piece.base = piece.done;
+      piece.status = 0;
+      piece.headers.clear();
+      piece.confirmed = false;
+      offsets[k] = NumberField(piece.offset + piece.done);
+      lengths[k] = NumberField(piece.size - piece.done);
+      fields[k].push_back(KeyValue("filename", &filename_vec));
+      fields[k].push_back(KeyValue("offset", &offsets[k]));
+      fields[k].push_back(KeyValue("length", &lengths[k]));
+      AcceptEncoding(&fields[k]);
+      listeners[k] = ChunkProgress::Listener(progress, batch[k]);
+      AppEnginePost *post = NewPost("read", fields[k], &dst);
+      post->set_window(&dst[piece.offset + piece.done],
+                       piece.size - piece.done);
+      post->set_status_dst(&piece.status);
+      post->set_headers_dst(&piece.headers);
+      post->set_listener(&listeners[k]);
+      jobs[k] = post;
+    }
+    errno = 0;
+    runner_->RunJobs(&jobs[0], &results[0], count, progress->priority, this);
+    // Pieces that failed because of Cancel() are not retried.
+    bool cancelled = errno == ECANCELED;
+    for (size_t k = 0; k < count; ++k) {
+      Piece& piece = pieces[batch[k]];
+      if (piece.status == '0' ||
+          (piece.status == '1' &&
+           FindHeader(piece.headers, "X-File-Version") != version)) {
+        // The file went away or changed under the transfer.
+        return -1;
+      }
+      if (results[k] && piece.status == '1') {
+        piece.done = piece.size;
+        progress->Publish();
+        continue;
+      }
+      if (cancelled || ++piece.attempts > kChunkRetries) {
+        return -1;
+      }
+      pending.push_back(batch[k]);
+    }
+  }
   return 0;
 }
 
-int AppEngineUrlRequest::Write(const std::string& path, const std::vector<char>& data) {
+int AppEngineUrlRequest::Stat(const std::string& path, AppEngineFileInfo *info) {
   KeyValueList fields;
   int raw_result;
 
-  std::vector<char>::const_iterator it;
-  fprintf(stderr, "###########\n");
-  for (it = data.begin(); it != data.end(); ++it) {
-    fprintf(stderr, "%c, ", *it);
+  std::vector<char> filename_vec(path.begin(), path.end());
+  fields.push_back(KeyValue("filename", &filename_vec));
+
+  std::vector<char> dst;
+  raw_result = runner_->RunJob(NewPost("stat", fields, &dst),
+                                MainThreadRunner::kMetadata, this);
+  if (!raw_result) return -1;
+  return ParseStat(dst, info);
+}
+
+// The state of one StatAsync() call.
+struct AppEngineUrlRequest::AsyncStat {
+  std::vector<char> filename;
+  KeyValueList fields;
+  std::vector<char> dst;
+  AppEngineFileInfo *info;
+  ReadCallback callback;
+  void* arg;
+};
+
+void AppEngineUrlRequest::StatAsync(const std::string& path,
+                                    AppEngineFileInfo *info,
+                                    ReadCallback callback, void* arg) {
+  AsyncStat *stat = new AsyncStat;
+  stat->filename.assign(path.begin(), path.end());
+  stat->fields.push_back(KeyValue("filename", &stat->filename));
+  stat->info = info;
+  stat->callback = callback;
+  stat->arg = arg;
+  AppEnginePost *post = NewPost("stat", stat->fields, &stat->dst);
+  if (runner_->StartJob(post, MainThreadRunner::kMetadata, this,
+                        &AsyncStatDone, stat) != 0) {
+    delete stat;
+    callback(arg, -1);
   }
-  fprintf(stderr, "\n###########\n");
+}
+
+void AppEngineUrlRequest::AsyncStatDone(void *p, int32_t result, int error) {
+  AsyncStat *stat = reinterpret_cast<AsyncStat*>(p);
+  int ret = -1;
+  if (result && error == 0) {
+    ret = ParseStat(stat->dst, stat->info);
+  }
+  ReadCallback callback = stat->callback;
+  void *arg = stat->arg;
+  delete stat;
+  callback(arg, ret);
+}
+
+int AppEngineUrlRequest::ParseStat(const std::vector<char>& dst,
+                                   AppEngineFileInfo *info) {
+  // The reply is "0" for a missing path, "2" for a directory and
+  // "1 <size> <mtime> <version>" for a file.
+  if (dst.size() < 1) return -1;
+  std::string reply(dst.begin(), dst.end());
+  *info = AppEngineFileInfo();
+  if (reply[0] == '0') {
+    return 0;
+  }
+  info->exists = true;
+  if (reply[0] == '2') {
+    info->is_dir = true;
+    return 0;
+  }
+  unsigned long long size;
+  long long mtime;
+  char version[64];
+  int n = sscanf(reply.c_str(), "1 %llu %lld %63s", &size, &mtime, version);
+  if (n < 2) return -1;
+  info->size = size;
+  info->mtime = mtime;
+  if (n == 3) {
+    info->version = version;
+  }
+  return 0;
+}
+
+int AppEngineUrlRequest::Write(const std::string& path, const std::vector<char>& data,
+                              std::string* version) {
+  if (chunk_size_ > 0 && data.size() > chunk_size_) {
+    return WriteChunks(path, data, version);
+  }
+  KeyValueList fields;
+  int raw_result;
 
   std::vector<char> filename_vec(path.begin(), path.end());
+  std::vector<char> packed;
   fields.push_back(KeyValue("filename", &filename_vec));
-  fields.push_back(KeyValue("data", &data));
+  AddDataField(&fields, "data", &data, &packed);
 
   std::vector<char> dst;
-  raw_result = runner_->RunJob(new AppEnginePost(base_url_ + "/write", fields, &dst));
+  std::string headers;
+  AppEnginePost *post = NewPost("write", fields, &dst);
+  post->set_headers_dst(&headers);
+  raw_result = runner_->RunJob(post, MainThreadRunner::kBackground,
+                               this);
   if (!raw_result) return -1;
-  return dst.size() == 1 && dst[0] == '1' ? 0 : -1;
+  if (dst.size() != 1 || dst[0] != '1') return -1;
+  if (version) *version = FindHeader(headers, "X-File-Version");
+  return 0;
 }
 
-int AppEngineUrlRequest::List(const std::string& path, std::vector<char>& dst) {
-  fprintf(stderr, "In List()\n");
+int AppEngineUrlRequest::WriteChunks(const std::string& path,
+                                     const std::vector<char>& data,
+                                     std::string* version) {
+  // Pieces are staged under an upload id until "commit" puts them all
+  // in place at once, so readers never see a partly written file.
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  char upload[64];
+  snprintf(upload, sizeof(upload), "%lx.%lx.%lx",
+           static_cast<unsigned long>(tv.tv_sec),
+           static_cast<unsigned long>(tv.tv_usec),
+           reinterpret_cast<unsigned long>(&data));
+  std::vector<char> filename_vec(path.begin(), path.end());
+  std::vector<char> upload_vec(upload, upload + strlen(upload));
+
+  size_t pieces = (data.size() + chunk_size_ - 1) / chunk_size_;
+  std::vector<int> attempts(pieces, 0);
+  std::list<size_t> pending;
+  for (size_t i = 0; i < pieces; ++i) {
+    pending.push_back(i);
+  }
+  bool ok = true;
+  while (ok && !pending.empty()) {
+    size_t count = std::min(pending.size(),
+                            static_cast<size_t>(concurrency_));
+    std::vector<size_t> batch(count);
+    std::vector<std::vector<char> > offsets(count);
+    std::vector<std::vector<char> > bodies(count);
+    std::vector<std::vector<char> > packed(count);
+    std::vector<std::vector<char> > replies(count);
+    std::vector<KeyValueList> fields(count);
+    std::vector<MainThreadJob*> jobs(count);
+    std::vector<int32_t> results(count);
+    for (size_t k = 0; k < count; ++k) {
+      batch[k] = pending.front();
+      pending.pop_front();
+      size_t offset = batch[k] * chunk_size_;
+      size_t size = std::min(chunk_size_, data.size() - offset);
+      offsets[k] = NumberField(offset);
+      bodies[k].assign(data.begin() + offset, data.begin() + offset + size);
+      fields[k].push_back(KeyValue("filename", &filename_vec));
+      fields[k].push_back(KeyValue("upload", &upload_vec));
+      fields[k].push_back(KeyValue("offset", &offsets[k]));
+      AddDataField(&fields[k], "data", &bodies[k], &packed[k]);
+      jobs[k] = NewPost("write_chunk", fields[k], &replies[k]);
+    }
+    errno = 0;
+    runner_->RunJobs(&jobs[0], &results[0], count,
+                     MainThreadRunner::kBackground, this);
+    bool cancelled = errno == ECANCELED;
+    for (size_t k = 0; k < count; ++k) {
+      if (results[k] && replies[k].size() == 1 && replies[k][0] == '1') {
+        continue;
+      }
+      if (cancelled || ++attempts[batch[k]] > kChunkRetries) {
+        ok = false;
+      }
+      pending.push_back(batch[k]);
+    }
+  }
+
   KeyValueList fields;
-  int raw_result;
+  fields.push_back(KeyValue("filename", &filename_vec));
+  fields.push_back(KeyValue("upload", &upload_vec));
+  std::vector<char> size_vec = NumberField(data.size());
+  std::vector<char> abort_vec(1, '1');
+  if (ok) {
+    fields.push_back(KeyValue("size", &size_vec));
+  } else {
+    // Let the server drop what was staged.
+    fields.push_back(KeyValue("abort", &abort_vec));
+  }
+  std::vector<char> dst;
+  std::string headers;
+  AppEnginePost *post = NewPost("commit", fields, &dst);
+  post->set_headers_dst(&headers);
+  int raw_result = runner_->RunJob(post, MainThreadRunner::kBackground,
+                                   this);
+  if (!ok || !raw_result) return -1;
+  if (dst.size() != 1 || dst[0] != '1') return -1;
+  if (version) *version = FindHeader(headers, "X-File-Version");
+  return 0;
+}
+
+int AppEngineUrlRequest::WriteDelta(const std::string& path,
+                                    const AppEngineSignature& base,
+                                    const std::vector<char>& data,
+                                    std::string* version,
+                                    size_t* delta_size) {
+  if (base.empty() || data.empty()) return -1;
+  std::vector<char> delta;
+  size_t literal = AppEngineDelta::Encode(base, &data[0], data.size(),
+                                          &delta);
+  // Not worth a request that may be refused.
+  if (literal > data.size() / 2) return -1;
 
+  // The server rebuilds the file from its copy of version base, checks
+  // the result against size and crc, and replies "1" if it stored it,
+  // "2" if base is not its current version and "0" otherwise.
+  KeyValueList fields;
   std::vector<char> filename_vec(path.begin(), path.end());
-  fields.push_back(KeyValue("prefix", &filename_vec));
+  std::vector<char> base_vec(base.version().begin(), base.version().end());
+  std::vector<char> block_size_vec = NumberField(base.block_size());
+  std::vector<char> size_vec = NumberField(data.size());
+  std::vector<char> crc_vec =
+      NumberField(AppEngineDelta::Crc32(&data[0], data.size()));
+  fields.push_back(KeyValue("filename", &filename_vec));
+  fields.push_back(KeyValue("base", &base_vec));
+  fields.push_back(KeyValue("block_size", &block_size_vec));
+  fields.push_back(KeyValue("size", &size_vec));
+  fields.push_back(KeyValue("crc", &crc_vec));
+  std::vector<char> packed;
+  AddDataField(&fields, "delta", &delta, &packed);
 
-  raw_result = runner_->RunJob(new AppEnginePost(base_url_ + "/list", fields, &dst));
+  std::vector<char> dst;
+  std::string headers;
+  AppEnginePost *post = NewPost("write_delta", fields, &dst);
+  post->set_headers_dst(&headers);
+  int raw_result = runner_->RunJob(post, MainThreadRunner::kBackground,
+                                   this);
   if (!raw_result) return -1;
+  if (dst.size() != 1 || dst[0] != '1') return -1;
+  if (version) *version = FindHeader(headers, "X-File-Version");
+  if (delta_size) *delta_size = packed.empty() ? delta.size() : packed.size();
+  return 0;
+}
+
+int AppEngineUrlRequest::WriteBatch(std::vector<AppEngineWrite>* writes) {
+  // Group small files, in order, into requests of up to chunk_size_.
+  std::vector<std::vector<size_t> > groups;
+  std::vector<size_t> large;
+  size_t group_bytes = 0;
+  for (size_t i = 0; i < writes->size(); ++i) {
+    size_t size = (*writes)[i].data->size();
+    if (chunk_size_ > 0 && size > chunk_size_) {
+      large.push_back(i);
+      continue;
+    }
+    if (groups.empty() ||
+        (chunk_size_ > 0 && group_bytes + size > chunk_size_)) {
+      groups.push_back(std::vector<size_t>());
+      group_bytes = 0;
+    }
+    groups.back().push_back(i);
+    group_bytes += size;
+  }
+
+  std::vector<std::vector<char> > paths(writes->size());
+  std::vector<std::vector<char> > packed(writes->size());
+  for (size_t i = 0; i < writes->size(); ++i) {
+    paths[i].assign((*writes)[i].path.begin(), (*writes)[i].path.end());
+  }
+  int ret = 0;
+  for (size_t first = 0; first < groups.size(); first += concurrency_) {
+    size_t count = std::min(groups.size() - first,
+                            static_cast<size_t>(concurrency_));
+    std::vector<std::vector<char> > counts(count);
+    std::vector<std::vector<char> > replies(count);
+    std::vector<KeyValueList> fields(count);
+    std::vector<MainThreadJob*> jobs(count);
+    std::vector<int32_t> results(count);
+    for (size_t k = 0; k < count; ++k) {
+      const std::vector<size_t>& group = groups[first + k];
+      counts[k] = NumberField(group.size());
+      fields[k].push_back(KeyValue("count", &counts[k]));
+      for (size_t j = 0; j < group.size(); ++j) {
+        char name[32];
+        snprintf(name, sizeof(name), "filename%d", static_cast<int>(j));
+        fields[k].push_back(KeyValue(name, &paths[group[j]]));
+        snprintf(name, sizeof(name), "data%d", static_cast<int>(j));
+        AddDataField(&fields[k], name, (*writes)[group[j]].data,
+                     &packed[group[j]]);
+      }
+      jobs[k] = NewPost("write_batch", fields[k], &replies[k]);
+    }
+    runner_->RunJobs(&jobs[0], &results[0], count,
+                     MainThreadRunner::kBackground, this);
+    // The reply has a line per file: "1 <version>" or "0".
+    for (size_t k = 0; k < count; ++k) {
+      const std::vector<size_t>& group = groups[first + k];
+      std::string reply(replies[k].begin(), replies[k].end());
+      size_t pos = 0;
+      for (size_t j = 0; j < group.size(); ++j) {
+        AppEngineWrite& write = (*writes)[group[j]];
+        size_t end = reply.find('\n', pos);
+        std::string line = reply.substr(pos, end - pos);
+        pos = end == std::string::npos ? reply.size() : end + 1;
+        if (results[k] && line.size() > 2 && line[0] == '1' &&
+            line[1] == ' ') {
+          write.result = 0;
+          write.version = line.substr(2);
+        } else {
+          write.result = -1;
+          ret = -1;
+        }
+      }
+    }
+  }
+  for (size_t i = 0; i < large.size(); ++i) {
+    AppEngineWrite& write = (*writes)[large[i]];
+    write.result = Write(write.path, *write.data, &write.version);
+    if (write.result != 0) {
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
+int AppEngineUrlRequest::ReadBatch(std::vector<AppEngineRead>* reads,
+                                   MainThreadRunner::Priority priority) {
+  std::vector<std::vector<size_t> > groups;
+  size_t group_bytes = 0;
+  for (size_t i = 0; i < reads->size(); ++i) {
+    size_t size = (*reads)[i].size;
+    if (groups.empty() ||
+        (chunk_size_ > 0 && group_bytes + size > chunk_size_)) {
+      groups.push_back(std::vector<size_t>());
+      group_bytes = 0;
+    }
+    groups.back().push_back(i);
+    group_bytes += size;
+  }
+
+  std::vector<std::vector<char> > paths(reads->size());
+  for (size_t i = 0; i < reads->size(); ++i) {
+    paths[i].assign((*reads)[i].path.begin(), (*reads)[i].path.end());
+  }
+  int ret = 0;
+  for (size_t first = 0; first < groups.size(); first += concurrency_) {
+    size_t count = std::min(groups.size() - first,
+                            static_cast<size_t>(concurrency_));
+    std::vector<std::vector<char> > counts(count);
+    std::vector<std::vector<char> > replies(count);
+    std::vector<KeyValueList> fields(count);
+    std::vector<MainThreadJob*> jobs(count);
+    std::vector<int32_t> results(count);
+    for (size_t k = 0; k < count; ++k) {
+      const std::vector<size_t>& group = groups[first + k];
+      counts[k] = NumberField(group.size());
+      fields[k].push_back(KeyValue("count", &counts[k]));
+      for (size_t j = 0; j < group.size(); ++j) {
+        char name[32];
+        snprintf(name, sizeof(name), "filename%d", static_cast<int>(j));
+        fields[k].push_back(KeyValue(name, &paths[group[j]]));
+      }
+      AcceptEncoding(&fields[k]);
+      jobs[k] = NewPost("read_batch", fields[k], &replies[k]);
+    }
+    runner_->RunJobs(&jobs[0], &results[0], count, priority, this);
+    // Each file is "1 <version> <size>\n" followed by its contents, or
+    // "0\n" if it cannot be read.
+    for (size_t k = 0; k < count; ++k) {
+      const std::vector<size_t>& group = groups[first + k];
+      const std::vector<char>& reply = replies[k];
+      size_t pos = 0;
+      for (size_t j = 0; j < group.size(); ++j) {
+        AppEngineRead& read = (*reads)[group[j]];
+        read.result = -1;
+        std::vector<char>::const_iterator eol =
+            std::find(reply.begin() + pos, reply.end(), '\n');
+        if (!results[k] || eol == reply.end()) {
+          ret = -1;
+          continue;
+        }
+        std::string line(reply.begin() + pos, eol);
+        pos = eol - reply.begin() + 1;
+        char version[64];
+        unsigned long long size;
+        if (sscanf(line.c_str(), "1 %63s %llu", version, &size) != 2 ||
+            size > reply.size() - pos) {
+          ret = -1;
+          continue;
+        }
+        read.data.assign(reply.begin() + pos, reply.begin() + pos + size);
+        read.version = version;
+        read.result = 0;
+        pos += size;
+      }
+    }
+  }
+  return ret;
+}
+
+// The state of one List() or ListAsync() call.
+struct AppEngineUrlRequest::AsyncList {
+  std::vector<char> filename;
+  std::vector<char> cursor;
+  std::vector<char> limit;
+  std::vector<char> stat;
+  KeyValueList fields;
+  std::string headers;
+  std::string* next_cursor;
+  ReadCallback callback;
+  void* arg;
+};
+
+AppEnginePost *AppEngineUrlRequest::NewListPost(AsyncList *list,
+                                                const std::string& path,
+                                                const std::string& cursor,
+                                                bool with_stat,
+                                                std::vector<char>* dst) {
+  list->filename.assign(path.begin(), path.end());
+  list->fields.push_back(KeyValue("prefix", &list->filename));
+  // A server that does not page ignores these and sends everything,
+  // with no cursor.
+  char limit[32];
+  snprintf(limit, sizeof(limit), "%u",
+           static_cast<unsigned int>(kListPageSize));
+  list->limit.assign(limit, limit + strlen(limit));
+  list->fields.push_back(KeyValue("limit", &list->limit));
+  if (!cursor.empty()) {
+    list->cursor.assign(cursor.begin(), cursor.end());
+    list->fields.push_back(KeyValue("cursor", &list->cursor));
+  }
+  if (with_stat) {
+    list->stat.push_back('1');
+    list->fields.push_back(KeyValue("stat", &list->stat));
+  }
+  AppEnginePost *post = NewPost("list", list->fields, dst);
+  post->set_headers_dst(&list->headers);
+  return post;
+}
+
+int AppEngineUrlRequest::List(const std::string& path,
+                              const std::string& cursor,
+                              std::vector<char>& dst,
+                              std::string* next_cursor) {
+  MOUNT_TRACE("AppEngineUrlRequest::List %s\n", path.c_str());
+  AsyncList list;
+  AppEnginePost *post = NewListPost(&list, path, cursor, false, &dst);
+  if (!runner_->RunJob(post, MainThreadRunner::kMetadata, this)) {
+    return -1;
+  }
+  *next_cursor = FindHeader(list.headers, "X-List-Cursor");
   return 0;
 }
 
+int AppEngineUrlRequest::ListStat(const std::string& path,
+                                  const std::string& cursor,
+                                  std::vector<AppEngineListEntry>* entries,
+                                  std::string* next_cursor) {
+  MOUNT_TRACE("AppEngineUrlRequest::ListStat %s\n", path.c_str());
+  AsyncList list;
+  std::vector<char> dst;
+  AppEnginePost *post = NewListPost(&list, path, cursor, true, &dst);
+  if (!runner_->RunJob(post, MainThreadRunner::kMetadata, this)) {
+    return -1;
+  }
+  *next_cursor = FindHeader(list.headers, "X-List-Cursor");
+  // Each line is "<path>\t<attributes>", or just the path from a server
+  // that does not know stat=1.
+  std::vector<char>::iterator begin = dst.begin();
+  while (begin != dst.end()) {
+    std::vector<char>::iterator end = std::find(begin, dst.end(), '\n');
+    std::vector<char>::iterator tab = std::find(begin, end, '\t');
+    AppEngineListEntry entry;
+    entry.path.assign(begin, tab);
+    if (tab != end &&
+        ParseStat(std::vector<char>(tab + 1, end), &entry.info) != 0) {
+      return -1;
+    }
+    if (!entry.path.empty()) {
+      entries->push_back(entry);
+    }
+    begin = end == dst.end() ? end : end + 1;
+  }
+  return 0;
+}
+
+void AppEngineUrlRequest::ListAsync(const std::string& path,
+                                    const std::string& cursor,
+                                    std::vector<char>* dst,
+                                    std::string* next_cursor,
+                                    MainThreadRunner::Priority priority,
+                                    ReadCallback callback, void* arg) {
+  MOUNT_TRACE("AppEngineUrlRequest::ListAsync %s\n", path.c_str());
+  AsyncList *list = new AsyncList;
+  list->next_cursor = next_cursor;
+  list->callback = callback;
+  list->arg = arg;
+  AppEnginePost *post = NewListPost(list, path, cursor, false, dst);
+  if (runner_->StartJob(post, priority, this, &AsyncListDone, list) != 0) {
+    delete list;
+    callback(arg, -1);
+  }
+}
+
+void AppEngineUrlRequest::AsyncListDone(void *p, int32_t result, int error) {
+  AsyncList *list = reinterpret_cast<AsyncList*>(p);
+  int ret = -1;
+  if (result && error == 0) {
+    *list->next_cursor = FindHeader(list->headers, "X-List-Cursor");
+    ret = 0;
+  }
+  ReadCallback callback = list->callback;
+  void *arg = list->arg;
+  delete list;
+  callback(arg, ret);
+}
+
 int AppEngineUrlRequest::Remove(const std::string& path) {
-  fprintf(stderr, "In Remove()\n");
+  MOUNT_TRACE("AppEngineUrlRequest::Remove %s\n", path.c_str());
   KeyValueList fields;
   int raw_result;
 
@@ -149,7 +1188,8 @@ int AppEngineUrlRequest::Remove(const std::string& path) {
   fields.push_back(KeyValue("filename", &filename_vec));
 
   std::vector<char> data;
-  raw_result = runner_->RunJob(new AppEnginePost(base_url_ + "/remove", fields, &data));
+  raw_result = runner_->RunJob(NewPost("remove", fields, &data),
+                                MainThreadRunner::kMetadata, this);
   if (!raw_result) return -1;
   return data.size() == 1 && data[0] == '1' ? 0 : -1;
 }
@@ -10,8 +10,9 @@
 #include <list>
 #include <string>
 #include <vector>
-#include <semaphore.h>
+#include <pthread.h>
 #include <string.h>
+#include <time.h>
 #include <ppapi/cpp/instance.h>
 #include <ppapi/cpp/completion_callback.h>
 #include <ppapi/cpp/completion_callback.h>
@@ -22,33 +23,165 @@
 #include <ppapi/c/pp_errors.h>
 #include <stdio.h>
 #include "../base/MainThreadRunner.h"
+#include "AppEngineCompression.h"
+#include "AppEngineDelta.h"
+
+// Attributes of a remote path, as returned by the stat method.
+struct AppEngineFileInfo {
+  AppEngineFileInfo() : exists(false), is_dir(false), size(0), mtime(0) {}
+  bool exists;
+  bool is_dir;
+  size_t size;
+  time_t mtime;
+  // Opaque server version of the contents; changes on every write.
+  std::string version;
+};
+
+// Byte counters for the response bodies received by AppEnginePost.
+struct AppEngineTransferStats {
+  AppEngineTransferStats()
+    : bytes_downloaded(0), bytes_copied(0), bytes_uploaded(0) {}
+  // Response body bytes received from the server.
+  int64_t bytes_downloaded;
+  // Body bytes that had to be copied out of the read buffer because the
+  // response did not say how long it was.
+  int64_t bytes_copied;
+  // Request body bytes sent to the server.
+  int64_t bytes_uploaded;
+};
+
+// Told about the progress of a response body that is read straight into
+// its destination.
+class AppEngineReadListener {
+ public:
+  virtual ~AppEngineReadListener() {}
+  // Called on the main thread each time more of the body has arrived.
+  // The destination already has its final size, total, and its first
+  // available bytes are valid.  They are not written to again.
+  virtual void OnProgress(size_t available, size_t total) = 0;
+};
+
+// One file of an AppEngineUrlRequest::WriteBatch() call.
+struct AppEngineWrite {
+  AppEngineWrite() : data(NULL), result(-1) {}
+  std::string path;
+  const std::vector<char>* data;
+  // 0 once the contents are stored, -1 if they could not be.
+  int result;
+  // The version the server assigned to the contents.
+  std::string version;
+};
+
+// One file of an AppEngineUrlRequest::ReadBatch() call.
+struct AppEngineRead {
+  AppEngineRead() : size(0), result(-1) {}
+  std::string path;
+  // The expected size of the file, used to share out the requests.
+  size_t size;
+  // 0 once data holds the contents, -1 if they could not be read.
+  int result;
+  std::vector<char> data;
+  // The version of the contents.
+  std::string version;
+};
+
+// One file of an AppEngineUrlRequest::ListStat() page.
+struct AppEngineListEntry {
+  std::string path;
+  // info.exists is false if the server sent the name alone.
+  AppEngineFileInfo info;
+};
 
 typedef std::pair< std::string, const std::vector<char>* > KeyValue;
 typedef std::list<KeyValue> KeyValueList;
 
+// Counters for the AppEnginePost free list.
+struct AppEnginePostPoolStats {
+  AppEnginePostPoolStats() : created(0), reused(0) {}
+  // Posts allocated, and posts taken from the free list instead.
+  int64_t created;
+  int64_t reused;
+};
+
 class AppEnginePost : public MainThreadJob {
  public:
-  AppEnginePost(const std::string& url, const KeyValueList& fields,
-	        std::vector<char>* dst) :
-    url_(url),
-    fields_(&fields),
-    dst_(dst),
-    did_open_(false) {
-    }
+  // New() returns a post from the free list, or a new one if it is
+  // empty.  A post puts itself back once it has reported its result, so
+  // a small request allocates neither the post nor its read buffer.
+  static AppEnginePost *New(const std::string& url,
+                            const KeyValueList& fields,
+                            std::vector<char>* dst);
+  static AppEnginePostPoolStats pool_stats(void);
 
-  ~AppEnginePost() {
-    fprintf(stderr, "In Post destructor\n");
-    delete loader_;
-    delete factory_;
+  AppEnginePost(const std::string& url, const KeyValueList& fields,
+                std::vector<char>* dst)
+    : factory_(this) {
+    Reset(url, fields, dst);
   }
-    
+
   void Run(MainThreadJobEntry* e);
-  
+  void Abort(MainThreadJobEntry* e);
+
   void TestOutput(void) { fprintf(stderr, "inside TestOutput\n"); }
   bool did_open(void) { return did_open_; }
-  
+
+  // If set, the raw response headers are stored in *headers_dst.
+  void set_headers_dst(std::string *headers_dst) { headers_dst_ = headers_dst; }
+
+  // If set, the first byte of the body is stored in *status_dst instead
+  // of dst, for replies that start with a status character.
+  void set_status_dst(char *status_dst) { status_dst_ = status_dst; }
+
+  // If set, transfer counters are added to *stats.
+  void set_stats(AppEngineTransferStats *stats) { stats_ = stats; }
+
+  // If set, listener is told whenever more of a body whose length is
+  // known has arrived.  Bodies of unknown length are not reported.
+  void set_listener(AppEngineReadListener *listener) { listener_ = listener; }
+
+  // If set, a response whose header size_header gives a larger size
+  // than its body makes dst that large, so that the rest of the file
+  // can later be read into place without moving this part.  With
+  // set_status_dst(), only a status byte of '1' does.
+  void set_size_header(const char *size_header) {
+    size_header_ = size_header;
+  }
+
+  // Largest number of bytes requested from the loader at a time.
+  void set_read_size(size_t read_size) { read_size_ = read_size; }
+
+  // If set, the body goes to the size bytes at window instead of dst,
+  // and must be exactly that long.  Posts with windows into the same
+  // buffer can run side by side.
+  void set_window(char *window, size_t size) {
+    window_ = window;
+    window_size_ = size;
+  }
+
+  static const size_t kDefaultReadSize = 256 * 1024;
+  // Number of idle posts kept on the free list.
+  static const int kMaxPooled = 16;
+
  private:
+  // Where the next ReadResponseBody() call puts its bytes.
+  enum ReadMode {
+    kReadStatus,
+    // Straight into dst, which was sized from Content-Length, or into
+    // the window.
+    kReadDirect,
+    // Into buf_, to be appended to dst by ProcessBytes().
+    kReadBuffered
+  };
+
+  // Where the body byte at received_ goes.
+  char *Target(void);
+
   pp::URLRequestInfo MakeRequest(const std::string& url, const KeyValueList& fields);
+  // Set up every field for a new request.
+  void Reset(const std::string& url, const KeyValueList& fields,
+             std::vector<char>* dst);
+  // Report result to the runner, then go back on the free list.
+  void Finish(int32_t result);
   void OnOpen(int32_t result);
   void OnRead(int32_t result);
   void ReadMore();
@@ -56,31 +189,214 @@ class AppEnginePost : public MainThreadJob {
     
   void ProcessBytes(const char* bytes, int32_t length);
     
-  pp::CompletionCallbackFactory<AppEnginePost> *factory_;
-  pp::URLLoader *loader_;
+  pp::CompletionCallbackFactory<AppEnginePost> factory_;
+  pp::URLLoader loader_;
   MainThreadJobEntry *job_entry_;
   const KeyValueList* fields_;
   std::string url_;
   std::vector<char>* dst_;
-  char buf_[4096];
+  char* window_;
+  size_t window_size_;
+  const char* size_header_;
+  std::string* headers_dst_;
+  char* status_dst_;
+  AppEngineTransferStats* stats_;
+  AppEngineReadListener* listener_;
+  int32_t status_code_;
+  size_t read_size_;
+  // Size of dst when the request started.
+  size_t base_;
+  // Size dst was given for the whole file, beyond base_, or 0.
+  size_t extent_;
+  // Body bytes announced by Content-Length, not counting the status
+  // byte, or -1 if unknown.
+  int64_t expected_;
+  // Body bytes stored in dst, or the window, so far.
+  size_t received_;
+  ReadMode mode_;
+  std::vector<char> buf_;
+  // Target of the read that confirms the end of a Content-Length body.
+  char probe_;
   bool did_open_;
+  // Cleared when the body was shorter than its Content-Length.
+  bool ok_;
+  // Link on the free list.
+  AppEnginePost *next_free_;
+
+  // Guards free_list_, pooled_ and pool_stats_.
+  static pthread_mutex_t pool_lock_;
+  static AppEnginePost *free_list_;
+  static int pooled_;
+  static AppEnginePostPoolStats pool_stats_;
 };
 
 class AppEngineUrlRequest {
  public:
   AppEngineUrlRequest(MainThreadRunner *runner, const std::string& base_url)
     : runner_(runner),
-    base_url_(base_url) {
+    base_url_(base_url),
+    read_size_(AppEnginePost::kDefaultReadSize),
+    chunk_size_(kDefaultChunkSize),
+    concurrency_(kDefaultConcurrency) {
     }
   
-  int Read(const std::string& path, std::vector<char>& dst);
-  int Write(const std::string& path, const std::vector<char>& data);
-  int List(const std::string& path, std::vector<char>& dst);
+  // Read() fetches the contents of path into dst.  If if_version is not
+  // empty and the server still has that version, nothing is transferred
+  // and kNotModified is returned.  When version is given it receives the
+  // version of the returned contents.  When listener is given it is told
+  // as the contents arrive in dst, so that they can be used before the
+  // transfer completes.  A read no one waits for yet should pass
+  // MainThreadRunner::kPrefetch as priority.
+  int Read(const std::string& path, std::vector<char>& dst,
+           const std::string& if_version = "", std::string* version = NULL,
+           AppEngineReadListener* listener = NULL,
+           MainThreadRunner::Priority priority =
+               MainThreadRunner::kInteractive);
+  static const int kNotModified = 1;
+  // ReadAsync() is Read() without waiting: it returns at once, and
+  // callback(arg, result) follows on the main thread with the result
+  // Read() would have returned, or right away if the request cannot be
+  // queued.  The file comes in a single request however large it is.
+  // dst, version and listener have to stay valid until then.
+  typedef void (*ReadCallback)(void *arg, int result);
+  void ReadAsync(const std::string& path, std::vector<char>* dst,
+                 std::string* version, AppEngineReadListener* listener,
+                 MainThreadRunner::Priority priority,
+                 ReadCallback callback, void* arg);
+  // Stat() fetches the attributes of path without its contents.  It
+  // returns 0 when the server answered, in which case info->exists tells
+  // whether the path is there, and -1 on failure.
+  int Stat(const std::string& path, AppEngineFileInfo *info);
+  // StatAsync() is Stat() without waiting, with callback(arg, result)
+  // following as for ReadAsync().  info has to stay valid until then.
+  void StatAsync(const std::string& path, AppEngineFileInfo *info,
+                 ReadCallback callback, void* arg);
+  // Write() stores data as the contents of path.  When version is given
+  // it receives the version the server assigned to them.
+  int Write(const std::string& path, const std::vector<char>& data,
+            std::string* version = NULL);
+  // WriteDelta() stores data as the contents of path by sending only
+  // what differs from the version base describes.  It fails, and the
+  // caller should fall back to Write(), if the server no longer has
+  // that version or the delta would not be much smaller than data.
+  // delta_size, if not NULL, receives the size of the delta sent.
+  int WriteDelta(const std::string& path, const AppEngineSignature& base,
+                 const std::vector<char>& data, std::string* version = NULL,
+                 size_t* delta_size = NULL);
+  // WriteBatch() stores several files with as few requests as possible:
+  // small files share write_batch requests of up to the chunk size,
+  // which go out concurrently, and larger ones are written on their
+  // own.  Each write gets its own result; the return value is 0 if all
+  // of them succeeded and -1 otherwise.
+  int WriteBatch(std::vector<AppEngineWrite>* writes);
+  // ReadBatch() fetches several small files in read_batch requests of up
+  // to the chunk size, going by their expected sizes, which go out
+  // concurrently.  Each read gets its own result; the return value is
+  // 0 if all of them succeeded and -1 otherwise.
+  int ReadBatch(std::vector<AppEngineRead>* reads,
+                MainThreadRunner::Priority priority =
+                    MainThreadRunner::kInteractive);
+  // List() fetches a page of at most kListPageSize of the names under
+  // path, one per line, into dst.  The first page is asked for with an
+  // empty cursor; *next_cursor receives the cursor of the page after
+  // this one, or is cleared after the last page.  Returns 0 on success.
+  int List(const std::string& path, const std::string& cursor,
+           std::vector<char>& dst, std::string* next_cursor);
+  // ListAsync() is List() without waiting, with callback(arg, result)
+  // following as for ReadAsync().  dst and next_cursor have to stay
+  // valid until then.
+  void ListAsync(const std::string& path, const std::string& cursor,
+                 std::vector<char>* dst, std::string* next_cursor,
+                 MainThreadRunner::Priority priority,
+                 ReadCallback callback, void* arg);
+  // ListStat() is List() with the attributes of each file as stat gives
+  // them, appended to entries, so that a directory and what is in it
+  // take one request per page.
+  int ListStat(const std::string& path, const std::string& cursor,
+               std::vector<AppEngineListEntry>* entries,
+               std::string* next_cursor);
+  static const size_t kListPageSize = 256;
   int Remove(const std::string& path);
 
+  // Set the size of the reads issued on response bodies.  Larger reads
+  // mean fewer callbacks on the main thread for big files.
+  void set_read_size(size_t read_size) { read_size_ = read_size; }
+
+  // Files larger than chunk_size are transferred in chunk_size pieces,
+  // concurrency of them at a time.  A piece that fails is retried from
+  // where it stopped, up to kChunkRetries times.  Uploaded pieces are
+  // staged by the server and replace the file together once all are
+  // in.  A chunk_size of 0 moves every file in a single request.
+  void set_chunking(size_t chunk_size, int concurrency) {
+    chunk_size_ = chunk_size;
+    concurrency_ = concurrency > 0 ? concurrency : 1;
+  }
+
+  size_t chunk_size(void) const { return chunk_size_; }
+
+  static const size_t kDefaultChunkSize = 4 * 1024 * 1024;
+  static const int kDefaultConcurrency = 4;
+  static const int kChunkRetries = 3;
+
+  // transfer_stats() returns the body byte counters.  They are updated on
+  // the main thread, so they are exact only between requests.
+  AppEngineTransferStats transfer_stats(void) { return transfer_stats_; }
+
+  // Cancel() makes the requests this object is waiting for fail now,
+  // with errno ECANCELED.  Pieces of chunked transfers are not retried
+  // then.  How long any one request may take is up to the runner's job
+  // timeout.
+  void Cancel(void) { runner_->Cancel(this); }
+
+  // compressor() decides which uploads go out deflated; it is off until
+  // given a level.  While it is on, reads also ask for compressed
+  // replies, which the browser inflates before they reach the module.
+  AppEngineCompressor *compressor(void) { return &compressor_; }
+
   private:
+    AppEnginePost *NewPost(const std::string& method,
+                           const KeyValueList& fields,
+                           std::vector<char>* dst);
+
+    class ChunkProgress;
+    struct AsyncRead;
+    static void AsyncReadDone(void *p, int32_t result, int error);
+    struct AsyncStat;
+    static void AsyncStatDone(void *p, int32_t result, int error);
+    struct AsyncList;
+    static void AsyncListDone(void *p, int32_t result, int error);
+    // Start a list request for the page of path after cursor, asking
+    // for the attributes of each file along with its name if with_stat.
+    AppEnginePost *NewListPost(AsyncList *list, const std::string& path,
+                               const std::string& cursor, bool with_stat,
+                               std::vector<char>* dst);
+    // Parse the reply to a stat request into *info.  Returns 0 on
+    // success.
+    static int ParseStat(const std::vector<char>& reply,
+                         AppEngineFileInfo *info);
+
+    // Fetch the rest of a file whose first piece Read() got.  dst
+    // already has the file's size.
+    int ReadChunks(const std::string& path, std::vector<char>& dst,
+                   const std::string& version, ChunkProgress *progress);
+    int WriteChunks(const std::string& path, const std::vector<char>& data,
+                    std::string* version);
+    // Add the field name with value to fields, deflated into packed if
+    // that makes it smaller, in which case a name_encoding field tells
+    // the server.  packed has to live as long as fields.
+    void AddDataField(KeyValueList *fields, const std::string& name,
+                      const std::vector<char>* value,
+                      std::vector<char>* packed);
+    // Ask for a compressed reply, if compression is on.
+    void AcceptEncoding(KeyValueList *fields);
+
     MainThreadRunner *runner_;
     std::string base_url_;
+    size_t read_size_;
+    size_t chunk_size_;
+    int concurrency_;
+    AppEngineTransferStats transfer_stats_;
+    AppEngineCompressor compressor_;
 };
 
 #endif  // PACKAGES_SCRIPTS_FILESYS_APPENGINE_APPENGINEURLLOADER_H_
@@ -1,9 +1,12 @@
+import calendar
 import cgi
 import datetime
 import urllib
 import wsgiref.handlers
 import os
 import logging
+import struct
+import zlib
 
 from google.appengine.ext import db
 from google.appengine.api import users
@@ -12,10 +15,28 @@ from google.appengine.ext.webapp.util import run_wsgi_app
 from google.appengine.ext.webapp import template
 from google.appengine.ext.db import Key
 
+# Names sent in one list page when the client does not say, and at most.
+LIST_PAGE_SIZE = 100
+MAX_LIST_PAGE_SIZE = 1000
+
 class File(db.Model):
   owner = db.UserProperty()
   filename = db.StringProperty()
   data = db.BlobProperty()
+  # Kept next to the blob so that stat does not have to load it.
+  size = db.IntegerProperty()
+  mtime = db.DateTimeProperty(auto_now=True)
+  # Bumped on every write; clients use it to revalidate cached contents.
+  version = db.IntegerProperty(default=0)
+
+
+class Chunk(db.Model):
+  # One staged piece of a chunked upload, until commit assembles them.
+  owner = db.UserProperty()
+  filename = db.StringProperty()
+  upload = db.StringProperty()
+  offset = db.IntegerProperty()
+  data = db.BlobProperty()
 
 
 class MainPage(webapp.RequestHandler):
@@ -41,6 +62,51 @@ def FileKey(owner, filename):
   return Key.from_path('File', ('%s_%s') % (u_id, filename))
 
 
+def FileAttributes(f):
+  # What stat says of a file: '1 <size> <mtime> <version>'.
+  size = f.size
+  if size is None:
+    size = len(f.data or '')
+  mtime = 0
+  if f.mtime:
+    mtime = calendar.timegm(f.mtime.utctimetuple())
+  return '1 %d %d %d' % (size, mtime, f.version or 0)
+
+
+def Field(request, name):
+  # Uploaded contents may arrive deflated, as a name_encoding field says.
+  # Replies are left to App Engine's own gzip support.
+  value = request.get(name)
+  if request.get(name + '_encoding') == 'deflate':
+    value = zlib.decompress(value)
+  return value
+
+
+def ApplyDelta(base, block_size, delta):
+  # See AppEngineDelta.h for the format.  Returns None if the delta does
+  # not fit base.
+  out = []
+  pos = 0
+  while pos < len(delta):
+    op = delta[pos]
+    if op == 'C' and pos + 9 <= len(delta):
+      first, count = struct.unpack('>II', delta[pos + 1:pos + 9])
+      start = first * block_size
+      if block_size <= 0 or start + count * block_size > len(base):
+        return None
+      out.append(base[start:start + count * block_size])
+      pos += 9
+    elif op == 'L' and pos + 5 <= len(delta):
+      length, = struct.unpack('>I', delta[pos + 1:pos + 5])
+      if pos + 5 + length > len(delta):
+        return None
+      out.append(delta[pos + 5:pos + 5 + length])
+      pos += 5 + length
+    else:
+      return None
+  return ''.join(out)
+
+
 class FileHandlingPage(webapp.RequestHandler):
   def post(self):
     # The user must be logged in.
@@ -69,45 +135,211 @@ class FileHandlingPage(webapp.RequestHandler):
       k = FileKey(user, filename)
       f = File.get(k)
       if f:
+        # '2' tells the client that its cached copy is still current.
+        version = str(f.version or 0)
+        data = f.data or ''
+        self.response.headers['X-File-Version'] = version
+        self.response.headers['X-File-Size'] = str(len(data))
+        if self.request.get('version') == version:
+          self.response.out.write('2')
+          return
         self.response.out.write('1')
-        self.response.out.write(f.data)
+        # Large files are read in pieces of length bytes from offset.
+        offset = int(self.request.get('offset') or 0)
+        length = self.request.get('length')
+        if length:
+          data = data[offset:offset + int(length)]
+        elif offset:
+          data = data[offset:]
+        self.response.out.write(data)
       else:
         self.response.out.write('0')
 
     elif method == 'write':
-      self.response.out.write('1')
-      return
+      # Replies '1' and the new version in X-File-Version, or '0'.
       filename = self.request.get('filename')
-      data = self.request.get('data')
       if not filename:
-        filename = '/test.txt'
-      #assert filename
-      if not data:
-        data = '111222333'
-      #assert data
+        self.response.out.write('0')
+        return
+      data = Field(self.request, 'data')
       def create_or_update(filename, data, owner=None):
         k = FileKey(user, filename)
         f = File.get(k)
         if not f:
           logging.info('Creating file: ' + filename)
-          f = File()
+          f = File(key=k)
           f.owner = owner
           f.filename = filename
-        f.data = data
+        f.data = db.Blob(data)
+        f.size = len(data)
+        f.version = (f.version or 0) + 1
         f.put()
-      db.run_in_transaction(create_or_update, filename, data)
+        return f.version
+      try:
+        version = db.run_in_transaction(create_or_update, filename, data,
+                                        user)
+      except db.Error:
+        self.response.out.write('0')
+        return
+      self.response.headers['X-File-Version'] = str(version)
+      self.response.out.write('1')
 
+    elif method == 'write_batch':
+      # Files filename0/data0 ... from a group of fsyncs; a reply line
+      # per file gives '1 <version>' or '0'.
+      for i in range(int(self.request.get('count') or 0)):
+        filename = self.request.get('filename%d' % i)
+        if not filename:
+          self.response.out.write('0\n')
+          continue
+        data = Field(self.request, 'data%d' % i)
+        def store(filename, data, owner=None):
+          k = FileKey(user, filename)
+          f = File.get(k)
+          if not f:
+            f = File(key=k)
+            f.owner = owner
+            f.filename = filename
+          f.data = db.Blob(data)
+          f.size = len(data)
+          f.version = (f.version or 0) + 1
+          f.put()
+          return f.version
+        try:
+          version = db.run_in_transaction(store, filename, data, user)
+          self.response.out.write('1 %d\n' % version)
+        except db.Error:
+          self.response.out.write('0\n')
+
+    elif method == 'read_batch':
+      # Files filename0 ... for a batch of reads, each as
+      # '1 <version> <size>\n' and its contents, or '0\n'.
+      for i in range(int(self.request.get('count') or 0)):
+        filename = self.request.get('filename%d' % i)
+        f = filename and File.get(FileKey(user, filename))
+        if not f:
+          self.response.out.write('0\n')
+          continue
+        data = f.data or ''
+        self.response.out.write('1 %d %d\n' % (f.version or 0, len(data)))
+        self.response.out.write(data)
+
+    elif method == 'write_delta':
+      # Rebuild a modified file from the blocks of version base and the
+      # new bytes in delta.  '2' means base is no longer current.
+      filename = self.request.get('filename')
+      base = self.request.get('base')
+      block_size = int(self.request.get('block_size') or 0)
+      delta = Field(self.request, 'delta')
+      def patch(filename, owner=None):
+        f = File.get(FileKey(user, filename))
+        if not f or str(f.version or 0) != base:
+          return '2'
+        data = ApplyDelta(f.data or '', block_size, delta)
+        if (data is None or len(data) != int(self.request.get('size') or 0) or
+            zlib.crc32(data) & 0xffffffff != int(self.request.get('crc') or 0)):
+          return '0'
+        f.data = db.Blob(data)
+        f.size = len(data)
+        f.version = (f.version or 0) + 1
+        f.put()
+        self.response.headers['X-File-Version'] = str(f.version)
+        return '1'
+      self.response.out.write(db.run_in_transaction(patch, filename, user))
+
+    elif method == 'write_chunk':
+      chunk = Chunk()
+      chunk.owner = user
+      chunk.filename = self.request.get('filename')
+      chunk.upload = self.request.get('upload')
+      chunk.offset = int(self.request.get('offset') or 0)
+      chunk.data = db.Blob(Field(self.request, 'data'))
+      chunk.put()
+      self.response.out.write('1')
+
+    elif method == 'commit':
+      # Put the staged pieces of an upload in place as one new version.
+      filename = self.request.get('filename')
+      q = Chunk.all()
+      q.filter('owner =', user)
+      q.filter('filename =', filename)
+      q.filter('upload =', self.request.get('upload'))
+      chunks = sorted(q.fetch(limit=1000), key=lambda c: c.offset)
+      if self.request.get('abort'):
+        db.delete(chunks)
+        self.response.out.write('1')
+        return
+      pos = 0
+      for c in chunks:
+        if c.offset != pos:
+          break
+        pos += len(c.data)
+      if pos != int(self.request.get('size') or 0):
+        db.delete(chunks)
+        self.response.out.write('0')
+        return
+      data = ''.join(c.data for c in chunks)
+      def commit(filename, data, owner=None):
+        k = FileKey(user, filename)
+        f = File.get(k)
+        if not f:
+          f = File(key=k)
+          f.owner = owner
+          f.filename = filename
+        f.data = db.Blob(data)
+        f.size = len(data)
+        f.version = (f.version or 0) + 1
+        f.put()
+        return f.version
+      version = db.run_in_transaction(commit, filename, data, user)
+      db.delete(chunks)
+      self.response.headers['X-File-Version'] = str(version)
+      self.response.out.write('1')
+
+    elif method == 'stat':
+      # Attributes only: '1 <size> <mtime> <version>' for a file, '2' for a
+      # directory (a prefix of other files) and '0' if nothing is there.
+      filename = self.request.get('filename')
+      assert filename
+      f = File.get(FileKey(user, filename))
+      if f:
+        self.response.out.write(FileAttributes(f))
+      else:
+        prefix = filename.rstrip('/') + '/'
+        q = File.all(keys_only=True)
+        q.filter('owner =', user)
+        q.filter('filename >', prefix)
+        q.filter('filename <', prefix + u'\uffff')
+        if q.get():
+          self.response.out.write('2')
+        else:
+          self.response.out.write('0')
 
     elif method == 'list':
       prefix = self.request.get('prefix')
       assert prefix
+      # One page of names at a time; X-List-Cursor tells the client where
+      # the next one starts, and is left out after the last page.
+      limit = min(int(self.request.get('limit') or LIST_PAGE_SIZE),
+                  MAX_LIST_PAGE_SIZE)
       q = File.all()
       q.filter('owner =', user)
       q.filter('filename >', prefix)
       q.filter('filename <', prefix + '\uffff')
-      results = q.fetch(limit=100)
+      cursor = self.request.get('cursor')
+      if cursor:
+        q.with_cursor(cursor)
+      results = q.fetch(limit=limit)
+      if len(results) == limit:
+        self.response.headers['X-List-Cursor'] = str(q.cursor())
+      # With stat=1 each name is followed by a tab and what stat says of
+      # it, so that a directory and its attributes take one request.
+      with_stat = self.request.get('stat') == '1'
       for r in results:
-        self.response.out.write('%s\n' % r.filename)
+        if with_stat:
+          self.response.out.write('%s\t%s\n' % (r.filename, FileAttributes(r)))
+        else:
+          self.response.out.write('%s\n' % r.filename)
 
     elif method == 'remove':
       filename = self.request.get('filename')
@@ -0,0 +1,511 @@
+#!/usr/bin/env python
+# Copyright (c) 2011 The Native Client Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+
+"""Local stand-in for the naclmounts App Engine file service.
+
+Speaks the same /_file/* protocol as simple.py (multipart POSTs to
+read, stat, write, list and remove) but keeps files in memory, so that
+AppEngineMount can be exercised without a live App Engine backend.
+Every request can be slowed down or failed on purpose:
+
+  --latency-ms     added round trip time per request
+  --jitter-ms      uniform random jitter added on top of the latency
+  --bandwidth-kbps throughput cap applied to request and response bodies
+  --fail-rate      probability of answering with HTTP 500
+  --drop-rate      probability of cutting the response body short
+
+The same knobs can be changed while the server runs by requesting
+/_standin/config?latency_ms=20&fail_rate=0.01 (GET or POST), which is
+what benchmark.html does between workloads.  /_standin/stats returns
+request and byte counters, and /_standin/reset clears files and counters.
+
+Every write gives the file a new version, returned in the X-File-Version
+header of read and write replies and by stat.  A read that sends the
+current version as its 'version' field gets '2' instead of the contents.
+
+write_batch stores several small files in one request, which is how
+AppEngineMount commits a group of fsyncs, and read_batch returns several
+for a batch of KernelProxy calls.  Large files move in pieces:
+reads may ask for 'length' bytes from 'offset' (the X-File-Size header
+gives the whole size), and uploads send write_chunk requests staged
+under an 'upload' id, which commit then puts in place as one new
+version.  write_delta rebuilds a modified file from the blocks of the
+version named by 'base' and the new bytes in 'delta'.
+
+Any field may arrive deflated, which a '<name>_encoding: deflate' field
+says, and a request with 'accept_encoding: gzip' gets a gzip reply when
+that makes it smaller and the browser accepts it.
+
+Static content (the .nexe, .nmf and html pages) is served from the
+directory this script lives in, so pointing a browser at
+http://localhost:8080/benchmark.html is enough to run the benchmarks.
+"""
+
+import optparse
+import os
+import random
+import re
+import struct
+import sys
+import threading
+import time
+import zlib
+
+try:
+  from http.server import BaseHTTPRequestHandler, HTTPServer
+  from socketserver import ThreadingMixIn
+  from urllib.parse import urlparse, parse_qs
+except ImportError:
+  from BaseHTTPServer import BaseHTTPRequestHandler, HTTPServer
+  from SocketServer import ThreadingMixIn
+  from urlparse import urlparse, parse_qs
+
+
+STATIC_DIR = os.path.dirname(os.path.abspath(__file__))
+CONTENT_TYPES = {
+  '.html': 'text/html',
+  '.js': 'text/javascript',
+  '.nmf': 'application/json',
+  '.nexe': 'application/octet-stream',
+}
+
+
+class Config(object):
+  """Injection settings, shared by all handler threads."""
+
+  FIELDS = (('latency_ms', float), ('jitter_ms', float),
+            ('bandwidth_kbps', float), ('fail_rate', float),
+            ('drop_rate', float))
+
+  def __init__(self, options):
+    self.lock = threading.Lock()
+    for name, _ in self.FIELDS:
+      setattr(self, name, getattr(options, name))
+
+  def Update(self, query):
+    with self.lock:
+      for name, kind in self.FIELDS:
+        if name in query:
+          setattr(self, name, kind(query[name][0]))
+
+  def Describe(self):
+    with self.lock:
+      return ' '.join('%s=%g' % (name, getattr(self, name))
+                      for name, _ in self.FIELDS)
+
+
+class Store(object):
+  """In-memory file table plus request counters."""
+
+  def __init__(self):
+    self.lock = threading.Lock()
+    self.Reset()
+
+  def Reset(self):
+    with self.lock:
+      self.files = {}
+      # Staged upload pieces: {(filename, upload): {offset: data}}.
+      self.uploads = {}
+      self.stats = {}
+      self.last_version = 0
+
+  def NextVersion(self):
+    """Returns a new file version.  Called with lock held."""
+    self.last_version += 1
+    return self.last_version
+
+  def Count(self, name, amount=1):
+    with self.lock:
+      self.stats[name] = self.stats.get(name, 0) + amount
+
+  def Describe(self):
+    with self.lock:
+      return ''.join('%s=%d\n' % kv for kv in sorted(self.stats.items()))
+
+
+def ApplyDelta(base, block_size, delta):
+  """Rebuilds a file from an AppEngineDelta, or returns None."""
+  out = []
+  pos = 0
+  while pos < len(delta):
+    op = delta[pos:pos + 1]
+    if op == b'C' and pos + 9 <= len(delta):
+      first, count = struct.unpack('>II', delta[pos + 1:pos + 9])
+      start = first * block_size
+      if block_size <= 0 or start + count * block_size > len(base):
+        return None
+      out.append(base[start:start + count * block_size])
+      pos += 9
+    elif op == b'L' and pos + 5 <= len(delta):
+      length, = struct.unpack('>I', delta[pos + 1:pos + 5])
+      if pos + 5 + length > len(delta):
+        return None
+      out.append(delta[pos + 5:pos + 5 + length])
+      pos += 5 + length
+    else:
+      return None
+  return b''.join(out)
+
+
+def FileAttributes(entry):
+  """What stat says of a stored file: '1 <size> <mtime> <version>'."""
+  return ('1 %d %d %d' % (len(entry[0]), entry[1], entry[2])).encode('ascii')
+
+
+def DecodeFields(fields):
+  """Inflates the fields that came with a <name>_encoding field."""
+  for name in [n for n in fields
+               if n.endswith('_encoding') and n != 'accept_encoding']:
+    encoding = fields.pop(name)
+    value = name[:-len('_encoding')]
+    if encoding != b'deflate' or value not in fields:
+      return None
+    try:
+      fields[value] = zlib.decompress(fields[value])
+    except zlib.error:
+      return None
+  return fields
+
+
+def GzipReply(body):
+  """Returns body gzipped, or None if that does not make it smaller."""
+  if len(body) < 1024:
+    return None
+  compressor = zlib.compressobj(1, zlib.DEFLATED, 31)
+  packed = compressor.compress(body) + compressor.flush()
+  return packed if len(packed) <= len(body) * 7 // 8 else None
+
+
+def ParseMultipart(body, content_type):
+  """Splits a multipart/form-data body into a {name: bytes} dict."""
+  match = re.search(r'boundary=([^\s;]+)', content_type or '')
+  if not match:
+    return {}
+  delimiter = b'--' + match.group(1).encode('ascii')
+  fields = {}
+  for part in body.split(delimiter)[1:]:
+    if part.startswith(b'--'):
+      break
+    if part.startswith(b'\r\n'):
+      part = part[2:]
+    headers, _, value = part.partition(b'\r\n\r\n')
+    name = re.search(br'name="([^"]*)"', headers)
+    if not name:
+      continue
+    if value.endswith(b'\r\n'):
+      value = value[:-2]
+    fields[name.group(1).decode('utf-8')] = value
+  return fields
+
+
+class StandInHandler(BaseHTTPRequestHandler):
+  protocol_version = 'HTTP/1.1'
+
+  def log_message(self, format, *args):
+    if self.server.verbose:
+      BaseHTTPRequestHandler.log_message(self, format, *args)
+
+  # Injection helpers.
+
+  def Throttle(self, nbytes):
+    kbps = self.server.config.bandwidth_kbps
+    if kbps > 0 and nbytes > 0:
+      time.sleep(nbytes * 8 / (kbps * 1000.0))
+
+  def Delay(self):
+    config = self.server.config
+    delay = config.latency_ms
+    if config.jitter_ms > 0:
+      delay += random.uniform(0, config.jitter_ms)
+    if delay > 0:
+      time.sleep(delay / 1000.0)
+
+  def Reply(self, code, body, content_type='application/octet-stream',
+            headers=()):
+    config = self.server.config
+    if code == 200 and random.random() < config.fail_rate:
+      self.server.store.Count('injected_failures')
+      code, body, headers = 500, b'injected failure', ()
+    self.send_response(code)
+    self.send_header('Content-Type', content_type)
+    self.send_header('Content-Length', str(len(body)))
+    for name, value in headers:
+      self.send_header(name, value)
+    self.end_headers()
+    if code == 200 and random.random() < config.drop_rate:
+      self.server.store.Count('injected_drops')
+      body = body[:len(body) // 2]
+      self.close_connection = True
+    # Write in slices so that the bandwidth cap shapes the transfer
+    # instead of adding one long pause at the end.
+    for pos in range(0, len(body), 65536):
+      chunk = body[pos:pos + 65536]
+      self.Throttle(len(chunk))
+      self.wfile.write(chunk)
+    self.server.store.Count('bytes_out', len(body))
+
+  # HTTP entry points.
+
+  def do_GET(self):
+    url = urlparse(self.path)
+    if url.path.startswith('/_standin/'):
+      self.HandleControl(url)
+      return
+    path = url.path.lstrip('/') or 'hello_world.html'
+    full = os.path.normpath(os.path.join(STATIC_DIR, path))
+    if not full.startswith(STATIC_DIR) or not os.path.isfile(full):
+      self.Reply(404, b'not found', 'text/plain')
+      return
+    with open(full, 'rb') as f:
+      data = f.read()
+    ext = os.path.splitext(full)[1]
+    self.send_response(200)
+    self.send_header('Content-Type', CONTENT_TYPES.get(ext, 'text/plain'))
+    self.send_header('Content-Length', str(len(data)))
+    self.end_headers()
+    self.wfile.write(data)
+
+  def do_POST(self):
+    url = urlparse(self.path)
+    length = int(self.headers.get('Content-Length') or 0)
+    body = self.rfile.read(length)
+    if url.path.startswith('/_standin/'):
+      self.HandleControl(url, body)
+      return
+    if not url.path.startswith('/_file/'):
+      self.Reply(404, b'not found', 'text/plain')
+      return
+    store = self.server.store
+    store.Count('requests')
+    store.Count('bytes_in', len(body))
+    self.Delay()
+    self.Throttle(len(body))
+    fields = DecodeFields(ParseMultipart(body,
+                                         self.headers.get('Content-Type')))
+    if fields is None:
+      self.Reply(400, b'bad encoding', 'text/plain')
+      return
+    method = url.path.rsplit('/', 1)[1]
+    handler = getattr(self, 'File_' + method, None)
+    if handler is None:
+      self.Reply(400, b'unknown method', 'text/plain')
+      return
+    store.Count('requests_' + method)
+    self.reply_headers = []
+    reply = handler(fields)
+    if (fields.get('accept_encoding') == b'gzip' and
+        'gzip' in self.headers.get('Accept-Encoding', '')):
+      packed = GzipReply(reply)
+      if packed is not None:
+        store.Count('gzip_replies')
+        store.Count('gzip_bytes_saved', len(reply) - len(packed))
+        reply = packed
+        self.reply_headers.append(('Content-Encoding', 'gzip'))
+    self.Reply(200, reply, headers=self.reply_headers)
+
+  def HandleControl(self, url, body=b''):
+    query = parse_qs(url.query)
+    query.update(parse_qs(body.decode('utf-8')))
+    command = url.path.rsplit('/', 1)[1]
+    if command == 'config':
+      self.server.config.Update(query)
+      text = self.server.config.Describe() + '\n'
+    elif command == 'stats':
+      text = self.server.store.Describe()
+    elif command == 'reset':
+      self.server.store.Reset()
+      text = 'ok\n'
+    else:
+      self.Reply(404, b'unknown control', 'text/plain')
+      return
+    self.Reply(200, text.encode('utf-8'), 'text/plain')
+
+  # /_file/* methods; each returns the response body and may add to
+  # self.reply_headers.
+
+  # Files are stored as (data, mtime, version) tuples.
+
+  def File_read(self, fields):
+    store = self.server.store
+    with store.lock:
+      entry = store.files.get(fields.get('filename', b''))
+    if entry is None:
+      return b'0'
+    version = str(entry[2])
+    self.reply_headers.append(('X-File-Version', version))
+    self.reply_headers.append(('X-File-Size', str(len(entry[0]))))
+    if fields.get('version', b'').decode('ascii', 'replace') == version:
+      store.Count('not_modified')
+      return b'2'
+    data = entry[0]
+    if 'offset' in fields or 'length' in fields:
+      offset = int(fields.get('offset') or 0)
+      length = int(fields.get('length') or len(data))
+      data = data[offset:offset + length]
+    return b'1' + data
+
+  def File_stat(self, fields):
+    filename = fields.get('filename', b'')
+    store = self.server.store
+    with store.lock:
+      entry = store.files.get(filename)
+      if entry is not None:
+        return FileAttributes(entry)
+      prefix = filename.rstrip(b'/') + b'/'
+      for name in store.files:
+        if name.startswith(prefix):
+          return b'2'
+    return b'0'
+
+  def File_write(self, fields):
+    store = self.server.store
+    with store.lock:
+      version = store.NextVersion()
+      store.files[fields.get('filename', b'')] = (fields.get('data', b''),
+                                                  int(time.time()), version)
+    self.reply_headers.append(('X-File-Version', str(version)))
+    return b'1'
+
+  def File_write_batch(self, fields):
+    # Stores files filename0/data0 ... in one go; a line per file says
+    # '1 <version>'.
+    store = self.server.store
+    lines = []
+    with store.lock:
+      for i in range(int(fields.get('count') or 0)):
+        filename = fields.get('filename%d' % i)
+        if filename is None:
+          lines.append(b'0\n')
+          continue
+        version = store.NextVersion()
+        store.files[filename] = (fields.get('data%d' % i, b''),
+                                 int(time.time()), version)
+        lines.append(('1 %d\n' % version).encode('ascii'))
+    store.Count('batched_writes', len(lines))
+    return b''.join(lines)
+
+  def File_read_batch(self, fields):
+    # Returns files filename0 ... in one go, each as '1 <version> <size>'
+    # and a newline followed by its contents, or as '0' and a newline.
+    store = self.server.store
+    parts = []
+    with store.lock:
+      for i in range(int(fields.get('count') or 0)):
+        entry = store.files.get(fields.get('filename%d' % i))
+        if entry is None:
+          parts.append(b'0\n')
+          continue
+        parts.append(('1 %d %d\n' % (entry[2], len(entry[0]))).encode('ascii'))
+        parts.append(entry[0])
+    store.Count('batched_reads', int(fields.get('count') or 0))
+    return b''.join(parts)
+
+  def File_write_delta(self, fields):
+    # Replies '2' if base is not the current version, '0' if the delta
+    # does not rebuild a file of the given size and crc.
+    filename = fields.get('filename', b'')
+    block_size = int(fields.get('block_size') or 0)
+    store = self.server.store
+    with store.lock:
+      entry = store.files.get(filename)
+      if entry is None or fields.get('base', b'') != str(entry[2]).encode():
+        return b'2'
+      data = ApplyDelta(entry[0], block_size, fields.get('delta', b''))
+      if (data is None or len(data) != int(fields.get('size') or 0) or
+          zlib.crc32(data) & 0xffffffff != int(fields.get('crc') or 0)):
+        return b'0'
+      version = store.NextVersion()
+      store.files[filename] = (data, int(time.time()), version)
+    store.Count('delta_writes')
+    self.reply_headers.append(('X-File-Version', str(version)))
+    return b'1'
+
+  def File_write_chunk(self, fields):
+    key = (fields.get('filename', b''), fields.get('upload', b''))
+    store = self.server.store
+    with store.lock:
+      pieces = store.uploads.setdefault(key, {})
+      pieces[int(fields.get('offset') or 0)] = fields.get('data', b'')
+    return b'1'
+
+  def File_commit(self, fields):
+    filename = fields.get('filename', b'')
+    store = self.server.store
+    with store.lock:
+      pieces = store.uploads.pop((filename, fields.get('upload', b'')), {})
+      if 'abort' in fields:
+        return b'1'
+      # The pieces have to cover the file exactly.
+      data = []
+      pos = 0
+      for offset in sorted(pieces):
+        if offset != pos:
+          return b'0'
+        data.append(pieces[offset])
+        pos += len(pieces[offset])
+      if pos != int(fields.get('size') or 0):
+        return b'0'
+      version = store.NextVersion()
+      store.files[filename] = (b''.join(data), int(time.time()), version)
+    self.reply_headers.append(('X-File-Version', str(version)))
+    return b'1'
+
+  def File_list(self, fields):
+    prefix = fields.get('prefix', b'')
+    store = self.server.store
+    with store.lock:
+      names = sorted(n for n in store.files if n.startswith(prefix))
+      # Pages as simple.py does, with the last name sent as the cursor.
+      limit = int(fields.get('limit') or 0)
+      cursor = fields.get('cursor')
+      if cursor:
+        names = [n for n in names if n > cursor]
+      if limit > 0 and len(names) > limit:
+        names = names[:limit]
+        self.reply_headers.append(('X-List-Cursor',
+                                   names[-1].decode('latin-1')))
+      if fields.get('stat') == b'1':
+        return b''.join(n + b'\t' + FileAttributes(store.files[n]) + b'\n'
+                        for n in names)
+    return b''.join(n + b'\n' for n in names)
+
+  def File_remove(self, fields):
+    store = self.server.store
+    with store.lock:
+      found = store.files.pop(fields.get('filename', b''), None)
+    return b'0' if found is None else b'1'
+
+
+class StandInServer(ThreadingMixIn, HTTPServer):
+  daemon_threads = True
+
+
+def main(argv):
+  parser = optparse.OptionParser()
+  parser.add_option('--port', type='int', default=8080)
+  parser.add_option('--latency-ms', dest='latency_ms', type='float',
+                    default=0.0)
+  parser.add_option('--jitter-ms', dest='jitter_ms', type='float',
+                    default=0.0)
+  parser.add_option('--bandwidth-kbps', dest='bandwidth_kbps', type='float',
+                    default=0.0, help='0 means unlimited')
+  parser.add_option('--fail-rate', dest='fail_rate', type='float',
+                    default=0.0)
+  parser.add_option('--drop-rate', dest='drop_rate', type='float',
+                    default=0.0)
+  parser.add_option('--verbose', action='store_true', default=False)
+  options, _ = parser.parse_args(argv)
+
+  server = StandInServer(('', options.port), StandInHandler)
+  server.config = Config(options)
+  server.store = Store()
+  server.verbose = options.verbose
+  sys.stderr.write('stand-in listening on port %d (%s)\n' %
+                   (options.port, server.config.Describe()))
+  server.serve_forever()
+
+
+if __name__ == '__main__':
+  main(sys.argv[1:])
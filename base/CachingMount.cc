@@ -0,0 +1,697 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that be
+ * found in the LICENSE file.
+ */
+#include "CachingMount.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <utility>
+#include "MountManager.h"
+
+const size_t CachingMount::kDefaultBlockSize;
+
+CacheBudget::CacheBudget(size_t max_bytes)
+  : max_bytes_(max_bytes),
+    bytes_(0) {
+  pthread_mutex_init(&lock_, NULL);
+}
+
+CacheBudget::~CacheBudget() {
+  pthread_mutex_destroy(&lock_);
+}
+
+size_t CacheBudget::max_bytes(void) {
+  pthread_mutex_lock(&lock_);
+  size_t max_bytes = max_bytes_;
+  pthread_mutex_unlock(&lock_);
+  return max_bytes;
+}
+
+void CacheBudget::set_max_bytes(size_t max_bytes) {
+  pthread_mutex_lock(&lock_);
+  max_bytes_ = max_bytes;
+  Evict();
+  pthread_mutex_unlock(&lock_);
+}
+
+size_t CacheBudget::bytes(void) {
+  pthread_mutex_lock(&lock_);
+  size_t bytes = bytes_;
+  pthread_mutex_unlock(&lock_);
+  return bytes;
+}
+
+void CacheBudget::Evict(void) {
+  std::list<BlockRef>::iterator it = lru_.end();
+  while (bytes_ > max_bytes_ && it != lru_.begin()) {
+    --it;
+    if (it == lru_.begin()) {
+      break;
+    }
+    CachingMount *mount = it->mount;
+    CachingMount::File *file = &mount->files_[it->path];
+    // Dirty blocks hold the only copy of unflushed writes.
+    if (file->blocks[it->index].dirty) {
+      continue;
+    }
+    std::string path = it->path;
+    off_t index = it->index;
+    ++it;
+    ++mount->stats_.evicted_blocks;
+    mount->DropBlock(path, file, index);
+  }
+}
+
+CachingMount::CachingMount(Mount *backing, WritePolicy policy,
+                           CacheBudget *budget, size_t block_size)
+  : backing_(backing),
+    policy_(policy),
+    budget_(budget),
+    block_size_(block_size),
+    attr_ttl_(1.0) {
+  if (budget_ == NULL) {
+    budget_ = MountManager::MMInstance()->cache_budget();
+  }
+}
+
+CachingMount::~CachingMount() {
+  std::vector<ino_t> dirty;
+  pthread_mutex_lock(&budget_->lock_);
+  std::map<std::string, File>::iterator it;
+  for (it = files_.begin(); it != files_.end(); ++it) {
+    if (it->second.dirty_blocks > 0) {
+      dirty.push_back(it->second.ino);
+    }
+  }
+  pthread_mutex_unlock(&budget_->lock_);
+  for (size_t i = 0; i < dirty.size(); ++i) {
+    Flush(dirty[i]);
+  }
+  pthread_mutex_lock(&budget_->lock_);
+  for (it = files_.begin(); it != files_.end(); ++it) {
+    DropBlocks(it->first, &it->second);
+  }
+  pthread_mutex_unlock(&budget_->lock_);
+  delete backing_;
+}
+
+double CachingMount::NowSeconds(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void CachingMount::set_attr_ttl(double attr_ttl) {
+  pthread_mutex_lock(&budget_->lock_);
+  attr_ttl_ = attr_ttl;
+  pthread_mutex_unlock(&budget_->lock_);
+}
+
+CachingMountStats CachingMount::stats(void) {
+  pthread_mutex_lock(&budget_->lock_);
+  CachingMountStats stats = stats_;
+  pthread_mutex_unlock(&budget_->lock_);
+  return stats;
+}
+
+void CachingMount::Bind(const std::string& path, const struct stat& st) {
+  File *file = &files_[path];
+  bool changed = file->ino != st.st_ino ||
+                 (file->has_attr && (file->st.st_mtime != st.st_mtime ||
+                                     file->st.st_size != st.st_size));
+  if (changed && file->dirty_blocks == 0) {
+    DropBlocks(path, file);
+  }
+  file->ino = st.st_ino;
+  paths_[st.st_ino] = path;
+  file->st = st;
+  file->has_attr = true;
+  file->attr_time = NowSeconds();
+}
+
+CachingMount::File *CachingMount::FileFor(ino_t node, std::string *path) {
+  std::map<ino_t, std::string>::iterator it = paths_.find(node);
+  if (it == paths_.end()) {
+    return NULL;
+  }
+  std::map<std::string, File>::iterator file = files_.find(it->second);
+  if (file == files_.end() || file->second.ino != node) {
+    return NULL;
+  }
+  *path = it->second;
+  return &file->second;
+}
+
+CachingMount::Block *CachingMount::FindBlock(File *file, off_t index) {
+  std::map<off_t, Block>::iterator it = file->blocks.find(index);
+  if (it == file->blocks.end()) {
+    return NULL;
+  }
+  budget_->lru_.splice(budget_->lru_.begin(), budget_->lru_,
+                       it->second.lru_pos);
+  return &it->second;
+}
+
+CachingMount::Block *CachingMount::InsertBlock(const std::string& path,
+                                               File *file, off_t index,
+                                               std::vector<char> *data,
+                                               bool dirty) {
+  Block *block = &file->blocks[index];
+  block->data.swap(*data);
+  block->dirty = dirty;
+  if (dirty) {
+    ++file->dirty_blocks;
+  }
+  CacheBudget::BlockRef ref;
+  ref.mount = this;
+  ref.path = path;
+  ref.index = index;
+  budget_->lru_.push_front(ref);
+  block->lru_pos = budget_->lru_.begin();
+  budget_->bytes_ += block->data.size();
+  // The new block is at the front of the LRU, so it is not evicted.
+  budget_->Evict();
+  return block;
+}
+
+void CachingMount::ResizeBlock(Block *block, size_t size) {
+  budget_->bytes_ -= block->data.size();
+  block->data.resize(size, 0);
+  budget_->bytes_ += size;
+}
+
+void CachingMount::DropBlock(const std::string& path, File *file,
+                             off_t index) {
+  std::map<off_t, Block>::iterator it = file->blocks.find(index);
+  if (it == file->blocks.end()) {
+    return;
+  }
+  budget_->bytes_ -= it->second.data.size();
+  budget_->lru_.erase(it->second.lru_pos);
+  if (it->second.dirty) {
+    --file->dirty_blocks;
+  }
+  file->blocks.erase(it);
+}
+
+void CachingMount::DropBlocks(const std::string& path, File *file) {
+  while (!file->blocks.empty()) {
+    DropBlock(path, file, file->blocks.begin()->first);
+  }
+}
+
+off_t CachingMount::FileSize(File *file) {
+  if (file->size >= 0) {
+    return file->size;
+  }
+  return file->has_attr ? file->st.st_size : -1;
+}
+
+int CachingMount::GetNode(const std::string& path, struct stat *st) {
+  struct stat local;
+  if (st == NULL) {
+    st = &local;
+  }
+  if (backing_->GetNode(path, st) != 0) {
+    return -1;
+  }
+  pthread_mutex_lock(&budget_->lock_);
+  Bind(path, *st);
+  File *file = &files_[path];
+  if (file->size >= 0) {
+    st->st_size = file->size;
+  }
+  pthread_mutex_unlock(&budget_->lock_);
+  return 0;
+}
+
+int CachingMount::Creat(const std::string& path, mode_t mode,
+                        struct stat *st) {
+  struct stat local;
+  if (st == NULL) {
+    st = &local;
+  }
+  if (backing_->Creat(path, mode, st) != 0) {
+    return -1;
+  }
+  pthread_mutex_lock(&budget_->lock_);
+  Bind(path, *st);
+  File *file = &files_[path];
+  if (file->size >= 0) {
+    st->st_size = file->size;
+  }
+  pthread_mutex_unlock(&budget_->lock_);
+  return 0;
+}
+
+int CachingMount::Mkdir(const std::string& path, mode_t mode,
+                        struct stat *st) {
+  return backing_->Mkdir(path, mode, st);
+}
+
+void CachingMount::Ref(ino_t node) {
+  backing_->Ref(node);
+  pthread_mutex_lock(&budget_->lock_);
+  std::string path;
+  File *file = FileFor(node, &path);
+  if (file != NULL) {
+    ++file->refs;
+  }
+  pthread_mutex_unlock(&budget_->lock_);
+}
+
+void CachingMount::Unref(ino_t node) {
+  bool flush = false;
+  pthread_mutex_lock(&budget_->lock_);
+  std::string path;
+  File *file = FileFor(node, &path);
+  if (file != NULL && file->refs > 0 && --file->refs == 0) {
+    flush = file->dirty_blocks > 0;
+  }
+  pthread_mutex_unlock(&budget_->lock_);
+  // Write back while node still means this file to the backing mount.
+  if (flush) {
+    Flush(node);
+  }
+  backing_->Unref(node);
+}
+
+int CachingMount::Unlink(const std::string& path) {
+  pthread_mutex_lock(&budget_->lock_);
+  std::map<std::string, File>::iterator it = files_.find(path);
+  if (it != files_.end()) {
+    DropBlocks(path, &it->second);
+    std::map<ino_t, std::string>::iterator p = paths_.find(it->second.ino);
+    if (p != paths_.end() && p->second == path) {
+      paths_.erase(p);
+    }
+    files_.erase(it);
+  }
+  pthread_mutex_unlock(&budget_->lock_);
+  return backing_->Unlink(path);
+}
+
+int CachingMount::Rmdir(ino_t node) {
+  return backing_->Rmdir(node);
+}
+
+int CachingMount::Chmod(ino_t node, mode_t mode) {
+  int ret = backing_->Chmod(node, mode);
+  pthread_mutex_lock(&budget_->lock_);
+  std::string path;
+  File *file = FileFor(node, &path);
+  if (file != NULL) {
+    file->has_attr = false;
+  }
+  pthread_mutex_unlock(&budget_->lock_);
+  return ret;
+}
+
+int CachingMount::Stat(ino_t node, struct stat *buf) {
+  pthread_mutex_lock(&budget_->lock_);
+  std::string path;
+  File *file = FileFor(node, &path);
+  if (file != NULL && file->has_attr &&
+      NowSeconds() - file->attr_time < attr_ttl_) {
+    ++stats_.attr_hits;
+    *buf = file->st;
+    if (file->size >= 0) {
+      buf->st_size = file->size;
+    }
+    pthread_mutex_unlock(&budget_->lock_);
+    return 0;
+  }
+  ++stats_.attr_misses;
+  pthread_mutex_unlock(&budget_->lock_);
+
+  if (backing_->Stat(node, buf) != 0) {
+    return -1;
+  }
+  pthread_mutex_lock(&budget_->lock_);
+  file = FileFor(node, &path);
+  if (file != NULL) {
+    Bind(path, *buf);
+    if (file->size >= 0) {
+      buf->st_size = file->size;
+    }
+  }
+  pthread_mutex_unlock(&budget_->lock_);
+  return 0;
+}
+
+int CachingMount::Fsync(ino_t node) {
+  if (policy_ == kWriteBack && Flush(node) != 0) {
+    return -1;
+  }
+  return backing_->Fsync(node);
+}
+
+int CachingMount::Getdents(ino_t node, off_t offset, struct dirent *dirp,
+                           unsigned int count) {
+  return backing_->Getdents(node, offset, dirp, count);
+}
+
+int CachingMount::ReadDirPlus(const std::string& path,
+                              std::vector<DirentPlus>* entries) {
+  return backing_->ReadDirPlus(path, entries);
+}
+
+int CachingMount::LoadBlock(ino_t node, off_t index) {
+  off_t start = index * block_size_;
+  std::vector<char> data(block_size_);
+  size_t got = 0;
+  while (got < block_size_) {
+    ssize_t n = backing_->Read(node, start + got, &data[got],
+                               block_size_ - got);
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    got += n;
+  }
+  data.resize(got);
+
+  pthread_mutex_lock(&budget_->lock_);
+  ++stats_.block_misses;
+  std::string path;
+  File *file = FileFor(node, &path);
+  if (file != NULL && FindBlock(file, index) == NULL) {
+    // Unflushed writes may have extended the file past what the backing
+    // mount has; the gap reads as zeros.
+    if (file->size > start + static_cast<off_t>(got)) {
+      data.resize(std::min(static_cast<off_t>(block_size_),
+                           file->size - start), 0);
+    }
+    InsertBlock(path, file, index, &data, false);
+  }
+  pthread_mutex_unlock(&budget_->lock_);
+  return 0;
+}
+
+ssize_t CachingMount::Read(ino_t node, off_t offset, void *buf,
+                           size_t count) {
+  if (offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  char *out = static_cast<char*>(buf);
+  size_t done = 0;
+  bool loaded = false;
+  while (done < count) {
+    off_t pos = offset + done;
+    off_t index = pos / block_size_;
+    size_t in = pos % block_size_;
+    pthread_mutex_lock(&budget_->lock_);
+    std::string path;
+    File *file = FileFor(node, &path);
+    if (file == NULL) {
+      pthread_mutex_unlock(&budget_->lock_);
+      // Not looked up through this mount, so there is nothing to keep
+      // the blocks under.
+      if (done > 0) {
+        break;
+      }
+      return backing_->Read(node, offset, buf, count);
+    }
+    off_t size = FileSize(file);
+    if (size >= 0 && pos >= size) {
+      pthread_mutex_unlock(&budget_->lock_);
+      break;
+    }
+    Block *block = FindBlock(file, index);
+    if (block == NULL) {
+      pthread_mutex_unlock(&budget_->lock_);
+      if (LoadBlock(node, index) != 0) {
+        return done > 0 ? done : -1;
+      }
+      loaded = true;
+      continue;
+    }
+    if (!loaded) {
+      ++stats_.block_hits;
+    }
+    loaded = false;
+    size_t length = block->data.size();
+    size_t n = 0;
+    if (in < length) {
+      n = std::min(length - in, count - done);
+      memcpy(out + done, &block->data[in], n);
+    }
+    done += n;
+    pthread_mutex_unlock(&budget_->lock_);
+    // A short block is the last one of the file.
+    if (n == 0 || (length < block_size_ && in + n == length)) {
+      break;
+    }
+  }
+  return done;
+}
+
+ssize_t CachingMount::Write(ino_t node, off_t offset, const void *buf,
+                            size_t count) {
+  if (offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (policy_ == kWriteBack) {
+    return WriteBack(node, offset, buf, count);
+  }
+  return WriteThrough(node, offset, buf, count);
+}
+
+ssize_t CachingMount::WriteThrough(ino_t node, off_t offset, const void *buf,
+                                   size_t count) {
+  ssize_t written = backing_->Write(node, offset, buf, count);
+  if (written <= 0) {
+    return written;
+  }
+  struct stat st;
+  bool have_st = backing_->Stat(node, &st) == 0;
+
+  pthread_mutex_lock(&budget_->lock_);
+  std::string path;
+  File *file = FileFor(node, &path);
+  if (file != NULL) {
+    // Update the cached blocks the write went to, so that they stay
+    // valid without another trip to the backing mount.
+    const char *in = static_cast<const char*>(buf);
+    off_t end = offset + written;
+    off_t first = offset / block_size_;
+    off_t last = (end - 1) / block_size_;
+    std::map<off_t, Block>::iterator it = file->blocks.lower_bound(first);
+    if (it != file->blocks.begin()) {
+      --it;
+      // The old end of the file is not the end anymore.
+      if (it->second.data.size() < block_size_) {
+        DropBlock(path, file, it->first);
+      }
+    }
+    for (off_t index = first; index <= last; ++index) {
+      Block *block = FindBlock(file, index);
+      if (block == NULL) {
+        continue;
+      }
+      off_t start = index * block_size_;
+      size_t from = std::max(offset, start) - start;
+      size_t to = std::min(end, start + static_cast<off_t>(block_size_)) -
+                  start;
+      if (from > block->data.size()) {
+        DropBlock(path, file, index);
+        continue;
+      }
+      if (to > block->data.size()) {
+        ResizeBlock(block, to);
+      }
+      memcpy(&block->data[from], in + (start + from - offset), to - from);
+    }
+    if (have_st) {
+      // Our own write; the cached blocks match these attributes.
+      file->st = st;
+      file->has_attr = true;
+      file->attr_time = NowSeconds();
+    } else {
+      file->has_attr = false;
+    }
+    budget_->Evict();
+  }
+  pthread_mutex_unlock(&budget_->lock_);
+  return written;
+}
+
+ssize_t CachingMount::WriteBack(ino_t node, off_t offset, const void *buf,
+                                size_t count) {
+  struct stat st;
+  // The file size decides which blocks have to be read before being
+  // partially overwritten.
+  if (Stat(node, &st) != 0) {
+    return -1;
+  }
+  const char *in = static_cast<const char*>(buf);
+  size_t done = 0;
+  bool over_budget = false;
+  while (done < count) {
+    off_t pos = offset + done;
+    off_t index = pos / block_size_;
+    off_t start = index * block_size_;
+    size_t from = pos - start;
+    size_t n = std::min(block_size_ - from, count - done);
+    pthread_mutex_lock(&budget_->lock_);
+    std::string path;
+    File *file = FileFor(node, &path);
+    if (file == NULL) {
+      pthread_mutex_unlock(&budget_->lock_);
+      // Not looked up through this mount.
+      if (done > 0) {
+        break;
+      }
+      return backing_->Write(node, offset, buf, count);
+    }
+    off_t size = FileSize(file);
+    if (size < 0) {
+      size = st.st_size;
+    }
+    Block *block = FindBlock(file, index);
+    if (block == NULL) {
+      if (n == block_size_ || start >= size) {
+        // Nothing in the block needs to be kept.
+        std::vector<char> empty;
+        block = InsertBlock(path, file, index, &empty, false);
+      } else {
+        pthread_mutex_unlock(&budget_->lock_);
+        if (LoadBlock(node, index) != 0) {
+          return done > 0 ? done : -1;
+        }
+        continue;
+      }
+    }
+    if (start > size) {
+      // Writing past the end: a short block before this one becomes a
+      // full block of zeros at its end.
+      std::map<off_t, Block>::iterator it = file->blocks.find(index);
+      if (it != file->blocks.begin()) {
+        --it;
+        Block *prev = &it->second;
+        if (prev->data.size() < block_size_) {
+          if (!prev->dirty) {
+            prev->dirty = true;
+            ++file->dirty_blocks;
+          }
+          ResizeBlock(prev, block_size_);
+        }
+      }
+    }
+    if (!block->dirty) {
+      block->dirty = true;
+      ++file->dirty_blocks;
+    }
+    if (from + n > block->data.size()) {
+      ResizeBlock(block, from + n);
+    }
+    memcpy(&block->data[from], in + done, n);
+    file->size = std::max(size, static_cast<off_t>(pos + n));
+    budget_->Evict();
+    over_budget = budget_->bytes_ > budget_->max_bytes_;
+    pthread_mutex_unlock(&budget_->lock_);
+    done += n;
+  }
+  // Only dirty blocks are left and they do not fit.
+  if (over_budget) {
+    Flush(node);
+  }
+  return done;
+}
+
+int CachingMount::Flush(ino_t node) {
+  // Copy the dirty blocks out, so that the lock is not held while the
+  // backing mount works.  They stay dirty, and so in the cache, until
+  // they are written.
+  std::vector<std::pair<off_t, std::vector<char> > > dirty;
+  pthread_mutex_lock(&budget_->lock_);
+  std::string path;
+  File *file = FileFor(node, &path);
+  if (file != NULL && file->dirty_blocks > 0) {
+    std::map<off_t, Block>::iterator it;
+    for (it = file->blocks.begin(); it != file->blocks.end(); ++it) {
+      if (it->second.dirty) {
+        dirty.push_back(std::make_pair(it->first, it->second.data));
+      }
+    }
+  }
+  pthread_mutex_unlock(&budget_->lock_);
+
+  int result = 0;
+  std::vector<bool> written(dirty.size(), false);
+  for (size_t i = 0; i < dirty.size(); ++i) {
+    const std::vector<char>& data = dirty[i].second;
+    ssize_t n = backing_->Write(node, dirty[i].first * block_size_,
+                                &data[0], data.size());
+    if (n == static_cast<ssize_t>(data.size())) {
+      written[i] = true;
+    } else {
+      result = -1;
+    }
+  }
+  struct stat st;
+  bool have_st = !dirty.empty() && backing_->Stat(node, &st) == 0;
+
+  pthread_mutex_lock(&budget_->lock_);
+  file = FileFor(node, &path);
+  if (file != NULL) {
+    for (size_t i = 0; i < dirty.size(); ++i) {
+      std::map<off_t, Block>::iterator it = file->blocks.find(dirty[i].first);
+      // Blocks written to again in the meantime stay dirty.
+      if (written[i] && it != file->blocks.end() && it->second.dirty &&
+          it->second.data == dirty[i].second) {
+        it->second.dirty = false;
+        --file->dirty_blocks;
+        ++stats_.flushed_blocks;
+      }
+    }
+    if (file->dirty_blocks == 0) {
+      file->size = -1;
+    }
+    if (have_st) {
+      file->st = st;
+      file->has_attr = true;
+      file->attr_time = NowSeconds();
+    }
+    budget_->Evict();
+  }
+  pthread_mutex_unlock(&budget_->lock_);
+  if (result != 0) {
+    errno = EIO;
+  }
+  return result;
+}
+
+int CachingMount::Prefetch(ino_t node, off_t offset, size_t count) {
+  if (offset < 0) {
+    return -1;
+  }
+  off_t end = offset + count;
+  for (off_t index = offset / block_size_;
+       index * static_cast<off_t>(block_size_) < end; ++index) {
+    pthread_mutex_lock(&budget_->lock_);
+    std::string path;
+    File *file = FileFor(node, &path);
+    if (file == NULL) {
+      pthread_mutex_unlock(&budget_->lock_);
+      return -1;
+    }
+    off_t size = FileSize(file);
+    bool cached = file->blocks.find(index) != file->blocks.end();
+    pthread_mutex_unlock(&budget_->lock_);
+    if (size >= 0 && index * static_cast<off_t>(block_size_) >= size) {
+      break;
+    }
+    if (!cached && LoadBlock(node, index) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
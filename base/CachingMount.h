@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that be
+ * found in the LICENSE file.
+ */
+#ifndef PACKAGES_SCRIPTS_FILESYS_BASE_CACHINGMOUNT_H_
+#define PACKAGES_SCRIPTS_FILESYS_BASE_CACHINGMOUNT_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include "Mount.h"
+
+class CachingMount;
+
+// CacheBudget bounds the memory used by the blocks of every CachingMount
+// that shares it.  When a mount needs room, the least recently used
+// clean block is dropped, whichever mount it belongs to.  MountManager
+// keeps the budget that caching mounts share by default.
+class CacheBudget {
+ public:
+  explicit CacheBudget(size_t max_bytes);
+  ~CacheBudget();
+
+  size_t max_bytes(void);
+  // Shrinking the budget drops clean blocks right away.
+  void set_max_bytes(size_t max_bytes);
+
+  // bytes() returns the size of all cached blocks.
+  size_t bytes(void);
+
+ private:
+  friend class CachingMount;
+
+  // One cached block, in LRU order.
+  struct BlockRef {
+    CachingMount *mount;
+    std::string path;
+    off_t index;
+  };
+
+  // Drop clean blocks from the tail of the LRU until the cached bytes
+  // fit in max_bytes_.  The most recently used block always stays.
+  // Called with lock_ held.
+  void Evict(void);
+
+  // lock_ guards the budget as well as the cache state of every
+  // CachingMount using it, so that eviction can reach across mounts.
+  pthread_mutex_t lock_;
+  size_t max_bytes_;
+  size_t bytes_;
+  // Most recently used first.
+  std::list<BlockRef> lru_;
+};
+
+// Counters describing how well a CachingMount is doing.
+struct CachingMountStats {
+  CachingMountStats()
+    : block_hits(0),
+      block_misses(0),
+      attr_hits(0),
+      attr_misses(0),
+      evicted_blocks(0),
+      flushed_blocks(0) {}
+
+  // Blocks read from the cache or from the backing mount.
+  int64_t block_hits;
+  int64_t block_misses;
+  // Stat() calls answered from the cache or by the backing mount.
+  int64_t attr_hits;
+  int64_t attr_misses;
+  // Clean blocks dropped to stay within the budget.
+  int64_t evicted_blocks;
+  // Dirty blocks written back to the backing mount.
+  int64_t flushed_blocks;
+};
+
+// CachingMount wraps another mount and keeps fixed-size blocks of the
+// files read through it, as well as their attributes, in memory.  The
+// backing mount's own code is left alone, so any mount can be put behind
+// a cache.
+//
+// Blocks are kept by path, which survives closing and reopening a file,
+// and are dropped when GetNode() reports a different mtime or size than
+// the cached attributes.  Writes either go straight to the backing mount
+// (kWriteThrough) or stay in the cache until Fsync() or the last Unref()
+// of the file (kWriteBack).  Dirty blocks are never evicted; if they
+// alone exceed the budget the file is flushed early.
+class CachingMount : public Mount {
+ public:
+  enum WritePolicy {
+    kWriteThrough,
+    kWriteBack
+  };
+
+  // backing is owned by the CachingMount.  A NULL budget means the one
+  // shared through MountManager.
+  CachingMount(Mount *backing, WritePolicy policy = kWriteThrough,
+               CacheBudget *budget = NULL,
+               size_t block_size = kDefaultBlockSize);
+  virtual ~CachingMount();
+
+  int GetNode(const std::string& path, struct stat *st);
+
+  void Ref(ino_t node);
+  void Unref(ino_t node);
+
+  int Creat(const std::string& path, mode_t mode, struct stat *st);
+  int Mkdir(const std::string& path, mode_t mode, struct stat *st);
+
+  int Unlink(const std::string& path);
+  int Rmdir(ino_t node);
+
+  int Chmod(ino_t node, mode_t mode);
+  int Stat(ino_t node, struct stat *buf);
+
+  int Fsync(ino_t node);
+
+  int Getdents(ino_t node, off_t offset, struct dirent *dirp,
+               unsigned int count);
+  int ReadDirPlus(const std::string& path, std::vector<DirentPlus>* entries);
+
+  ssize_t Read(ino_t node, off_t offset, void *buf, size_t count);
+  ssize_t Write(ino_t node, off_t offset, const void *buf, size_t count);
+
+  // Loads the blocks of the range into the cache.
+  int Prefetch(ino_t node, off_t offset, size_t count);
+  bool SupportsPrefetch(void) { return true; }
+
+  // Misses block as long as the backing mount's calls do.
+  int IoThreads(void) { return backing_->IoThreads(); }
+
+  Mount *backing(void) { return backing_; }
+
+  // Attributes are trusted for attr_ttl seconds; 0 disables the cache.
+  void set_attr_ttl(double attr_ttl);
+
+  CachingMountStats stats(void);
+
+  static const size_t kDefaultBlockSize = 64 * 1024;
+
+ private:
+  friend class CacheBudget;
+
+  struct Block {
+    // The block's bytes; shorter than the block size only at the end
+    // of the file.
+    std::vector<char> data;
+    bool dirty;
+    std::list<CacheBudget::BlockRef>::iterator lru_pos;
+  };
+
+  struct File {
+    File() : ino(0), refs(0), has_attr(false), attr_time(0), size(-1),
+             dirty_blocks(0) {}
+    ino_t ino;
+    int refs;
+    bool has_attr;
+    struct stat st;
+    double attr_time;
+    // The size including unflushed writes, or -1 if there are none.
+    off_t size;
+    int dirty_blocks;
+    // Cached blocks by index.
+    std::map<off_t, Block> blocks;
+  };
+
+  // The members below are called with budget_->lock_ held.
+
+  // Record that path is node with attributes st, dropping cached blocks
+  // of an earlier, different version of the file.
+  void Bind(const std::string& path, const struct stat& st);
+  File *FileFor(ino_t node, std::string *path);
+  Block *FindBlock(File *file, off_t index);
+  Block *InsertBlock(const std::string& path, File *file, off_t index,
+                     std::vector<char> *data, bool dirty);
+  void ResizeBlock(Block *block, size_t size);
+  void DropBlock(const std::string& path, File *file, off_t index);
+  void DropBlocks(const std::string& path, File *file);
+  // The current size of file, or -1 if it is not known.
+  off_t FileSize(File *file);
+
+  // The members below are called without the lock.
+
+  // Read block index of node from the backing mount into the cache.
+  int LoadBlock(ino_t node, off_t index);
+  // Write the dirty blocks of node back to the backing mount.
+  int Flush(ino_t node);
+  ssize_t WriteThrough(ino_t node, off_t offset, const void *buf,
+                       size_t count);
+  ssize_t WriteBack(ino_t node, off_t offset, const void *buf, size_t count);
+
+  static double NowSeconds(void);
+
+  Mount *backing_;
+  WritePolicy policy_;
+  CacheBudget *budget_;
+  size_t block_size_;
+  double attr_ttl_;
+  // Guarded by budget_->lock_.
+  std::map<std::string, File> files_;
+  std::map<ino_t, std::string> paths_;
+  CachingMountStats stats_;
+};
+
+#endif  // PACKAGES_SCRIPTS_FILESYS_BASE_CACHINGMOUNT_H_
@@ -9,6 +9,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include "ReadAhead.h"
 
 class Mount;
 
@@ -23,6 +24,8 @@ struct FileHandle {
   off_t offset;
   int flags;
   int use_count;
+  // Access pattern of the reads made through this handle.
+  ReadAheadWindow readahead;
 };
 
 #endif  // PACKAGES_SCRIPTS_FILESYS_BASE_FILEHANDLE_H_
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that be
+ * found in the LICENSE file.
+ */
+#include "KernelAwait.h"
+
+#if __cplusplus >= 202002L
+
+#include <exception>
+
+void KernelTask::promise_type::FinalAwaiter::await_suspend(
+    std::coroutine_handle<promise_type> h) noexcept {
+  KernelExecutor *executor = h.promise().executor;
+  h.destroy();
+  executor->Finished();
+}
+
+void KernelTask::promise_type::unhandled_exception() {
+  std::terminate();
+}
+
+KernelExecutor::KernelExecutor()
+  : live_(0), wakeup_(NULL), wakeup_arg_(NULL) {
+  pthread_mutex_init(&lock_, NULL);
+  pthread_cond_init(&ready_cond_, NULL);
+}
+
+KernelExecutor::~KernelExecutor() {
+  pthread_cond_destroy(&ready_cond_);
+  pthread_mutex_destroy(&lock_);
+}
+
+void KernelExecutor::Spawn(KernelTask task) {
+  std::coroutine_handle<KernelTask::promise_type> handle = task.handle_;
+  task.handle_ = NULL;
+  handle.promise().executor = this;
+  pthread_mutex_lock(&lock_);
+  ++live_;
+  pthread_mutex_unlock(&lock_);
+  Post(handle);
+}
+
+void KernelExecutor::Post(std::coroutine_handle<> handle) {
+  pthread_mutex_lock(&lock_);
+  bool was_empty = ready_.empty();
+  ready_.push_back(handle);
+  void (*wakeup)(void *arg) = wakeup_;
+  void *wakeup_arg = wakeup_arg_;
+  pthread_cond_signal(&ready_cond_);
+  pthread_mutex_unlock(&lock_);
+  if (was_empty && wakeup) {
+    wakeup(wakeup_arg);
+  }
+}
+
+void KernelExecutor::Run(void) {
+  pthread_mutex_lock(&lock_);
+  while (live_ > 0) {
+    if (ready_.empty()) {
+      pthread_cond_wait(&ready_cond_, &lock_);
+      continue;
+    }
+    std::coroutine_handle<> handle = ready_.front();
+    ready_.pop_front();
+    pthread_mutex_unlock(&lock_);
+    handle.resume();
+    pthread_mutex_lock(&lock_);
+  }
+  pthread_mutex_unlock(&lock_);
+}
+
+int KernelExecutor::RunReady(void) {
+  pthread_mutex_lock(&lock_);
+  // Only what is ready now: a task that is ready again by the time it
+  // suspends waits for the next call.
+  size_t count = ready_.size();
+  for (size_t i = 0; i < count && !ready_.empty(); ++i) {
+    std::coroutine_handle<> handle = ready_.front();
+    ready_.pop_front();
+    pthread_mutex_unlock(&lock_);
+    handle.resume();
+    pthread_mutex_lock(&lock_);
+  }
+  int live = live_;
+  pthread_mutex_unlock(&lock_);
+  return live;
+}
+
+void KernelExecutor::set_wakeup(void (*wakeup)(void *arg), void *arg) {
+  pthread_mutex_lock(&lock_);
+  wakeup_ = wakeup;
+  wakeup_arg_ = arg;
+  pthread_mutex_unlock(&lock_);
+}
+
+void KernelExecutor::Finished(void) {
+  pthread_mutex_lock(&lock_);
+  --live_;
+  // Run() may be waiting for the last task to finish.
+  pthread_cond_signal(&ready_cond_);
+  pthread_mutex_unlock(&lock_);
+}
+
+void KernelAwaitable::Done(void *arg, ssize_t result, int error) {
+  KernelAwaitable *awaitable = reinterpret_cast<KernelAwaitable*>(arg);
+  awaitable->result_ = result;
+  awaitable->error_ = error;
+  awaitable->executor_->Post(awaitable->handle_);
+}
+
+#endif  // __cplusplus >= 202002L
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that be
+ * found in the LICENSE file.
+ */
+#ifndef PACKAGES_SCRIPTS_FILESYS_BASE_KERNELAWAIT_H_
+#define PACKAGES_SCRIPTS_FILESYS_BASE_KERNELAWAIT_H_
+
+// Coroutine wrappers for the KernelProxy _async calls.  They need C++20;
+// with an older compiler this header declares nothing.
+#if __cplusplus >= 202002L
+
+#include <errno.h>
+#include <pthread.h>
+#include <coroutine>
+#include <deque>
+#include <string>
+#include "KernelProxy.h"
+
+class KernelExecutor;
+
+// KernelTask is a coroutine started by KernelExecutor::Spawn().  It has
+// no result; it stores what it computes wherever it was told to.
+//
+//   KernelTask Fetch(KernelProxy *kp, const char *path, char *buf) {
+//     struct stat st;
+//     if (co_await AsyncStat(kp, path, &st) != 0) co_return;
+//     int fd = kp->open(path, O_RDONLY, 0);
+//     ssize_t n = co_await AsyncRead(kp, fd, buf, st.st_size);
+//     kp->close(fd);
+//   }
+//   executor.Spawn(Fetch(kp, "/remote/a", buf));
+class KernelTask {
+ public:
+  struct promise_type {
+    promise_type() : executor(NULL) {}
+    KernelTask get_return_object() {
+      return KernelTask(
+          std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    // Tasks wait for Spawn(), and tell the executor when they are done.
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    struct FinalAwaiter {
+      bool await_ready() noexcept { return false; }
+      void await_suspend(std::coroutine_handle<promise_type> h) noexcept;
+      void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return FinalAwaiter(); }
+    void return_void() {}
+    void unhandled_exception();
+
+    KernelExecutor *executor;
+  };
+
+  KernelTask(KernelTask&& other) : handle_(other.handle_) {
+    other.handle_ = NULL;
+  }
+  // A task that was never spawned is destroyed with its KernelTask.
+  ~KernelTask() {
+    if (handle_) handle_.destroy();
+  }
+
+ private:
+  friend class KernelExecutor;
+  explicit KernelTask(std::coroutine_handle<promise_type> handle)
+    : handle_(handle) {}
+  KernelTask(const KernelTask&);
+  void operator=(const KernelTask&);
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+// KernelExecutor resumes KernelTasks on a single thread: the _async
+// callbacks only queue the task that waits on them, wherever they run,
+// and the thread driving the executor resumes it.  Thousands of file
+// operations can then be in flight with no thread of their own.
+class KernelExecutor {
+ public:
+  KernelExecutor();
+  ~KernelExecutor();
+
+  // Spawn() queues task to start on the executor's thread.
+  void Spawn(KernelTask task);
+
+  // Post() queues handle to be resumed.  Any thread may call it.
+  void Post(std::coroutine_handle<> handle);
+
+  // Run() resumes tasks as they become ready until none is left.
+  void Run(void);
+
+  // RunReady() resumes the tasks ready now, without waiting for others,
+  // and returns the number of tasks left.  It is meant for a thread that
+  // must not block, such as the PPAPI main thread, with set_wakeup()
+  // scheduling the next call.  Tasks run that way must not make
+  // blocking calls: no open() or close() of remote files.
+  int RunReady(void);
+
+  // wakeup(arg) is called, on the thread calling Post(), whenever a task
+  // becomes ready while none was; with CallOnMainThread() it can bring
+  // RunReady() to the PPAPI main loop.
+  void set_wakeup(void (*wakeup)(void *arg), void *arg);
+
+ private:
+  friend struct KernelTask::promise_type::FinalAwaiter;
+  void Finished(void);
+
+  // lock_ guards everything below; ready_cond_ is signalled by Post().
+  pthread_mutex_t lock_;
+  pthread_cond_t ready_cond_;
+  std::deque<std::coroutine_handle<> > ready_;
+  // Number of tasks spawned and not finished.
+  int live_;
+  void (*wakeup_)(void *arg);
+  void *wakeup_arg_;
+};
+
+// What the awaitables below have in common: they start a call with
+// Done() as its callback and, once resumed, return what the synchronous
+// call returns, with errno set as it sets it.
+class KernelAwaitable {
+ public:
+  bool await_ready(void) { return false; }
+  void await_suspend(std::coroutine_handle<KernelTask::promise_type> h) {
+    handle_ = h;
+    executor_ = h.promise().executor;
+    Start();
+  }
+  ssize_t await_resume(void) {
+    if (result_ == -1) {
+      errno = error_;
+    }
+    return result_;
+  }
+
+ protected:
+  explicit KernelAwaitable(KernelProxy *kp)
+    : kp_(kp), executor_(NULL), result_(-1), error_(0) {}
+  virtual ~KernelAwaitable() {}
+  virtual void Start(void) = 0;
+  static void Done(void *arg, ssize_t result, int error);
+
+  KernelProxy *kp_;
+
+ private:
+  std::coroutine_handle<> handle_;
+  KernelExecutor *executor_;
+  ssize_t result_;
+  int error_;
+};
+
+class AsyncStat : public KernelAwaitable {
+ public:
+  AsyncStat(KernelProxy *kp, const std::string& path, struct stat *buf)
+    : KernelAwaitable(kp), path_(path), buf_(buf) {}
+ private:
+  void Start(void) { kp_->stat_async(path_, buf_, Done, this); }
+  std::string path_;
+  struct stat *buf_;
+};
+
+class AsyncRead : public KernelAwaitable {
+ public:
+  AsyncRead(KernelProxy *kp, int fd, void *buf, size_t count)
+    : KernelAwaitable(kp), fd_(fd), buf_(buf), count_(count) {}
+ private:
+  void Start(void) { kp_->read_async(fd_, buf_, count_, Done, this); }
+  int fd_;
+  void *buf_;
+  size_t count_;
+};
+
+class AsyncWrite : public KernelAwaitable {
+ public:
+  AsyncWrite(KernelProxy *kp, int fd, const void *buf, size_t count)
+    : KernelAwaitable(kp), fd_(fd), buf_(buf), count_(count) {}
+ private:
+  void Start(void) { kp_->write_async(fd_, buf_, count_, Done, this); }
+  int fd_;
+  const void *buf_;
+  size_t count_;
+};
+
+class AsyncFstat : public KernelAwaitable {
+ public:
+  AsyncFstat(KernelProxy *kp, int fd, struct stat *buf)
+    : KernelAwaitable(kp), fd_(fd), buf_(buf) {}
+ private:
+  void Start(void) { kp_->fstat_async(fd_, buf_, Done, this); }
+  int fd_;
+  struct stat *buf_;
+};
+
+class AsyncFsync : public KernelAwaitable {
+ public:
+  AsyncFsync(KernelProxy *kp, int fd) : KernelAwaitable(kp), fd_(fd) {}
+ private:
+  void Start(void) { kp_->fsync_async(fd_, Done, this); }
+  int fd_;
+};
+
+#endif  // __cplusplus >= 202002L
+
+#endif  // PACKAGES_SCRIPTS_FILESYS_BASE_KERNELAWAIT_H_
@@ -6,6 +6,16 @@
 #include "KernelProxy.h"
 #include "MountManager.h"
 
+const int KernelOp::kLinkedFd;
+
+KernelProxy::KernelProxy() {
+  pthread_mutex_init(&lock_, NULL);
+}
+
+KernelProxy::~KernelProxy() {
+  pthread_mutex_destroy(&lock_);
+}
+
 void KernelProxy::Init(MountManager *mm) {
   max_path_len_ = 256;
   cwd_.set_is_absolute(true);
@@ -122,6 +132,7 @@ int KernelProxy::OpenHandle(Mount* mount, const std::string& path,
   mount->Ref(st.st_ino);
 
   // Setup file handle.
+  pthread_mutex_lock(&lock_);
   int handle_slot = open_files_.Alloc();
   int fd = fds_.Alloc();
   FileDescriptor* file = fds_.At(fd);
@@ -138,11 +149,35 @@ int KernelProxy::OpenHandle(Mount* mount, const std::string& path,
   } else {
     handle->offset = 0;
   }
+  pthread_mutex_unlock(&lock_);
 
   return fd;
 }
 
 int KernelProxy::open(const std::string& path, int flags, mode_t mode) {
+  return OpenPath(path, flags, mode, NULL);
+}
+
+int KernelProxy::readdirplus(const std::string& path,
+                             std::vector<DirentPlus>* entries) {
+  PathHandle ph(path);
+  if (ph.FormulatePath() == "") {
+    errno = ENOENT;
+    return -1;
+  }
+  if (ph.FormulatePath()[0] != '/') {
+    ph = PathHandle(cwd_.FormulatePath() + "/" + ph.FormulatePath());
+  }
+  std::pair<Mount*, std::string> m_and_p = mm_->GetMount(ph.FormulatePath());
+  if (!m_and_p.first || m_and_p.second.empty()) {
+    errno = ENOENT;
+    return -1;
+  }
+  return m_and_p.first->ReadDirPlus(m_and_p.second, entries);
+}
+
+int KernelProxy::OpenPath(const std::string& path, int flags, mode_t mode,
+                          MountCache *mounts) {
   PathHandle ph(path);
   // NOTE(krasin): side effect inside FormulatePath: it puts the path into the canonical form.
   ph.FormulatePath();
@@ -166,8 +201,17 @@ int KernelProxy::open(const std::string& path, int flags, mode_t mode) {
   parent.FormulatePath();
 
   // NOTE(krasin): side effect inside FormulatePath: it puts the path into the canonical form.
-  std::pair<Mount *, std::string> m_and_p =
-    mm_->GetMount(parent.FormulatePath());
+  std::pair<Mount *, std::string> m_and_p;
+  if (mounts == NULL) {
+    m_and_p = mm_->GetMount(parent.FormulatePath());
+  } else {
+    std::string dir = parent.FormulatePath();
+    MountCache::iterator it = mounts->find(dir);
+    if (it == mounts->end()) {
+      it = mounts->insert(std::make_pair(dir, mm_->GetMount(dir))).first;
+    }
+    m_and_p = it->second;
+  }
 
   if (!(m_and_p.first)) {
     errno = ENOENT;
@@ -182,86 +226,213 @@ int KernelProxy::open(const std::string& path, int flags, mode_t mode) {
   return OpenHandle(m_and_p.first, mount_rel_path.FormulatePath(), flags, mode);
 }
 
+int KernelProxy::submit(std::vector<KernelOp>* ops) {
+  std::vector<KernelOp>& batch = *ops;
+  // Files in the same directory share the lookup of its mount.
+  MountCache mounts;
+  for (size_t i = 0; i < batch.size(); ++i) {
+    KernelOp& op = batch[i];
+    op.result = 0;
+    op.error = 0;
+    if (op.type == KernelOp::kOpen) {
+      op.result = OpenPath(op.path, op.flags, op.mode, &mounts);
+      op.error = op.result == -1 ? errno : 0;
+    }
+  }
+  // The other ops need an fd, possibly that of an open of the batch.
+  std::vector<int> fds(batch.size(), -1);
+  for (size_t i = 0; i < batch.size(); ++i) {
+    KernelOp& op = batch[i];
+    if (op.type == KernelOp::kOpen) {
+      continue;
+    }
+    fds[i] = op.fd;
+    if (op.fd == KernelOp::kLinkedFd) {
+      if (op.link < 0 || op.link >= static_cast<int>(batch.size()) ||
+          batch[op.link].type != KernelOp::kOpen) {
+        op.result = -1;
+        op.error = EINVAL;
+      } else if (batch[op.link].result == -1) {
+        op.result = -1;
+        op.error = ECANCELED;
+      } else {
+        fds[i] = batch[op.link].result;
+      }
+    }
+  }
+  // Let each mount fetch the files the batch reads together.
+  std::map<Mount*, std::vector<ino_t> > reads;
+  for (size_t i = 0; i < batch.size(); ++i) {
+    FileHandle *handle;
+    int h;
+    if (batch[i].type == KernelOp::kRead && batch[i].result == 0 &&
+        (handle = AcquireHandle(fds[i], &h)) != NULL) {
+      reads[handle->mount].push_back(handle->node);
+      ReleaseHandle(h);
+    }
+  }
+  std::map<Mount*, std::vector<ino_t> >::iterator it;
+  for (it = reads.begin(); it != reads.end(); ++it) {
+    it->first->PrefetchBatch(it->second);
+  }
+  // Then reads and fstats in order, and the closes last.
+  for (int pass = 0; pass < 2; ++pass) {
+    for (size_t i = 0; i < batch.size(); ++i) {
+      KernelOp& op = batch[i];
+      if (op.type == KernelOp::kOpen || op.result == -1 ||
+          (op.type == KernelOp::kClose) != (pass == 1)) {
+        continue;
+      }
+      switch (op.type) {
+        case KernelOp::kRead:
+          op.result = read(fds[i], op.buf, op.count);
+          break;
+        case KernelOp::kFstat:
+          op.result = fstat(fds[i], op.st);
+          break;
+        case KernelOp::kClose:
+          op.result = close(fds[i]);
+          break;
+        default:
+          break;
+      }
+      op.error = op.result == -1 ? errno : 0;
+    }
+  }
+  for (size_t i = 0; i < batch.size(); ++i) {
+    if (batch[i].result == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
 int KernelProxy::close(int fd) {
+  pthread_mutex_lock(&lock_);
   FileDescriptor* file = fds_.At(fd);
   if (file == NULL) {
+    pthread_mutex_unlock(&lock_);
     errno = EBADF;
     return -1;
   }
   int h = file->handle;
   fds_.Free(fd);
-  FileHandle *handle = open_files_.At(h);
-  if (handle == NULL) {
+  bool open = open_files_.At(h) != NULL;
+  pthread_mutex_unlock(&lock_);
+  if (!open) {
     errno = EBADF;
     return -1;
   }
+  ReleaseHandle(h);
+  return 0;
+}
+
+FileHandle *KernelProxy::AcquireHandle(int fd, int *h) {
+  pthread_mutex_lock(&lock_);
+  FileDescriptor* file = fds_.At(fd);
+  FileHandle *handle = file ? open_files_.At(file->handle) : NULL;
+  if (handle != NULL) {
+    *h = file->handle;
+    handle->use_count++;
+  }
+  pthread_mutex_unlock(&lock_);
+  return handle;
+}
+
+void KernelProxy::ReleaseHandle(int h) {
+  pthread_mutex_lock(&lock_);
+  FileHandle *handle = open_files_.At(h);
   handle->use_count--;
   ino_t node = handle->node;
   Mount* mount = handle->mount;
-  if (handle->use_count <= 0) {
+  bool last = handle->use_count <= 0;
+  if (last) {
     open_files_.Free(h);
+  }
+  pthread_mutex_unlock(&lock_);
+  if (last) {
     mount->Unref(node);
   }
-
-  return 0;
 }
 
 ssize_t KernelProxy::read(int fd, void *buf, size_t count) {
   FileHandle *handle;
+  int h;
 
   // check if fd is valid and handle exists
-  if (!(handle = GetFileHandle(fd))) {
+  if (!(handle = AcquireHandle(fd, &h))) {
     errno = EBADF;
     return -1;
   }
   // Check that this file handle can be read from.
   if ((handle->flags & O_ACCMODE) == O_WRONLY ||
       is_dir(handle->mount, handle->node)) {
+    ReleaseHandle(h);
     errno = EBADF;
     return -1;
   }
 
-  ssize_t n = handle->mount->Read(handle->node, handle->offset, buf, count);
+  pthread_mutex_lock(&lock_);
+  off_t offset = handle->offset;
+  pthread_mutex_unlock(&lock_);
+  ssize_t n = handle->mount->Read(handle->node, offset, buf, count);
   if (n > 0) {
+    pthread_mutex_lock(&lock_);
+    ReadAheadRange ahead = handle->readahead.Observe(offset, n);
     handle->offset += n;
+    pthread_mutex_unlock(&lock_);
+    if (ahead.count > 0 && handle->mount->SupportsPrefetch()) {
+      readahead_.Submit(handle->mount, handle->node, ahead.offset,
+                        ahead.count);
+    }
   }
+  ReleaseHandle(h);
   return n;
 }
 
 ssize_t KernelProxy::write(int fd, const void *buf, size_t count) {
   FileHandle *handle;
-
-  // TODO(krasin): fix locking here.
+  int h;
 
   // check if fd is valid and handle exists
-  if (!(handle = GetFileHandle(fd))) {
+  if (!(handle = AcquireHandle(fd, &h))) {
     errno = EBADF;
     return -1;
   }
   // Check that this file handle can be written to.
   if ((handle->flags & O_ACCMODE) == O_RDONLY ||
       is_dir(handle->mount, handle->node)) {
+    ReleaseHandle(h);
     errno = EBADF;
     return -1;
   }
 
-  ssize_t n = handle->mount->Write(handle->node, handle->offset, buf, count);
+  pthread_mutex_lock(&lock_);
+  off_t offset = handle->offset;
+  pthread_mutex_unlock(&lock_);
+  ssize_t n = handle->mount->Write(handle->node, offset, buf, count);
   if (n > 0) {
+    pthread_mutex_lock(&lock_);
     handle->offset += n;
+    pthread_mutex_unlock(&lock_);
   }
+  ReleaseHandle(h);
   return n;
 }
 
 int KernelProxy::fstat(int fd, struct stat *buf) {
   FileHandle *handle;
+  int h;
 
   // check if fd is valid and handle exists
-  if (!(handle = GetFileHandle(fd))) {
+  if (!(handle = AcquireHandle(fd, &h))) {
     errno = EBADF;
     return -1;
   }
 
-  return handle->mount->Stat(handle->node, buf);
+  int result = handle->mount->Stat(handle->node, buf);
+  ReleaseHandle(h);
+  return result;
 }
 
 int KernelProxy::ioctl(int fd, unsigned long request) {
@@ -271,41 +442,177 @@ int KernelProxy::ioctl(int fd, unsigned long request) {
 
 int KernelProxy::getdents(int fd, void *buf, unsigned int count) {
   FileHandle *handle;
+  int h;
 
   // check if fd is valid and handle exists
-  if (!(handle = GetFileHandle(fd))) {
+  if (!(handle = AcquireHandle(fd, &h))) {
     errno = EBADF;
     return -1;
   }
 
-  // TODO(Krasin): support offset for getdents
-  return handle->mount->Getdents(handle->node, 0, (struct dirent*)buf, count);
+  // Each call carries on where the last one stopped; lseek() to 0
+  // starts over.
+  pthread_mutex_lock(&lock_);
+  off_t offset = handle->offset;
+  pthread_mutex_unlock(&lock_);
+  int n = handle->mount->Getdents(handle->node, offset,
+                                  (struct dirent*)buf, count);
+  if (n > 0) {
+    pthread_mutex_lock(&lock_);
+    handle->offset += n;
+    pthread_mutex_unlock(&lock_);
+  }
+  ReleaseHandle(h);
+  return n;
 }
 
 int KernelProxy::fsync(int fd) {
   FileHandle *handle;
+  int h;
 
-  if (!(handle = GetFileHandle(fd))) {
+  if (!(handle = AcquireHandle(fd, &h))) {
     errno = EBADF;
     return -1;
   }
 
-  return handle->mount->Fsync(handle->node);
+  int result = handle->mount->Fsync(handle->node);
+  ReleaseHandle(h);
+  return result;
+}
+
+void KernelProxy::stat_async(const std::string& path, struct stat *buf,
+                             Mount::AsyncCallback callback, void *arg) {
+  std::pair<Mount*, std::string> m_and_p;
+  if (!path.empty() && path[0] == '/') {
+    m_and_p = mm_->GetMount(path);
+  }
+  if (!m_and_p.first || m_and_p.second.empty()) {
+    callback(arg, -1, ENOENT);
+    return;
+  }
+  m_and_p.first->StatPathAsync(m_and_p.second, buf, callback, arg);
+}
+
+struct KernelProxy::AsyncIo {
+  KernelProxy *kp;
+  // Index of the handle in open_files_.
+  int handle;
+  Mount *mount;
+  ino_t node;
+  off_t offset;
+  size_t count;
+  Mount::AsyncCallback callback;
+  void *arg;
+};
+
+KernelProxy::AsyncIo *KernelProxy::StartAsyncIo(
+    int fd, int denied, size_t count, Mount::AsyncCallback callback,
+    void *arg) {
+  int h;
+  FileHandle *handle = AcquireHandle(fd, &h);
+  if (handle == NULL) {
+    return NULL;
+  }
+  if (denied != -1 && ((handle->flags & O_ACCMODE) == denied ||
+                       is_dir(handle->mount, handle->node))) {
+    ReleaseHandle(h);
+    return NULL;
+  }
+  AsyncIo *io = new AsyncIo;
+  io->kp = this;
+  io->handle = h;
+  io->mount = handle->mount;
+  io->node = handle->node;
+  io->count = count;
+  io->callback = callback;
+  io->arg = arg;
+  pthread_mutex_lock(&lock_);
+  io->offset = handle->offset;
+  handle->offset += count;
+  pthread_mutex_unlock(&lock_);
+  return io;
+}
+
+// Runs on whichever thread the mount completes on.
+void KernelProxy::AsyncIoDone(void *p, ssize_t result, int error) {
+  AsyncIo *io = reinterpret_cast<AsyncIo*>(p);
+  KernelProxy *kp = io->kp;
+  pthread_mutex_lock(&kp->lock_);
+  FileHandle *handle = kp->open_files_.At(io->handle);
+  // Give back what a short or failed call did not cover, unless later
+  // calls or lseek() have moved the offset on.
+  size_t done = result > 0 ? result : 0;
+  off_t end = io->offset + io->count;
+  if (done < io->count && handle->offset == end) {
+    handle->offset = io->offset + done;
+  }
+  pthread_mutex_unlock(&kp->lock_);
+  kp->ReleaseHandle(io->handle);
+  io->callback(io->arg, result, error);
+  delete io;
+}
+
+void KernelProxy::read_async(int fd, void *buf, size_t count,
+                             Mount::AsyncCallback callback, void *arg) {
+  AsyncIo *io = StartAsyncIo(fd, O_WRONLY, count, callback, arg);
+  if (io == NULL) {
+    callback(arg, -1, EBADF);
+    return;
+  }
+  io->mount->ReadAsync(io->node, io->offset, buf, count, AsyncIoDone, io);
+}
+
+void KernelProxy::write_async(int fd, const void *buf, size_t count,
+                              Mount::AsyncCallback callback, void *arg) {
+  AsyncIo *io = StartAsyncIo(fd, O_RDONLY, count, callback, arg);
+  if (io == NULL) {
+    callback(arg, -1, EBADF);
+    return;
+  }
+  io->mount->WriteAsync(io->node, io->offset, buf, count, AsyncIoDone, io);
+}
+
+void KernelProxy::fstat_async(int fd, struct stat *buf,
+                              Mount::AsyncCallback callback, void *arg) {
+  AsyncIo *io = StartAsyncIo(fd, -1, 0, callback, arg);
+  if (io == NULL) {
+    callback(arg, -1, EBADF);
+    return;
+  }
+  io->mount->StatAsync(io->node, buf, AsyncIoDone, io);
+}
+
+void KernelProxy::fsync_async(int fd, Mount::AsyncCallback callback,
+                              void *arg) {
+  AsyncIo *io = StartAsyncIo(fd, -1, 0, callback, arg);
+  if (io == NULL) {
+    callback(arg, -1, EBADF);
+    return;
+  }
+  io->mount->FsyncAsync(io->node, AsyncIoDone, io);
 }
 
 off_t KernelProxy::lseek(int fd, off_t offset, int whence) {
   FileHandle *handle;
+  int h;
 
   // check if fd is valid and handle exists
-  if (!(handle = GetFileHandle(fd))) {
+  if (!(handle = AcquireHandle(fd, &h))) {
     errno = EBADF;
     return -1;
   }
+  off_t next = Seek(handle, offset, whence);
+  ReleaseHandle(h);
+  return next;
+}
+
+off_t KernelProxy::Seek(FileHandle *handle, off_t offset, int whence) {
   off_t next;
   ssize_t len;
 
-  // Check that it isn't a directory.
-  if (is_dir(handle->mount, handle->node)) {
+  // A directory has no end to seek from, but may go back to an offset
+  // getdents() reached.
+  if (whence == SEEK_END && is_dir(handle->mount, handle->node)) {
     errno = EBADF;
     return -1;
   }
@@ -314,7 +621,9 @@ off_t KernelProxy::lseek(int fd, off_t offset, int whence) {
     next = offset;
     break;
   case SEEK_CUR:
+    pthread_mutex_lock(&lock_);
     next = handle->offset + offset;
+    pthread_mutex_unlock(&lock_);
     // TODO(arbenson): handle EOVERFLOW if too big.
     break;
   case SEEK_END:
@@ -336,8 +645,10 @@ off_t KernelProxy::lseek(int fd, off_t offset, int whence) {
     return -1;
   }
   // Go to the new offset.
+  pthread_mutex_lock(&lock_);
   handle->offset = next;
-  return handle->offset;
+  pthread_mutex_unlock(&lock_);
+  return next;
 }
 
 int KernelProxy::chmod(const std::string& path, mode_t mode) {
@@ -465,11 +776,3 @@ int KernelProxy::rmdir(const std::string& path) {
   }
   return mnode.first->Rmdir(mnode.second);
 }
-
-FileHandle *KernelProxy::GetFileHandle(int fd) {
-  FileDescriptor* file = fds_.At(fd);
-  if (file == NULL) {
-    return NULL;
-  }
-  return open_files_.At(file->handle);
-}
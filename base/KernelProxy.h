@@ -20,14 +20,45 @@
 #include "FileHandle.h"
 #include "Mount.h"
 #include "PathHandle.h"
+#include "ReadAhead.h"
 #include "SlotAllocator.h"
 
 class MountManager;
 
+// One operation of a KernelProxy::submit() batch.
+struct KernelOp {
+  enum Type { kOpen, kRead, kFstat, kClose };
+
+  KernelOp()
+    : type(kOpen), flags(0), mode(0), fd(-1), link(-1), buf(NULL),
+      count(0), st(NULL), result(0), error(0) {}
+
+  Type type;
+  // kOpen: what to open, as for open().
+  std::string path;
+  int flags;
+  mode_t mode;
+  // kRead, kFstat and kClose: the file.  kLinkedFd means the fd opened
+  // by the kOpen op at index link of the batch.
+  int fd;
+  int link;
+  // kRead: where to and how much; kFstat: where to.
+  void *buf;
+  size_t count;
+  struct stat *st;
+  // Set by submit(): what the call returned and, if that was -1, errno.
+  // An op linked to a failed open fails with ECANCELED.
+  ssize_t result;
+  int error;
+
+  static const int kLinkedFd = -2;
+};
+
 class KernelProxy {
 
  public:
-  virtual ~KernelProxy() {}
+  KernelProxy();
+  virtual ~KernelProxy();
   void Init(MountManager *mm);
 
   // sys calls handled by mount manager (not mount-specific)
@@ -51,6 +82,9 @@ class KernelProxy {
   int mkdir(const std::string& path, mode_t mode);
   int rmdir(const std::string& path);
   int open(const std::string& path, int oflag, mode_t mode);
+  // readdirplus() appends the entries of the directory at path to
+  // entries, each with its struct stat, as Mount::ReadDirPlus() does.
+  int readdirplus(const std::string& path, std::vector<DirentPlus>* entries);
 
   // sys calls that take a file descriptor as an argument
   // The mount manager will look at the registered file handles for the
@@ -68,15 +102,79 @@ class KernelProxy {
   int ioctl(int fd, unsigned long request);
   int fsync(int fd);
 
+  // submit() runs a batch of calls, much like a submission ring: all
+  // the opens first, then the reads and fstats in order, then the
+  // closes.  Before the reads, each mount is told which of its files the
+  // batch reads, so that it can fetch them together.  Every op gets its
+  // own result; the return value is 0 if all of them succeeded and -1
+  // otherwise.
+  int submit(std::vector<KernelOp>* ops);
+
+  // The _async calls start stat(), read(), write(), fstat() or fsync()
+  // through the mount's Async calls and return at once; callback(arg,
+  // result, error) follows as Mount::AsyncCallback describes.  The path
+  // given to stat_async() must be absolute.  read_async() and
+  // write_async() move the file offset by count when they start, so that
+  // calls started one after another cover consecutive ranges of the file.
+  // A call that reads or writes less moves it back by the rest when it
+  // completes, unless the offset has been moved since.
+  void stat_async(const std::string& path, struct stat *buf,
+                  Mount::AsyncCallback callback, void *arg);
+  void read_async(int fd, void *buf, size_t count,
+                  Mount::AsyncCallback callback, void *arg);
+  void write_async(int fd, const void *buf, size_t count,
+                   Mount::AsyncCallback callback, void *arg);
+  void fstat_async(int fd, struct stat *buf,
+                   Mount::AsyncCallback callback, void *arg);
+  void fsync_async(int fd, Mount::AsyncCallback callback, void *arg);
+
+  // readahead() prefetches ahead of sequential readers on all mounts.
+  ReadAhead *readahead(void) { return &readahead_; }
+
  private:
   PathHandle cwd_;
   int max_path_len_;
   MountManager *mm_;
 
+  // Guards fds_, open_files_, and the offset and readahead of the
+  // handles, which async calls update from other threads.  Never held
+  // across calls into a mount.
+  pthread_mutex_t lock_;
   SlotAllocator<FileDescriptor> fds_;
   SlotAllocator<FileHandle> open_files_;
+  ReadAhead readahead_;
+
+  // Mounts of the directories looked up in a batch, with the path of the
+  // directory within its mount.
+  typedef std::map<std::string, std::pair<Mount*, std::string> > MountCache;
+
+  // Looks up the handle of fd, at index *h of open_files_, and takes a
+  // use of it, so that it stays open until ReleaseHandle(*h) even if fd
+  // is closed meanwhile.  Returns NULL if fd is not open.  The mount,
+  // node and flags of a handle never change, so they can be read
+  // without lock_.
+  FileHandle *AcquireHandle(int fd, int *h);
+  // lseek() on a handle acquired by the caller.
+  off_t Seek(FileHandle *handle, off_t offset, int whence);
+  // Drops a use of the handle at index h of open_files_, and frees it
+  // once it has none left.
+  void ReleaseHandle(int h);
+
+  // An async call in flight on a file handle.  It holds a use of the
+  // handle, so that the node stays open until the call is done and the
+  // offset of a read or write can be put right then.
+  struct AsyncIo;
+  // Starts a call on fd's handle.  Reads and writes pass the access
+  // mode they cannot go through as denied, and their count; other calls
+  // pass -1 and 0.  Returns NULL if fd is not open for the call.
+  AsyncIo *StartAsyncIo(int fd, int denied, size_t count,
+                        Mount::AsyncCallback callback, void *arg);
+  static void AsyncIoDone(void *p, ssize_t result, int error);
 
-  FileHandle *GetFileHandle(int fd);
+  // open(), with the mount of the file's directory taken from mounts,
+  // if given, and added to it.
+  int OpenPath(const std::string& path, int flags, mode_t mode,
+               MountCache *mounts);
   int OpenHandle(Mount* mount, const std::string& path, int oflag, mode_t mode);
 };
 
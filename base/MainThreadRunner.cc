@@ -1,5 +1,10 @@
 #include "MainThreadRunner.h"
-#include <stdio.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <vector>
+#include <ppapi/cpp/module.h>
+#include "Trace.h"
 #include "../AppEngine/AppEngineUrlLoader.h"
 
 MainThreadJobOpen::MainThreadJobOpen(pp::URLLoader* loader, const pp::URLRequestInfo& request_info) {
@@ -12,62 +17,428 @@ void MainThreadJobOpen::Run(MainThreadJobEntry* e) {
   delete this;
 }
 
+const int MainThreadRunner::kDefaultMaxInFlight;
+const double MainThreadRunner::kDefaultMaxWait = 0.5;
+const double MainThreadRunner::kDefaultJobTimeout = 120;
+const size_t MainThreadRunner::kDefaultMaxQueued;
+const int MainThreadRunner::kMaxStackEntries;
+
+void MainThreadJobList::PushBack(MainThreadJobEntry *e) {
+  e->prev = tail;
+  e->next = NULL;
+  if (tail != NULL) {
+    tail->next = e;
+  } else {
+    head = e;
+  }
+  tail = e;
+  ++size;
+}
+
+void MainThreadJobList::Remove(MainThreadJobEntry *e) {
+  if (e->prev != NULL) {
+    e->prev->next = e->next;
+  } else {
+    head = e->next;
+  }
+  if (e->next != NULL) {
+    e->next->prev = e->prev;
+  } else {
+    tail = e->prev;
+  }
+  e->prev = e->next = NULL;
+  --size;
+}
+
 MainThreadRunner::MainThreadRunner(pp::Instance *instance) { 
   pepper_instance_ = instance;
-  DoWork();
+  max_in_flight_ = kDefaultMaxInFlight;
+  in_flight_ = 0;
+  max_wait_ms_ = kDefaultMaxWait * 1000;
+  queued_ = 0;
+  max_queued_ = kDefaultMaxQueued;
+  block_when_full_ = true;
+  job_timeout_ms_ = kDefaultJobTimeout * 1000;
   pthread_mutex_init(&lock_, NULL);
+  pthread_cond_init(&changed_, NULL);
+  // Start polling the queue.
+  DoWorkShim(this, 0);
 }
 
 MainThreadRunner::~MainThreadRunner() { 
+  pthread_cond_destroy(&changed_);
   pthread_mutex_destroy(&lock_);
 }
 
-int32_t MainThreadRunner::RunJob(MainThreadJob* job) {
-  MainThreadJobEntry e;
- 
-  e.runner = this; 
-  e.pepper_instance = pepper_instance_;
-  e.job = job;
-  sem_init(&e.done, 0, 0);
-  fprintf(stderr, "Waiting for lock...\n");
+double MainThreadRunner::NowMs(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+void MainThreadRunner::set_max_in_flight(int max_in_flight) {
+  pthread_mutex_lock(&lock_);
+  max_in_flight_ = std::max(max_in_flight, 0);
+  pthread_mutex_unlock(&lock_);
+}
+
+void MainThreadRunner::set_max_wait(double max_wait) {
+  pthread_mutex_lock(&lock_);
+  max_wait_ms_ = max_wait * 1000;
+  pthread_mutex_unlock(&lock_);
+}
+
+void MainThreadRunner::set_job_timeout(double job_timeout) {
   pthread_mutex_lock(&lock_);
-  fprintf(stderr, "Got lock\n");
-  job_queue_.push_back(&e);
+  job_timeout_ms_ = std::max(job_timeout, 0.0) * 1000;
   pthread_mutex_unlock(&lock_);
-  fprintf(stderr, "Released lock, waiting on sem...\n");
-  sem_wait(&e.done);
-  fprintf(stderr, "Sem signaled\n");
-  sem_destroy(&e.done);
+}
+
+void MainThreadRunner::set_max_queued(size_t max_queued, bool block) {
+  pthread_mutex_lock(&lock_);
+  max_queued_ = max_queued;
+  block_when_full_ = block;
+  // Blocked callers may fit now, or have to fail.
+  pthread_cond_broadcast(&changed_);
+  pthread_mutex_unlock(&lock_);
+}
+
+MainThreadQueueStats MainThreadRunner::queue_stats(Priority priority) {
+  pthread_mutex_lock(&lock_);
+  MainThreadQueueStats stats = stats_[priority];
+  stats.depth = job_queue_[priority].size;
+  pthread_mutex_unlock(&lock_);
+  return stats;
+}
+
+void MainThreadRunner::InitEntry(MainThreadJobEntry *e, MainThreadJob* job,
+                                 Priority priority, const void* tag) {
+  e->runner = this;
+  e->pepper_instance = pepper_instance_;
+  e->job = job;
+  e->result = 0;
+  e->priority = priority;
+  e->tag = tag;
+  e->running = false;
+  e->done = false;
+  e->aborting = false;
+  e->error = 0;
+  e->callback = NULL;
+  e->callback_arg = NULL;
+  e->prev = e->next = NULL;
+}
+
+void MainThreadRunner::Submit(MainThreadJobEntry *entries,
+                              MainThreadJob** jobs, int count,
+                              Priority priority, const void* tag) {
+  double now = NowMs();
+  for (int i = 0; i < count; ++i) {
+    InitEntry(&entries[i], jobs[i], priority, tag);
+  }
+  pthread_mutex_lock(&lock_);
+  // The deadline covers the wait for room as well.
+  double deadline = job_timeout_ms_ > 0 ? now + job_timeout_ms_ : 0;
+  int error = 0;
+  while (max_queued_ > 0 && queued_ > 0 &&
+         queued_ + count > max_queued_) {
+    if (!block_when_full_) {
+      error = EAGAIN;
+      break;
+    }
+    if (deadline > 0) {
+      struct timespec ts;
+      ts.tv_sec = static_cast<time_t>(deadline / 1000);
+      ts.tv_nsec = static_cast<long>((deadline - ts.tv_sec * 1000.0) * 1e6);
+      if (pthread_cond_timedwait(&changed_, &lock_, &ts) == ETIMEDOUT &&
+          NowMs() >= deadline) {
+        error = ETIMEDOUT;
+        break;
+      }
+    } else {
+      pthread_cond_wait(&changed_, &lock_);
+    }
+  }
+  now = NowMs();
+  for (int i = 0; i < count; ++i) {
+    MainThreadJobEntry& e = entries[i];
+    if (error != 0) {
+      e.done = true;
+      e.error = error;
+      delete e.job;
+      continue;
+    }
+    e.queued_ms = now;
+    e.deadline_ms = deadline;
+    job_queue_[priority].PushBack(&e);
+    ++queued_;
+  }
+}
+
+int MainThreadRunner::StartJob(MainThreadJob* job, Priority priority,
+                               const void* tag,
+                               MainThreadJobCallback callback, void* arg) {
+  MainThreadJobEntry *e = new MainThreadJobEntry;
+  InitEntry(e, job, priority, tag);
+  e->callback = callback;
+  e->callback_arg = arg;
+  pthread_mutex_lock(&lock_);
+  // This may be the main thread, which must never wait for room.
+  if (max_queued_ > 0 && queued_ >= max_queued_) {
+    pthread_mutex_unlock(&lock_);
+    delete job;
+    delete e;
+    errno = EAGAIN;
+    return -1;
+  }
+  e->queued_ms = NowMs();
+  e->deadline_ms = job_timeout_ms_ > 0 ? e->queued_ms + job_timeout_ms_ : 0;
+  job_queue_[priority].PushBack(e);
+  ++queued_;
+  pthread_mutex_unlock(&lock_);
+  return 0;
+}
+
+void MainThreadRunner::GiveUp(MainThreadJobEntry *e, int error) {
+  if (e->done || e->error != 0) {
+    return;
+  }
+  e->error = error;
+  if (!e->running) {
+    job_queue_[e->priority].Remove(e);
+    --queued_;
+    e->done = true;
+    delete e->job;
+    pthread_cond_broadcast(&changed_);
+    if (e->callback != NULL) {
+      // Callbacks run on the main thread, and never under lock_.
+      pp::Module::Get()->core()->CallOnMainThread(
+          0, pp::CompletionCallback(&CompleteShim, e), PP_OK);
+    }
+    return;
+  }
+  // Abort() has to run on the main thread, and e has to stay around
+  // until it has.
+  e->aborting = true;
+  pp::Module::Get()->core()->CallOnMainThread(
+      0, pp::CompletionCallback(&AbortShim, e), PP_OK);
+}
+
+void MainThreadRunner::AbortShim(void *p, int32_t unused) {
+  MainThreadJobEntry *e = reinterpret_cast<MainThreadJobEntry*>(p);
+  MainThreadRunner *runner = e->runner;
+  pthread_mutex_lock(&runner->lock_);
+  // The job is deleted once it is done; on the main thread that cannot
+  // happen between here and the Abort() call.
+  bool done = e->done;
+  pthread_mutex_unlock(&runner->lock_);
+  if (!done) {
+    e->job->Abort(e);
+  }
+  pthread_mutex_lock(&runner->lock_);
+  e->aborting = false;
+  // A StartJob() entry that finished meanwhile was left for this call to
+  // free.
+  bool orphaned = e->done && e->callback != NULL;
+  pthread_cond_broadcast(&runner->changed_);
+  pthread_mutex_unlock(&runner->lock_);
+  if (orphaned) {
+    delete e;
+  }
+}
+
+void MainThreadRunner::CompleteShim(void *p, int32_t unused) {
+  MainThreadJobEntry *e = reinterpret_cast<MainThreadJobEntry*>(p);
+  e->callback(e->callback_arg, e->result, e->error);
+  delete e;
+}
+
+void MainThreadRunner::ExpireJobs(void) {
+  double now = NowMs();
+  for (int i = 0; i < kNumPriorities; ++i) {
+    MainThreadJobEntry *e = job_queue_[i].head;
+    while (e != NULL) {
+      MainThreadJobEntry *next = e->next;
+      if (e->callback != NULL && e->deadline_ms > 0 &&
+          now >= e->deadline_ms) {
+        GiveUp(e, ETIMEDOUT);
+      }
+      e = next;
+    }
+  }
+  for (MainThreadJobEntry *e = running_.head; e != NULL; e = e->next) {
+    if (e->callback != NULL && e->deadline_ms > 0 && now >= e->deadline_ms) {
+      GiveUp(e, ETIMEDOUT);
+    }
+  }
+}
+
+void MainThreadRunner::Wait(MainThreadJobEntry *e) {
+  while (!e->done || e->aborting) {
+    if (e->deadline_ms > 0 && e->error == 0) {
+      if (NowMs() >= e->deadline_ms) {
+        GiveUp(e, ETIMEDOUT);
+        continue;
+      }
+      struct timespec ts;
+      ts.tv_sec = static_cast<time_t>(e->deadline_ms / 1000);
+      ts.tv_nsec = static_cast<long>(
+          (e->deadline_ms - ts.tv_sec * 1000.0) * 1e6);
+      pthread_cond_timedwait(&changed_, &lock_, &ts);
+    } else {
+      pthread_cond_wait(&changed_, &lock_);
+    }
+  }
+}
+
+void MainThreadRunner::Cancel(const void* tag) {
+  pthread_mutex_lock(&lock_);
+  // GiveUp() takes a queued entry off its list, so step past it first.
+  for (int i = 0; i < kNumPriorities; ++i) {
+    MainThreadJobEntry *e = job_queue_[i].head;
+    while (e != NULL) {
+      MainThreadJobEntry *next = e->next;
+      if (e->tag == tag) GiveUp(e, ECANCELED);
+      e = next;
+    }
+  }
+  for (MainThreadJobEntry *e = running_.head; e != NULL; e = e->next) {
+    if (e->tag == tag) GiveUp(e, ECANCELED);
+  }
+  pthread_mutex_unlock(&lock_);
+}
+
+MainThreadJobEntry *MainThreadRunner::NextJob(void) {
+  if (max_in_flight_ > 0 && in_flight_ >= max_in_flight_) {
+    return NULL;
+  }
+  double now = NowMs();
+  int next = -1;
+  bool aged = false;
+  // The highest class with a job waiting goes first, unless the oldest
+  // job of a lower class has waited max_wait.  Each queue is in order,
+  // so only the first jobs need a look.
+  double oldest = now;
+  for (int i = 0; i < kNumPriorities; ++i) {
+    if (job_queue_[i].empty()) {
+      continue;
+    }
+    if (next == -1) {
+      next = i;
+    } else if (job_queue_[i].head->queued_ms < oldest &&
+               now - job_queue_[i].head->queued_ms >= max_wait_ms_) {
+      next = i;
+      aged = true;
+    }
+    oldest = std::min(oldest, job_queue_[i].head->queued_ms);
+  }
+  if (next == -1) {
+    return NULL;
+  }
+  MainThreadJobEntry *e = job_queue_[next].head;
+  job_queue_[next].Remove(e);
+  --queued_;
+  e->running = true;
+  running_.PushBack(e);
+  ++in_flight_;
+  MainThreadQueueStats& stats = stats_[next];
+  double wait = now - e->queued_ms;
+  ++stats.started;
+  if (aged) ++stats.aged;
+  stats.wait_ms += wait;
+  stats.max_wait_ms = std::max(stats.max_wait_ms, wait);
+  // Room for a blocked submitter.
+  pthread_cond_broadcast(&changed_);
+  return e;
+}
+
+int32_t MainThreadRunner::RunJob(MainThreadJob* job, Priority priority,
+                                 const void* tag) {
+  MainThreadJobEntry e;
+  Submit(&e, &job, 1, priority, tag);
+  Wait(&e);
+  pthread_mutex_unlock(&lock_);
+  if (e.error != 0) {
+    errno = e.error;
+  }
   return e.result;
 }
 
+void MainThreadRunner::RunJobs(MainThreadJob** jobs, int32_t* results,
+                               int count, Priority priority,
+                               const void* tag) {
+  if (count == 0) {
+    return;
+  }
+  // The usual batch is a handful of chunks; only a larger one costs an
+  // allocation.
+  MainThreadJobEntry stack_entries[kMaxStackEntries];
+  std::vector<MainThreadJobEntry> heap_entries;
+  MainThreadJobEntry *entries = stack_entries;
+  if (count > kMaxStackEntries) {
+    heap_entries.resize(count);
+    entries = &heap_entries[0];
+  }
+  Submit(entries, jobs, count, priority, tag);
+  int error = 0;
+  for (int i = 0; i < count; ++i) {
+    Wait(&entries[i]);
+    results[i] = entries[i].result;
+    if (entries[i].error != 0) error = entries[i].error;
+  }
+  pthread_mutex_unlock(&lock_);
+  if (error != 0) {
+    errno = error;
+  }
+}
+
 void MainThreadRunner::StuffResult(void *arg, int32_t result) {
   MainThreadJobEntry *e = reinterpret_cast<MainThreadJobEntry*>(arg);
+  MainThreadRunner *runner = e->runner;
 
+  pthread_mutex_lock(&runner->lock_);
   e->result = result;
-  DoWorkShim(e->runner, 0);
-  sem_post(&e->done);
+  e->done = true;
+  runner->running_.Remove(e);
+  --runner->in_flight_;
+  // e may be gone as soon as the lock is released, unless it came from
+  // StartJob().  Then it is freed here, or by a pending AbortShim().
+  MainThreadJobCallback callback = e->callback;
+  bool aborting = e->aborting;
+  pthread_cond_broadcast(&runner->changed_);
+  pthread_mutex_unlock(&runner->lock_);
+  if (callback != NULL) {
+    callback(e->callback_arg, e->result, e->error);
+    if (!aborting) {
+      delete e;
+    }
+  }
+  // Start whatever was queued meanwhile without waiting for the next poll.
+  runner->DoWork();
 }
 
 void MainThreadRunner::DoWorkShim(void *p, int32_t unused) {
   MainThreadRunner *mtr = (MainThreadRunner *)p;
+  pthread_mutex_lock(&mtr->lock_);
+  mtr->ExpireJobs();
+  pthread_mutex_unlock(&mtr->lock_);
   mtr->DoWork();
+  pp::Module::Get()->core()->CallOnMainThread(10, pp::CompletionCallback(&DoWorkShim, mtr), PP_OK);
 }
 
 void MainThreadRunner::DoWork(void) {
-  //fprintf(stderr, "in DoWork()\n");
-  pthread_mutex_lock(&lock_);
-  if (!job_queue_.empty()) { 
-    MainThreadJobEntry *e = job_queue_.front();
-    job_queue_.pop_front();
-    if (e == NULL || e->job == NULL) fprintf(stderr, "NULL POINTERS\n");
-    fprintf(stderr, "about to Run\n");
+  // Queued jobs are started up to max_in_flight_; their requests then
+  // run side by side.  The lock is not held while they run, since a job
+  // that completes right away comes back here through StuffResult().
+  for (;;) {
+    pthread_mutex_lock(&lock_);
+    MainThreadJobEntry *e = NextJob();
+    pthread_mutex_unlock(&lock_);
+    if (e == NULL) {
+      break;
+    }
+    MOUNT_TRACE("MainThreadRunner: running job %p\n", e->job);
     e->job->Run(e);
-  } else {
-    //fprintf(stderr, "Creating callback to DoWorkShim\n");
-    pp::Module::Get()->core()->CallOnMainThread(10, pp::CompletionCallback(&DoWorkShim, this), PP_OK);
   }
-  pthread_mutex_unlock(&lock_);
 }
 
 
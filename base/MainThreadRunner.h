@@ -7,7 +7,7 @@
 #define PACKAGES_SCRIPTS_FILESYS_BASE_MAINTHREADRUNNER_H_
 
 #include <pthread.h>
-#include <list>
+#include <stddef.h>
 #include <ppapi/cpp/instance.h>
 #include <ppapi/cpp/completion_callback.h>
 #include <ppapi/cpp/completion_callback.h>
@@ -16,23 +16,80 @@
 #include <ppapi/cpp/url_response_info.h>
 #include <ppapi/cpp/var.h>
 #include <ppapi/c/pp_errors.h>
-#include <semaphore.h>
 
 struct MainThreadJobEntry;
 class MainThreadRunner;
 
+// Called on the main thread once a job started by
+// MainThreadRunner::StartJob() is done, with its result and 0,
+// ETIMEDOUT or ECANCELED.
+typedef void (*MainThreadJobCallback)(void *arg, int32_t result, int error);
+
+// A job deletes itself once it has run and reported its result through
+// MainThreadRunner::StuffResult().  One that never gets to run is
+// deleted by the runner.
 class MainThreadJob {
  public:
   virtual ~MainThreadJob() {}
   virtual void Run(MainThreadJobEntry* e) = 0;
+  // Abort() is called on the main thread when a running job is cancelled
+  // or times out.  It should make the job finish soon; the job still
+  // reports its result as usual.
+  virtual void Abort(MainThreadJobEntry* e) {}
 };
 
 struct MainThreadJobEntry {
   pp::Instance *pepper_instance;
   MainThreadRunner *runner;
   MainThreadJob *job;
-  sem_t done;
   int32_t result;
+  int priority;
+  // When the job was queued and when it has to be done by, in
+  // milliseconds.  A zero deadline_ms means none.
+  double queued_ms;
+  double deadline_ms;
+  // Jobs submitted with the same tag can be cancelled together.
+  const void *tag;
+  bool running;
+  bool done;
+  // Whether an Abort() call is still to come on the main thread.
+  bool aborting;
+  // ETIMEDOUT or ECANCELED once the job has been given up on.
+  int error;
+  // Set for jobs started by StartJob(), which own their entry.
+  MainThreadJobCallback callback;
+  void *callback_arg;
+  // Links in the runner's queue or running list.
+  MainThreadJobEntry *prev;
+  MainThreadJobEntry *next;
+};
+
+// A list of entries linked through their own prev and next fields, so
+// that queueing a job allocates nothing.  An entry is on at most one
+// list at a time.
+struct MainThreadJobList {
+  MainThreadJobList() : head(NULL), tail(NULL), size(0) {}
+  void PushBack(MainThreadJobEntry *e);
+  void Remove(MainThreadJobEntry *e);
+  bool empty(void) const { return head == NULL; }
+  MainThreadJobEntry *head;
+  MainThreadJobEntry *tail;
+  size_t size;
+};
+
+// Counters for one priority class of MainThreadRunner jobs.
+struct MainThreadQueueStats {
+  MainThreadQueueStats()
+    : depth(0), started(0), aged(0), wait_ms(0), max_wait_ms(0) {}
+  // Number of jobs waiting to be started.
+  int depth;
+  // Number of jobs started, and of those that went ahead of a higher
+  // class because they had waited too long.
+  int64_t started;
+  int64_t aged;
+  // Total and longest time jobs waited to be started, in milliseconds.
+  double wait_ms;
+  double max_wait_ms;
 };
 
 class MainThreadJobOpen : public MainThreadJob {
@@ -52,15 +109,109 @@ class MainThreadRunner {
   MainThreadRunner(pp::Instance *instance);
   ~MainThreadRunner();
 
-  int32_t RunJob(MainThreadJob* job);
+  // Jobs of a higher priority class are started before queued jobs of
+  // a lower one, so that a bulk upload does not hold up an open().
+  enum Priority {
+    kInteractive,  // reads someone is waiting for
+    kMetadata,     // stat, list and remove
+    kBackground,   // writes and flushes
+    kPrefetch,     // reads no one is waiting for yet
+    kNumPriorities
+  };
+
+  // RunJob() queues job and waits for its result.  A job that is not
+  // done within the job timeout, or that is cancelled, is aborted; then
+  // errno is set to ETIMEDOUT or ECANCELED and the result is whatever
+  // the aborted job reported, or 0 if it never ran.  When the queue is
+  // full and does not block, the job is not run, errno is EAGAIN and
+  // the result is 0.
+  int32_t RunJob(MainThreadJob* job, Priority priority = kInteractive,
+                 const void* tag = NULL);
+  // RunJobs() starts count jobs at once, so that their requests are in
+  // flight together, and waits for all of them.  The result of jobs[i]
+  // is stored in results[i].
+  void RunJobs(MainThreadJob** jobs, int32_t* results, int count,
+               Priority priority = kInteractive, const void* tag = NULL);
+  // StartJob() queues job and returns without waiting for it; callback
+  // is called with arg once it is done.  No thread is blocked meanwhile,
+  // and the job timeout is enforced by the main thread's polling.
+  // Returns 0, or -1 with errno EAGAIN if the queue is full, in which
+  // case job is deleted and callback is never called.
+  int StartJob(MainThreadJob* job, Priority priority, const void* tag,
+               MainThreadJobCallback callback, void* arg);
   static void StuffResult(void *arg, int32_t result);
 
+  // Cancel() gives up on every queued or running job submitted with tag.
+  // Jobs submitted afterwards are not affected.
+  void Cancel(const void* tag);
+
+  // At most max_in_flight jobs run at a time; 0 means no limit.  The
+  // browser only keeps a few requests per server open anyway and starts
+  // the rest in order, so queueing them here is what lets priorities
+  // take effect.  A job that has waited max_wait seconds is started
+  // ahead of any higher class, so that none waits forever.
+  void set_max_in_flight(int max_in_flight);
+  void set_max_wait(double max_wait);
+  static const int kDefaultMaxInFlight = 6;
+  static const double kDefaultMaxWait;
+
+  // A job that has not finished job_timeout seconds after it was queued
+  // is aborted; 0 means jobs may take forever.
+  void set_job_timeout(double job_timeout);
+  static const double kDefaultJobTimeout;
+
+  // At most max_queued jobs wait to be started; 0 means no limit.  When
+  // the queue is full, RunJob() waits for room if block is set and
+  // fails with EAGAIN otherwise.  RunJobs() waits for room for all its
+  // jobs, or for an empty queue if there never is room for that many.
+  void set_max_queued(size_t max_queued, bool block);
+  static const size_t kDefaultMaxQueued = 256;
+
+  // RunJobs() keeps the entries of up to this many jobs on its stack.
+  static const int kMaxStackEntries = 16;
+
+  MainThreadQueueStats queue_stats(Priority priority);
+
  private:
   static void DoWorkShim(void *p, int32_t unused);
   void DoWork(void);
+  void InitEntry(MainThreadJobEntry *e, MainThreadJob* job,
+                 Priority priority, const void* tag);
+  // Set up the count entries for jobs and queue them, once there is room
+  // or, if the queue does not block, fail them with EAGAIN.  Returns
+  // with lock_ held.
+  void Submit(MainThreadJobEntry *entries, MainThreadJob** jobs, int count,
+              Priority priority, const void* tag);
+  // Take the next job to start off its queue, or return NULL if there
+  // is none or enough are running.  Called with lock_ held.
+  MainThreadJobEntry *NextJob(void);
+  // Wait for e to be done, aborting it at its deadline.  Called and
+  // returns with lock_ held.
+  void Wait(MainThreadJobEntry *e);
+  // Give up on e with error.  A queued job is dropped right away; a
+  // running one is aborted on the main thread.  Called with lock_ held.
+  void GiveUp(MainThreadJobEntry *e, int error);
+  static void AbortShim(void *p, int32_t unused);
+  // Report the outcome of a StartJob() job and free its entry.
+  static void CompleteShim(void *p, int32_t unused);
+  // Give up on StartJob() jobs past their deadline, which nobody waits
+  // on to do it.  Called with lock_ held.
+  void ExpireJobs(void);
+  static double NowMs(void);
 
   pthread_mutex_t lock_;
-  std::list<MainThreadJobEntry*> job_queue_;
+  // Signalled when a job is done or leaves the queue.
+  pthread_cond_t changed_;
+  MainThreadJobList job_queue_[kNumPriorities];
+  MainThreadJobList running_;
+  size_t queued_;
+  size_t max_queued_;
+  bool block_when_full_;
+  double job_timeout_ms_;
+  MainThreadQueueStats stats_[kNumPriorities];
+  int max_in_flight_;
+  int in_flight_;
+  double max_wait_ms_;
   pp::Instance *pepper_instance_;
 };
 
@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that be
+ * found in the LICENSE file.
+ */
+#include "Mount.h"
+#include <errno.h>
+#include "ThreadPool.h"
+#include "dirent.h"
+
+// One call waiting for, or running on, the async pool.
+struct Mount::AsyncCall {
+  enum Op { kRead, kWrite, kStat, kFsync, kStatPath };
+  Mount *mount;
+  Op op;
+  std::string path;
+  ino_t node;
+  off_t offset;
+  void *buf;
+  size_t count;
+  struct stat *st;
+  AsyncCallback callback;
+  void *arg;
+};
+
+ThreadPool *Mount::io_pool_ = NULL;
+
+void Mount::InitIoPool(void) {
+  // Shared by every mount for the life of the process.
+  io_pool_ = new ThreadPool();
+}
+
+ThreadPool *Mount::io_pool(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, InitIoPool);
+  return io_pool_;
+}
+
+void Mount::ReadAsync(ino_t node, off_t offset, void *buf, size_t count,
+                      AsyncCallback callback, void *arg) {
+  AsyncCall *call = new AsyncCall;
+  call->op = AsyncCall::kRead;
+  call->node = node;
+  call->offset = offset;
+  call->buf = buf;
+  call->count = count;
+  call->callback = callback;
+  call->arg = arg;
+  StartAsync(call);
+}
+
+void Mount::WriteAsync(ino_t node, off_t offset, const void *buf,
+                       size_t count, AsyncCallback callback, void *arg) {
+  AsyncCall *call = new AsyncCall;
+  call->op = AsyncCall::kWrite;
+  call->node = node;
+  call->offset = offset;
+  call->buf = const_cast<void*>(buf);
+  call->count = count;
+  call->callback = callback;
+  call->arg = arg;
+  StartAsync(call);
+}
+
+void Mount::StatAsync(ino_t node, struct stat *buf,
+                      AsyncCallback callback, void *arg) {
+  AsyncCall *call = new AsyncCall;
+  call->op = AsyncCall::kStat;
+  call->node = node;
+  call->st = buf;
+  call->callback = callback;
+  call->arg = arg;
+  StartAsync(call);
+}
+
+void Mount::FsyncAsync(ino_t node, AsyncCallback callback, void *arg) {
+  AsyncCall *call = new AsyncCall;
+  call->op = AsyncCall::kFsync;
+  call->node = node;
+  call->callback = callback;
+  call->arg = arg;
+  StartAsync(call);
+}
+
+void Mount::StatPathAsync(const std::string& path, struct stat *buf,
+                          AsyncCallback callback, void *arg) {
+  AsyncCall *call = new AsyncCall;
+  call->op = AsyncCall::kStatPath;
+  call->path = path;
+  call->st = buf;
+  call->callback = callback;
+  call->arg = arg;
+  StartAsync(call);
+}
+
+int Mount::ReadDirPlus(const std::string& path,
+                       std::vector<DirentPlus>* entries) {
+  struct stat st;
+  errno = 0;
+  if (GetNode(path, &st) != 0) {
+    if (errno == 0) {
+      errno = ENOENT;
+    }
+    return -1;
+  }
+  std::string prefix = path;
+  if (prefix.empty() || prefix[prefix.size() - 1] != '/') {
+    prefix += "/";
+  }
+  ino_t dir = st.st_ino;
+  Ref(dir);
+  std::vector<struct dirent> dirents(64);
+  off_t offset = 0;
+  int n;
+  while ((n = Getdents(dir, offset, &dirents[0],
+                       dirents.size() * sizeof(struct dirent))) > 0) {
+    for (size_t i = 0; i < n / sizeof(struct dirent); ++i) {
+      DirentPlus entry;
+      entry.d = dirents[i];
+      offset = entry.d.d_off;
+      // An entry removed since Getdents() is left out.
+      if (GetNode(prefix + entry.d.d_name, &entry.st) == 0) {
+        entries->push_back(entry);
+      }
+    }
+  }
+  Unref(dir);
+  return n < 0 ? -1 : 0;
+}
+
+void Mount::StartAsync(AsyncCall *call) {
+  call->mount = this;
+  if (IoThreads() == 0) {
+    RunAsync(call);
+    return;
+  }
+  if (io_pool()->Submit(RunAsync, call) != 0) {
+    AsyncCallback callback = call->callback;
+    void *arg = call->arg;
+    delete call;
+    callback(arg, -1, EAGAIN);
+  }
+}
+
+void Mount::RunAsync(void *p) {
+  AsyncCall *call = reinterpret_cast<AsyncCall*>(p);
+  Mount *mount = call->mount;
+  ssize_t result = -1;
+  errno = 0;
+  switch (call->op) {
+    case AsyncCall::kRead:
+      result = mount->Read(call->node, call->offset, call->buf, call->count);
+      break;
+    case AsyncCall::kWrite:
+      result = mount->Write(call->node, call->offset, call->buf,
+                            call->count);
+      break;
+    case AsyncCall::kStat:
+      result = mount->Stat(call->node, call->st);
+      break;
+    case AsyncCall::kFsync:
+      result = mount->Fsync(call->node);
+      break;
+    case AsyncCall::kStatPath:
+      result = mount->GetNode(call->path, call->st);
+      if (result == 0) {
+        result = mount->Stat(call->st->st_ino, call->st);
+      } else if (errno == 0) {
+        errno = ENOENT;
+      }
+      break;
+  }
+  int error = result == -1 ? errno : 0;
+  AsyncCallback callback = call->callback;
+  void *arg = call->arg;
+  delete call;
+  callback(arg, result, error);
+}
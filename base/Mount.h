@@ -9,6 +9,10 @@
 #include <fcntl.h>
 #include <string>
 #include <sys/stat.h>
+#include <vector>
+
+struct DirentPlus;
+class ThreadPool;
 
 // Mount serves as the base mounting class that will be used by
 // the mount manager (class MountManager).  The mount manager
@@ -39,9 +43,73 @@ class Mount {
   virtual int Getdents(ino_t node, off_t offset,
                        struct dirent *dirp, unsigned int count) { return -1; }
 
+  // ReadDirPlus() appends every entry of the directory at path to
+  // entries, each with its attributes, so that listing a directory and
+  // stat'ing what is in it takes one call.  Returns 0, or -1 with errno
+  // set.  The default goes through Getdents() and a GetNode() of each
+  // entry; mounts that can do better answer from one pass or request.
+  virtual int ReadDirPlus(const std::string& path,
+                          std::vector<DirentPlus>* entries);
+
   virtual ssize_t Read(ino_t node, off_t offset, void *buf, size_t count) { return -1; }
   virtual ssize_t Write(ino_t node, off_t offset, const void *buf, size_t count) { return -1; }
 
+  // Prefetch() asks the mount to bring count bytes at offset of node
+  // into whatever local copy of the file it keeps, so that later reads
+  // of them do not wait on its backend.  It is called by ReadAhead from
+  // a thread of its own and may block.  ReadAhead holds a reference to
+  // node for the duration.  Returns 0 if the mount prefetches; mounts
+  // without a slow backend leave it alone.
+  virtual int Prefetch(ino_t node, off_t offset, size_t count) { return -1; }
+
+  // SupportsPrefetch() is true for mounts that implement Prefetch(), so
+  // that reads from the others do not queue readahead for nothing.
+  virtual bool SupportsPrefetch(void) { return false; }
+
+  // PrefetchBatch() is told the nodes a KernelProxy::submit() batch is
+  // about to read, so that a mount with a remote backend can fetch them
+  // in fewer round trips.  The reads follow right after it returns.
+  virtual void PrefetchBatch(const std::vector<ino_t>& nodes) {}
+
+  // Called once an asynchronous call is done, with what the synchronous
+  // call returns and, if that is -1, the errno it sets.
+  typedef void (*AsyncCallback)(void *arg, ssize_t result, int error);
+
+  // The Async calls start Read(), Write(), Stat() and Fsync() and return
+  // at once; callback(arg, ...) follows once they are done, possibly on
+  // the PPAPI main thread or before the call returns, so it must not
+  // block.  Buffers have to stay valid until then.  The defaults run
+  // the synchronous calls on io_pool() if IoThreads() says they block,
+  // and before returning otherwise; mounts whose backend completes
+  // through callbacks do better.
+  virtual void ReadAsync(ino_t node, off_t offset, void *buf, size_t count,
+                         AsyncCallback callback, void *arg);
+  virtual void WriteAsync(ino_t node, off_t offset, const void *buf,
+                          size_t count, AsyncCallback callback, void *arg);
+  virtual void StatAsync(ino_t node, struct stat *buf,
+                         AsyncCallback callback, void *arg);
+  virtual void FsyncAsync(ino_t node, AsyncCallback callback, void *arg);
+  // StatPathAsync() starts GetNode() of path followed by Stat() of the
+  // node, the lookup a later open() or stat() of path then finds done.
+  virtual void StatPathAsync(const std::string& path, struct stat *buf,
+                             AsyncCallback callback, void *arg);
+
+  // IoThreads() is the number of threads the mount's blocking calls can
+  // keep busy at once.  0, the default, declares calls that never wait
+  // for long.  MountManager sizes io_pool() for the mounts it has.
+  virtual int IoThreads(void) { return 0; }
+
+  // The pool shared by all mounts that blocking calls are offloaded to.
+  static ThreadPool *io_pool(void);
+
+ private:
+  struct AsyncCall;
+  // Queue call on the pool, or fail it with EAGAIN, or run it now if
+  // the mount does not block.
+  void StartAsync(AsyncCall *call);
+  static void RunAsync(void *p);
+  static void InitIoPool(void);
+  static ThreadPool *io_pool_;
 };
 
 #endif  // PACKAGES_SCRIPTS_FILESYS_BASE_MOUNT_H_
@@ -4,11 +4,14 @@
  * found in the LICENSE file.
  */
 #include "MountManager.h"
+#include <algorithm>
 
 static pthread_once_t mount_manager_once_ = PTHREAD_ONCE_INIT;
 MountManager *MountManager::mm_instance_;
 
-MountManager::MountManager() {
+MountManager::MountManager()
+  : cache_budget_(kDefaultCacheBudget),
+    max_io_threads_(kDefaultMaxIoThreads) {
   Init();
 }
 
@@ -44,6 +47,7 @@ int MountManager::AddMount(Mount *m, const char *path) {
   if (mount) return -1;  // mount already exists
   if (p.length() == 0) return -3;  // bad path
   mount_map_[path] = m;
+  SizeIoPool();
   return 0;
 }
 
@@ -56,15 +60,39 @@ int MountManager::RemoveMount(const char *path) {
   } else {
     if (cwd_mount_ == it->second)
       cwd_mount_ = NULL;
+    // No prefetching into a mount that is going away.
+    kp_.readahead()->Forget(it->second);
     // erase() calls the destructor
     mount_map_.erase(it);
+    SizeIoPool();
     return 0;
   }
 }
 
 void MountManager::ClearMounts(void) {
+  std::map<std::string, Mount *>::iterator it;
+  for (it = mount_map_.begin(); it != mount_map_.end(); ++it) {
+    kp_.readahead()->Forget(it->second);
+  }
   mount_map_.clear();
   cwd_mount_ = NULL;
+  SizeIoPool();
+}
+
+void MountManager::set_max_io_threads(int max_io_threads) {
+  max_io_threads_ = max_io_threads;
+  SizeIoPool();
+}
+
+void MountManager::SizeIoPool(void) {
+  int threads = 0;
+  std::map<std::string, Mount *>::iterator it;
+  for (it = mount_map_.begin(); it != mount_map_.end(); ++it) {
+    if (it->second) {
+      threads += it->second->IoThreads();
+    }
+  }
+  Mount::io_pool()->set_max_threads(std::min(threads, max_io_threads_));
 }
 
 std::pair<Mount*, ino_t> MountManager::GetNode(std::string path) {
@@ -18,9 +18,11 @@
 #include <utility>
 #include <vector>
 #include "../memory/MemMount.h"
+#include "CachingMount.h"
 #include "KernelProxy.h"
 #include "Mount.h"
 #include "PathHandle.h"
+#include "ThreadPool.h"
 
 class Mount;
 // MountManager serves as an indirection layer between libc and IRT.  Different
@@ -58,17 +60,35 @@ class MountManager {
 
   KernelProxy *kp() { return &kp_; }
 
+  // The memory budget shared by CachingMounts that are not given their
+  // own.
+  CacheBudget *cache_budget() { return &cache_budget_; }
+
   std::pair<Mount*, ino_t> GetNode(std::string path);
 
+  // Blocking mount calls are offloaded to Mount::io_pool(), which gets
+  // as many threads as the mounts added declare with IoThreads(), up to
+  // max_io_threads.
+  void set_max_io_threads(int max_io_threads);
+  ThreadPoolStats io_stats(void) { return Mount::io_pool()->stats(); }
+
  private:
+  // Give the I/O pool the threads the mounts ask for.
+  void SizeIoPool(void);
+
   std::map<std::string, Mount*> mount_map_;
   KernelProxy kp_;
+  CacheBudget cache_budget_;
   static MountManager *mm_instance_;
   Mount *cwd_mount_;
+  int max_io_threads_;
 
   MountManager();
   static void Instantiate();
   void Init(void);
+
+  static const size_t kDefaultCacheBudget = 32 * 1024 * 1024;
+  static const int kDefaultMaxIoThreads = 16;
 };
 
 #endif  // PACKAGES_SCRIPTS_FILESYS_BASE_MOUNTMANAGER_H_
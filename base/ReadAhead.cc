@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that be
+ * found in the LICENSE file.
+ */
+#include "ReadAhead.h"
+#include <algorithm>
+#include "Mount.h"
+
+const size_t ReadAheadWindow::kMinWindow;
+const size_t ReadAheadWindow::kMaxWindow;
+const size_t ReadAhead::kMaxPending;
+
+ReadAheadWindow::ReadAheadWindow(size_t min_window, size_t max_window)
+  : min_window_(min_window),
+    max_window_(max_window),
+    next_offset_(0),
+    ahead_end_(0),
+    window_(0) {
+}
+
+ReadAheadRange ReadAheadWindow::Observe(off_t offset, size_t count) {
+  off_t end = offset + count;
+  bool sequential = offset == next_offset_;
+  next_offset_ = end;
+  if (!sequential) {
+    window_ /= 2;
+    if (window_ < min_window_) {
+      window_ = 0;
+    }
+    ahead_end_ = end;
+    return ReadAheadRange();
+  }
+  if (window_ == 0) {
+    window_ = min_window_;
+  } else if (end + static_cast<off_t>(window_ / 2) < ahead_end_) {
+    // Still comfortably inside the prefetched data.
+    return ReadAheadRange();
+  } else if (ahead_end_ > offset) {
+    // The reader is keeping up with the prefetching; go further ahead.
+    window_ = std::min(window_ * 2, max_window_);
+  }
+  // Otherwise nothing is prefetched past this read, as after a seek, and
+  // prefetching restarts with the current window.
+  off_t start = std::max(ahead_end_, end);
+  ahead_end_ = end + window_;
+  return ReadAheadRange(start, ahead_end_ - start);
+}
+
+ReadAhead::ReadAhead()
+  : busy_mount_(NULL),
+    started_(false),
+    stop_(false) {
+  pthread_mutex_init(&lock_, NULL);
+  pthread_cond_init(&work_, NULL);
+  pthread_cond_init(&idle_, NULL);
+}
+
+ReadAhead::~ReadAhead() {
+  pthread_mutex_lock(&lock_);
+  stop_ = true;
+  std::list<Request> dropped;
+  dropped.swap(queue_);
+  pthread_cond_signal(&work_);
+  bool started = started_;
+  pthread_mutex_unlock(&lock_);
+  Release(dropped);
+  if (started) {
+    pthread_join(thread_, NULL);
+  }
+  pthread_cond_destroy(&idle_);
+  pthread_cond_destroy(&work_);
+  pthread_mutex_destroy(&lock_);
+}
+
+void ReadAhead::Submit(Mount *mount, ino_t node, off_t offset, size_t count) {
+  pthread_mutex_lock(&lock_);
+  if (queue_.size() >= kMaxPending) {
+    ++stats_.dropped;
+    pthread_mutex_unlock(&lock_);
+    return;
+  }
+  // The worker is only started once somebody reads sequentially.
+  if (!started_) {
+    if (pthread_create(&thread_, NULL, WorkerShim, this) != 0) {
+      ++stats_.dropped;
+      pthread_mutex_unlock(&lock_);
+      return;
+    }
+    started_ = true;
+  }
+  Request request;
+  request.mount = mount;
+  request.node = node;
+  request.offset = offset;
+  request.count = count;
+  // Taken before the worker can see the request, and released once it is
+  // done with it.
+  mount->Ref(node);
+  queue_.push_back(request);
+  pthread_cond_signal(&work_);
+  pthread_mutex_unlock(&lock_);
+}
+
+void ReadAhead::Forget(Mount *mount) {
+  std::list<Request> dropped;
+  pthread_mutex_lock(&lock_);
+  std::list<Request>::iterator it = queue_.begin();
+  while (it != queue_.end()) {
+    std::list<Request>::iterator next = it;
+    ++next;
+    if (it->mount == mount) {
+      dropped.splice(dropped.end(), queue_, it);
+    }
+    it = next;
+  }
+  while (mount != NULL && busy_mount_ == mount) {
+    pthread_cond_wait(&idle_, &lock_);
+  }
+  pthread_mutex_unlock(&lock_);
+  Release(dropped);
+}
+
+void ReadAhead::Drain(void) {
+  pthread_mutex_lock(&lock_);
+  while (!queue_.empty() || busy_mount_ != NULL) {
+    pthread_cond_wait(&idle_, &lock_);
+  }
+  pthread_mutex_unlock(&lock_);
+}
+
+ReadAheadStats ReadAhead::stats(void) {
+  pthread_mutex_lock(&lock_);
+  ReadAheadStats stats = stats_;
+  pthread_mutex_unlock(&lock_);
+  return stats;
+}
+
+void ReadAhead::Release(const std::list<Request>& requests) {
+  std::list<Request>::const_iterator it;
+  for (it = requests.begin(); it != requests.end(); ++it) {
+    it->mount->Unref(it->node);
+  }
+}
+
+void *ReadAhead::WorkerShim(void *p) {
+  ReadAhead *ra = reinterpret_cast<ReadAhead*>(p);
+  ra->Worker();
+  return NULL;
+}
+
+void ReadAhead::Worker(void) {
+  pthread_mutex_lock(&lock_);
+  for (;;) {
+    while (queue_.empty() && !stop_) {
+      pthread_cond_wait(&work_, &lock_);
+    }
+    if (stop_) {
+      break;
+    }
+    Request request = queue_.front();
+    queue_.pop_front();
+    busy_mount_ = request.mount;
+    pthread_mutex_unlock(&lock_);
+
+    int result = request.mount->Prefetch(request.node, request.offset,
+                                         request.count);
+    request.mount->Unref(request.node);
+
+    pthread_mutex_lock(&lock_);
+    if (result == 0) {
+      ++stats_.prefetched;
+      stats_.prefetched_bytes += request.count;
+    }
+    busy_mount_ = NULL;
+    pthread_cond_broadcast(&idle_);
+  }
+  pthread_mutex_unlock(&lock_);
+}
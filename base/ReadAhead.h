@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that be
+ * found in the LICENSE file.
+ */
+#ifndef PACKAGES_SCRIPTS_FILESYS_BASE_READAHEAD_H_
+#define PACKAGES_SCRIPTS_FILESYS_BASE_READAHEAD_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <list>
+
+class Mount;
+
+// A byte range of a file.  An empty range (count == 0) means nothing.
+struct ReadAheadRange {
+  ReadAheadRange() : offset(0), count(0) {}
+  ReadAheadRange(off_t o, size_t c) : offset(o), count(c) {}
+  off_t offset;
+  size_t count;
+};
+
+// ReadAheadWindow follows the reads made through one file handle and
+// decides what to prefetch.  A read that starts where the previous one
+// ended is sequential.  Sequential readers are kept window() bytes ahead,
+// and each time they catch up with the second half of what was
+// prefetched the window doubles, up to max_window.  A read anywhere else
+// halves the window, and turns readahead off once it drops below
+// min_window, until the reader goes sequential again.
+class ReadAheadWindow {
+ public:
+  explicit ReadAheadWindow(size_t min_window = kMinWindow,
+                           size_t max_window = kMaxWindow);
+
+  // Observe() records a read of count bytes at offset and returns the
+  // range to prefetch now, which is empty if there is nothing to do.
+  ReadAheadRange Observe(off_t offset, size_t count);
+
+  size_t window(void) const { return window_; }
+
+  static const size_t kMinWindow = 64 * 1024;
+  static const size_t kMaxWindow = 4 * 1024 * 1024;
+
+ private:
+  size_t min_window_;
+  size_t max_window_;
+  // Where the next sequential read starts.
+  off_t next_offset_;
+  // End of the data prefetched so far.
+  off_t ahead_end_;
+  size_t window_;
+};
+
+// Counters describing the work done by a ReadAhead.
+struct ReadAheadStats {
+  ReadAheadStats() : prefetched(0), dropped(0), prefetched_bytes(0) {}
+  // Ranges the mounts accepted for prefetching.
+  int64_t prefetched;
+  // Ranges not prefetched because the queue was full.
+  int64_t dropped;
+  // Bytes in those ranges.
+  int64_t prefetched_bytes;
+};
+
+// ReadAhead calls Mount::Prefetch() for submitted ranges on a thread of
+// its own, so that readers do not wait for it.  A queued range holds a
+// reference to its node, so that the node outlives the file handle that
+// submitted it.  Prefetching is advisory: when more than kMaxPending
+// ranges are waiting, new ones are dropped.
+class ReadAhead {
+ public:
+  ReadAhead();
+  ~ReadAhead();
+
+  // Submit() queues a prefetch of count bytes at offset of node.  Only
+  // submit ranges of mounts whose SupportsPrefetch() is true.
+  void Submit(Mount *mount, ino_t node, off_t offset, size_t count);
+
+  // Forget() drops the queued ranges of mount and waits until mount is
+  // not being prefetched from anymore.  Call it before deleting mount.
+  void Forget(Mount *mount);
+
+  // Drain() waits until every queued range has been prefetched.
+  void Drain(void);
+
+  ReadAheadStats stats(void);
+
+  static const size_t kMaxPending = 16;
+
+ private:
+  struct Request {
+    Mount *mount;
+    ino_t node;
+    off_t offset;
+    size_t count;
+  };
+
+  // Unrefs the nodes of requests that were dropped from queue_.
+  static void Release(const std::list<Request>& requests);
+
+  static void *WorkerShim(void *p);
+  void Worker(void);
+
+  pthread_mutex_t lock_;
+  // Signalled when work is queued or stop_ is set.
+  pthread_cond_t work_;
+  // Signalled when the worker finishes a request.
+  pthread_cond_t idle_;
+  std::list<Request> queue_;
+  // The mount the worker is calling into, or NULL.
+  Mount *busy_mount_;
+  bool started_;
+  bool stop_;
+  pthread_t thread_;
+  ReadAheadStats stats_;
+};
+
+#endif  // PACKAGES_SCRIPTS_FILESYS_BASE_READAHEAD_H_
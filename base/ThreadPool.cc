@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that be
+ * found in the LICENSE file.
+ */
+#include "ThreadPool.h"
+#include <sys/time.h>
+#include <algorithm>
+
+const int ThreadPool::kDefaultMaxThreads;
+const int ThreadPool::kMaxThreads;
+
+ThreadPool::ThreadPool(int max_threads)
+  : max_threads_(std::max(1, std::min(max_threads, kMaxThreads))),
+    next_(0),
+    idle_(0),
+    stop_(false) {
+  pthread_mutex_init(&lock_, NULL);
+  pthread_cond_init(&work_, NULL);
+  // Never reallocated, so that threads can read it without lock_.
+  workers_.reserve(kMaxThreads);
+  pthread_key_create(&self_, NULL);
+}
+
+ThreadPool::~ThreadPool() {
+  pthread_mutex_lock(&lock_);
+  stop_ = true;
+  pthread_cond_broadcast(&work_);
+  pthread_mutex_unlock(&lock_);
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    pthread_join(threads_[i], NULL);
+  }
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    pthread_mutex_destroy(&workers_[i]->lock);
+    delete workers_[i];
+  }
+  pthread_key_delete(self_);
+  pthread_cond_destroy(&work_);
+  pthread_mutex_destroy(&lock_);
+}
+
+int64_t ThreadPool::NowMicros(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+int ThreadPool::Queued(void) {
+  int queued = 0;
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    pthread_mutex_lock(&workers_[i]->lock);
+    queued += workers_[i]->queue.size();
+    pthread_mutex_unlock(&workers_[i]->lock);
+  }
+  return queued;
+}
+
+int ThreadPool::Submit(Task task, void *arg) {
+  Worker *self = reinterpret_cast<Worker*>(pthread_getspecific(self_));
+  pthread_mutex_lock(&lock_);
+  int queued = Queued();
+  if (idle_ <= queued && static_cast<int>(threads_.size()) < max_threads_) {
+    Worker *worker = new Worker;
+    worker->pool = this;
+    worker->index = workers_.size();
+    pthread_mutex_init(&worker->lock, NULL);
+    workers_.push_back(worker);
+    worker->peers = workers_.size();
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, WorkerShim, worker) == 0) {
+      threads_.push_back(thread);
+    } else {
+      workers_.pop_back();
+      pthread_mutex_destroy(&worker->lock);
+      delete worker;
+      if (threads_.empty()) {
+        pthread_mutex_unlock(&lock_);
+        return -1;
+      }
+    }
+  }
+  Item item;
+  item.task = task;
+  item.arg = arg;
+  item.queued_us = NowMicros();
+  // A pool thread keeps what it submits; the rest is dealt out.
+  if (self == NULL || self->pool != this) {
+    self = workers_[next_++ % workers_.size()];
+  }
+  pthread_mutex_lock(&self->lock);
+  self->queue.push_back(item);
+  pthread_mutex_unlock(&self->lock);
+  ++stats_.submitted;
+  stats_.max_queued = std::max(stats_.max_queued, queued + 1);
+  // Any idle thread will do: it takes from the others when its own
+  // queue is empty.
+  pthread_cond_signal(&work_);
+  pthread_mutex_unlock(&lock_);
+  return 0;
+}
+
+void ThreadPool::set_max_threads(int max_threads) {
+  pthread_mutex_lock(&lock_);
+  max_threads_ = std::max(1, std::min(max_threads, kMaxThreads));
+  pthread_mutex_unlock(&lock_);
+}
+
+int ThreadPool::max_threads(void) {
+  pthread_mutex_lock(&lock_);
+  int max_threads = max_threads_;
+  pthread_mutex_unlock(&lock_);
+  return max_threads;
+}
+
+ThreadPoolStats ThreadPool::stats(void) {
+  pthread_mutex_lock(&lock_);
+  ThreadPoolStats stats = stats_;
+  stats.threads = threads_.size();
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    Worker *worker = workers_[i];
+    pthread_mutex_lock(&worker->lock);
+    stats.queued += worker->queue.size();
+    stats.active += worker->stats.active;
+    stats.completed += worker->stats.completed;
+    stats.stolen += worker->stats.stolen;
+    stats.wait_us += worker->stats.wait_us;
+    stats.max_wait_us = std::max(stats.max_wait_us,
+                                 worker->stats.max_wait_us);
+    stats.run_us += worker->stats.run_us;
+    pthread_mutex_unlock(&worker->lock);
+  }
+  pthread_mutex_unlock(&lock_);
+  return stats;
+}
+
+void *ThreadPool::WorkerShim(void *p) {
+  Worker *worker = reinterpret_cast<Worker*>(p);
+  pthread_setspecific(worker->pool->self_, worker);
+  worker->pool->Run(worker);
+  return NULL;
+}
+
+bool ThreadPool::Take(Worker *worker, Item *item) {
+  pthread_mutex_lock(&worker->lock);
+  if (!worker->queue.empty()) {
+    *item = worker->queue.front();
+    worker->queue.pop_front();
+    pthread_mutex_unlock(&worker->lock);
+    return true;
+  }
+  pthread_mutex_unlock(&worker->lock);
+  // Steal the newest task of the next thread that has one, leaving the
+  // older ones to run in order on their own thread.
+  for (size_t i = 1; i < worker->peers; ++i) {
+    Worker *victim = workers_[(worker->index + i) % worker->peers];
+    pthread_mutex_lock(&victim->lock);
+    if (!victim->queue.empty()) {
+      *item = victim->queue.back();
+      victim->queue.pop_back();
+      pthread_mutex_unlock(&victim->lock);
+      pthread_mutex_lock(&worker->lock);
+      ++worker->stats.stolen;
+      pthread_mutex_unlock(&worker->lock);
+      return true;
+    }
+    pthread_mutex_unlock(&victim->lock);
+  }
+  return false;
+}
+
+void ThreadPool::Run(Worker *worker) {
+  for (;;) {
+    Item item;
+    if (!Take(worker, &item)) {
+      pthread_mutex_lock(&lock_);
+      // Look again with lock_ held, at all the threads started so far,
+      // so that a task queued meanwhile is not slept through.
+      worker->peers = workers_.size();
+      while (!Take(worker, &item)) {
+        if (stop_) {
+          pthread_mutex_unlock(&lock_);
+          return;
+        }
+        ++idle_;
+        pthread_cond_wait(&work_, &lock_);
+        --idle_;
+        worker->peers = workers_.size();
+      }
+      pthread_mutex_unlock(&lock_);
+    }
+    int64_t start = NowMicros();
+    int64_t wait = start - item.queued_us;
+    pthread_mutex_lock(&worker->lock);
+    ++worker->stats.active;
+    worker->stats.wait_us += wait;
+    worker->stats.max_wait_us = std::max(worker->stats.max_wait_us, wait);
+    pthread_mutex_unlock(&worker->lock);
+    item.task(item.arg);
+    int64_t run = NowMicros() - start;
+    pthread_mutex_lock(&worker->lock);
+    --worker->stats.active;
+    ++worker->stats.completed;
+    worker->stats.run_us += run;
+    pthread_mutex_unlock(&worker->lock);
+  }
+}
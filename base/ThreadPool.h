@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that be
+ * found in the LICENSE file.
+ */
+#ifndef PACKAGES_SCRIPTS_FILESYS_BASE_THREADPOOL_H_
+#define PACKAGES_SCRIPTS_FILESYS_BASE_THREADPOOL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+// What a ThreadPool is doing and has done.
+struct ThreadPoolStats {
+  ThreadPoolStats()
+    : threads(0),
+      active(0),
+      queued(0),
+      max_queued(0),
+      submitted(0),
+      completed(0),
+      stolen(0),
+      wait_us(0),
+      max_wait_us(0),
+      run_us(0) {}
+  // Threads started, and how many of them are running a task.
+  int threads;
+  int active;
+  // Tasks waiting for a thread now, and the most that ever did.
+  int queued;
+  int max_queued;
+  int64_t submitted;
+  int64_t completed;
+  // Tasks run by a thread other than the one they were queued on.
+  int64_t stolen;
+  // Time tasks waited between Submit() and their start, in total and
+  // at most, and the time they ran, in microseconds.
+  int64_t wait_us;
+  int64_t max_wait_us;
+  int64_t run_us;
+};
+
+// ThreadPool runs tasks on up to max_threads threads of its own.  Threads
+// are started as tasks arrive and no idle one is left, and they stay
+// around until the pool is deleted.  Each thread has a queue of its own,
+// with a lock of its own: tasks submitted by a pool thread go on its
+// queue, others are dealt out in turn, and a thread whose queue is empty
+// takes the newest task of another's under that queue's lock.  Threads
+// only take the pool's lock to sleep when there is nothing to take.
+// Each queue runs in the order its tasks were submitted.
+class ThreadPool {
+ public:
+  typedef void (*Task)(void *arg);
+
+  explicit ThreadPool(int max_threads = kDefaultMaxThreads);
+  // Runs the tasks still queued before returning.
+  ~ThreadPool();
+
+  // Submit() queues task(arg).  Returns 0, or -1 if there is no thread
+  // to run it and none could be started.
+  int Submit(Task task, void *arg);
+
+  // Raising max_threads lets the pool start more threads; lowering it
+  // only stops it from starting any.
+  void set_max_threads(int max_threads);
+  int max_threads(void);
+
+  ThreadPoolStats stats(void);
+
+  static const int kDefaultMaxThreads = 4;
+  // No more threads than this are ever started.
+  static const int kMaxThreads = 64;
+
+ private:
+  struct Item {
+    Task task;
+    void *arg;
+    int64_t queued_us;
+  };
+
+  // The queue of one thread, and the counters of the tasks it ran, which
+  // stats() adds up.  Guarded by lock.
+  struct Worker {
+    ThreadPool *pool;
+    int index;
+    pthread_mutex_t lock;
+    std::deque<Item> queue;
+    ThreadPoolStats stats;
+    // How many of workers_ the thread takes tasks from.  Only written
+    // with lock_ held, by the thread itself once it runs.
+    size_t peers;
+  };
+
+  static void *WorkerShim(void *p);
+  void Run(Worker *worker);
+  // Take the next task for worker, its own or another's, into *item.
+  // Returns false if there is none.  Takes one queue lock at a time.
+  bool Take(Worker *worker, Item *item);
+  // Tasks on all the queues.  Called with lock_ held.
+  int Queued(void);
+  static int64_t NowMicros(void);
+
+  // Guards the members below, but not the queues.  Tasks are queued
+  // with it held, so that a thread cannot miss one before it sleeps.
+  pthread_mutex_t lock_;
+  // Signalled when a task is queued or stop_ is set.
+  pthread_cond_t work_;
+  // The Worker of the pool thread calling, if any.
+  pthread_key_t self_;
+  // Only appended to.  Threads read the first peers of them without
+  // lock_.
+  std::vector<Worker*> workers_;
+  std::vector<pthread_t> threads_;
+  int max_threads_;
+  // Where the next task from outside the pool goes.
+  size_t next_;
+  // Number of threads waiting for a task.
+  int idle_;
+  bool stop_;
+  // Only submitted and max_queued are kept here.
+  ThreadPoolStats stats_;
+};
+
+#endif  // PACKAGES_SCRIPTS_FILESYS_BASE_THREADPOOL_H_
@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that be
+ * found in the LICENSE file.
+ */
+#ifndef PACKAGES_SCRIPTS_FILESYS_BASE_TRACE_H_
+#define PACKAGES_SCRIPTS_FILESYS_BASE_TRACE_H_
+
+#include <stdio.h>
+
+// MOUNT_TRACE() prints a line to stderr about what a request is doing.
+// It is compiled in only when MOUNT_TRACE_ENABLED is defined: the
+// formatting and the stderr lock otherwise cost every request more than
+// the request itself takes to set up.
+#ifdef MOUNT_TRACE_ENABLED
+#define MOUNT_TRACE(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define MOUNT_TRACE(...) do {} while (0)
+#endif
+
+#endif  // PACKAGES_SCRIPTS_FILESYS_BASE_TRACE_H_
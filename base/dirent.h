@@ -9,6 +9,11 @@
 #include <stdint.h>
 #include <sys/stat.h>
 
+// Mounts fill one record of sizeof(struct dirent) bytes per entry.  d_off
+// is the offset to pass to Getdents() to continue after the entry.  This
+// is the layout of NaCl newlib's struct dirent, which __wrap_getdents()
+// fills for readdir(), so it cannot change.  It has no d_type: the type
+// of an entry is only known from stat() or ReadDirPlus().
 struct dirent {
   ino_t d_ino;
   off_t d_off;
@@ -16,4 +21,11 @@ struct dirent {
   char d_name[256];
 };
 
+// An entry of a directory together with what Stat() says of it, as
+// Mount::ReadDirPlus() returns them.  st.st_mode gives its type.
+struct DirentPlus {
+  struct dirent d;
+  struct stat st;
+};
+
 #endif  // PACKAGES_SCRIPTS_FILESYS_BASE_DIRENT_H_
@@ -294,26 +294,64 @@ int MemMount::Getdents(ino_t slot, off_t offset,
   bytes_read = 0;
   assert(children);
   // Skip to the child at the current offset.
-  std::list<int>::iterator children_it;
+  std::list<int>::iterator children_it = children->begin();
+  for (off_t skip = offset / sizeof(struct dirent);
+       skip > 0 && children_it != children->end(); --skip) {
+    ++children_it;
+    ++pos;
+  }
 
-  for (children_it = children->begin();
-       children_it != children->end() &&
+  for (; children_it != children->end() &&
            bytes_read + sizeof(struct dirent) <= count;
        ++children_it) {
+    MemNode *child = slots_.At(*children_it);
     memset(dir, 0, sizeof(struct dirent));
-    // We want d_ino to be non-zero because readdir()
-    // will return null if d_ino is zero.
-    dir->d_ino = 0x60061E;
-    dir->d_off = sizeof(struct dirent);
+    // The slot, as stat() reports it.  Only the root has slot 0, which
+    // readdir() would skip.
+    dir->d_ino = child->slot;
+    ++pos;
+    dir->d_off = pos * sizeof(struct dirent);
     dir->d_reclen = sizeof(struct dirent);
-    strncpy(dir->d_name, slots_.At(*children_it)->name().c_str(), sizeof(dir->d_name));
+    strncpy(dir->d_name, child->name().c_str(), sizeof(dir->d_name) - 1);
     ++dir;
-    ++pos;
     bytes_read += sizeof(struct dirent);
   }
   return bytes_read;
 }
 
+int MemMount::ReadDirPlus(const std::string& path,
+                          std::vector<DirentPlus>* entries) {
+  MemNode *node = GetMemNode(path);
+  if (node == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
+  if (!node->is_dir()) {
+    errno = ENOTDIR;
+    return -1;
+  }
+  // The children are at hand: fill the entries and their attributes in
+  // one pass, as Getdents() and Stat() would.
+  std::list<int>* children = node->children();
+  assert(children);
+  int pos = 0;
+  std::list<int>::iterator it;
+  for (it = children->begin(); it != children->end(); ++it) {
+    MemNode *child = slots_.At(*it);
+    DirentPlus entry;
+    memset(&entry.d, 0, sizeof(entry.d));
+    entry.d.d_ino = child->slot;
+    ++pos;
+    entry.d.d_off = pos * sizeof(struct dirent);
+    entry.d.d_reclen = sizeof(struct dirent);
+    strncpy(entry.d.d_name, child->name().c_str(),
+            sizeof(entry.d.d_name) - 1);
+    child->stat(&entry.st);
+    entries->push_back(entry);
+  }
+  return 0;
+}
+
 ssize_t MemMount::Read(ino_t slot, off_t offset, void *buf, size_t count) {
   MemNode* node = slots_.At(slot);
   if (node == NULL) {
@@ -321,6 +359,9 @@ ssize_t MemMount::Read(ino_t slot, off_t offset, void *buf, size_t count) {
     return -1;
   }
   // Limit to the end of the file.
+  if (offset >= static_cast<off_t>(node->len())) {
+    return 0;
+  }
   size_t len = count;
   if (len > node->len() - offset) {
     len = node->len() - offset;
@@ -350,7 +391,7 @@ ssize_t MemMount::Write(ino_t slot, off_t offset, const void *buf, size_t count)
   }
   // Pad any gap with zeros.
   if (offset > static_cast<off_t>(node->len())) {
-    memset(node->data()+len, 0, offset);
+    memset(node->data() + node->len(), 0, offset - node->len());
   }
 
   // Write out the block.
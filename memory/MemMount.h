@@ -52,8 +52,11 @@ class MemMount: public Mount {
 
   int Chmod(ino_t node, mode_t mode);
   int Stat(ino_t node, struct stat *buf);
+  // Everything is in memory already, so there is nothing to sync.
+  int Fsync(ino_t node) { return 0; }
 
   int Getdents(ino_t node, off_t offset, struct dirent *dirp, unsigned int count);
+  int ReadDirPlus(const std::string& path, std::vector<DirentPlus>* entries);
 
   virtual ssize_t Read(ino_t node, off_t offset, void *buf, size_t count);
   virtual ssize_t Write(ino_t node, off_t offset, const void *buf, size_t count);
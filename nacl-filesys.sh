@@ -12,6 +12,9 @@
 #
 
 readonly PACKAGE_NAME=filesys
+# The coroutine wrappers in KernelAwait, and the benchmark's coread
+# workload built on them, need C++20.
+readonly CXX20FLAGS="-std=c++20"
 
 source ../common.sh
 
@@ -20,9 +23,15 @@ CustomBuildStep() {
   export PACKAGE_DIR="${NACL_PACKAGES_REPOSITORY}/${PACKAGE_NAME}"
   MakeDir ${PACKAGE_DIR}
   ChangeDir ${PACKAGE_DIR}
+  ${NACLCC} -c ${START_DIR}/base/Mount.cc -o Mount.o
   ${NACLCC} -c ${START_DIR}/base/MountManager.cc -o MountManager.o
   ${NACLCC} -c ${START_DIR}/base/KernelProxy.cc -o KernelProxy.o
+  ${NACLCXX} ${CXX20FLAGS} -c ${START_DIR}/base/KernelAwait.cc \
+      -o KernelAwait.o
   ${NACLCC} -c ${START_DIR}/base/PathHandle.cc -o PathHandle.o
+  ${NACLCC} -c ${START_DIR}/base/ReadAhead.cc -o ReadAhead.o
+  ${NACLCC} -c ${START_DIR}/base/ThreadPool.cc -o ThreadPool.o
+  ${NACLCC} -c ${START_DIR}/base/CachingMount.cc -o CachingMount.o
   ${NACLCC} -c ${START_DIR}/base/MainThreadRunner.cc -o MainThreadRunner.o  
   ${NACLCC} -c ${START_DIR}/base/Entry.cc -o Entry.o
   ${NACLCC} -c ${START_DIR}/memory/MemMount.cc -o MemMount.o
@@ -30,26 +39,47 @@ CustomBuildStep() {
   ${NACLCC} -c ${START_DIR}/AppEngine/AppEngineUrlLoader.cc -o AppEngineUrlLoader.o
   ${NACLCC} -c ${START_DIR}/AppEngine/AppEngineMount.cc -o AppEngineMount.o
   ${NACLCC} -c ${START_DIR}/AppEngine/AppEngineNode.cc -o AppEngineNode.o
+  ${NACLCC} -c ${START_DIR}/AppEngine/AppEngineCache.cc -o AppEngineCache.o
+  ${NACLCC} -c ${START_DIR}/AppEngine/AppEngineDelta.cc -o AppEngineDelta.o
+  ${NACLCC} -c ${START_DIR}/AppEngine/AppEngineCompression.cc \
+      -o AppEngineCompression.o
   ${NACLAR} rcs filesys.a \
+      Mount.o \
       MountManager.o \
       KernelProxy.o \
+      KernelAwait.o \
       PathHandle.o \
+      ReadAhead.o \
+      ThreadPool.o \
+      CachingMount.o \
       MainThreadRunner.o \
       Entry.o \
       MemMount.o \
       MemNode.o \
       AppEngineUrlLoader.o \
       AppEngineMount.o \
-      AppEngineNode.o
+      AppEngineNode.o \
+      AppEngineCache.o \
+      AppEngineDelta.o \
+      AppEngineCompression.o
 
 
   ${NACLRANLIB} filesys.a
 
   ${NACLCXX} ${START_DIR}/AppEngine/AppEngineTest.cc KernelProxy.o PathHandle.o \
-      MountManager.o AppEngineUrlLoader.o AppEngineMount.o AppEngineNode.o \
-      MemMount.o MemNode.o MainThreadRunner.o \
-      -lpthread -lppapi -lppapi_cpp \
+      Mount.o ReadAhead.o ThreadPool.o CachingMount.o MountManager.o \
+      AppEngineUrlLoader.o AppEngineMount.o AppEngineNode.o AppEngineCache.o \
+      AppEngineDelta.o AppEngineCompression.o MemMount.o MemNode.o \
+      MainThreadRunner.o -lpthread -lppapi -lppapi_cpp -lz \
       -o ${START_DIR}/AppEngine/naclmounts/static/AppEngineTest.nexe
+
+  ${NACLCXX} ${CXX20FLAGS} ${START_DIR}/AppEngine/AppEngineBenchmark.cc \
+      KernelProxy.o KernelAwait.o Mount.o PathHandle.o ReadAhead.o \
+      ThreadPool.o CachingMount.o MountManager.o AppEngineUrlLoader.o \
+      AppEngineMount.o AppEngineNode.o AppEngineCache.o AppEngineDelta.o \
+      AppEngineCompression.o MemMount.o MemNode.o MainThreadRunner.o \
+      -lpthread -lppapi -lppapi_cpp -lz \
+      -o ${START_DIR}/AppEngine/naclmounts/static/AppEngineBenchmark.nexe
 }
 
 CustomInstallStep() {
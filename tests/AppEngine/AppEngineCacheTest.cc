@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that be
+ * found in the LICENSE file.
+ */
+
+#include "../../AppEngine/AppEngineCache.h"
+#include "../../memory/MemMount.h"
+#include "../common/common.h"
+
+static std::vector<char> MakeData(const std::string& s) {
+  return std::vector<char>(s.begin(), s.end());
+}
+
+TEST(AppEngineCacheTest, StoreLoad) {
+  MemMount store;
+  AppEngineCache cache(&store, 1024);
+  std::vector<char> data;
+
+  EXPECT_EQ("", cache.Version("/a.txt"));
+  EXPECT_EQ(-1, cache.Load("/a.txt", "1", &data));
+
+  EXPECT_EQ(0, cache.Store("/a.txt", "1", MakeData("hello")));
+  EXPECT_EQ("1", cache.Version("/a.txt"));
+  EXPECT_EQ(0, cache.Load("/a.txt", "1", &data));
+  EXPECT_EQ(MakeData("hello"), data);
+  EXPECT_EQ(5u, cache.bytes());
+
+  // Only the cached version can be loaded.
+  EXPECT_EQ(-1, cache.Load("/a.txt", "2", &data));
+
+  // A newer version replaces the old one.
+  EXPECT_EQ(0, cache.Store("/a.txt", "2", MakeData("hi")));
+  EXPECT_EQ("2", cache.Version("/a.txt"));
+  EXPECT_EQ(0, cache.Load("/a.txt", "2", &data));
+  EXPECT_EQ(MakeData("hi"), data);
+  EXPECT_EQ(2u, cache.bytes());
+}
+
+TEST(AppEngineCacheTest, EmptyAndLargeFiles) {
+  MemMount store;
+  AppEngineCache cache(&store, 1 << 20);
+  std::vector<char> data;
+
+  EXPECT_EQ(0, cache.Store("/empty", "7", std::vector<char>()));
+  EXPECT_EQ(0, cache.Load("/empty", "7", &data));
+  EXPECT_EQ(0u, data.size());
+
+  // Spans several store blocks.
+  std::vector<char> big(3 * AppEngineCache::kBlockSize + 17);
+  for (size_t i = 0; i < big.size(); ++i) {
+    big[i] = i % 251;
+  }
+  EXPECT_EQ(0, cache.Store("/dir/big", "v1", big));
+  EXPECT_EQ(0, cache.Load("/dir/big", "v1", &data));
+  EXPECT_EQ(big, data);
+}
+
+TEST(AppEngineCacheTest, Persistence) {
+  MemMount store;
+  std::vector<char> data;
+  {
+    AppEngineCache cache(&store, 1024);
+    EXPECT_EQ(0, cache.Store("/dir/a.txt", "abc", MakeData("persist")));
+  }
+  // A new cache over the same store finds the entry again.
+  AppEngineCache cache(&store, 1024);
+  EXPECT_EQ("abc", cache.Version("/dir/a.txt"));
+  EXPECT_EQ(0, cache.Load("/dir/a.txt", "abc", &data));
+  EXPECT_EQ(MakeData("persist"), data);
+  EXPECT_EQ(7u, cache.bytes());
+}
+
+TEST(AppEngineCacheTest, ScanOnStart) {
+  MemMount store;
+  {
+    AppEngineCache cache(&store, 1024);
+    EXPECT_EQ(0, cache.Store("/a", "1", MakeData("aaaa")));
+    EXPECT_EQ(0, cache.Store("/dir/100%", "2", MakeData("bbbb")));
+  }
+  // What an earlier session left counts before anything is looked up.
+  {
+    AppEngineCache cache(&store, 1024);
+    EXPECT_EQ(8u, cache.bytes());
+    EXPECT_EQ("2", cache.Version("/dir/100%"));
+  }
+  // And is evicted down to a smaller limit.
+  AppEngineCache cache(&store, 5);
+  EXPECT_EQ(4u, cache.bytes());
+  struct stat st;
+  int left = (store.GetNode("/%2Fa", &st) == 0) +
+             (store.GetNode("/%2Fdir%2F100%25", &st) == 0);
+  EXPECT_EQ(1, left);
+}
+
+TEST(AppEngineCacheTest, RemoveAndEvict) {
+  MemMount store;
+  AppEngineCache cache(&store, 10);
+  std::vector<char> data;
+
+  EXPECT_EQ(0, cache.Store("/a", "1", MakeData("aaaa")));
+  cache.Remove("/a");
+  EXPECT_EQ("", cache.Version("/a"));
+
+  // Too big to ever fit.
+  EXPECT_EQ(-1, cache.Store("/huge", "1", MakeData("01234567890")));
+
+  EXPECT_EQ(0, cache.Store("/a", "1", MakeData("aaaa")));
+  EXPECT_EQ(0, cache.Store("/b", "1", MakeData("bbbb")));
+  // Touch /a so that /b is the least recently used.
+  EXPECT_EQ("1", cache.Version("/a"));
+  EXPECT_EQ(0, cache.Store("/c", "1", MakeData("cccc")));
+  EXPECT_EQ("1", cache.Version("/a"));
+  EXPECT_EQ("", cache.Version("/b"));
+  EXPECT_EQ("1", cache.Version("/c"));
+  EXPECT_EQ(8u, cache.bytes());
+}
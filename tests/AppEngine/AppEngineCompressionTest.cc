@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that be
+ * found in the LICENSE file.
+ */
+
+#include <string.h>
+#include <vector>
+#include "../../AppEngine/AppEngineCompression.h"
+#include "../common/common.h"
+
+static std::vector<char> TextData(size_t len) {
+  const char *words = "the quick brown fox jumps over the lazy dog ";
+  std::vector<char> data(len);
+  for (size_t i = 0; i < len; ++i) {
+    data[i] = words[i % strlen(words)];
+  }
+  return data;
+}
+
+static std::vector<char> NoiseData(size_t len) {
+  std::vector<char> data(len);
+  unsigned int seed = 1;
+  for (size_t i = 0; i < len; ++i) {
+    seed = seed * 1103515245 + 12345;
+    data[i] = static_cast<char>(seed >> 16);
+  }
+  return data;
+}
+
+TEST(AppEngineCompressionTest, OffByDefault) {
+  AppEngineCompressor compressor;
+  std::vector<char> data = TextData(64 * 1024);
+  std::vector<char> out;
+  EXPECT_EQ(0, compressor.level());
+  EXPECT_EQ(-1, compressor.Compress(&data[0], data.size(), &out));
+  EXPECT_EQ(0, compressor.stats().fields_compressed);
+  EXPECT_EQ(0, compressor.stats().fields_skipped);
+}
+
+TEST(AppEngineCompressionTest, RoundTrip) {
+  AppEngineCompressor compressor;
+  compressor.set_level(1);
+  std::vector<char> data = TextData(256 * 1024);
+  std::vector<char> out;
+  ASSERT_EQ(0, compressor.Compress(&data[0], data.size(), &out));
+  EXPECT_LT(out.size(), data.size() / 10);
+
+  std::vector<char> back;
+  EXPECT_EQ(0, AppEngineCompressor::Inflate(&out[0], out.size(), &back));
+  EXPECT_TRUE(back == data);
+  // A truncated stream is an error.
+  back.clear();
+  EXPECT_EQ(-1, AppEngineCompressor::Inflate(&out[0], out.size() / 2,
+                                             &back));
+
+  AppEngineCompressionStats stats = compressor.stats();
+  EXPECT_EQ(1, stats.fields_compressed);
+  EXPECT_EQ(static_cast<int64_t>(data.size()), stats.bytes_in);
+  EXPECT_EQ(static_cast<int64_t>(out.size()), stats.bytes_out);
+}
+
+TEST(AppEngineCompressionTest, Skips) {
+  AppEngineCompressor compressor;
+  compressor.set_level(6);
+  std::vector<char> out;
+  // Too small to bother.
+  std::vector<char> small = TextData(AppEngineCompressor::kMinSize - 1);
+  EXPECT_EQ(-1, compressor.Compress(&small[0], small.size(), &out));
+  EXPECT_EQ(0, compressor.stats().fields_skipped);
+  // Noise does not shrink, whether the sample or the whole says so.
+  std::vector<char> noise = NoiseData(8 * 1024);
+  EXPECT_EQ(-1, compressor.Compress(&noise[0], noise.size(), &out));
+  EXPECT_TRUE(out.empty());
+  noise = NoiseData(1024 * 1024);
+  EXPECT_EQ(-1, compressor.Compress(&noise[0], noise.size(), &out));
+  EXPECT_EQ(2, compressor.stats().fields_skipped);
+  EXPECT_EQ(0, compressor.stats().fields_compressed);
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that be
+ * found in the LICENSE file.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "../../AppEngine/AppEngineDelta.h"
+#include "../common/common.h"
+
+static std::vector<char> RandomData(size_t len, unsigned int seed) {
+  std::vector<char> data(len);
+  for (size_t i = 0; i < len; ++i) {
+    seed = seed * 1103515245 + 12345;
+    data[i] = static_cast<char>(seed >> 16);
+  }
+  return data;
+}
+
+// Encodes data against base, checks that it rebuilds, and returns the
+// number of literal bytes.
+static size_t RoundTrip(const std::vector<char>& base,
+                        const std::vector<char>& data, size_t block_size) {
+  AppEngineSignature sig;
+  sig.Compute("1", base.empty() ? NULL : &base[0], base.size(), block_size);
+  std::vector<char> delta;
+  size_t literal = AppEngineDelta::Encode(sig, data.empty() ? NULL : &data[0],
+                                          data.size(), &delta);
+  std::vector<char> out;
+  EXPECT_EQ(0, AppEngineDelta::Apply(base.empty() ? NULL : &base[0],
+                                     base.size(), block_size, delta, &out));
+  EXPECT_TRUE(out == data);
+  return literal;
+}
+
+TEST(AppEngineDeltaTest, Checksums) {
+  // The standard CRC-32 check value.
+  EXPECT_EQ(0xcbf43926u, AppEngineDelta::Crc32("123456789", 9));
+  // Checksums can be continued.
+  uint32_t crc = AppEngineDelta::Crc32("1234", 4);
+  EXPECT_EQ(0xcbf43926u, AppEngineDelta::Crc32("56789", 5, crc));
+}
+
+TEST(AppEngineDeltaTest, Unchanged) {
+  std::vector<char> base = RandomData(10000, 1);
+  // Everything but the short last block is copied.
+  EXPECT_EQ(10000u % 256, RoundTrip(base, base, 256));
+}
+
+TEST(AppEngineDeltaTest, Edits) {
+  std::vector<char> base = RandomData(64 * 1024, 2);
+  std::vector<char> data = base;
+  memcpy(&data[5000], "edited", 6);
+  memcpy(&data[40000], "again", 5);
+  // Only the two blocks touched are sent.
+  EXPECT_EQ(2 * 1024u, RoundTrip(base, data, 1024));
+}
+
+TEST(AppEngineDeltaTest, InsertAndDelete) {
+  std::vector<char> base = RandomData(64 * 1024, 3);
+  std::vector<char> data = base;
+  // Shifting the contents does not stop the later blocks from matching.
+  data.insert(data.begin() + 3000, 17, 'x');
+  data.erase(data.begin() + 50000, data.begin() + 50100);
+  EXPECT_GT(4 * 1024u, RoundTrip(base, data, 1024));
+}
+
+TEST(AppEngineDeltaTest, EmptyAndNew) {
+  std::vector<char> empty;
+  std::vector<char> data = RandomData(3000, 4);
+  EXPECT_EQ(3000u, RoundTrip(empty, data, 1024));
+  EXPECT_EQ(0u, RoundTrip(data, empty, 1024));
+
+  // A delta that reaches past the old version is rejected.
+  std::vector<char> delta;
+  delta.push_back('C');
+  for (int i = 0; i < 7; ++i) delta.push_back(0);
+  delta.push_back(9);
+  std::vector<char> out;
+  EXPECT_EQ(-1, AppEngineDelta::Apply(&data[0], data.size(), 1024, delta,
+                                      &out));
+}
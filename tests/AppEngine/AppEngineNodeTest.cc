@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that be
+ * found in the LICENSE file.
+ */
+
+#include <string>
+#include <vector>
+#include "../../AppEngine/AppEngineNode.h"
+#include "../common/common.h"
+
+TEST(AppEngineNodeTest, SetData) {
+  AppEngineNode node;
+  EXPECT_FALSE(node.is_loaded());
+
+  std::string s = "hello world";
+  std::vector<char> data(s.begin(), s.end());
+  const char *storage = &data[0];
+  node.set_data(&data);
+  EXPECT_TRUE(node.is_loaded());
+  EXPECT_EQ(11u, node.len());
+  // The contents are moved in, not copied.
+  EXPECT_EQ(storage, &node.data()[0]);
+  EXPECT_EQ(0u, data.size());
+}
+
+TEST(AppEngineNodeTest, ReadData) {
+  AppEngineNode node;
+  std::string s = "0123456789";
+  std::vector<char> data(s.begin(), s.end());
+  node.set_data(&data);
+
+  char buf[16];
+  EXPECT_EQ(4, node.ReadData(2, buf, 4));
+  EXPECT_EQ("2345", std::string(buf, 4));
+  // Clipped at the end of the file.
+  EXPECT_EQ(3, node.ReadData(7, buf, sizeof(buf)));
+  EXPECT_EQ("789", std::string(buf, 3));
+  EXPECT_EQ(0, node.ReadData(10, buf, sizeof(buf)));
+  EXPECT_EQ(0, node.ReadData(100, buf, sizeof(buf)));
+  EXPECT_EQ(-1, node.ReadData(-1, buf, sizeof(buf)));
+}
+
+TEST(AppEngineNodeTest, WriteData) {
+  AppEngineNode node;
+  std::vector<char> empty;
+  node.set_data(&empty);
+
+  EXPECT_EQ(0, node.WriteData(0, "abc", 3));
+  EXPECT_EQ(3u, node.len());
+  EXPECT_TRUE(node.is_dirty());
+  EXPECT_EQ(0, node.WriteData(5, "xy", 2));
+  EXPECT_EQ(7u, node.len());
+  EXPECT_EQ(0, node.WriteData(1, "B", 1));
+
+  // Spare capacity past len() is not part of the contents.
+  std::vector<char> copy;
+  node.CopyData(&copy);
+  EXPECT_EQ(7u, copy.size());
+  EXPECT_EQ(std::string("aBc\0\0xy", 7), std::string(copy.begin(), copy.end()));
+
+  char buf[16];
+  EXPECT_EQ(7, node.ReadData(0, buf, sizeof(buf)));
+  EXPECT_EQ(std::string("aBc\0\0xy", 7), std::string(buf, 7));
+}
+
+TEST(AppEngineNodeTest, WriteDuringSync) {
+  AppEngineNode node;
+  std::vector<char> empty;
+  node.set_data(&empty);
+  EXPECT_EQ(0, node.WriteData(0, "abc", 3));
+
+  // A write lands while the snapshot is being uploaded: the node keeps
+  // the bytes the server has not seen, and stays dirty.
+  int64_t snapshot = node.write_count();
+  EXPECT_EQ(0, node.WriteData(3, "d", 1));
+  EXPECT_FALSE(node.MarkSynced(snapshot, "v1"));
+  EXPECT_TRUE(node.is_dirty());
+  EXPECT_EQ("", node.version());
+
+  // Once a sync covers every write, the node is clean at its version.
+  EXPECT_TRUE(node.MarkSynced(node.write_count(), "v2"));
+  EXPECT_FALSE(node.is_dirty());
+  EXPECT_EQ("v2", node.version());
+}
+
+TEST(AppEngineNodeTest, Base) {
+  AppEngineNode node;
+  std::string s = "server";
+  std::vector<char> data(s.begin(), s.end());
+  node.set_data(&data);
+  node.set_version("v1");
+  EXPECT_EQ("", node.base_version());
+
+  // The base keeps what the server has while the contents change.
+  node.SaveBase();
+  EXPECT_EQ(0, node.WriteData(0, "S", 1));
+  std::vector<char> base;
+  std::string version;
+  node.SwapBase(&base, &version);
+  EXPECT_EQ("server", std::string(base.begin(), base.end()));
+  EXPECT_EQ("v1", version);
+  EXPECT_EQ("", node.base_version());
+
+  // Put back, it goes once the new contents are synced.
+  node.SwapBase(&base, &version);
+  EXPECT_EQ("v1", node.base_version());
+  EXPECT_TRUE(node.MarkSynced(node.write_count(), "v2"));
+  EXPECT_EQ("", node.base_version());
+}
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that be
+ * found in the LICENSE file.
+ */
+
+#include <string.h>
+#include <string>
+#include "../../base/CachingMount.h"
+#include "../../memory/MemMount.h"
+#include "../common/common.h"
+
+// A MemMount that counts the reads reaching it.
+class CountingMemMount : public MemMount {
+ public:
+  CountingMemMount() : reads(0) {}
+  ssize_t Read(ino_t node, off_t offset, void *buf, size_t count) {
+    ++reads;
+    return MemMount::Read(node, offset, buf, count);
+  }
+  int reads;
+};
+
+static const size_t kBlock = 16;
+
+static ino_t MakeFile(Mount *mount, const std::string& path,
+                      const std::string& data) {
+  struct stat st;
+  EXPECT_EQ(0, mount->Creat(path, 0644, &st));
+  EXPECT_EQ(static_cast<ssize_t>(data.size()),
+            mount->Write(st.st_ino, 0, data.data(), data.size()));
+  return st.st_ino;
+}
+
+static std::string ReadAll(Mount *mount, ino_t node, size_t max) {
+  std::string buf(max, '\0');
+  ssize_t n = mount->Read(node, 0, &buf[0], max);
+  EXPECT_LE(0, n);
+  buf.resize(n < 0 ? 0 : n);
+  return buf;
+}
+
+TEST(CachingMountTest, ReadHitsAndMisses) {
+  CacheBudget budget(1024);
+  CountingMemMount *backing = new CountingMemMount();
+  CachingMount mount(backing, CachingMount::kWriteThrough, &budget, kBlock);
+  std::string data = "0123456789abcdef0123456789abcdef0123456789";
+  MakeFile(backing, "/file", data);
+
+  struct stat st;
+  EXPECT_EQ(0, mount.GetNode("/file", &st));
+  EXPECT_EQ(data, ReadAll(&mount, st.st_ino, 100));
+  CachingMountStats stats = mount.stats();
+  EXPECT_EQ(3, stats.block_misses);
+  EXPECT_EQ(0, stats.block_hits);
+  EXPECT_EQ(data.size(), budget.bytes());
+
+  int reads = backing->reads;
+  EXPECT_EQ(data, ReadAll(&mount, st.st_ino, 100));
+  char buf[4];
+  EXPECT_EQ(4, mount.Read(st.st_ino, 14, buf, 4));
+  EXPECT_EQ(0, memcmp(buf, "ef01", 4));
+  EXPECT_EQ(0, mount.Read(st.st_ino, 100, buf, 4));
+  EXPECT_EQ(reads, backing->reads);
+  EXPECT_EQ(3, mount.stats().block_misses);
+
+  // Attributes are answered from the cache.
+  EXPECT_EQ(0, mount.Stat(st.st_ino, &st));
+  EXPECT_EQ(static_cast<off_t>(data.size()), st.st_size);
+  EXPECT_EQ(1, mount.stats().attr_hits);
+
+  // Blocks are dropped with the file.
+  EXPECT_EQ(0, mount.Unlink("/file"));
+  EXPECT_EQ(0u, budget.bytes());
+}
+
+TEST(CachingMountTest, WriteThrough) {
+  CacheBudget budget(1024);
+  CountingMemMount *backing = new CountingMemMount();
+  CachingMount mount(backing, CachingMount::kWriteThrough, &budget, kBlock);
+  MakeFile(backing, "/file", "0123456789");
+
+  struct stat st;
+  EXPECT_EQ(0, mount.GetNode("/file", &st));
+  EXPECT_EQ("0123456789", ReadAll(&mount, st.st_ino, 100));
+  EXPECT_EQ(5, mount.Write(st.st_ino, 8, "ABCDE", 5));
+  // The backing mount has the write at once.
+  EXPECT_EQ("01234567ABCDE", ReadAll(backing, st.st_ino, 100));
+
+  // And the cached block was updated rather than dropped.
+  int reads = backing->reads;
+  EXPECT_EQ("01234567ABCDE", ReadAll(&mount, st.st_ino, 100));
+  EXPECT_EQ(reads, backing->reads);
+  EXPECT_EQ(0, mount.Stat(st.st_ino, &st));
+  EXPECT_EQ(13, st.st_size);
+}
+
+TEST(CachingMountTest, WriteBack) {
+  CacheBudget budget(1024);
+  CountingMemMount *backing = new CountingMemMount();
+  CachingMount mount(backing, CachingMount::kWriteBack, &budget, kBlock);
+
+  struct stat st;
+  EXPECT_EQ(0, mount.Creat("/file", 0644, &st));
+  mount.Ref(st.st_ino);
+  std::string data = "0123456789abcdef0123456789";
+  EXPECT_EQ(static_cast<ssize_t>(data.size()),
+            mount.Write(st.st_ino, 0, data.data(), data.size()));
+  EXPECT_EQ(4, mount.Write(st.st_ino, 40, "WXYZ", 4));
+
+  // Nothing reached the backing mount yet, but the cache has it all.
+  EXPECT_EQ("", ReadAll(backing, st.st_ino, 100));
+  std::string expected = data + std::string(14, '\0') + "WXYZ";
+  EXPECT_EQ(expected, ReadAll(&mount, st.st_ino, 100));
+  EXPECT_EQ(0, mount.Stat(st.st_ino, &st));
+  EXPECT_EQ(44, st.st_size);
+
+  EXPECT_EQ(0, mount.Fsync(st.st_ino));
+  EXPECT_EQ(expected, ReadAll(backing, st.st_ino, 100));
+  EXPECT_EQ(3, mount.stats().flushed_blocks);
+
+  // The last Unref() writes back too.
+  EXPECT_EQ(2, mount.Write(st.st_ino, 0, "!!", 2));
+  mount.Unref(st.st_ino);
+  EXPECT_EQ("!!", ReadAll(backing, st.st_ino, 2));
+}
+
+TEST(CachingMountTest, SharedBudget) {
+  CacheBudget budget(3 * kBlock);
+  CountingMemMount *backing1 = new CountingMemMount();
+  CountingMemMount *backing2 = new CountingMemMount();
+  CachingMount mount1(backing1, CachingMount::kWriteThrough, &budget, kBlock);
+  CachingMount mount2(backing2, CachingMount::kWriteThrough, &budget, kBlock);
+  std::string data(2 * kBlock, 'x');
+  MakeFile(backing1, "/a", data);
+  MakeFile(backing2, "/b", data);
+
+  struct stat st1, st2;
+  EXPECT_EQ(0, mount1.GetNode("/a", &st1));
+  EXPECT_EQ(0, mount2.GetNode("/b", &st2));
+  EXPECT_EQ(data, ReadAll(&mount1, st1.st_ino, 100));
+  EXPECT_EQ(data, ReadAll(&mount2, st2.st_ino, 100));
+  // Reading the second file pushed a block of the first one out.
+  EXPECT_EQ(3 * kBlock, budget.bytes());
+  EXPECT_EQ(1, mount1.stats().evicted_blocks);
+  EXPECT_EQ(0, mount2.stats().evicted_blocks);
+
+  budget.set_max_bytes(kBlock);
+  EXPECT_EQ(kBlock, budget.bytes());
+}
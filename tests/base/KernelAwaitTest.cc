@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that be
+ * found in the LICENSE file.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "../../base/KernelAwait.h"
+#include "../../base/MountManager.h"
+#include "../../memory/MemMount.h"
+#include "../common/common.h"
+
+TEST(KernelAwaitTest, AsyncCalls) {
+  MountManager *mm = MountManager::MMInstance();
+  mm->ClearMounts();
+  ASSERT_EQ(0, mm->AddMount(new MemMount(), "/"));
+  KernelProxy *kp = mm->kp();
+  int fd = kp->open("/async.txt", O_CREAT | O_RDWR, 0);
+  ASSERT_LE(0, fd);
+
+  AsyncWaiter call;
+  kp->write_async(fd, "hello", 5, AsyncWaiter::Done, &call);
+  call.Wait();
+  EXPECT_EQ(5, call.result);
+  kp->fsync_async(fd, AsyncWaiter::Done, &call);
+  call.Wait();
+  EXPECT_EQ(0, call.result);
+
+  struct stat st;
+  kp->stat_async("/async.txt", &st, AsyncWaiter::Done, &call);
+  call.Wait();
+  EXPECT_EQ(0, call.result);
+  EXPECT_EQ(5, st.st_size);
+  kp->stat_async("/none.txt", &st, AsyncWaiter::Done, &call);
+  call.Wait();
+  EXPECT_EQ(-1, call.result);
+  EXPECT_EQ(ENOENT, call.error);
+
+  // Reads started back to back get consecutive ranges.
+  EXPECT_EQ(0, kp->lseek(fd, 0, SEEK_SET));
+  char a[2], b[3];
+  AsyncWaiter call2;
+  kp->read_async(fd, a, sizeof(a), AsyncWaiter::Done, &call);
+  kp->read_async(fd, b, sizeof(b), AsyncWaiter::Done, &call2);
+  call.Wait();
+  call2.Wait();
+  ASSERT_EQ(2, call.result);
+  ASSERT_EQ(3, call2.result);
+  EXPECT_EQ(0, memcmp(a, "he", 2));
+  EXPECT_EQ(0, memcmp(b, "llo", 3));
+
+  // A short read leaves the offset where the data ended.
+  char c[10];
+  EXPECT_EQ(3, kp->lseek(fd, 3, SEEK_SET));
+  kp->read_async(fd, c, sizeof(c), AsyncWaiter::Done, &call);
+  call.Wait();
+  ASSERT_EQ(2, call.result);
+  EXPECT_EQ(5, kp->lseek(fd, 0, SEEK_CUR));
+  kp->read_async(fd, c, sizeof(c), AsyncWaiter::Done, &call);
+  call.Wait();
+  EXPECT_EQ(0, call.result);
+  EXPECT_EQ(5, kp->lseek(fd, 0, SEEK_CUR));
+  EXPECT_EQ(0, kp->close(fd));
+
+  kp->fstat_async(fd, &st, AsyncWaiter::Done, &call);
+  call.Wait();
+  EXPECT_EQ(-1, call.result);
+  EXPECT_EQ(EBADF, call.error);
+}
+
+// Holds on to FsyncAsync() calls until Finish(), and counts references.
+class KernelAwaitTestSlowMount : public Mount {
+ public:
+  KernelAwaitTestSlowMount() : refs(0), callback(NULL), arg(NULL) {}
+  int GetNode(const std::string& path, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_ino = 1;
+    st->st_mode = S_IFREG | 0644;
+    return 0;
+  }
+  int Stat(ino_t node, struct stat *buf) { return GetNode("", buf); }
+  void Ref(ino_t node) { ++refs; }
+  void Unref(ino_t node) { --refs; }
+  void FsyncAsync(ino_t node, AsyncCallback callback, void *arg) {
+    this->callback = callback;
+    this->arg = arg;
+  }
+  void Finish(void) { callback(arg, 0, 0); }
+  int refs;
+  AsyncCallback callback;
+  void *arg;
+};
+
+TEST(KernelAwaitTest, CloseDuringCall) {
+  MountManager *mm = MountManager::MMInstance();
+  mm->ClearMounts();
+  KernelAwaitTestSlowMount *mount = new KernelAwaitTestSlowMount();
+  ASSERT_EQ(0, mm->AddMount(mount, "/"));
+  KernelProxy *kp = mm->kp();
+  int fd = kp->open("/slow.txt", O_RDONLY, 0);
+  ASSERT_LE(0, fd);
+  EXPECT_EQ(1, mount->refs);
+
+  // The node stays open until the call in flight is done with it.
+  AsyncWaiter call;
+  kp->fsync_async(fd, AsyncWaiter::Done, &call);
+  EXPECT_EQ(0, kp->close(fd));
+  EXPECT_EQ(1, mount->refs);
+  mount->Finish();
+  call.Wait();
+  EXPECT_EQ(0, call.result);
+  EXPECT_EQ(0, mount->refs);
+  mm->ClearMounts();
+}
+
+#if __cplusplus >= 202002L
+
+static KernelTask KernelAwaitTestFetch(KernelProxy *kp, std::string path,
+                                       std::string *out) {
+  struct stat st;
+  if (co_await AsyncStat(kp, path, &st) != 0) {
+    *out = "stat failed";
+    co_return;
+  }
+  int fd = kp->open(path, O_RDONLY, 0);
+  std::string data(st.st_size, '\0');
+  ssize_t n = co_await AsyncRead(kp, fd, &data[0], data.size());
+  kp->close(fd);
+  *out = n == st.st_size ? data : "read failed";
+}
+
+TEST(KernelAwaitTest, Tasks) {
+  MountManager *mm = MountManager::MMInstance();
+  mm->ClearMounts();
+  ASSERT_EQ(0, mm->AddMount(new MemMount(), "/"));
+  KernelProxy *kp = mm->kp();
+  const int kFiles = 100;
+  char path[32];
+  for (int i = 0; i < kFiles; ++i) {
+    snprintf(path, sizeof(path), "/task%d.txt", i);
+    int fd = kp->open(path, O_CREAT | O_RDWR, 0);
+    ASSERT_LE(0, fd);
+    EXPECT_EQ(static_cast<ssize_t>(strlen(path)),
+              kp->write(fd, path, strlen(path)));
+    EXPECT_EQ(0, kp->close(fd));
+  }
+
+  KernelExecutor executor;
+  std::vector<std::string> out(kFiles + 1);
+  for (int i = 0; i < kFiles; ++i) {
+    snprintf(path, sizeof(path), "/task%d.txt", i);
+    executor.Spawn(KernelAwaitTestFetch(kp, path, &out[i]));
+  }
+  executor.Spawn(KernelAwaitTestFetch(kp, "/none.txt", &out[kFiles]));
+  executor.Run();
+  for (int i = 0; i < kFiles; ++i) {
+    snprintf(path, sizeof(path), "/task%d.txt", i);
+    EXPECT_EQ(path, out[i]);
+  }
+  EXPECT_EQ("stat failed", out[kFiles]);
+  EXPECT_EQ(0, executor.RunReady());
+}
+
+#endif  // __cplusplus >= 202002L
@@ -4,6 +4,7 @@
  * found in the LICENSE file.
  */
 
+#include "../../base/dirent.h"
 #include "../../base/Mount.h"
 #include "../../base/MountManager.h"
 #include "../../memory/MemMount.h"
@@ -229,3 +230,190 @@ TEST(MountManagerTest, access) {
   EXPECT_EQ(0, mm->kp()->access("hello/world/test.txt", amode));
 
 }
+
+TEST(MountManagerTest, getdents) {
+  mm->ClearMounts();
+  MemMount *mnt = new MemMount();
+  EXPECT_EQ(0, mm->AddMount(mnt, "/"));
+  KernelProxy *kp = mm->kp();
+  EXPECT_EQ(0, kp->mkdir("/dir", 0));
+  EXPECT_EQ(0, kp->mkdir("/dir/sub", 0));
+  for (int i = 0; i < 3; ++i) {
+    char path[32];
+    snprintf(path, sizeof(path), "/dir/file%d", i);
+    int fd = kp->open(path, O_CREAT, 0);
+    ASSERT_LE(0, fd);
+    EXPECT_EQ(0, kp->close(fd));
+  }
+
+  // Two entries at a time: each call picks up where the last stopped.
+  int fd = kp->open("/dir", O_RDONLY, 0);
+  ASSERT_LE(0, fd);
+  struct dirent dirents[2];
+  std::vector<std::string> names;
+  int n;
+  while ((n = kp->getdents(fd, dirents, sizeof(dirents))) > 0) {
+    for (int i = 0; i < n / static_cast<int>(sizeof(struct dirent)); ++i) {
+      names.push_back(dirents[i].d_name);
+    }
+  }
+  EXPECT_EQ(0, n);
+  ASSERT_EQ(4u, names.size());
+  EXPECT_EQ("sub", names[0]);
+  EXPECT_EQ("file2", names[3]);
+
+  // lseek() goes back to where an earlier call had got to.
+  EXPECT_EQ(static_cast<off_t>(3 * sizeof(struct dirent)),
+            kp->lseek(fd, 3 * sizeof(struct dirent), SEEK_SET));
+  EXPECT_EQ(static_cast<int>(sizeof(struct dirent)),
+            kp->getdents(fd, dirents, sizeof(dirents)));
+  EXPECT_STREQ("file2", dirents[0].d_name);
+  EXPECT_EQ(-1, kp->lseek(fd, 0, SEEK_END));
+  EXPECT_EQ(0, kp->lseek(fd, 0, SEEK_SET));
+  EXPECT_EQ(static_cast<int>(sizeof(dirents)),
+            kp->getdents(fd, dirents, sizeof(dirents)));
+  EXPECT_STREQ("sub", dirents[0].d_name);
+  EXPECT_EQ(0, kp->close(fd));
+  mm->ClearMounts();
+}
+
+// A mount that leaves ReadDirPlus() to the default.
+class MountManagerTestPlainMount : public Mount {
+ public:
+  explicit MountManagerTestPlainMount(MemMount *mem) : mem_(mem) {}
+  int GetNode(const std::string& path, struct stat *st) {
+    return mem_->GetNode(path, st);
+  }
+  int Stat(ino_t node, struct stat *buf) { return mem_->Stat(node, buf); }
+  int Getdents(ino_t node, off_t offset, struct dirent *dirp,
+               unsigned int count) {
+    return mem_->Getdents(node, offset, dirp, count);
+  }
+ private:
+  MemMount *mem_;
+};
+
+TEST(MountManagerTest, readdirplus) {
+  mm->ClearMounts();
+  MemMount *mnt = new MemMount();
+  EXPECT_EQ(0, mm->AddMount(mnt, "/"));
+  KernelProxy *kp = mm->kp();
+  EXPECT_EQ(0, kp->mkdir("/dir", 0));
+  EXPECT_EQ(0, kp->mkdir("/dir/sub", 0));
+  int fd = kp->open("/dir/a", O_CREAT | O_RDWR, 0);
+  ASSERT_LE(0, fd);
+  EXPECT_EQ(3, kp->write(fd, "abc", 3));
+  EXPECT_EQ(0, kp->close(fd));
+  struct stat st;
+  EXPECT_EQ(0, kp->stat("/dir/a", &st));
+
+  std::vector<DirentPlus> entries;
+  EXPECT_EQ(0, kp->readdirplus("/dir", &entries));
+  ASSERT_EQ(2u, entries.size());
+  EXPECT_STREQ("sub", entries[0].d.d_name);
+  EXPECT_TRUE(S_ISDIR(entries[0].st.st_mode));
+  EXPECT_STREQ("a", entries[1].d.d_name);
+  EXPECT_TRUE(S_ISREG(entries[1].st.st_mode));
+  EXPECT_EQ(3, entries[1].st.st_size);
+  EXPECT_EQ(st.st_ino, entries[1].st.st_ino);
+  // getdents() and stat() agree on the inode of each entry.
+  EXPECT_EQ(st.st_ino, entries[1].d.d_ino);
+  EXPECT_EQ(entries[0].st.st_ino, entries[0].d.d_ino);
+
+  entries.clear();
+  EXPECT_EQ(0, kp->chdir("/dir"));
+  EXPECT_EQ(0, kp->readdirplus("sub", &entries));
+  EXPECT_EQ(0u, entries.size());
+  EXPECT_EQ(0, kp->chdir("/"));
+  EXPECT_EQ(-1, kp->readdirplus("/dir/a", &entries));
+  EXPECT_EQ(ENOTDIR, errno);
+  EXPECT_EQ(-1, kp->readdirplus("/none", &entries));
+  EXPECT_EQ(ENOENT, errno);
+
+  // The default goes through Getdents() and GetNode(), to the same end.
+  MountManagerTestPlainMount *plain = new MountManagerTestPlainMount(mnt);
+  EXPECT_EQ(0, mm->AddMount(plain, "/plain"));
+  EXPECT_EQ(0, kp->readdirplus("/plain/dir", &entries));
+  ASSERT_EQ(2u, entries.size());
+  EXPECT_STREQ("sub", entries[0].d.d_name);
+  EXPECT_TRUE(S_ISDIR(entries[0].st.st_mode));
+  EXPECT_STREQ("a", entries[1].d.d_name);
+  EXPECT_EQ(3, entries[1].st.st_size);
+  EXPECT_EQ(st.st_ino, entries[1].st.st_ino);
+  // getdents() and stat() agree on the inode of each entry.
+  EXPECT_EQ(st.st_ino, entries[1].d.d_ino);
+  EXPECT_EQ(entries[0].st.st_ino, entries[0].d.d_ino);
+  mm->ClearMounts();
+}
+
+TEST(MountManagerTest, SubmitBatch) {
+  mm->ClearMounts();
+  MemMount *mnt = new MemMount();
+  EXPECT_EQ(0, mm->AddMount(mnt, "/"));
+  KernelProxy *kp = mm->kp();
+  const char *names[] = { "/a.txt", "/b.txt", "/missing.txt" };
+  for (int i = 0; i < 2; ++i) {
+    int fd = kp->open(names[i], O_CREAT | O_RDWR, 0);
+    ASSERT_LE(0, fd);
+    EXPECT_EQ(3, kp->write(fd, names[i] + 1, 3));
+    EXPECT_EQ(0, kp->close(fd));
+  }
+
+  std::vector<KernelOp> ops;
+  char bufs[3][8];
+  struct stat st[3];
+  for (int i = 0; i < 3; ++i) {
+    int open = ops.size();
+    KernelOp op;
+    op.path = names[i];
+    ops.push_back(op);
+    op.fd = KernelOp::kLinkedFd;
+    op.link = open;
+    op.type = KernelOp::kFstat;
+    op.st = &st[i];
+    ops.push_back(op);
+    op.type = KernelOp::kRead;
+    op.buf = bufs[i];
+    op.count = sizeof(bufs[i]);
+    ops.push_back(op);
+    op.type = KernelOp::kClose;
+    ops.push_back(op);
+  }
+  EXPECT_EQ(-1, kp->submit(&ops));
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_LE(0, ops[4 * i].result);
+    EXPECT_EQ(0, ops[4 * i + 1].result);
+    EXPECT_EQ(3, st[i].st_size);
+    ASSERT_EQ(3, ops[4 * i + 2].result);
+    EXPECT_EQ(0, memcmp(bufs[i], names[i] + 1, 3));
+    EXPECT_EQ(0, ops[4 * i + 3].result);
+  }
+  // Everything linked to the failed open is cancelled.
+  EXPECT_EQ(-1, ops[8].result);
+  EXPECT_EQ(ENOENT, ops[8].error);
+  for (int k = 9; k < 12; ++k) {
+    EXPECT_EQ(-1, ops[k].result);
+    EXPECT_EQ(ECANCELED, ops[k].error);
+  }
+  // The batch closed what it opened.
+  EXPECT_EQ(-1, kp->close(ops[0].result));
+}
+
+// A mount whose calls wait on a server.
+class MountManagerTestBlockingMount : public Mount {
+ public:
+  int IoThreads(void) { return 8; }
+};
+
+TEST(MountManagerTest, IoPool) {
+  MountManagerTestBlockingMount *mnt = new MountManagerTestBlockingMount();
+  mm->set_max_io_threads(3);
+  EXPECT_EQ(0, mm->AddMount(mnt, "/blocking"));
+  EXPECT_EQ(3, Mount::io_pool()->max_threads());
+  mm->set_max_io_threads(20);
+  EXPECT_EQ(8, Mount::io_pool()->max_threads());
+  EXPECT_EQ(0, mm->RemoveMount("/blocking"));
+  // Mounts that never block leave the pool its one thread.
+  EXPECT_EQ(1, Mount::io_pool()->max_threads());
+  delete mnt;
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that be
+ * found in the LICENSE file.
+ */
+
+#include <vector>
+#include "../../base/Mount.h"
+#include "../../base/ReadAhead.h"
+#include "../common/common.h"
+
+TEST(ReadAheadTest, SequentialGrows) {
+  ReadAheadWindow ra(1000, 8000);
+  // The first read starts readahead with the smallest window.
+  ReadAheadRange r = ra.Observe(0, 100);
+  EXPECT_EQ(100, r.offset);
+  EXPECT_EQ(1000u, r.count);
+  EXPECT_EQ(1000u, ra.window());
+
+  // Nothing to do while well inside the prefetched data.
+  r = ra.Observe(100, 100);
+  EXPECT_EQ(0u, r.count);
+
+  // Catching up with the second half doubles the window, and only what
+  // has not been asked for yet is prefetched.
+  r = ra.Observe(200, 500);
+  EXPECT_EQ(2000u, ra.window());
+  EXPECT_EQ(1100, r.offset);
+  EXPECT_EQ(1600u, r.count);
+
+  // The window stops growing at its maximum.
+  off_t offset = 700;
+  for (int i = 0; i < 100; ++i) {
+    ra.Observe(offset, 500);
+    offset += 500;
+  }
+  EXPECT_EQ(8000u, ra.window());
+}
+
+TEST(ReadAheadTest, RandomShrinks) {
+  ReadAheadWindow ra(1000, 8000);
+  off_t offset = 0;
+  for (int i = 0; i < 100; ++i) {
+    ra.Observe(offset, 500);
+    offset += 500;
+  }
+  EXPECT_EQ(8000u, ra.window());
+
+  // Seeks halve the window and do not prefetch.
+  ReadAheadRange r = ra.Observe(100000, 500);
+  EXPECT_EQ(0u, r.count);
+  EXPECT_EQ(4000u, ra.window());
+  r = ra.Observe(5, 500);
+  EXPECT_EQ(0u, r.count);
+  EXPECT_EQ(2000u, ra.window());
+
+  // Going sequential again restarts with the current window.
+  r = ra.Observe(505, 500);
+  EXPECT_EQ(1005, r.offset);
+  EXPECT_EQ(2000u, r.count);
+  EXPECT_EQ(2000u, ra.window());
+
+  // Enough random access turns readahead off; a new sequential run
+  // starts over at the smallest window.
+  ra.Observe(50000, 10);
+  ra.Observe(70000, 10);
+  EXPECT_EQ(0u, ra.window());
+  r = ra.Observe(70010, 10);
+  EXPECT_EQ(1000u, r.count);
+}
+
+// Records the ranges it is asked to prefetch.
+class PrefetchMount : public Mount {
+ public:
+  PrefetchMount() : refs(0), refs_in_prefetch(0) {}
+  void Ref(ino_t node) { ++refs; }
+  void Unref(ino_t node) { --refs; }
+  int Prefetch(ino_t node, off_t offset, size_t count) {
+    nodes.push_back(node);
+    offsets.push_back(offset);
+    refs_in_prefetch += refs > 0;
+    return 0;
+  }
+  bool SupportsPrefetch(void) { return true; }
+  int refs;
+  int refs_in_prefetch;
+  std::vector<ino_t> nodes;
+  std::vector<off_t> offsets;
+};
+
+TEST(ReadAheadTest, Prefetch) {
+  PrefetchMount mount;
+  ReadAhead ra;
+  ra.Submit(&mount, 3, 100, 10);
+  ra.Submit(&mount, 4, 200, 20);
+  ra.Drain();
+  ASSERT_EQ(2u, mount.offsets.size());
+  EXPECT_EQ(3u, mount.nodes[0]);
+  EXPECT_EQ(100, mount.offsets[0]);
+  EXPECT_EQ(4u, mount.nodes[1]);
+  EXPECT_EQ(200, mount.offsets[1]);
+  // The nodes were held while they were prefetched, and released after.
+  EXPECT_EQ(2, mount.refs_in_prefetch);
+  EXPECT_EQ(0, mount.refs);
+  ReadAheadStats stats = ra.stats();
+  EXPECT_EQ(2, stats.prefetched);
+  EXPECT_EQ(30, stats.prefetched_bytes);
+
+  // Mounts that do not prefetch are not counted.
+  Mount plain;
+  ra.Submit(&plain, 1, 0, 10);
+  ra.Forget(&mount);
+  ra.Drain();
+  EXPECT_EQ(2, ra.stats().prefetched);
+}
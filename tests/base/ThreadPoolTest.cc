@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2011 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that be
+ * found in the LICENSE file.
+ */
+
+#include <pthread.h>
+#include "../../base/ThreadPool.h"
+#include "../common/common.h"
+
+struct ThreadPoolTestCounter {
+  pthread_mutex_t lock;
+  int count;
+};
+
+static void CountTask(void *p) {
+  ThreadPoolTestCounter *counter = reinterpret_cast<ThreadPoolTestCounter*>(p);
+  pthread_mutex_lock(&counter->lock);
+  ++counter->count;
+  pthread_mutex_unlock(&counter->lock);
+}
+
+TEST(ThreadPoolTest, RunsEverything) {
+  ThreadPoolTestCounter counter;
+  pthread_mutex_init(&counter.lock, NULL);
+  counter.count = 0;
+  {
+    ThreadPool pool(3);
+    for (int i = 0; i < 100; ++i) {
+      EXPECT_EQ(0, pool.Submit(CountTask, &counter));
+    }
+    // Deleting the pool runs what is still queued.
+  }
+  EXPECT_EQ(100, counter.count);
+  pthread_mutex_destroy(&counter.lock);
+}
+
+// Blocks on a gate, the way a task waiting on a server does.
+struct ThreadPoolTestGate {
+  ThreadPoolTestGate() : open(false), entered(0) {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+  }
+  ~ThreadPoolTestGate() {
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+  }
+  void WaitEntered(int count) {
+    pthread_mutex_lock(&lock);
+    while (entered < count) {
+      pthread_cond_wait(&cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+  }
+  void Open(void) {
+    pthread_mutex_lock(&lock);
+    open = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+  }
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool open;
+  int entered;
+};
+
+static void GateTask(void *p) {
+  ThreadPoolTestGate *gate = reinterpret_cast<ThreadPoolTestGate*>(p);
+  pthread_mutex_lock(&gate->lock);
+  ++gate->entered;
+  pthread_cond_broadcast(&gate->cond);
+  while (!gate->open) {
+    pthread_cond_wait(&gate->cond, &gate->lock);
+  }
+  pthread_mutex_unlock(&gate->lock);
+}
+
+TEST(ThreadPoolTest, StealsAndCounts) {
+  ThreadPoolTestGate first, second, third;
+  ThreadPool pool(2);
+  // Tasks from outside the pool are dealt out in turn, so the third one
+  // waits behind the first, which stays stuck.
+  EXPECT_EQ(0, pool.Submit(GateTask, &first));
+  first.WaitEntered(1);
+  EXPECT_EQ(0, pool.Submit(GateTask, &second));
+  second.WaitEntered(1);
+  EXPECT_EQ(0, pool.Submit(GateTask, &third));
+  ThreadPoolStats stats = pool.stats();
+  EXPECT_EQ(2, stats.threads);
+  EXPECT_EQ(2, stats.active);
+  EXPECT_EQ(1, stats.queued);
+  EXPECT_EQ(3, stats.submitted);
+
+  // The second thread takes it once it is free.
+  third.Open();
+  second.Open();
+  third.WaitEntered(1);
+  stats = pool.stats();
+  EXPECT_EQ(1, stats.stolen);
+  EXPECT_EQ(0, stats.queued);
+  EXPECT_EQ(1, stats.max_queued);
+  EXPECT_LE(0, stats.max_wait_us);
+  first.Open();
+}
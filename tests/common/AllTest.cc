@@ -1,5 +1,13 @@
+#include "../base/CachingMountTest.cc"
 #include "../base/MountManagerTest.cc"
+#include "../base/KernelAwaitTest.cc"
 #include "../base/PathHandleTest.cc"
+#include "../base/ReadAheadTest.cc"
 #include "../base/SlotAllocatorTest.cc"
+#include "../base/ThreadPoolTest.cc"
 #include "../memory/MemNodeTest.cc"
 #include "../memory/MemMountTest.cc"
+#include "../AppEngine/AppEngineCacheTest.cc"
+#include "../AppEngine/AppEngineCompressionTest.cc"
+#include "../AppEngine/AppEngineDeltaTest.cc"
+#include "../AppEngine/AppEngineNodeTest.cc"
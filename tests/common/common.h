@@ -7,8 +7,47 @@
 #ifndef PACKAGES_SCRIPTS_FILESYS_TESTS_COMMON_COMMON_H_
 #define PACKAGES_SCRIPTS_FILESYS_TESTS_COMMON_COMMON_H_
 
+#include <pthread.h>
+#include <sys/types.h>
+
 // location of gtest.h
 #include "../../../../../testing/gtest/include/gtest/gtest.h"
 
+// Collects the outcome of an async call: pass Done and the waiter as the
+// callback and its argument, then Wait() for the call to complete.
+struct AsyncWaiter {
+  AsyncWaiter() : done(false), result(0), error(0) {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+  }
+  ~AsyncWaiter() {
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+  }
+  static void Done(void *p, ssize_t result, int error) {
+    AsyncWaiter *waiter = reinterpret_cast<AsyncWaiter*>(p);
+    pthread_mutex_lock(&waiter->lock);
+    waiter->done = true;
+    waiter->result = result;
+    waiter->error = error;
+    pthread_cond_signal(&waiter->cond);
+    pthread_mutex_unlock(&waiter->lock);
+  }
+  // Waits for the call, and readies the waiter for the next one.
+  void Wait(void) {
+    pthread_mutex_lock(&lock);
+    while (!done) {
+      pthread_cond_wait(&cond, &lock);
+    }
+    done = false;
+    pthread_mutex_unlock(&lock);
+  }
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool done;
+  ssize_t result;
+  int error;
+};
+
 #endif  // PACKAGES_SCRIPTS_FILESYS_TESTS_COMMON_COMMON_H_
 
@@ -4,6 +4,8 @@
  * found in the LICENSE file.
  */
 
+#include <pthread.h>
+#include <string.h>
 #include "../../base/MountManager.h"
 #include "../../memory/MemMount.h"
 #include "../common/common.h"
@@ -193,6 +195,34 @@ TEST(MemMountTest, Stat2) {
   ASSERT_TRUE(S_ISREG(st.st_mode));
 }
 
+TEST(MemMountTest, Async) {
+  MemMount mount;
+  struct stat st;
+  ASSERT_EQ(0, mount.Creat("/file", 0644, &st));
+  AsyncWaiter async;
+  mount.WriteAsync(st.st_ino, 0, "hello", 5, AsyncWaiter::Done, &async);
+  async.Wait();
+  EXPECT_EQ(5, async.result);
+
+  char buf[8];
+  mount.ReadAsync(st.st_ino, 1, buf, sizeof(buf), AsyncWaiter::Done,
+                  &async);
+  async.Wait();
+  ASSERT_EQ(4, async.result);
+  EXPECT_EQ(0, memcmp(buf, "ello", 4));
+
+  struct stat st2;
+  mount.StatAsync(st.st_ino, &st2, AsyncWaiter::Done, &async);
+  async.Wait();
+  EXPECT_EQ(0, async.result);
+  EXPECT_EQ(5, st2.st_size);
+
+  mount.StatAsync(12345, &st2, AsyncWaiter::Done, &async);
+  async.Wait();
+  EXPECT_EQ(-1, async.result);
+  EXPECT_NE(0, async.error);
+}
+
 TEST(MemMountTest, Unlink) {
   MemMount mount;
   struct stat st;